@@ -0,0 +1,505 @@
+// Copyright © 2003-2004 Matthias Melcher
+// Copyright © 2019-2020 Neil McNeight
+
+#include "heBatch.h"
+#include "hePatch.h"
+#include "heTransform.h"
+#include "heScript.h"
+#include "heDigest.h"
+
+#include <FL/filename.H>
+#include <FL/Fl_utf8.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef _MSC_VER
+#include <unistd.h>
+#else
+#include <corecrt_io.h>
+#endif
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <errno.h>
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+#define HE_BATCH_STEP (16<<20)
+#define HE_BATCH_MAX_BYTES 4096
+#define HE_BATCH_TMP ".mickey-tmp"
+// folders below the one that was named
+#define HE_BATCH_MAX_DEPTH 64
+
+double heSeconds();
+
+/// Position of the first 'm' bytes equal to 'f' in p[pos, n), or 'n'.
+static size_t heFindBytes(const unsigned char *p, size_t n, size_t pos,
+                          const unsigned char *f, int m)
+{
+  if ((size_t)m>n) return n;
+  const unsigned char *end = p+n-m+1;
+  const unsigned char *q = p+pos;
+  while (q<end) {
+    q = (const unsigned char*)memchr(q, f[0], end-q);
+    if (!q) break;
+    if (memcmp(q+1, f+1, m-1)==0) return q-p;
+    q++;
+  }
+  return n;
+}
+
+static char heWriteAll(int fd, const unsigned char *p, size_t n) {
+  while (n>0) {
+    int w = (int)::_write(fd, p, n<HE_BATCH_STEP ? n : HE_BATCH_STEP);
+    if (w<=0) {
+      if (w==0) errno = ENOSPC;
+      return 0;
+    }
+    p += w; n -= w;
+  }
+  return 1;
+}
+
+/// Parse "left=hex" into the left side and the bytes. Returns the number of
+/// bytes, or -1.
+static int heSplitRule(const char *text, char *left, int maxLeft,
+                       unsigned char *dst)
+{
+  const char *eq = strchr(text, '=');
+  if (!eq || eq-text>=maxLeft) return -1;
+  memcpy(left, text, eq-text);
+  left[eq-text] = 0;
+  return heParseHexBytes(eq+1, dst, HE_BATCH_MAX_BYTES);
+}
+
+/// A script's view of a file that is loaded into memory. Everything it
+/// prints is kept until the job reports.
+class HeBatchScriptHost : public HeScriptHost {
+public:
+  unsigned char *buf_;
+  size_t n_, cap_;
+  int changes_;
+  char *out_;
+  size_t nOut_, capOut_;
+  HeBatchScriptHost(unsigned char *buf, size_t n) {
+    buf_ = buf; n_ = cap_ = n;
+    changes_ = 0;
+    out_ = 0; nOut_ = capOut_ = 0;
+  }
+  unsigned long long size() { return n_; }
+  int lock(unsigned long long pos, unsigned long long n, HeScriptSpan *span) {
+    if (pos>=n_) return 0;
+    span->data = buf_+pos;
+    span->size = n<n_-pos ? n : n_-pos;
+    return 1;
+  }
+  void unlock() { }
+  const char *replace(unsigned long long pos, unsigned long long nDel,
+                      const unsigned char *data, unsigned long long nIns) {
+    if (pos>n_ || nDel>n_-pos) return "Can't replace past the end of the file";
+    // like the writes, overwriting bytes with the same bytes is no change
+    if (nDel==nIns && memcmp(buf_+pos, data, (size_t)nIns)==0) return 0;
+    size_t n = n_-(size_t)nDel+(size_t)nIns;
+    if (n>cap_) {
+      size_t cap = cap_+cap_/2>n ? cap_+cap_/2 : n;
+      unsigned char *buf = (unsigned char*)realloc(buf_, cap);
+      if (!buf) return "Not enough memory";
+      buf_ = buf;
+      cap_ = cap;
+    }
+    memmove(buf_+pos+nIns, buf_+pos+nDel, n_-(size_t)(pos+nDel));
+    memcpy(buf_+pos, data, (size_t)nIns);
+    n_ = n;
+    changes_++;
+    return 0;
+  }
+  void print(const char *text, size_t n) {
+    if (nOut_+n+1>capOut_) {
+      capOut_ = (nOut_+n+1)*2;
+      out_ = (char*)realloc(out_, capOut_);
+    }
+    memcpy(out_+nOut_, text, n);
+    nOut_ += n;
+    out_[nOut_] = 0;
+  }
+};
+
+HeBatch::HeBatch() {
+  rule_ = 0; nRules_ = 0;
+  write_ = 0; nWrites_ = 0;
+  job_ = 0; nJobs_ = capJobs_ = 0;
+  patch_ = outDir_ = 0;
+  script_ = 0;
+  dryRun_ = 0;
+}
+
+HeBatch::~HeBatch() {
+  int i;
+  for (i=0; i<nRules_; i++) {
+    free(rule_[i].find);
+    free(rule_[i].replace);
+  }
+  for (i=0; i<nWrites_; i++)
+    free(write_[i].data);
+  for (i=0; i<nJobs_; i++) {
+    free(job_[i].name);
+    free(job_[i].output);
+    free(job_[i].scriptErr);
+  }
+  free(script_);
+  free(rule_);
+  free(write_);
+  free(job_);
+}
+
+const char *HeBatch::addRule(const char *text) {
+  char left[2*HE_BATCH_MAX_BYTES+64];
+  unsigned char find[HE_BATCH_MAX_BYTES], replace[HE_BATCH_MAX_BYTES];
+  int nReplace = heSplitRule(text, left, sizeof(left), replace);
+  int nFind = nReplace<0 ? -1 : heParseHexBytes(left, find, HE_BATCH_MAX_BYTES);
+  if (nFind<=0 || nReplace<0)
+    return "A rule must look like \"de ad be ef=ca fe\".";
+  rule_ = (Rule*)realloc(rule_, (nRules_+1)*sizeof(Rule));
+  Rule &r = rule_[nRules_++];
+  r.find = (unsigned char*)malloc(nFind);
+  r.replace = (unsigned char*)malloc(nReplace ? nReplace : 1);
+  memcpy(r.find, find, nFind);
+  memcpy(r.replace, replace, nReplace);
+  r.nFind = nFind;
+  r.nReplace = nReplace;
+  return 0;
+}
+
+const char *HeBatch::addWrite(const char *text) {
+  char left[64], *end;
+  unsigned char data[HE_BATCH_MAX_BYTES];
+  int n = heSplitRule(text, left, sizeof(left), data);
+  unsigned long long pos = n>0 ? strtoull(left, &end, 0) : 0;
+  if (n<=0 || !left[0] || *end)
+    return "A write must look like \"0x1000=ca fe\".";
+  write_ = (Write*)realloc(write_, (nWrites_+1)*sizeof(Write));
+  Write &w = write_[nWrites_++];
+  w.pos = pos;
+  w.data = (unsigned char*)malloc(n);
+  memcpy(w.data, data, n);
+  w.n = n;
+  return 0;
+}
+
+const char *HeBatch::script(const char *name) {
+  FILE *f = fopen(name, "rb");
+  if (!f) {
+    snprintf(scriptErr_, sizeof(scriptErr_), "%s: %s", name, strerror(errno));
+    return scriptErr_;
+  }
+  size_t n = 0, cap = 4096, k;
+  char *text = (char*)malloc(cap);
+  while ((k = fread(text+n, 1, cap-n-1, f))>0) {
+    n += k;
+    if (n+1==cap) text = (char*)realloc(text, cap *= 2);
+  }
+  fclose(f);
+  text[n] = 0;
+  // every job compiles its own copy, but errors are found once, up front
+  HeScript s;
+  int line = 0;
+  const char *err = s.compile(text, &line);
+  if (err) {
+    snprintf(scriptErr_, sizeof(scriptErr_), "%s:%d: %s", name, line, err);
+    free(text);
+    return scriptErr_;
+  }
+  free(script_);
+  script_ = text;
+  return 0;
+}
+
+void HeBatch::add(const char *name) {
+  int rel = (int)(fl_filename_name(name)-name);
+  if (fl_filename_isdir(name)) {
+    rel = (int)strlen(name);
+    while (rel>1 && name[rel-1]=='/') rel--;
+    rel++;
+  }
+  add(name, rel, 0);
+}
+
+/// Folders are walked recursively, and the files in them keep their path
+/// below the folder that was named. Links to folders inside are not
+/// followed, they may lead back up the tree.
+void HeBatch::add(const char *name, int rel, int depth) {
+  if (fl_filename_isdir(name)) {
+    if (depth>HE_BATCH_MAX_DEPTH) {
+      fprintf(stderr, "%s: folders nested too deeply, skipped.\n", name);
+      return;
+    }
+    struct dirent **list;
+    int i, n = fl_filename_list(name, &list);
+    int len = (int)strlen(name);
+    while (len>1 && name[len-1]=='/') len--;
+    for (i=0; i<n; i++) {
+      const char *e = list[i]->d_name;
+      if (strcmp(e, "./")==0 || strcmp(e, "../")==0
+          || strcmp(e, ".")==0 || strcmp(e, "..")==0)
+        continue;
+      char path[2048];
+      snprintf(path, sizeof(path), "%.*s/%s", len, name, e);
+      int k = (int)strlen(path);
+      if (k>1 && path[k-1]=='/') path[k-1] = 0;
+#ifndef _MSC_VER
+      struct stat st;
+      if (lstat(path, &st)==0 && S_ISLNK(st.st_mode) && fl_filename_isdir(path))
+        continue;
+#endif
+      add(path, rel, depth+1);
+    }
+    fl_filename_free_list(&list, n);
+    return;
+  }
+  size_t n = strlen(name), nt = strlen(HE_BATCH_TMP);
+  if (n>nt && strcmp(name+n-nt, HE_BATCH_TMP)==0)
+    return;
+  if (nJobs_==capJobs_) {
+    capJobs_ = capJobs_ ? capJobs_*2 : 64;
+    job_ = (Job*)realloc(job_, capJobs_*sizeof(Job));
+  }
+  Job &j = job_[nJobs_++];
+  memset(&j, 0, sizeof(Job));
+  j.name = _strdup(name);
+  j.rel = rel;
+}
+
+/// Load 'src', apply the writes, run the script and find the replacements,
+/// then write the
+/// result to 'tmpName' in one pass: unchanged runs straight from the loaded
+/// bytes, replacements in between. Nothing is written if nothing changed,
+/// unless the file was patched or goes to another folder.
+const char *HeBatch::edit(Job &job, const char *src, const char *tmpName) {
+  int fd = ::_open(src, O_RDONLY|O_BINARY, 0);
+  if (fd==-1) return strerror(errno);
+  struct stat st;
+  if (fstat(fd, &st)==-1) {
+    ::_close(fd);
+    return strerror(errno);
+  }
+  size_t i, n = (size_t)st.st_size, got = 0;
+  unsigned char *buf = (unsigned char*)malloc(n ? n : 1);
+  if (!buf) {
+    ::_close(fd);
+    return "Not enough memory";
+  }
+  while (got<n) {
+    int k = (int)::_read(fd, buf+got, n-got<HE_BATCH_STEP ? n-got : HE_BATCH_STEP);
+    if (k<=0) break;
+    got += k;
+  }
+  ::_close(fd);
+  if (got<n) {
+    free(buf);
+    return "Can't read the whole file";
+  }
+  job.size = n;
+  const char *err = 0;
+  // writes only count if they change something, so running a batch twice
+  // leaves the files alone the second time
+  for (i=0; i<(size_t)nWrites_; i++) {
+    Write &w = write_[i];
+    if (w.pos>n || (size_t)w.n>n-w.pos) {
+      err = "A write goes past the end of the file";
+      break;
+    }
+    if (memcmp(buf+w.pos, w.data, w.n)) {
+      memcpy(buf+w.pos, w.data, w.n);
+      job.changes++;
+    }
+  }
+  if (!err && script_) {
+    HeScript s;
+    HeBatchScriptHost host(buf, n);
+    const char *e = s.compile(script_, 0);
+    if (!e) e = s.run(&host);
+    buf = host.buf_;
+    n = host.n_;
+    job.changes += host.changes_;
+    job.output = host.out_;
+    if (e) err = job.scriptErr = _strdup(e);
+  }
+  // replacements don't overlap; where two rules match at the same byte,
+  // the one given first wins
+  size_t *matchPos = 0, nMatches = 0, capMatches = 0;
+  int *matchRule = 0;
+  if (!err && nRules_) {
+    size_t *next = (size_t*)malloc(nRules_*sizeof(size_t));
+    int r;
+    for (r=0; r<nRules_; r++)
+      next[r] = heFindBytes(buf, n, 0, rule_[r].find, rule_[r].nFind);
+    for (;;) {
+      int best = -1;
+      for (r=0; r<nRules_; r++)
+        if (next[r]<n && (best<0 || next[r]<next[best])) best = r;
+      if (best<0) break;
+      if (nMatches==capMatches) {
+        capMatches = capMatches ? capMatches*2 : 256;
+        matchPos = (size_t*)realloc(matchPos, capMatches*sizeof(size_t));
+        matchRule = (int*)realloc(matchRule, capMatches*sizeof(int));
+      }
+      matchPos[nMatches] = next[best];
+      matchRule[nMatches++] = best;
+      size_t pos = next[best]+rule_[best].nFind;
+      for (r=0; r<nRules_; r++)
+        if (next[r]<pos)
+          next[r] = heFindBytes(buf, n, pos, rule_[r].find, rule_[r].nFind);
+    }
+    free(next);
+    job.changes += (int)nMatches;
+  }
+  if (!err && !dryRun_ && (job.changes>0 || src!=job.name || outDir_)) {
+    int mode = stat(job.name, &st)==0 ? (st.st_mode&0777) : 0644;
+    int out = ::_open(tmpName, O_WRONLY|O_CREAT|O_TRUNC|O_BINARY, mode);
+    if (out==-1) {
+      err = strerror(errno);
+    } else {
+      size_t last = 0;
+      char ok = 1;
+      for (i=0; i<nMatches && ok; i++) {
+        Rule &r = rule_[matchRule[i]];
+        ok = heWriteAll(out, buf+last, matchPos[i]-last)
+          && heWriteAll(out, r.replace, r.nReplace);
+        last = matchPos[i]+r.nFind;
+      }
+      if (ok) ok = heWriteAll(out, buf+last, n-last);
+      if (::_close(out)!=0) ok = 0;
+      if (!ok) err = strerror(errno);
+      else job.written = 1;
+    }
+  }
+  free(matchPos);
+  free(matchRule);
+  free(buf);
+  return err;
+}
+
+void HeBatch::process(Job &job) {
+  double t0 = heSeconds();
+  char outName[2048], tmpName[2048+sizeof(HE_BATCH_TMP)];
+  if (outDir_) {
+    snprintf(outName, sizeof(outName), "%s/%s", outDir_, job.name+job.rel);
+    if (!dryRun_) fl_make_path_for_file(outName);
+  } else {
+    snprintf(outName, sizeof(outName), "%s", job.name);
+  }
+  snprintf(tmpName, sizeof(tmpName), "%s%s", outName, HE_BATCH_TMP);
+  const char *src = job.name;
+  if (patch_) {
+    job.err = heApplyPatch(job.name, patch_, tmpName);
+    if (!job.err) {
+      src = tmpName;
+      job.written = 1;
+      job.changes++;
+    }
+  }
+  if (!job.err && (nWrites_ || nRules_ || script_ || (outDir_ && !patch_)))
+    job.err = edit(job, src, tmpName);
+  else if (!job.err) {
+    struct stat st;
+    if (stat(src, &st)==0) job.size = st.st_size;
+  }
+  if (job.written && !job.err && !dryRun_) {
+#ifdef WIN32
+    _unlink(outName);
+#endif
+    if (::rename(tmpName, outName)!=0)
+      job.err = strerror(errno);
+  }
+  if (job.err || dryRun_)
+    unlink(tmpName);
+  if (dryRun_) job.written = 0;
+  job.seconds = heSeconds()-t0;
+  report(job);
+}
+
+void HeBatch::jobCB(void *batch, int index) {
+  HeBatch *b = (HeBatch*)batch;
+  b->process(b->job_[index]);
+}
+
+/// One line per file as soon as it is done, so a long run shows progress.
+void HeBatch::report(const Job &job) {
+  outputLock_.lock();
+  if (job.err)
+    printf("%10.3f ms  FAILED      %s: %s\n", job.seconds*1000.0,
+           job.name, job.err);
+  else
+    printf("%10.3f ms %9.2f MB %6d changes  %s%s\n", job.seconds*1000.0,
+           job.size/1e6, job.changes, job.name,
+           job.written ? "" : dryRun_ ? " (dry run)" : " (unchanged)");
+  if (job.output)
+    fputs(job.output, stdout);
+  fflush(stdout);
+  outputLock_.unlock();
+}
+
+int HeBatch::run(int threads) {
+  double t0 = heSeconds();
+  if (threads<1) threads = heCpuCount();
+  if (threads>nJobs_) threads = nJobs_;
+  // the CRC tables are built on first use, which must not race
+  heCrc32(0, 0, 0);
+  heCrc32c(0, 0, 0);
+  if (threads<=1) {
+    for (int i=0; i<nJobs_; i++)
+      jobCB(this, i);
+  } else {
+    // the calling thread works, too
+    HeThreadPool pool(threads-1);
+    pool.parallelFor(nJobs_, jobCB, this);
+  }
+  double dt = heSeconds()-t0;
+  int i, failed = 0, changed = 0;
+  unsigned long long bytes = 0;
+  for (i=0; i<nJobs_; i++) {
+    if (job_[i].err) failed++;
+    else if (job_[i].changes) changed++;
+    bytes += job_[i].size;
+  }
+  if (dt<=0.0) dt = 0.000001;
+  printf("%d files, %d changed, %d failed, %.2f MB in %.3f s "
+         "(%.1f MB/s, %d threads)\n", nJobs_, changed, failed, bytes/1e6,
+         dt, bytes/1e6/dt, threads<1 ? 1 : threads);
+  return failed;
+}
+
+int HeBatch::main(int argc, char **argv) {
+  HeBatch b;
+  int i, threads = 0;
+  const char *err = 0;
+  for (i=2; i<argc && !err; i++) {
+    const char *a = argv[i];
+    char more = i+1<argc;
+    if (strcmp(a, "-j")==0 && more) threads = atoi(argv[++i]);
+    else if (strcmp(a, "-o")==0 && more) b.outputDir(argv[++i]);
+    else if (strcmp(a, "-p")==0 && more) b.patch(argv[++i]);
+    else if (strcmp(a, "-w")==0 && more) err = b.addWrite(argv[++i]);
+    else if (strcmp(a, "-s")==0 && more) err = b.addRule(argv[++i]);
+    else if (strcmp(a, "-x")==0 && more) err = b.script(argv[++i]);
+    else if (strcmp(a, "-n")==0) b.dryRun(1);
+    else if (a[0]=='-' && a[1]) err = "Unknown option.";
+    else b.add(a);
+  }
+  if (!err && !b.nJobs_) err = "No files given.";
+  if (!err && !b.patch_ && !b.nWrites_ && !b.nRules_ && !b.script_
+      && !b.outDir_)
+    err = "Nothing to do.";
+  if (err) {
+    fprintf(stderr, "%s\nusage: %s -batch [-j threads] [-o folder] [-p patch] "
+            "[-w offset=bytes]... [-s find=replace]... [-x script] [-n] "
+            "file|folder...\n",
+            err, argv[0]);
+    return 2;
+  }
+  return b.run(threads) ? 1 : 0;
+}
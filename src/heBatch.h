@@ -0,0 +1,87 @@
+// Copyright © 2003-2004 Matthias Melcher
+// Copyright © 2019-2020 Neil McNeight
+
+
+#ifndef HEBATCH_H
+#define HEBATCH_H
+
+// Patching many files without a window, for build scripts:
+//
+//   mickey -batch [-j threads] [-o folder] [-p patch] [-w offset=bytes]...
+//                 [-s find=replace]... [-x script] [-n] file|folder...
+//
+// Every file is one job for a pool of worker threads. A job applies a BPS
+// or IPS patch first, streaming from the file to the output like the Apply
+// Patch menu does, then loads the result, overwrites bytes at the given
+// offsets, runs the script (see heScript.h) on the bytes and replaces all
+// occurrences of byte sequences. The output is
+// written from the loaded bytes and the replacements in a single pass, to
+// a temporary file that is renamed over the original (or placed in the
+// output folder) only once it is complete. Files that nothing matched are
+// left alone. Each file reports its time and what its script printed
+// when it is done.
+
+#include "heThread.h"
+
+class HeBatch {
+  struct Rule {
+    unsigned char *find, *replace;
+    int nFind, nReplace;
+  };
+  struct Write {
+    unsigned long long pos;
+    unsigned char *data;
+    int n;
+  };
+  struct Job {
+    char *name;
+    /// where the part of the name starts that is kept in the output folder
+    int rel;
+    const char *err;
+    unsigned long long size;
+    int changes;
+    char written;
+    double seconds;
+    /// what the script printed, and its error message
+    char *output, *scriptErr;
+  };
+  Rule *rule_;
+  int nRules_;
+  Write *write_;
+  int nWrites_;
+  Job *job_;
+  int nJobs_, capJobs_;
+  const char *patch_, *outDir_;
+  char *script_;
+  char scriptErr_[256];
+  char dryRun_;
+  HeMutex outputLock_;
+  static void jobCB(void *batch, int index);
+  void process(Job &job);
+  const char *edit(Job &job, const char *src, const char *tmpName);
+  void report(const Job &job);
+  void add(const char *name, int rel, int depth);
+public:
+  HeBatch();
+  ~HeBatch();
+  /// "find=replace", both in hex. Returns an error message, or 0.
+  const char *addRule(const char *text);
+  /// "offset=bytes", the bytes in hex. Returns an error message, or 0.
+  const char *addWrite(const char *text);
+  void patch(const char *name) { patch_ = name; }
+  /// Load and compile a script to run on every file. Returns an error
+  /// message, or 0.
+  const char *script(const char *name);
+  /// write the results here instead of replacing the files
+  void outputDir(const char *dir) { outDir_ = dir; }
+  /// find what would change, but write nothing
+  void dryRun(char v) { dryRun_ = v; }
+  /// Add a file, or all files in a folder and its subfolders.
+  void add(const char *name);
+  /// Process all files with 'threads' threads, or one per core if 0.
+  /// Returns the number of files that failed.
+  int run(int threads);
+  static int main(int argc, char **argv);
+};
+
+#endif
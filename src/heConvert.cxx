@@ -0,0 +1,701 @@
+// Copyright © 2003-2004 Matthias Melcher
+// Copyright © 2019-2020 Neil McNeight
+
+#include "heConvert.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP>=2)
+# include <emmintrin.h>
+# define HE_CONV_SSE2 1
+#endif
+
+// larger holes between records are taken for a broken file
+#define HE_CONV_MAX_HOLE (256<<20)
+#define HE_CONV_CHUNK (1<<20)
+
+static const char *heConvNames[HE_CONV_COUNT] = {
+  "xxd", "c", "ihex", "srec", "base64"
+};
+
+static const char heB64Digits[] =
+  "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+static char heHexLower[256][2], heHexUpper[256][2], hePrintable[256];
+static signed char heHexValue[256], heB64Value[256];
+
+static void heConvInit() {
+  static char ready = 0;
+  if (ready) return;
+  int i;
+  for (i=0; i<256; i++) {
+    heHexLower[i][0] = "0123456789abcdef"[i>>4];
+    heHexLower[i][1] = "0123456789abcdef"[i&15];
+    heHexUpper[i][0] = "0123456789ABCDEF"[i>>4];
+    heHexUpper[i][1] = "0123456789ABCDEF"[i&15];
+    hePrintable[i] = (i>=0x20 && i<0x7f) ? (char)i : '.';
+    heHexValue[i] = -1;
+    heB64Value[i] = -1;
+  }
+  for (i=0; i<10; i++) heHexValue['0'+i] = i;
+  for (i=0; i<6; i++) heHexValue['a'+i] = heHexValue['A'+i] = 10+i;
+  for (i=0; i<64; i++) heB64Value[(unsigned char)heB64Digits[i]] = i;
+  ready = 1;
+}
+
+const char *heConvertName(int format) {
+  return format>=0 && format<HE_CONV_COUNT ? heConvNames[format] : 0;
+}
+
+int heConvertFormat(const char *name) {
+  for (int i=0; i<HE_CONV_COUNT; i++)
+    if (strcmp(name, heConvNames[i])==0) return i;
+  return -1;
+}
+
+//---- HeText ----
+
+void HeText::grow(size_t m) {
+  cap = cap ? cap*2 : 4096;
+  if (cap<n+m) cap = n+m;
+  text = (char*)realloc(text, cap);
+}
+
+void HeText::clear() {
+  free(text);
+  text = 0;
+  n = cap = 0;
+}
+
+//---- HeBytes ----
+
+const char *HeBytes::put(unsigned long long addr, const unsigned char *p, size_t m) {
+  if (!hasBase) {
+    base = addr;
+    hasBase = 1;
+  }
+  if (addr<base)
+    return "Data in front of the first address is not supported.";
+  unsigned long long off = addr-base;
+  if (off>n+HE_CONV_MAX_HOLE)
+    return "The records are too far apart.";
+  size_t end = (size_t)off+m;
+  if (end>cap) {
+    size_t c = cap ? cap*2 : 65536;
+    if (c<end) c = end;
+    data = (unsigned char*)realloc(data, c);
+    cap = c;
+  }
+  if (off>n)
+    memset(data+n, 0, (size_t)off-n);
+  memcpy(data+off, p, m);
+  if (end>n) n = end;
+  return 0;
+}
+
+void HeBytes::clear() {
+  free(data);
+  data = 0;
+  n = cap = 0;
+  base = 0;
+  hasBase = 0;
+}
+
+//---- HeEncoder ----
+
+/// Write 16 bytes as 32 hex digits.
+static inline void heHex16(const unsigned char *p, char *dst, char upper) {
+#ifdef HE_CONV_SSE2
+  __m128i v = _mm_loadu_si128((const __m128i*)p);
+  __m128i mask = _mm_set1_epi8(0x0f);
+  __m128i hi = _mm_and_si128(_mm_srli_epi16(v, 4), mask);
+  __m128i lo = _mm_and_si128(v, mask);
+  __m128i a = _mm_unpacklo_epi8(hi, lo), b = _mm_unpackhi_epi8(hi, lo);
+  // '0'+n, and the distance to 'a' or 'A' for digits above 9
+  __m128i nine = _mm_set1_epi8(9), zero = _mm_set1_epi8('0');
+  __m128i letter = _mm_set1_epi8(upper ? 'A'-'0'-10 : 'a'-'0'-10);
+  a = _mm_add_epi8(_mm_add_epi8(a, zero), _mm_and_si128(_mm_cmpgt_epi8(a, nine), letter));
+  b = _mm_add_epi8(_mm_add_epi8(b, zero), _mm_and_si128(_mm_cmpgt_epi8(b, nine), letter));
+  _mm_storeu_si128((__m128i*)dst, a);
+  _mm_storeu_si128((__m128i*)(dst+16), b);
+#else
+  char (*tab)[2] = upper ? heHexUpper : heHexLower;
+  for (int i=0; i<16; i++) {
+    dst[2*i] = tab[p[i]][0];
+    dst[2*i+1] = tab[p[i]][1];
+  }
+#endif
+}
+
+static char *heHex(char *s, unsigned long long v, int digits, char (*tab)[2]) {
+  for (int i=digits-2; i>=0; i-=2) {
+    const char *h = tab[(v>>(4*i))&0xff];
+    *s++ = h[0]; *s++ = h[1];
+  }
+  return s;
+}
+
+HeEncoder::HeEncoder(int format, unsigned long long base, unsigned long long size,
+                     const char *name)
+{
+  static const int lineBytes[HE_CONV_COUNT] = { 16, 12, 16, 16, 57 };
+  heConvInit();
+  format_ = format;
+  addr_ = base;
+  count_ = records_ = 0;
+  upper_ = 0;
+  lineBytes_ = lineBytes[format];
+  nPending_ = 0;
+  started_ = 0;
+  // S1 records for 16 bit addresses, S2 for 24 bit, S3 for 32 bit
+  unsigned long long end = size ? base+size : 0x100000000ULL;
+  addrBytes_ = end<=0x10000 ? 2 : end<=0x1000000 ? 3 : 4;
+  // C identifiers, like 'xxd -i' makes them
+  if (!name || !*name) name = "data";
+  name_ = (char*)malloc(strlen(name)+2);
+  char *d = name_;
+  if (*name>='0' && *name<='9') *d++ = '_';
+  for (; *name; name++) {
+    char c = *name;
+    *d++ = ((c|0x20)>='a' && (c|0x20)<='z') || (c>='0' && c<='9') ? c : '_';
+  }
+  *d = 0;
+}
+
+HeEncoder::~HeEncoder() {
+  free(name_);
+}
+
+void HeEncoder::header(HeText *out) {
+  started_ = 1;
+  if (format_==HE_CONV_C) {
+    char *s = out->reserve(strlen(name_)+32);
+    out->n += sprintf(s, "unsigned char %s[] = {\n", name_);
+  } else if (format_==HE_CONV_SREC) {
+    int n = (int)strlen(name_);
+    if (n>32) n = 32;
+    int a = addrBytes_;
+    addrBytes_ = 2;
+    srecRecord(0, 0, (const unsigned char*)name_, n, out);
+    addrBytes_ = a;
+    records_ = 0;
+  }
+}
+
+void HeEncoder::ihexRecord(int type, unsigned int addr, const unsigned char *p,
+                           int n, HeText *out)
+{
+  char *s = out->reserve(2*n+16), *s0 = s;
+  unsigned int sum = n + (addr>>8) + (addr&0xff) + type;
+  *s++ = ':';
+  s = heHex(s, n, 2, heHexUpper);
+  s = heHex(s, addr&0xffff, 4, heHexUpper);
+  s = heHex(s, type, 2, heHexUpper);
+  int i = 0;
+  for (; i+16<=n; i+=16, s+=32)
+    heHex16(p+i, s, 1);
+  for (; i<n; i++, s+=2)
+    memcpy(s, heHexUpper[p[i]], 2);
+  for (i=0; i<n; i++)
+    sum += p[i];
+  s = heHex(s, (0x100-(sum&0xff))&0xff, 2, heHexUpper);
+  *s++ = '\n';
+  out->n += s-s0;
+}
+
+void HeEncoder::srecRecord(int type, unsigned long long addr,
+                           const unsigned char *p, int n, HeText *out)
+{
+  char *s = out->reserve(2*n+20), *s0 = s;
+  int count = addrBytes_+n+1;
+  unsigned int sum = count;
+  *s++ = 'S';
+  *s++ = (char)('0'+type);
+  s = heHex(s, count, 2, heHexUpper);
+  s = heHex(s, addr, 2*addrBytes_, heHexUpper);
+  int i;
+  for (i=0; i<addrBytes_; i++)
+    sum += (addr>>(8*i))&0xff;
+  for (i=0; i+16<=n; i+=16, s+=32)
+    heHex16(p+i, s, 1);
+  for (; i<n; i++, s+=2)
+    memcpy(s, heHexUpper[p[i]], 2);
+  for (i=0; i<n; i++)
+    sum += p[i];
+  s = heHex(s, ~sum&0xff, 2, heHexUpper);
+  *s++ = '\n';
+  out->n += s-s0;
+  records_++;
+}
+
+/// Format one line of at most 'lineBytes_' bytes.
+void HeEncoder::line(const unsigned char *p, int n, HeText *out) {
+  switch (format_) {
+    case HE_CONV_XXD: {
+      char *s = out->reserve(96), *s0 = s;
+      s = heHex(s, addr_, addr_>>32 ? 16 : 8, heHexLower);
+      *s++ = ':'; *s++ = ' ';
+      if (n==16) {
+        char hex[32];
+        heHex16(p, hex, 0);
+        for (int g=0; g<8; g++, s+=5) {
+          memcpy(s, hex+4*g, 4);
+          s[4] = ' ';
+        }
+      }
+      for (int i=0; i<16 && n<16; i++) {
+        if (i<n) {
+          const char *h = heHexLower[p[i]];
+          s[0] = h[0]; s[1] = h[1];
+        } else {
+          s[0] = s[1] = ' ';
+        }
+        s += 2;
+        if (i&1) *s++ = ' ';
+      }
+      *s++ = ' ';
+      for (int i=0; i<n; i++)
+        *s++ = hePrintable[p[i]];
+      *s++ = '\n';
+      out->n += s-s0;
+      break; }
+    case HE_CONV_C: {
+      // lines start at multiples of 12 bytes
+      char *s = out->reserve(6*n+8), *s0 = s;
+      if (count_) {
+        memcpy(s, ",\n  0x", 6); s += 6;
+      } else {
+        memcpy(s, "  0x", 4); s += 4;
+      }
+      for (int i=0; i<n; i++) {
+        if (i) {
+          memcpy(s, ", 0x", 4); s += 4;
+        }
+        memcpy(s, heHexLower[p[i]], 2); s += 2;
+      }
+      out->n += s-s0;
+      break; }
+    case HE_CONV_IHEX: {
+      // records don't cross 64 KByte, which are set by extended linear
+      // address records
+      unsigned long long a = addr_;
+      int i = 0;
+      while (i<n) {
+        unsigned int lo = (unsigned int)(a&0xffff);
+        int k = n-i;
+        if (lo+k>0x10000) k = 0x10000-lo;
+        if ((unsigned int)(a>>16)!=upper_) {
+          upper_ = (unsigned int)(a>>16);
+          unsigned char u[2] = { (unsigned char)(upper_>>8), (unsigned char)upper_ };
+          ihexRecord(4, 0, u, 2, out);
+        }
+        ihexRecord(0, lo, p+i, k, out);
+        i += k; a += k;
+      }
+      break; }
+    case HE_CONV_SREC:
+      srecRecord(addrBytes_-1, addr_, p, n, out);
+      break;
+    case HE_CONV_BASE64: {
+      char *s = out->reserve(80), *s0 = s;
+      int i = 0;
+      for (; i+3<=n; i+=3) {
+        unsigned int v = (p[i]<<16) | (p[i+1]<<8) | p[i+2];
+        s[0] = heB64Digits[v>>18];
+        s[1] = heB64Digits[(v>>12)&63];
+        s[2] = heB64Digits[(v>>6)&63];
+        s[3] = heB64Digits[v&63];
+        s += 4;
+      }
+      if (i<n) {
+        unsigned int v = p[i]<<16;
+        if (i+1<n) v |= p[i+1]<<8;
+        s[0] = heB64Digits[v>>18];
+        s[1] = heB64Digits[(v>>12)&63];
+        s[2] = i+1<n ? heB64Digits[(v>>6)&63] : '=';
+        s[3] = '=';
+        s += 4;
+      }
+      *s++ = '\n';
+      out->n += s-s0;
+      break; }
+  }
+  addr_ += n;
+  count_ += n;
+}
+
+void HeEncoder::add(const unsigned char *p, size_t n, HeText *out) {
+  if (!started_) header(out);
+  if (nPending_) {
+    size_t k = lineBytes_-nPending_;
+    if (k>n) k = n;
+    memcpy(pending_+nPending_, p, k);
+    nPending_ += (int)k; p += k; n -= k;
+    if (nPending_<lineBytes_) return;
+    line(pending_, lineBytes_, out);
+    nPending_ = 0;
+  }
+  for (; n>=(size_t)lineBytes_; p+=lineBytes_, n-=lineBytes_)
+    line(p, lineBytes_, out);
+  memcpy(pending_, p, n);
+  nPending_ = (int)n;
+}
+
+void HeEncoder::finish(HeText *out) {
+  if (!started_) header(out);
+  if (nPending_) line(pending_, nPending_, out);
+  nPending_ = 0;
+  if (format_==HE_CONV_C) {
+    char *s = out->reserve(strlen(name_)+64);
+    out->n += sprintf(s, "%s};\nunsigned int %s_len = %llu;\n",
+                      count_ ? "\n" : "", name_, count_);
+  } else if (format_==HE_CONV_IHEX) {
+    memcpy(out->reserve(12), ":00000001FF\n", 12);
+    out->n += 12;
+  } else if (format_==HE_CONV_SREC) {
+    // a count record, if the count fits, and the termination record
+    int a = addrBytes_;
+    if (records_<=0xffff) {
+      addrBytes_ = 2;
+      srecRecord(5, records_, 0, 0, out);
+    } else if (records_<=0xffffff) {
+      addrBytes_ = 3;
+      srecRecord(6, records_, 0, 0, out);
+    }
+    addrBytes_ = a;
+    srecRecord(11-addrBytes_, 0, 0, 0, out);
+  }
+}
+
+//---- HeDecoder ----
+
+HeDecoder::HeDecoder(int format, HeBytes *out) {
+  heConvInit();
+  format_ = format;
+  out_ = out;
+  memset(&line_, 0, sizeof(line_));
+  lineNo_ = 0;
+  addr_ = upper_ = 0;
+  quad_ = 0;
+  nQuad_ = 0;
+  state_ = done_ = 0;
+  error_[0] = 0;
+}
+
+HeDecoder::~HeDecoder() {
+  line_.clear();
+}
+
+/// Read hex pairs from 's' into 'dst' up to the end of the line. Returns the
+/// number of bytes, or -1.
+static int heHexBytes(const char *s, unsigned char *dst, int max) {
+  int n = 0;
+  while (*s && *s!=' ' && *s!='\t') {
+    int h = heHexValue[(unsigned char)s[0]], l = heHexValue[(unsigned char)s[1]];
+    if (h<0 || l<0 || n>=max) return -1;
+    dst[n++] = (unsigned char)(h<<4 | l);
+    s += 2;
+  }
+  while (*s==' ' || *s=='\t') s++;
+  return *s ? -1 : n;
+}
+
+const char *HeDecoder::parseXxd(char *s) {
+  unsigned char buf[256];
+  unsigned long long addr = 0;
+  int n = 0;
+  while (*s==' ') s++;
+  if (!*s) return 0;
+  for (; *s!=':'; s++) {
+    int h = heHexValue[(unsigned char)*s];
+    if (h<0) return "address expected";
+    addr = addr<<4 | h;
+  }
+  s++;
+  // hex pairs in groups, up to two spaces in front of the text column
+  for (;;) {
+    if (*s==' ') {
+      if (s[1]==' ') break;
+      s++;
+      continue;
+    }
+    int h = heHexValue[(unsigned char)s[0]];
+    int l = h<0 ? -1 : heHexValue[(unsigned char)s[1]];
+    if (l<0) break;
+    buf[n++] = (unsigned char)(h<<4 | l);
+    s += 2;
+    if (n==(int)sizeof(buf)) {
+      const char *err = out_->put(addr, buf, n);
+      if (err) return err;
+      addr += n;
+      n = 0;
+    }
+  }
+  return n ? out_->put(addr, buf, n) : 0;
+}
+
+const char *HeDecoder::parseC(char *s) {
+  unsigned char buf[256];
+  int n = 0;
+  const char *err = 0;
+  while (*s && state_<2 && !err) {
+    char c = *s;
+    if (state_==0) {
+      // the numbers follow the brace, but a list without the declaration
+      // is fine, too
+      while (*s==' ' || *s=='\t') s++;
+      if (*s<'0' || *s>'9') {
+        s = strchr(s, '{');
+        if (!s) break;
+        s++;
+      }
+      state_ = 1;
+    } else if (c==' ' || c=='\t' || c==',') {
+      s++;
+    } else if (c=='}') {
+      state_ = 2;
+    } else if (c=='/' && s[1]=='/') {
+      break;
+    } else if (c>='0' && c<='9') {
+      int h = heHexValue[(unsigned char)s[2]];
+      int l = h<0 ? -1 : heHexValue[(unsigned char)s[3]];
+      if (c=='0' && (s[1]|0x20)=='x' && l>=0 && heHexValue[(unsigned char)s[4]]<0) {
+        // the usual 0xhh
+        buf[n++] = (unsigned char)(h<<4 | l);
+        s += 4;
+      } else {
+        char *e;
+        unsigned long v = strtoul(s, &e, 0);
+        if (v>255) return "number out of range";
+        buf[n++] = (unsigned char)v;
+        s = e;
+      }
+      if (n==(int)sizeof(buf)) {
+        err = out_->put(addr_, buf, n);
+        addr_ += n;
+        n = 0;
+      }
+    } else {
+      return "number expected";
+    }
+  }
+  if (!err && n) {
+    err = out_->put(addr_, buf, n);
+    addr_ += n;
+  }
+  return err;
+}
+
+const char *HeDecoder::parseIhex(char *s) {
+  unsigned char rec[262];
+  while (*s==' ' || *s=='\t') s++;
+  if (!*s) return 0;
+  if (*s!=':') return "':' expected";
+  int n = heHexBytes(s+1, rec, sizeof(rec));
+  if (n<5 || n!=rec[0]+5) return "bad record length";
+  unsigned int sum = 0;
+  for (int i=0; i<n; i++) sum += rec[i];
+  if (sum&0xff) return "checksum error";
+  unsigned int value = rec[0]>=2 ? (rec[4]<<8 | rec[5]) : 0;
+  switch (rec[3]) {
+    case 0:
+      return out_->put(upper_ + (rec[1]<<8 | rec[2]), rec+4, rec[0]);
+    case 1:
+      done_ = 1;
+      break;
+    case 2:
+      upper_ = (unsigned long long)value<<4;
+      break;
+    case 4:
+      upper_ = (unsigned long long)value<<16;
+      break;
+  }
+  return 0;
+}
+
+const char *HeDecoder::parseSrec(char *s) {
+  unsigned char rec[262];
+  while (*s==' ' || *s=='\t') s++;
+  if (!*s) return 0;
+  if (s[0]!='S' || s[1]<'0' || s[1]>'9') return "'S' and record type expected";
+  int type = s[1]-'0';
+  int n = heHexBytes(s+2, rec, sizeof(rec));
+  if (n<1 || n!=rec[0]+1) return "bad record length";
+  unsigned int sum = 0;
+  for (int i=0; i<n; i++) sum += rec[i];
+  if ((sum&0xff)!=0xff) return "checksum error";
+  if (type>=1 && type<=3) {
+    int ab = type+1;
+    if (rec[0]<ab+1) return "bad record length";
+    unsigned long long addr = 0;
+    for (int i=0; i<ab; i++) addr = addr<<8 | rec[1+i];
+    return out_->put(addr, rec+1+ab, rec[0]-ab-1);
+  }
+  if (type>=7) done_ = 1;
+  return 0;
+}
+
+const char *HeDecoder::parseLine(char *s) {
+  lineNo_++;
+  if (done_) return 0;
+  const char *err = 0;
+  switch (format_) {
+    case HE_CONV_XXD: err = parseXxd(s); break;
+    case HE_CONV_C: err = parseC(s); break;
+    case HE_CONV_IHEX: err = parseIhex(s); break;
+    case HE_CONV_SREC: err = parseSrec(s); break;
+  }
+  if (!err) return 0;
+  snprintf(error_, sizeof(error_), "Line %d: %s.", lineNo_, err);
+  return error_;
+}
+
+const char *HeDecoder::addBase64(const char *p, size_t n) {
+  unsigned char buf[3*1024];
+  int k = 0;
+  for (size_t i=0; i<n; i++) {
+    unsigned char c = p[i];
+    int v = heB64Value[c];
+    if (v<0) {
+      if (c=='=') { done_ = 1; continue; }
+      if (c==' ' || c=='\t' || c=='\r' || c=='\n') continue;
+      return "Not a base64 character.";
+    }
+    if (done_) return "Data after the padding.";
+    quad_ = quad_<<6 | v;
+    if (++nQuad_==4) {
+      buf[k++] = (unsigned char)(quad_>>16);
+      buf[k++] = (unsigned char)(quad_>>8);
+      buf[k++] = (unsigned char)quad_;
+      nQuad_ = 0;
+      quad_ = 0;
+      if (k==(int)sizeof(buf)) {
+        const char *err = out_->put(addr_, buf, k);
+        if (err) return err;
+        addr_ += k;
+        k = 0;
+      }
+    }
+  }
+  const char *err = k ? out_->put(addr_, buf, k) : 0;
+  addr_ += k;
+  return err;
+}
+
+const char *HeDecoder::add(const char *text, size_t n) {
+  if (format_==HE_CONV_BASE64)
+    return addBase64(text, n);
+  while (n>0) {
+    const char *nl = (const char*)memchr(text, '\n', n);
+    size_t k = nl ? (size_t)(nl-text) : n;
+    memcpy(line_.reserve(k+1), text, k);
+    line_.n += k;
+    if (!nl) break;
+    if (line_.n && line_.text[line_.n-1]=='\r') line_.n--;
+    line_.text[line_.n] = 0;
+    line_.n = 0;
+    const char *err = parseLine(line_.text);
+    if (err) return err;
+    text += k+1; n -= k+1;
+  }
+  return 0;
+}
+
+const char *HeDecoder::finish() {
+  if (format_==HE_CONV_BASE64) {
+    unsigned char b[2];
+    const char *err = 0;
+    if (nQuad_==1) return "The base64 text is cut off.";
+    if (nQuad_==2) {
+      b[0] = (unsigned char)(quad_>>4);
+      err = out_->put(addr_, b, 1);
+    } else if (nQuad_==3) {
+      b[0] = (unsigned char)(quad_>>10);
+      b[1] = (unsigned char)(quad_>>2);
+      err = out_->put(addr_, b, 2);
+    }
+    nQuad_ = 0;
+    return err;
+  }
+  if (line_.n) {
+    *line_.reserve(1) = 0;
+    line_.n = 0;
+    return parseLine(line_.text);
+  }
+  return 0;
+}
+
+//---- command line ----
+
+int heConvertMain(int argc, char **argv) {
+  int i, format = argc>2 ? heConvertFormat(argv[2]) : -1;
+  char reverse = 0;
+  unsigned long long base = 0;
+  const char *name = 0, *inName = 0, *outName = 0;
+  for (i=3; i<argc && format>=0; i++) {
+    if (strcmp(argv[i], "-r")==0) reverse = 1;
+    else if (strcmp(argv[i], "-a")==0 && i+1<argc) base = strtoull(argv[++i], 0, 0);
+    else if (strcmp(argv[i], "-n")==0 && i+1<argc) name = argv[++i];
+    else if (!inName) inName = argv[i];
+    else if (!outName) outName = argv[i];
+    else format = -1;
+  }
+  if (format<0) {
+    fprintf(stderr, "usage: %s -convert xxd|c|ihex|srec|base64 [-r] "
+            "[-a address] [-n name] [in [out]]\n", argv[0]);
+    return 1;
+  }
+  FILE *in = inName && strcmp(inName, "-") ? fopen(inName, "rb") : stdin;
+  if (!in) {
+    perror(inName);
+    return 1;
+  }
+  FILE *out = outName && strcmp(outName, "-") ? fopen(outName, "wb") : stdout;
+  if (!out) {
+    perror(outName);
+    if (in!=stdin) fclose(in);
+    return 1;
+  }
+  unsigned char *buf = (unsigned char*)malloc(HE_CONV_CHUNK);
+  HeText text;
+  memset(&text, 0, sizeof(text));
+  const char *err = 0;
+  size_t n;
+  if (!reverse) {
+    struct stat st;
+    unsigned long long size = 0;
+    if (in!=stdin && stat(inName, &st)==0) size = st.st_size;
+    if (!name && inName && in!=stdin) {
+      name = strrchr(inName, '/');
+      name = name ? name+1 : inName;
+    }
+    HeEncoder enc(format, base, size, name);
+    while ((n = fread(buf, 1, HE_CONV_CHUNK, in))>0) {
+      enc.add(buf, n, &text);
+      fwrite(text.text, 1, text.n, out);
+      text.n = 0;
+    }
+    enc.finish(&text);
+    fwrite(text.text, 1, text.n, out);
+  } else {
+    HeBytes bytes;
+    memset(&bytes, 0, sizeof(bytes));
+    HeDecoder dec(format, &bytes);
+    while (!err && (n = fread(buf, 1, HE_CONV_CHUNK, in))>0)
+      err = dec.add((const char*)buf, n);
+    if (!err) err = dec.finish();
+    if (!err) fwrite(bytes.data, 1, bytes.n, out);
+    bytes.clear();
+  }
+  if (ferror(in)) err = "Can't read the input.";
+  if (ferror(out)) err = "Can't write the output.";
+  if (err) fprintf(stderr, "%s: %s\n", inName ? inName : "stdin", err);
+  text.clear();
+  free(buf);
+  if (in!=stdin) fclose(in);
+  if (out!=stdout) fclose(out);
+  return err ? 1 : 0;
+}
@@ -0,0 +1,108 @@
+// Copyright © 2003-2004 Matthias Melcher
+// Copyright © 2019-2020 Neil McNeight
+
+
+#ifndef HECONVERT_H
+#define HECONVERT_H
+
+#include <stddef.h>
+
+// Text formats for binary data: xxd style hex dumps, C arrays like 'xxd -i',
+// Intel HEX, Motorola S-records and base64. Encoders and decoders work on a
+// stream of chunks of any size and keep only a partial line in between, so
+// a selection of any size goes through a small buffer. Formatting uses
+// lookup tables for hex pairs, printable characters and base64 digits, and
+// writes every line into space that was reserved for it in one go.
+
+#define HE_CONV_XXD     0
+#define HE_CONV_C       1
+#define HE_CONV_IHEX    2
+#define HE_CONV_SREC    3
+#define HE_CONV_BASE64  4
+#define HE_CONV_COUNT   5
+
+/// Short name of a format as used on the command line, like "ihex".
+const char *heConvertName(int format);
+/// Format for a short name, or -1.
+int heConvertFormat(const char *name);
+
+/// Growing text. Zero it before use, release it with clear().
+struct HeText {
+  char *text;
+  size_t n, cap;
+  /// room for 'm' more characters at text+n
+  char *reserve(size_t m) { if (n+m>cap) grow(m); return text+n; }
+  void grow(size_t m);
+  void clear();
+};
+
+/// Growing bytes with the address of the first one. Zero it before use,
+/// release it with clear().
+struct HeBytes {
+  unsigned char *data;
+  size_t n, cap;
+  unsigned long long base;
+  char hasBase;
+  /// Store bytes at an address. Holes are filled with zeros. Returns an
+  /// error message, or 0.
+  const char *put(unsigned long long addr, const unsigned char *p, size_t m);
+  void clear();
+};
+
+class HeEncoder {
+  int format_;
+  unsigned long long addr_, count_, records_;
+  unsigned int upper_;
+  int lineBytes_, addrBytes_;
+  unsigned char pending_[64];
+  int nPending_;
+  char *name_;
+  char started_;
+  void header(HeText *out);
+  void line(const unsigned char *p, int n, HeText *out);
+  void ihexRecord(int type, unsigned int addr, const unsigned char *p, int n,
+                  HeText *out);
+  void srecRecord(int type, unsigned long long addr,
+                  const unsigned char *p, int n, HeText *out);
+public:
+  /// 'base' is the address of the first byte, 'size' the number of bytes
+  /// that will follow, if known, or 0. The name is used by C arrays and the
+  /// S-record header.
+  HeEncoder(int format, unsigned long long base=0, unsigned long long size=0,
+            const char *name=0);
+  ~HeEncoder();
+  /// Append the text for 'n' more bytes to 'out'.
+  void add(const unsigned char *p, size_t n, HeText *out);
+  /// Append the rest of the text.
+  void finish(HeText *out);
+};
+
+class HeDecoder {
+  int format_;
+  HeBytes *out_;
+  HeText line_;
+  int lineNo_;
+  unsigned long long addr_, upper_;
+  unsigned int quad_;
+  int nQuad_;
+  char state_, done_;
+  char error_[128];
+  const char *parseLine(char *s);
+  const char *parseXxd(char *s);
+  const char *parseC(char *s);
+  const char *parseIhex(char *s);
+  const char *parseSrec(char *s);
+  const char *addBase64(const char *p, size_t n);
+public:
+  HeDecoder(int format, HeBytes *out);
+  ~HeDecoder();
+  /// Decode the next chunk of text. Returns an error message, or 0.
+  const char *add(const char *text, size_t n);
+  const char *finish();
+};
+
+/// 'mickey -convert FORMAT [-r] [-a ADDRESS] [-n NAME] [IN [OUT]]' converts
+/// a file, or stdin, to a text format, or back with -r, without a display.
+int heConvertMain(int argc, char **argv);
+
+#endif
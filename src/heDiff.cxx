@@ -0,0 +1,649 @@
+// Copyright © 2003-2004 Matthias Melcher
+// Copyright © 2019-2020 Neil McNeight
+
+#include "heDiff.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// memcmp() tells us whether a block differs, but not where
+#define HE_DIFF_SKIP 256
+
+size_t heMismatch(const unsigned char *a, const unsigned char *b, size_t n) {
+  size_t i = 0;
+  while (i+HE_DIFF_SKIP<=n && memcmp(a+i, b+i, HE_DIFF_SKIP)==0)
+    i += HE_DIFF_SKIP;
+  for ( ; i+8<=n; i+=8) {
+    unsigned long long x, y;
+    memcpy(&x, a+i, 8);
+    memcpy(&y, b+i, 8);
+    if (x!=y) break;
+  }
+  for ( ; i<n; i++)
+    if (a[i]!=b[i]) return i;
+  return n;
+}
+
+size_t heLastMismatch(const unsigned char *a, const unsigned char *b, size_t n) {
+  size_t i = n;
+  while (i>=HE_DIFF_SKIP
+         && memcmp(a+i-HE_DIFF_SKIP, b+i-HE_DIFF_SKIP, HE_DIFF_SKIP)==0)
+    i -= HE_DIFF_SKIP;
+  for ( ; i>=8; i-=8) {
+    unsigned long long x, y;
+    memcpy(&x, a+i-8, 8);
+    memcpy(&y, b+i-8, 8);
+    if (x!=y) break;
+  }
+  while (i>0) {
+    i--;
+    if (a[i]!=b[i]) return i;
+  }
+  return n;
+}
+
+size_t heCountMismatch(const unsigned char *a, const unsigned char *b, size_t n) {
+  size_t i = 0, count = 0;
+  for (;;) {
+    i += heMismatch(a+i, b+i, n-i);
+    if (i>=n) break;
+    // count the rest of this run byte by byte
+    for ( ; i<n && a[i]!=b[i]; i++)
+      count++;
+  }
+  return count;
+}
+
+//---- HeAlignment -------------------------------------------------------------
+
+// bytes hashed into each anchor
+#define HE_ALIGN_WINDOW     32
+// anchors in A are spaced further apart to stay below this count
+#define HE_ALIGN_MAX_ANCHOR (1<<21)
+// uniform data such as zero fill may have no natural anchor at all, so A
+// gets one after this many times the average spacing, and B looks up every
+// window until it finds a natural anchor again
+#define HE_ALIGN_FORCE      8
+#define HE_ALIGN_PIECE      (4<<20)
+#define HE_ALIGN_READ       (1<<20)
+#define HE_ALIGN_EXTEND     (64<<10)
+#define HE_ALIGN_BACK       4096
+#define HE_ALIGN_PRIME      0x100000001B3ULL
+
+struct HeAlignment::List {
+  Anchor *anchor;
+  Match *match;
+  size_t n, cap;
+};
+
+static void *heGrow(void *p, size_t *cap, size_t n, size_t size) {
+  if (n<*cap) return p;
+  *cap = *cap ? *cap*2 : 256;
+  return realloc(p, *cap*size);
+}
+
+static void heRun(HeThreadPool *pool, int n, HeJobFunc func, void *data) {
+  if (pool) {
+    pool->parallelFor(n, func, data);
+  } else {
+    for (int i=0; i<n; i++) func(data, i);
+  }
+}
+
+/// A window of HE_ALIGN_WINDOW bytes and its hash, moving over a document
+/// that is read in large blocks.
+class HeRoller {
+  HeReadFunc read_;
+  void *src_;
+  size_t size_;
+  unsigned char *buf_;
+  size_t bufPos_, bufLen_;
+  unsigned long long out_;
+  char load(size_t p) {
+    bufPos_ = p;
+    bufLen_ = p<size_ ? read_(src_, p, buf_, HE_ALIGN_READ) : 0;
+    return bufLen_>=HE_ALIGN_WINDOW;
+  }
+public:
+  size_t pos;
+  unsigned long long hash;
+  HeRoller(HeReadFunc read, void *src, size_t size) {
+    read_ = read; src_ = src; size_ = size;
+    buf_ = (unsigned char*)malloc(HE_ALIGN_READ);
+    bufPos_ = bufLen_ = 0;
+    out_ = 1;
+    for (int i=0; i<HE_ALIGN_WINDOW; i++)
+      out_ *= HE_ALIGN_PRIME;
+    pos = 0;
+    hash = 0;
+  }
+  ~HeRoller() { free(buf_); }
+  const unsigned char *window() { return buf_+(pos-bufPos_); }
+  /// Put the window at 'p'. Fails if it does not fit into the document.
+  char start(size_t p) {
+    if (!load(p)) return 0;
+    pos = p;
+    hash = 0;
+    for (int i=0; i<HE_ALIGN_WINDOW; i++)
+      hash = hash*HE_ALIGN_PRIME+buf_[i];
+    return 1;
+  }
+  /// Move the window by one byte.
+  char roll() {
+    if (pos+HE_ALIGN_WINDOW>=size_) return 0;
+    if (pos+HE_ALIGN_WINDOW>=bufPos_+bufLen_
+        && (!load(pos) || bufLen_==HE_ALIGN_WINDOW)) return 0;
+    const unsigned char *p = window();
+    hash = hash*HE_ALIGN_PRIME+p[HE_ALIGN_WINDOW]-out_*p[0];
+    pos++;
+    return 1;
+  }
+};
+
+HeAlignment::HeAlignment() {
+  ops = 0;
+  nOps = 0;
+  capOps_ = 0;
+  scanned = 0;
+  table_ = 0;
+  bucket_ = 0;
+  lists_ = 0;
+  gaps_ = 0;
+}
+
+HeAlignment::~HeAlignment() {
+  clear();
+}
+
+void HeAlignment::clear() {
+  if (ops) free(ops);
+  ops = 0;
+  nOps = 0;
+  capOps_ = 0;
+  scanned = 0;
+}
+
+void HeAlignment::progress(size_t n) {
+  mutex_.lock();
+  scanned += n;
+  mutex_.unlock();
+}
+
+char HeAlignment::compute(HeReadFunc readA, void *a, size_t sizeA,
+                          HeReadFunc readB, void *b, size_t sizeB,
+                          HeThreadPool *pool, volatile char *cancel)
+{
+  static volatile char never = 0;
+  clear();
+  readA_ = readA;
+  readB_ = readB;
+  srcA_ = a; sizeA_ = sizeA;
+  srcB_ = b; sizeB_ = sizeB;
+  cancel_ = cancel ? cancel : &never;
+  mask_ = 31;
+  while (sizeA/(mask_+1)>HE_ALIGN_MAX_ANCHOR)
+    mask_ = mask_*2+1;
+  // enough pieces to keep every thread busy, but not too many lists
+  size_t larger = sizeA>sizeB ? sizeA : sizeB;
+  size_t threads = pool ? pool->threads()+1 : 1;
+  piece_ = HE_ALIGN_PIECE;
+  if (larger/piece_>threads*64)
+    piece_ = larger/(threads*64)+1;
+  int nA = (int)((sizeA+piece_-1)/piece_);
+  int nB = (int)((sizeB+piece_-1)/piece_);
+  int nLists = nA>nB ? nA : nB;
+  Match *m = 0;
+  int n = 0;
+  if (sizeA>=HE_ALIGN_WINDOW && sizeB>=HE_ALIGN_WINDOW) {
+    lists_ = (List*)calloc(nLists, sizeof(List));
+    heRun(pool, nA, indexCB, this);
+    if (!*cancel_)
+      buildTable(nA);
+    if (!*cancel_)
+      heRun(pool, nB, scanCB, this);
+    if (!*cancel_)
+      n = merge(nB, &m);
+    for (int i=0; i<nLists; i++) {
+      if (lists_[i].anchor) free(lists_[i].anchor);
+      if (lists_[i].match) free(lists_[i].match);
+    }
+    free(lists_);
+    lists_ = 0;
+  }
+  if (!*cancel_) {
+    n = chain(m, n);
+    n = fillGaps(pool, &m, n);
+  }
+  if (table_) free(table_);
+  if (bucket_) free(bucket_);
+  table_ = 0;
+  bucket_ = 0;
+  if (!*cancel_)
+    emit(m, n);
+  if (m) free(m);
+  scanned = sizeB;
+  return !*cancel_;
+}
+
+void HeAlignment::indexCB(void *user_data, int i) {
+  ((HeAlignment*)user_data)->indexPiece(i);
+}
+
+void HeAlignment::scanCB(void *user_data, int i) {
+  ((HeAlignment*)user_data)->scanPiece(i);
+}
+
+void HeAlignment::gapCB(void *user_data, int i) {
+  ((HeAlignment*)user_data)->fillGap(i);
+}
+
+/// Collect the anchors of one piece of A; windows may reach into the next
+/// piece. Anchors are at least a window apart, so a run of equal bytes
+/// does not flood the table.
+void HeAlignment::indexPiece(int i) {
+  List *l = lists_+i;
+  size_t first = (size_t)i*piece_, end = first+piece_;
+  size_t force = (mask_+1)*HE_ALIGN_FORCE, last = first;
+  HeRoller r(readA_, srcA_, sizeA_);
+  char ok = r.start(first);
+  while (ok && r.pos<end) {
+    if ((r.pos&0xffff)==0 && *cancel_) break;
+    size_t d = r.pos-last;
+    if ((d>=HE_ALIGN_WINDOW || r.pos==first) && (anchor(r.hash) || d>=force)) {
+      l->anchor = (Anchor*)heGrow(l->anchor, &l->cap, l->n, sizeof(Anchor));
+      l->anchor[l->n].hash = r.hash;
+      l->anchor[l->n].pos = r.pos;
+      l->n++;
+      last = r.pos;
+    }
+    ok = r.roll();
+  }
+}
+
+static int heCompareAnchor(const void *a, const void *b) {
+  const unsigned long long *x = (const unsigned long long*)a;
+  const unsigned long long *y = (const unsigned long long*)b;
+  if (x[0]!=y[0]) return x[0]<y[0] ? -1 : 1;
+  return x[1]<y[1] ? -1 : x[1]>y[1];
+}
+
+/// Every anchor is kept, not just the first of several equal windows:
+/// repeated content such as a table of equal records has the same window
+/// in every copy, and only the copy at the right place lines up after an
+/// edit. The anchors are put into buckets by their slot with a counting
+/// sort, and each bucket is ordered by hash and position, so lookup() can
+/// find the first copy in a range of A.
+void HeAlignment::buildTable(int nPieces) {
+  size_t i, j, count = 0;
+  for (i=0; i<(size_t)nPieces; i++)
+    count += lists_[i].n;
+  tableBits_ = 10;
+  while (((size_t)1<<tableBits_)<count*2)
+    tableBits_++;
+  tableMask_ = ((size_t)1<<tableBits_)-1;
+  table_ = (Anchor*)malloc((count ? count : 1)*sizeof(Anchor));
+  bucket_ = (size_t*)calloc(tableMask_+2, sizeof(size_t));
+  for (i=0; i<(size_t)nPieces; i++)
+    for (j=0; j<lists_[i].n; j++)
+      bucket_[slot(lists_[i].anchor[j].hash)+1]++;
+  for (i=1; i<=tableMask_+1; i++)
+    bucket_[i] += bucket_[i-1];
+  // bucket_[k] moves on to the end of bucket k while it is filled
+  for (i=0; i<(size_t)nPieces; i++) {
+    List *l = lists_+i;
+    for (j=0; j<l->n; j++)
+      table_[bucket_[slot(l->anchor[j].hash)]++] = l->anchor[j];
+    free(l->anchor);
+    l->anchor = 0;
+    l->n = l->cap = 0;
+  }
+  for (i=tableMask_+1; i>0; i--)
+    bucket_[i] = bucket_[i-1];
+  bucket_[0] = 0;
+  // pieces were added in order, so a bucket with one hash is sorted already
+  for (i=0; i<=tableMask_; i++) {
+    size_t b0 = bucket_[i], b1 = bucket_[i+1];
+    for (j=b0+1; j<b1 && table_[j].hash==table_[b0].hash; j++) { }
+    if (j<b1)
+      qsort(table_+b0, b1-b0, sizeof(Anchor), heCompareAnchor);
+  }
+}
+
+/// Position of the first anchor in A with hash 'h' in [lo, hi), or -1.
+size_t HeAlignment::lookup(unsigned long long h, size_t lo, size_t hi) {
+  size_t k = slot(h), b0 = bucket_[k], b1 = bucket_[k+1];
+  while (b0<b1) {
+    size_t mid = b0+(b1-b0)/2;
+    const Anchor &x = table_[mid];
+    if (x.hash<h || (x.hash==h && x.pos<lo)) b0 = mid+1; else b1 = mid;
+  }
+  if (b0<bucket_[k+1] && table_[b0].hash==h && table_[b0].pos<hi)
+    return (size_t)table_[b0].pos;
+  return (size_t)-1;
+}
+
+/// Number of equal bytes at 'a' in A and 'b' in B, up to 'max'.
+size_t HeAlignment::extend(size_t a, size_t b, size_t max,
+                           unsigned char *bufA, unsigned char *bufB)
+{
+  size_t total = 0;
+  if (max>sizeA_-a) max = sizeA_-a;
+  if (max>sizeB_-b) max = sizeB_-b;
+  while (total<max) {
+    size_t n = max-total;
+    if (n>HE_ALIGN_EXTEND) n = HE_ALIGN_EXTEND;
+    size_t na = readA_(srcA_, a, bufA, n), nb = readB_(srcB_, b, bufB, n);
+    n = na<nb ? na : nb;
+    size_t k = heMismatch(bufA, bufB, n);
+    total += k;
+    if (k<n || !n) break;
+    a += n; b += n;
+  }
+  return total;
+}
+
+/// Number of equal bytes right before 'a' in A and 'b' in B, not reaching
+/// back before 'limitA' in A and 'limitB' in B.
+size_t HeAlignment::extendBack(size_t a, size_t b, size_t limitA,
+                               size_t limitB)
+{
+  unsigned char bufA[HE_ALIGN_BACK], bufB[HE_ALIGN_BACK];
+  size_t total = 0;
+  for (;;) {
+    size_t n = HE_ALIGN_BACK;
+    if (n>a-limitA) n = a-limitA;
+    if (n>b-limitB) n = b-limitB;
+    if (!n) break;
+    if (readA_(srcA_, a-n, bufA, n)!=n || readB_(srcB_, b-n, bufB, n)!=n) break;
+    size_t k = heLastMismatch(bufA, bufB, n);
+    if (k<n) return total+n-1-k;
+    total += n;
+    a -= n; b -= n;
+  }
+  return total;
+}
+
+/// Find the matches that start in [first, end) of B. At every anchor, the
+/// place in A right behind the previous match, moved by the distance
+/// skipped in B, is tried first. It is the likely one after a small edit.
+/// Then the table is asked for the first copy of the window behind the
+/// previous match, which finds the right copy of repeated content after
+/// an insertion or deletion, and then for any copy at all, which finds
+/// moved content. In a gap, matches must stay in order, so only copies
+/// behind the previous match count. Matches stay below 'limitA' in A and
+/// 'limitB' in B.
+void HeAlignment::scan(List *l, size_t first, size_t end, size_t limitA,
+                       size_t limitB, size_t endA, size_t endB, char seeded,
+                       char inGap)
+{
+  size_t force = (mask_+1)*HE_ALIGN_FORCE, natural = first, done = first;
+  unsigned char *bufA = (unsigned char*)malloc(HE_ALIGN_EXTEND);
+  unsigned char *bufB = (unsigned char*)malloc(HE_ALIGN_EXTEND);
+  unsigned char w[HE_ALIGN_WINDOW];
+  HeRoller r(readB_, srcB_, limitB);
+  char ok = r.start(first);
+  while (ok && r.pos<end) {
+    if ((r.pos&0xffff)==0) {
+      if (*cancel_) break;
+      if (!inGap) progress(r.pos-done);
+      done = r.pos;
+    }
+    char isAnchor = anchor(r.hash);
+    if (isAnchor) natural = r.pos;
+    size_t a = (size_t)-1;
+    if (isAnchor || r.pos-natural>=force) {
+      size_t guess = endA+(r.pos-endB);
+      if (seeded && guess+HE_ALIGN_WINDOW<=limitA
+          && readA_(srcA_, guess, w, HE_ALIGN_WINDOW)==HE_ALIGN_WINDOW
+          && memcmp(w, r.window(), HE_ALIGN_WINDOW)==0)
+      {
+        a = guess;
+      } else if (table_) {
+        size_t lo = seeded ? endA : 0, x = lookup(r.hash, lo, limitA);
+        if (x==(size_t)-1 && lo && !inGap)
+          x = lookup(r.hash, 0, limitA);
+        if (x!=(size_t)-1 && x+HE_ALIGN_WINDOW<=limitA
+            && readA_(srcA_, x, w, HE_ALIGN_WINDOW)==HE_ALIGN_WINDOW
+            && memcmp(w, r.window(), HE_ALIGN_WINDOW)==0)
+          a = x;
+      }
+    }
+    if (a!=(size_t)-1) {
+      size_t max = limitA-a;
+      if (max>limitB-r.pos) max = limitB-r.pos;
+      size_t len = HE_ALIGN_WINDOW+extend(a+HE_ALIGN_WINDOW, r.pos+HE_ALIGN_WINDOW,
+                                          max-HE_ALIGN_WINDOW, bufA, bufB);
+      l->match = (Match*)heGrow(l->match, &l->cap, l->n, sizeof(Match));
+      l->match[l->n].a = a;
+      l->match[l->n].b = r.pos;
+      l->match[l->n].len = len;
+      l->n++;
+      endA = a+len;
+      endB = natural = r.pos+len;
+      seeded = 1;
+      ok = natural<end && r.start(natural);
+    } else {
+      ok = r.roll();
+    }
+  }
+  if (!inGap) progress(end-done);
+  free(bufA);
+  free(bufB);
+}
+
+/// A match is followed to its end even if that lies in the next piece;
+/// merge() trims the overlap. Before the first match, the piece guesses
+/// that its content is at the same place in A, and looks for copies from
+/// there on, so a piece in the middle of repeated content starts with the
+/// copy that is in order with its neighbours.
+void HeAlignment::scanPiece(int i) {
+  size_t first = (size_t)i*piece_, end = first+piece_;
+  if (end>sizeB_) end = sizeB_;
+  scan(lists_+i, first, end, sizeA_, sizeB_, first, first, 1, 0);
+}
+
+/// Look for more matches between two neighbours of the chain. Pieces of B
+/// that start in the middle of repeated content, such as a long run of
+/// zeros, may find a copy that the chain then drops. Going on from the end
+/// of the previous match, and looking up copies in the gap's part of A,
+/// finds the right one.
+void HeAlignment::fillGap(int i) {
+  Gap *g = gaps_+i;
+  scan(lists_+i, g->b0, g->b1, g->a1, g->b1, g->a0, g->b0, 1, 1);
+}
+
+/// Returns the new number of matches in '*m'.
+int HeAlignment::fillGaps(HeThreadPool *pool, Match **m, int n) {
+  int i, k = 0;
+  size_t j, total = 0;
+  gaps_ = (Gap*)malloc((n+1)*sizeof(Gap));
+  lists_ = (List*)calloc(n+1, sizeof(List));
+  for (i=0; i<=n; i++) {
+    Gap *g = gaps_+i;
+    g->a0 = i ? (*m)[i-1].a+(*m)[i-1].len : 0;
+    g->b0 = i ? (*m)[i-1].b+(*m)[i-1].len : 0;
+    g->a1 = i<n ? (*m)[i].a : sizeA_;
+    g->b1 = i<n ? (*m)[i].b : sizeB_;
+  }
+  heRun(pool, n+1, gapCB, this);
+  for (i=0; i<=n; i++)
+    total += lists_[i].n+1;
+  Match *dst = (Match*)malloc((total ? total : 1)*sizeof(Match));
+  for (i=0; i<=n; i++) {
+    List *l = lists_+i;
+    size_t endA = gaps_[i].a0, end = gaps_[i].b0;
+    for (j=0; j<l->n; j++) {
+      Match x = l->match[j];
+      size_t back = extendBack(x.a, x.b, endA, end);
+      x.a -= back; x.b -= back; x.len += back;
+      dst[k++] = x;
+      endA = x.a+x.len;
+      end = x.b+x.len;
+    }
+    if (i<n) dst[k++] = (*m)[i];
+    if (l->match) free(l->match);
+  }
+  free(lists_);
+  lists_ = 0;
+  free(gaps_);
+  gaps_ = 0;
+  free(*m);
+  *m = dst;
+  return k;
+}
+
+/// Join the matches of all pieces, which are in order of their position in
+/// B, into one list where they do not overlap in B, and extend each one
+/// backwards up to the end of the one before.
+int HeAlignment::merge(int nPieces, Match **dst) {
+  size_t total = 0, end = 0;
+  int i, n = 0;
+  for (i=0; i<nPieces; i++)
+    total += lists_[i].n;
+  Match *m = (Match*)malloc((total ? total : 1)*sizeof(Match));
+  for (i=0; i<nPieces; i++) {
+    List *l = lists_+i;
+    for (size_t j=0; j<l->n; j++) {
+      Match x = l->match[j];
+      if (x.b+x.len<=end) continue;
+      if (x.b<end) {
+        size_t d = end-x.b;
+        x.a += d; x.b += d; x.len -= d;
+      }
+      size_t back = extendBack(x.a, x.b, 0, end);
+      x.a -= back; x.b -= back; x.len += back;
+      m[n++] = x;
+      end = x.b+x.len;
+    }
+  }
+  *dst = m;
+  return n;
+}
+
+static int heCompareSize(const void *a, const void *b) {
+  size_t x = *(const size_t*)a, y = *(const size_t*)b;
+  return x<y ? -1 : x>y;
+}
+
+/// Keep the heaviest set of matches that are in the same order and do not
+/// overlap in A either. Matches are visited in order of B; a Fenwick tree
+/// over their end positions in A finds the best chain that ends before the
+/// start of the current one in O(log n).
+int HeAlignment::chain(Match *m, int n) {
+  if (n<2) return n;
+  size_t *ends = (size_t*)malloc(n*sizeof(size_t));
+  unsigned long long *tree = (unsigned long long*)calloc(n+1, sizeof(*tree));
+  int *treeIx = (int*)malloc((n+1)*sizeof(int));
+  unsigned long long *best = (unsigned long long*)malloc(n*sizeof(*best));
+  int *prev = (int*)malloc(n*sizeof(int));
+  int i, k, top = -1;
+  for (i=0; i<n; i++)
+    ends[i] = m[i].a+m[i].len;
+  qsort(ends, n, sizeof(size_t), heCompareSize);
+  for (i=0; i<=n; i++)
+    treeIx[i] = -1;
+  for (i=0; i<n; i++) {
+    // chains whose last match ends at or before m[i].a
+    int lo = 0, hi = n;
+    while (lo<hi) {
+      int mid = (lo+hi)/2;
+      if (ends[mid]<=m[i].a) lo = mid+1; else hi = mid;
+    }
+    unsigned long long w = 0;
+    int from = -1;
+    for (k=lo; k>0; k-=k&-k)
+      if (tree[k]>w) { w = tree[k]; from = treeIx[k]; }
+    best[i] = w+m[i].len;
+    prev[i] = from;
+    if (top<0 || best[i]>best[top]) top = i;
+    // insert at the rank of its own end
+    size_t e = m[i].a+m[i].len;
+    lo = 0; hi = n;
+    while (lo<hi) {
+      int mid = (lo+hi)/2;
+      if (ends[mid]<e) lo = mid+1; else hi = mid;
+    }
+    for (k=lo+1; k<=n; k+=k&-k)
+      if (best[i]>tree[k]) { tree[k] = best[i]; treeIx[k] = i; }
+  }
+  // follow the chain back, then move it to the front in order
+  int len = 0;
+  for (i=top; i>=0; i=prev[i])
+    len++;
+  k = len;
+  for (i=top; i>=0; i=prev[i])
+    ends[--k] = i;
+  for (k=0; k<len; k++)
+    m[k] = m[ends[k]];
+  free(ends);
+  free(tree);
+  free(treeIx);
+  free(best);
+  free(prev);
+  return len;
+}
+
+void HeAlignment::addOp(int type, size_t a, size_t b, size_t len) {
+  HeDiffOp *last = nOps ? ops+nOps-1 : 0;
+  if (last && last->type==type && type==HE_DIFF_COPY
+      && last->aPos+last->len==a && last->bPos+last->len==b) {
+    last->len += len;
+    return;
+  }
+  ops = (HeDiffOp*)heGrow(ops, &capOps_, nOps, sizeof(HeDiffOp));
+  ops[nOps].type = type;
+  ops[nOps].aPos = a;
+  ops[nOps].bPos = b;
+  ops[nOps].len = len;
+  nOps++;
+}
+
+void HeAlignment::emit(Match *m, int n) {
+  size_t a = 0, b = 0;
+  for (int i=0; i<n; i++) {
+    if (m[i].a>a) addOp(HE_DIFF_DELETE, a, b, m[i].a-a);
+    if (m[i].b>b) addOp(HE_DIFF_INSERT, m[i].a, b, m[i].b-b);
+    addOp(HE_DIFF_COPY, m[i].a, m[i].b, m[i].len);
+    a = m[i].a+m[i].len;
+    b = m[i].b+m[i].len;
+  }
+  if (a<sizeA_) addOp(HE_DIFF_DELETE, a, b, sizeA_-a);
+  if (b<sizeB_) addOp(HE_DIFF_INSERT, sizeA_, b, sizeB_-b);
+}
+
+static size_t heOpStart(const HeDiffOp *op, int side) {
+  return side ? op->bPos : op->aPos;
+}
+
+static size_t heOpLength(const HeDiffOp *op, int side) {
+  return op->type==(side ? HE_DIFF_DELETE : HE_DIFF_INSERT) ? 0 : op->len;
+}
+
+int HeAlignment::find(int side, size_t pos) {
+  int lo = 0, hi = nOps;
+  while (lo<hi) {
+    int mid = (lo+hi)/2;
+    if (heOpStart(ops+mid, side)<=pos) lo = mid+1; else hi = mid;
+  }
+  int i = lo-1;
+  while (i>=0 && !heOpLength(ops+i, side))
+    i--;
+  return i;
+}
+
+size_t HeAlignment::map(int side, size_t pos) {
+  int i = find(side, pos);
+  if (i<0) return pos;
+  HeDiffOp *op = ops+i;
+  size_t other = heOpStart(op, !side);
+  if (op->type!=HE_DIFF_COPY) return other;
+  size_t d = pos-heOpStart(op, side);
+  return other+(d<op->len ? d : op->len);
+}
+
+size_t HeAlignment::total(int type) {
+  size_t n = 0;
+  for (int i=0; i<nOps; i++)
+    if (ops[i].type==type) n += ops[i].len;
+  return n;
+}
@@ -0,0 +1,112 @@
+// Copyright © 2003-2004 Matthias Melcher
+// Copyright © 2019-2020 Neil McNeight
+
+
+#ifndef HEDIFF_H
+#define HEDIFF_H
+
+#include <stddef.h>
+
+#include "heThread.h"
+
+// Comparing blocks of memory. Equal stretches are skipped with memcmp(),
+// which the C library implements with vector instructions, so finding the
+// next difference runs at memory bandwidth.
+
+/// Index of the first byte where 'a' and 'b' differ, or 'n' if none does.
+size_t heMismatch(const unsigned char *a, const unsigned char *b, size_t n);
+
+/// Index of the last byte where 'a' and 'b' differ, or 'n' if none does.
+size_t heLastMismatch(const unsigned char *a, const unsigned char *b, size_t n);
+
+/// Number of bytes that differ.
+size_t heCountMismatch(const unsigned char *a, const unsigned char *b, size_t n);
+
+// Aligning documents that differ by inserted and deleted bytes. A rolling
+// hash slides over both documents one byte at a time, Rabin-Karp style.
+// Windows whose hash has a given bit pattern are anchors; those of A go into
+// a hash table and those of B are looked up in it, so matches are found no
+// matter how far the content moved, and only about one window in 32 touches
+// the table. Matches are extended in both directions, and the heaviest chain
+// of matches that is in order in both documents becomes a list of copy,
+// insert and delete steps. Both documents are split into large pieces that
+// are worked on by the whole thread pool.
+
+#define HE_DIFF_COPY   0
+#define HE_DIFF_INSERT 1
+#define HE_DIFF_DELETE 2
+
+/// One step of turning A into B. COPY keeps 'len' bytes that are at 'aPos'
+/// in A and at 'bPos' in B, INSERT adds 'len' bytes of B at 'bPos', and
+/// DELETE drops 'len' bytes of A at 'aPos'. The other position tells where
+/// the step happens in the other document.
+struct HeDiffOp {
+  int type;
+  size_t aPos, bPos, len;
+};
+
+/// Reads up to 'n' bytes at 'pos' and returns how many were read.
+typedef size_t (*HeReadFunc)(void *source, size_t pos, unsigned char *dst, size_t n);
+
+class HeAlignment {
+  struct Anchor { unsigned long long hash, pos; };
+  struct Match { size_t a, b, len; };
+  struct Gap { size_t a0, b0, a1, b1; };
+  struct List;
+  HeReadFunc readA_, readB_;
+  void *srcA_, *srcB_;
+  size_t sizeA_, sizeB_;
+  unsigned long long mask_;
+  Anchor *table_;
+  size_t *bucket_;
+  size_t tableMask_;
+  int tableBits_;
+  size_t capOps_;
+  List *lists_;
+  Gap *gaps_;
+  size_t piece_;
+  volatile char *cancel_;
+  HeMutex mutex_;
+  char anchor(unsigned long long h) { return ((h*0x9E3779B97F4A7C15ULL)>>40 & mask_)==0; }
+  size_t slot(unsigned long long h) {
+    return (size_t)(((h^h>>32)*0xD6E8FEB86659FD93ULL)>>(64-tableBits_)); }
+  size_t lookup(unsigned long long h, size_t lo, size_t hi);
+  size_t extend(size_t a, size_t b, size_t max,
+                unsigned char *bufA, unsigned char *bufB);
+  size_t extendBack(size_t a, size_t b, size_t limitA, size_t limitB);
+  void scan(List *l, size_t first, size_t end, size_t limitA, size_t limitB,
+            size_t endA, size_t endB, char seeded, char inGap);
+  void indexPiece(int i);
+  void scanPiece(int i);
+  void fillGap(int i);
+  int fillGaps(HeThreadPool *pool, Match **m, int n);
+  void buildTable(int nPieces);
+  int merge(int nPieces, Match **dst);
+  int chain(Match *m, int n);
+  void emit(Match *m, int n);
+  void addOp(int type, size_t a, size_t b, size_t len);
+  void progress(size_t n);
+  static void indexCB(void*, int);
+  static void scanCB(void*, int);
+  static void gapCB(void*, int);
+public:
+  HeDiffOp *ops;
+  int nOps;
+  volatile size_t scanned;
+  HeAlignment();
+  ~HeAlignment();
+  void clear();
+  /// Align A with B. Returns 0 if '*cancel' was set before it finished.
+  char compute(HeReadFunc readA, void *a, size_t sizeA,
+               HeReadFunc readB, void *b, size_t sizeB,
+               HeThreadPool *pool, volatile char *cancel=0);
+  /// The step that holds 'pos' in A (side 0) or B (side 1), or -1.
+  int find(int side, size_t pos);
+  /// Position in the other document that corresponds to 'pos'.
+  size_t map(int side, size_t pos);
+  /// Number of bytes copied, inserted or deleted.
+  size_t total(int type);
+};
+
+#endif
+
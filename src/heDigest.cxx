@@ -0,0 +1,652 @@
+// Copyright © 2003-2004 Matthias Melcher
+// Copyright © 2019-2020 Neil McNeight
+
+#include "heDigest.h"
+#include "heThread.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HE_HW_CRC32C
+#endif
+
+//---- CRC32 -------------------------------------------------------------------
+
+static unsigned int crcTable[2][8][256];
+static char crcReady = 0;
+
+/// Build the slicing-by-8 tables. This is not thread safe, so
+/// HeByteStats::reset() and HeBatch::run() get it done on the main thread
+/// before any worker needs the tables.
+static void crcInit() {
+  static const unsigned int poly[2] = { 0xedb88320, 0x82f63b78 };
+  if (crcReady) return;
+  for (int t=0; t<2; t++) {
+    int i, k;
+    for (i=0; i<256; i++) {
+      unsigned int c = i;
+      for (k=0; k<8; k++)
+        c = (c&1) ? (c>>1)^poly[t] : c>>1;
+      crcTable[t][0][i] = c;
+    }
+    for (i=0; i<256; i++)
+      for (k=1; k<8; k++)
+        crcTable[t][k][i] = (crcTable[t][k-1][i]>>8)
+                          ^ crcTable[t][0][crcTable[t][k-1][i]&0xff];
+  }
+  crcReady = 1;
+}
+
+static unsigned int crcUpdate(unsigned int (*t)[256], unsigned int c,
+                              const unsigned char *p, size_t n) {
+  while (n>=8) {
+    unsigned int a = c ^ (p[0] | (p[1]<<8) | (p[2]<<16) | ((unsigned int)p[3]<<24));
+    c = t[7][a&0xff] ^ t[6][(a>>8)&0xff] ^ t[5][(a>>16)&0xff] ^ t[4][a>>24]
+      ^ t[3][p[4]] ^ t[2][p[5]] ^ t[1][p[6]] ^ t[0][p[7]];
+    p += 8; n -= 8;
+  }
+  while (n--)
+    c = (c>>8) ^ t[0][(c^*p++)&0xff];
+  return c;
+}
+
+#ifdef HE_HW_CRC32C
+
+/// CRC32C using the SSE 4.2 crc32 instruction.
+__attribute__((target("sse4.2")))
+static unsigned int crc32cHw(unsigned int c, const unsigned char *p, size_t n) {
+  while (n && ((size_t)p&7)) {
+    c = __builtin_ia32_crc32qi(c, *p++); n--;
+  }
+#ifdef __x86_64__
+  while (n>=8) {
+    unsigned long long v;
+    memcpy(&v, p, 8);
+    c = (unsigned int)__builtin_ia32_crc32di(c, v);
+    p += 8; n -= 8;
+  }
+#endif
+  while (n>=4) {
+    unsigned int v;
+    memcpy(&v, p, 4);
+    c = __builtin_ia32_crc32si(c, v);
+    p += 4; n -= 4;
+  }
+  while (n--)
+    c = __builtin_ia32_crc32qi(c, *p++);
+  return c;
+}
+
+static char hasHwCrc32c() {
+  static int hw = -1;
+  if (hw<0) hw = __builtin_cpu_supports("sse4.2") ? 1 : 0;
+  return hw;
+}
+
+#endif
+
+unsigned int heCrc32(unsigned int crc, const unsigned char *p, size_t n) {
+  crcInit();
+  return ~crcUpdate(crcTable[0], ~crc, p, n);
+}
+
+unsigned int heCrc32c(unsigned int crc, const unsigned char *p, size_t n) {
+#ifdef HE_HW_CRC32C
+  if (hasHwCrc32c())
+    return ~crc32cHw(~crc, p, n);
+#endif
+  crcInit();
+  return ~crcUpdate(crcTable[1], ~crc, p, n);
+}
+
+static unsigned int gf2Times(const unsigned int *mat, unsigned int vec) {
+  unsigned int sum = 0;
+  for ( ; vec; vec>>=1, mat++)
+    if (vec&1) sum ^= *mat;
+  return sum;
+}
+
+static void gf2Square(unsigned int *square, const unsigned int *mat) {
+  for (int n=0; n<32; n++)
+    square[n] = gf2Times(mat, mat[n]);
+}
+
+/// Advances 'crc1' over 'len2' zero bytes by repeated squaring of the CRC
+/// operator matrix, as in zlib, then adds in 'crc2'.
+unsigned int heCrc32Combine(unsigned int crc1, unsigned int crc2,
+                            unsigned long long len2, char castagnoli) {
+  unsigned int even[32], odd[32], row = 1;
+  if (len2==0) return crc1;
+  odd[0] = castagnoli ? 0x82f63b78 : 0xedb88320;
+  for (int n=1; n<32; n++, row<<=1)
+    odd[n] = row;
+  gf2Square(even, odd);
+  gf2Square(odd, even);
+  do {
+    gf2Square(even, odd);
+    if (len2&1) crc1 = gf2Times(even, crc1);
+    len2 >>= 1;
+    if (!len2) break;
+    gf2Square(odd, even);
+    if (len2&1) crc1 = gf2Times(odd, crc1);
+    len2 >>= 1;
+  } while (len2);
+  return crc1^crc2;
+}
+
+//---- Histogram ---------------------------------------------------------------
+
+void heHistogram(unsigned long long hist[256], const unsigned char *p, size_t n) {
+  static const size_t maxRun = (size_t)1<<30;
+  unsigned int c[4][256];
+  while (n) {
+    size_t m = n<maxRun ? n : maxRun;
+    n -= m;
+    memset(c, 0, sizeof(c));
+    for ( ; m>=4; m-=4, p+=4) {
+      c[0][p[0]]++; c[1][p[1]]++; c[2][p[2]]++; c[3][p[3]]++;
+    }
+    for ( ; m; m--)
+      c[0][*p++]++;
+    for (int i=0; i<256; i++)
+      hist[i] += (unsigned long long)c[0][i]+c[1][i]+c[2][i]+c[3][i];
+  }
+}
+
+//---- HeXxh64 -----------------------------------------------------------------
+
+#define XXH_P1 11400714785074694791ULL
+#define XXH_P2 14029467366897019727ULL
+#define XXH_P3  1609587929392839161ULL
+#define XXH_P4  9650029242287828579ULL
+#define XXH_P5  2870177450012600261ULL
+
+static inline unsigned long long rotl64(unsigned long long x, int r) {
+  return (x<<r)|(x>>(64-r));
+}
+
+static inline unsigned long long readLE64(const unsigned char *p) {
+  unsigned long long v = 0;
+  for (int i=7; i>=0; i--) v = (v<<8)|p[i];
+  return v;
+}
+
+static inline unsigned int readLE32(const unsigned char *p) {
+  return p[0] | (p[1]<<8) | (p[2]<<16) | ((unsigned int)p[3]<<24);
+}
+
+static inline unsigned long long xxhRound(unsigned long long acc,
+                                          unsigned long long in) {
+  acc += in*XXH_P2;
+  return rotl64(acc, 31)*XXH_P1;
+}
+
+static inline unsigned long long xxhMerge(unsigned long long acc,
+                                          unsigned long long v) {
+  acc ^= xxhRound(0, v);
+  return acc*XXH_P1+XXH_P4;
+}
+
+void HeXxh64::init(unsigned long long seed) {
+  seed_ = seed;
+  v[0] = seed+XXH_P1+XXH_P2;
+  v[1] = seed+XXH_P2;
+  v[2] = seed;
+  v[3] = seed-XXH_P1;
+  total_ = 0;
+  nBuf = 0;
+}
+
+void HeXxh64::update(const unsigned char *p, size_t n) {
+  total_ += n;
+  if (nBuf+n<32) {
+    memcpy(buf+nBuf, p, n);
+    nBuf += n;
+    return;
+  }
+  if (nBuf) {
+    int m = 32-nBuf;
+    memcpy(buf+nBuf, p, m);
+    p += m; n -= m;
+    for (int i=0; i<4; i++)
+      v[i] = xxhRound(v[i], readLE64(buf+8*i));
+    nBuf = 0;
+  }
+  unsigned long long v0 = v[0], v1 = v[1], v2 = v[2], v3 = v[3];
+  for ( ; n>=32; n-=32, p+=32) {
+    v0 = xxhRound(v0, readLE64(p));
+    v1 = xxhRound(v1, readLE64(p+8));
+    v2 = xxhRound(v2, readLE64(p+16));
+    v3 = xxhRound(v3, readLE64(p+24));
+  }
+  v[0] = v0; v[1] = v1; v[2] = v2; v[3] = v3;
+  memcpy(buf, p, n);
+  nBuf = n;
+}
+
+unsigned long long HeXxh64::digest() {
+  unsigned long long h;
+  if (total_>=32) {
+    h = rotl64(v[0], 1)+rotl64(v[1], 7)+rotl64(v[2], 12)+rotl64(v[3], 18);
+    for (int i=0; i<4; i++)
+      h = xxhMerge(h, v[i]);
+  } else {
+    h = seed_+XXH_P5;
+  }
+  h += total_;
+  const unsigned char *p = buf;
+  int n = nBuf;
+  for ( ; n>=8; n-=8, p+=8) {
+    h ^= xxhRound(0, readLE64(p));
+    h = rotl64(h, 27)*XXH_P1+XXH_P4;
+  }
+  if (n>=4) {
+    h ^= (unsigned long long)readLE32(p)*XXH_P1;
+    h = rotl64(h, 23)*XXH_P2+XXH_P3;
+    p += 4; n -= 4;
+  }
+  for ( ; n; n--, p++) {
+    h ^= (*p)*XXH_P5;
+    h = rotl64(h, 11)*XXH_P1;
+  }
+  h ^= h>>33; h *= XXH_P2;
+  h ^= h>>29; h *= XXH_P3;
+  h ^= h>>32;
+  return h;
+}
+
+//---- HeBlockHash -------------------------------------------------------------
+
+void HeBlockHash::update(const unsigned char *p, size_t n) {
+  total_ += n;
+  if (nBuf) {
+    size_t m = 64-nBuf;
+    if (m>n) m = n;
+    memcpy(buf+nBuf, p, m);
+    nBuf += m; p += m; n -= m;
+    if (nBuf<64) return;
+    block(buf);
+    nBuf = 0;
+  }
+  for ( ; n>=64; n-=64, p+=64)
+    block(p);
+  memcpy(buf, p, n);
+  nBuf = n;
+}
+
+/// Append the final 0x80 marker, zeros and the length in bits.
+void HeBlockHash::pad(char bigEndian) {
+  unsigned long long bits = total_*8;
+  unsigned char tail[72];
+  int n = (nBuf<56 ? 56 : 120)-nBuf;
+  memset(tail, 0, sizeof(tail));
+  tail[0] = 0x80;
+  for (int i=0; i<8; i++)
+    tail[n+i] = (unsigned char)(bigEndian ? bits>>(56-8*i) : bits>>(8*i));
+  update(tail, n+8);
+}
+
+static inline unsigned int rotl32(unsigned int x, int r) {
+  return (x<<r)|(x>>(32-r));
+}
+
+static inline unsigned int rotr32(unsigned int x, int r) {
+  return (x>>r)|(x<<(32-r));
+}
+
+static inline unsigned int readBE32(const unsigned char *p) {
+  return ((unsigned int)p[0]<<24)|(p[1]<<16)|(p[2]<<8)|p[3];
+}
+
+static void writeBE32(unsigned char *dst, const unsigned int *h, int n) {
+  for (int i=0; i<n; i++) {
+    dst[4*i] = h[i]>>24; dst[4*i+1] = h[i]>>16;
+    dst[4*i+2] = h[i]>>8; dst[4*i+3] = h[i];
+  }
+}
+
+static void writeLE32(unsigned char *dst, const unsigned int *h, int n) {
+  for (int i=0; i<n; i++) {
+    dst[4*i] = h[i]; dst[4*i+1] = h[i]>>8;
+    dst[4*i+2] = h[i]>>16; dst[4*i+3] = h[i]>>24;
+  }
+}
+
+//---- HeSha256 ----------------------------------------------------------------
+
+static const unsigned int sha256K[64] = {
+  0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+  0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+  0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+  0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+  0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+  0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+  0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+  0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+  0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+  0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+  0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2 };
+
+static const unsigned int sha256H0[8] = {
+  0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+  0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19 };
+
+void HeSha256::init() {
+  memcpy(h, sha256H0, sizeof(h));
+  total_ = 0;
+  nBuf = 0;
+}
+
+void HeSha256::block(const unsigned char *p) {
+  unsigned int w[64], a, b, c, d, e, f, g, hh;
+  int i;
+  for (i=0; i<16; i++)
+    w[i] = readBE32(p+4*i);
+  for (i=16; i<64; i++) {
+    unsigned int s0 = rotr32(w[i-15], 7)^rotr32(w[i-15], 18)^(w[i-15]>>3);
+    unsigned int s1 = rotr32(w[i-2], 17)^rotr32(w[i-2], 19)^(w[i-2]>>10);
+    w[i] = w[i-16]+s0+w[i-7]+s1;
+  }
+  a = h[0]; b = h[1]; c = h[2]; d = h[3];
+  e = h[4]; f = h[5]; g = h[6]; hh = h[7];
+  for (i=0; i<64; i++) {
+    unsigned int s1 = rotr32(e, 6)^rotr32(e, 11)^rotr32(e, 25);
+    unsigned int t1 = hh+s1+((e&f)^(~e&g))+sha256K[i]+w[i];
+    unsigned int s0 = rotr32(a, 2)^rotr32(a, 13)^rotr32(a, 22);
+    unsigned int t2 = s0+((a&b)^(a&c)^(b&c));
+    hh = g; g = f; f = e; e = d+t1;
+    d = c; c = b; b = a; a = t1+t2;
+  }
+  h[0] += a; h[1] += b; h[2] += c; h[3] += d;
+  h[4] += e; h[5] += f; h[6] += g; h[7] += hh;
+}
+
+void HeSha256::digest(unsigned char out[32]) {
+  pad(1);
+  writeBE32(out, h, 8);
+}
+
+//---- HeSha1 ------------------------------------------------------------------
+
+void HeSha1::init() {
+  h[0] = 0x67452301; h[1] = 0xefcdab89; h[2] = 0x98badcfe;
+  h[3] = 0x10325476; h[4] = 0xc3d2e1f0;
+  total_ = 0;
+  nBuf = 0;
+}
+
+void HeSha1::block(const unsigned char *p) {
+  unsigned int w[80], a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+  int i;
+  for (i=0; i<16; i++)
+    w[i] = readBE32(p+4*i);
+  for (i=16; i<80; i++)
+    w[i] = rotl32(w[i-3]^w[i-8]^w[i-14]^w[i-16], 1);
+  for (i=0; i<80; i++) {
+    unsigned int f, k;
+    if (i<20)      { f = (b&c)|(~b&d);        k = 0x5a827999; }
+    else if (i<40) { f = b^c^d;               k = 0x6ed9eba1; }
+    else if (i<60) { f = (b&c)|(b&d)|(c&d);   k = 0x8f1bbcdc; }
+    else           { f = b^c^d;               k = 0xca62c1d6; }
+    unsigned int t = rotl32(a, 5)+f+e+k+w[i];
+    e = d; d = c; c = rotl32(b, 30); b = a; a = t;
+  }
+  h[0] += a; h[1] += b; h[2] += c; h[3] += d; h[4] += e;
+}
+
+void HeSha1::digest(unsigned char out[20]) {
+  pad(1);
+  writeBE32(out, h, 5);
+}
+
+//---- HeMd5 -------------------------------------------------------------------
+
+static const unsigned int md5K[64] = {
+  0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a,
+  0xa8304613, 0xfd469501, 0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be,
+  0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821, 0xf61e2562, 0xc040b340,
+  0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+  0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8,
+  0x676f02d9, 0x8d2a4c8a, 0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c,
+  0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70, 0x289b7ec6, 0xeaa127fa,
+  0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+  0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92,
+  0xffeff47d, 0x85845dd1, 0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1,
+  0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391 };
+
+static const unsigned char md5S[16] = {
+  7, 12, 17, 22, 5, 9, 14, 20, 4, 11, 16, 23, 6, 10, 15, 21 };
+
+void HeMd5::init() {
+  h[0] = 0x67452301; h[1] = 0xefcdab89; h[2] = 0x98badcfe; h[3] = 0x10325476;
+  total_ = 0;
+  nBuf = 0;
+}
+
+void HeMd5::block(const unsigned char *p) {
+  unsigned int m[16], a = h[0], b = h[1], c = h[2], d = h[3];
+  int i;
+  for (i=0; i<16; i++)
+    m[i] = readLE32(p+4*i);
+  for (i=0; i<64; i++) {
+    unsigned int f;
+    int g;
+    if (i<16)      { f = (b&c)|(~b&d); g = i; }
+    else if (i<32) { f = (d&b)|(~d&c); g = (5*i+1)&15; }
+    else if (i<48) { f = b^c^d;        g = (3*i+5)&15; }
+    else           { f = c^(b|~d);     g = (7*i)&15; }
+    f += a+md5K[i]+m[g];
+    a = d; d = c; c = b;
+    b += rotl32(f, md5S[(i>>4)*4+(i&3)]);
+  }
+  h[0] += a; h[1] += b; h[2] += c; h[3] += d;
+}
+
+void HeMd5::digest(unsigned char out[16]) {
+  pad(0);
+  writeLE32(out, h, 4);
+}
+
+//---- BLAKE3 ------------------------------------------------------------------
+
+#define B3_CHUNK_START  1
+#define B3_CHUNK_END    2
+#define B3_PARENT       4
+#define B3_ROOT         8
+
+static const unsigned char b3Permutation[16] = {
+  2, 6, 3, 10, 7, 0, 4, 13, 1, 11, 12, 5, 9, 14, 15, 8 };
+
+static inline void b3G(unsigned int *s, int a, int b, int c, int d,
+                       unsigned int mx, unsigned int my) {
+  s[a] = s[a]+s[b]+mx; s[d] = rotr32(s[d]^s[a], 16);
+  s[c] = s[c]+s[d];    s[b] = rotr32(s[b]^s[c], 12);
+  s[a] = s[a]+s[b]+my; s[d] = rotr32(s[d]^s[a], 8);
+  s[c] = s[c]+s[d];    s[b] = rotr32(s[b]^s[c], 7);
+}
+
+/// The BLAKE3 compression function, returning the new chaining value.
+static void b3Compress(unsigned int cv[8], const unsigned char *block,
+                       unsigned long long counter, unsigned int len,
+                       unsigned int flags) {
+  unsigned int s[16], m[16], t[16];
+  int i, r;
+  for (i=0; i<16; i++)
+    m[i] = readLE32(block+4*i);
+  memcpy(s, cv, 8*sizeof(unsigned int));
+  memcpy(s+8, sha256H0, 4*sizeof(unsigned int));
+  s[12] = (unsigned int)counter;
+  s[13] = (unsigned int)(counter>>32);
+  s[14] = len;
+  s[15] = flags;
+  for (r=0; r<7; r++) {
+    b3G(s, 0, 4,  8, 12, m[0],  m[1]);
+    b3G(s, 1, 5,  9, 13, m[2],  m[3]);
+    b3G(s, 2, 6, 10, 14, m[4],  m[5]);
+    b3G(s, 3, 7, 11, 15, m[6],  m[7]);
+    b3G(s, 0, 5, 10, 15, m[8],  m[9]);
+    b3G(s, 1, 6, 11, 12, m[10], m[11]);
+    b3G(s, 2, 7,  8, 13, m[12], m[13]);
+    b3G(s, 3, 4,  9, 14, m[14], m[15]);
+    for (i=0; i<16; i++) t[i] = m[b3Permutation[i]];
+    memcpy(m, t, sizeof(m));
+  }
+  for (i=0; i<8; i++)
+    cv[i] = s[i]^s[i+8];
+}
+
+static void b3Chunk(const unsigned char *p, size_t n, unsigned long long chunk,
+                    char root, unsigned int cv[8]) {
+  unsigned char block[64];
+  unsigned int flags = B3_CHUNK_START;
+  memcpy(cv, sha256H0, 8*sizeof(unsigned int));
+  for (;;) {
+    size_t m = n<64 ? n : 64;
+    if (m==n) flags |= B3_CHUNK_END | (root ? B3_ROOT : 0);
+    memset(block, 0, sizeof(block));
+    memcpy(block, p, m);
+    b3Compress(cv, block, chunk, (unsigned int)m, flags);
+    p += m; n -= m;
+    if (!n) break;
+    flags = 0;
+  }
+}
+
+void heBlake3Parent(const unsigned int left[8], const unsigned int right[8],
+                    char root, unsigned int cv[8]) {
+  unsigned char block[64];
+  writeLE32(block, left, 8);
+  writeLE32(block+32, right, 8);
+  memcpy(cv, sha256H0, 8*sizeof(unsigned int));
+  b3Compress(cv, block, 0, 64, B3_PARENT | (root ? B3_ROOT : 0));
+}
+
+void heBlake3Subtree(const unsigned char *p, size_t n, unsigned long long chunk,
+                     char root, unsigned int cv[8]) {
+  if (n<=HE_BLAKE3_CHUNK) {
+    b3Chunk(p, n, chunk, root, cv);
+    return;
+  }
+  unsigned int l[8], r[8];
+  size_t left = HE_BLAKE3_CHUNK;
+  while (2*left<n) left *= 2;
+  heBlake3Subtree(p, left, chunk, 0, l);
+  heBlake3Subtree(p+left, n-left, chunk+left/HE_BLAKE3_CHUNK, 0, r);
+  heBlake3Parent(l, r, root, cv);
+}
+
+void heBlake3Digest(const unsigned int cv[8], unsigned char out[32]) {
+  writeLE32(out, cv, 8);
+}
+
+//---- HeByteStats -------------------------------------------------------------
+
+#define HE_STATS_CHUNK (1<<20)
+
+struct HeByteStatsJob {
+  HeByteStats *stats;
+  const unsigned char *data;
+  size_t size, chunk;
+  unsigned long long (*hist)[256];
+  unsigned int *crc, *crcc;
+};
+
+void HeByteStats::reset() {
+  crcInit();
+  memset(hist, 0, sizeof(hist));
+  count = 0;
+  crc32 = crc32c = 0;
+  xxh64.init();
+  sha256.init();
+}
+
+void HeByteStats::addSerial(const unsigned char *p, size_t n) {
+  heHistogram(hist, p, n);
+  crc32 = heCrc32(crc32, p, n);
+  crc32c = heCrc32c(crc32c, p, n);
+  xxh64.update(p, n);
+  sha256.update(p, n);
+  count += n;
+}
+
+/// Job 0 and 1 run the sequential hashes over the whole range, all other
+/// jobs count and checksum one chunk each.
+void HeByteStats::jobCB(void *user_data, int index) {
+  HeByteStatsJob *j = (HeByteStatsJob*)user_data;
+  if (index==0) {
+    j->stats->sha256.update(j->data, j->size);
+  } else if (index==1) {
+    j->stats->xxh64.update(j->data, j->size);
+  } else {
+    int i = index-2;
+    size_t first = i*j->chunk, n = j->chunk;
+    if (first>j->size) first = j->size;
+    if (first+n>j->size) n = j->size-first;
+    heHistogram(j->hist[i], j->data+first, n);
+    j->crc[i] = heCrc32(0, j->data+first, n);
+    j->crcc[i] = heCrc32c(0, j->data+first, n);
+  }
+}
+
+void HeByteStats::add(const unsigned char *p, size_t n, HeThreadPool *pool) {
+  if (!pool || pool->threads()<2 || n<4*HE_STATS_CHUNK) {
+    addSerial(p, n);
+    return;
+  }
+  HeByteStatsJob j;
+  int i, k, nChunks = pool->threads();
+  j.stats = this;
+  j.data = p;
+  j.size = n;
+  j.chunk = (n+nChunks-1)/nChunks;
+  j.hist = (unsigned long long(*)[256])calloc(nChunks, sizeof(*j.hist));
+  j.crc = (unsigned int*)malloc(2*nChunks*sizeof(unsigned int));
+  j.crcc = j.crc+nChunks;
+  pool->parallelFor(nChunks+2, jobCB, &j);
+  for (i=0; i<nChunks; i++) {
+    size_t first = i*j.chunk, m = j.chunk;
+    if (first>n) first = n;
+    if (first+m>n) m = n-first;
+    for (k=0; k<256; k++)
+      hist[k] += j.hist[i][k];
+    crc32 = heCrc32Combine(crc32, j.crc[i], m, 0);
+    crc32c = heCrc32Combine(crc32c, j.crcc[i], m, 1);
+  }
+  count += n;
+  free(j.crc);
+  free(j.hist);
+}
+
+int HeByteStats::minimum() {
+  for (int i=0; i<256; i++)
+    if (hist[i]) return i;
+  return -1;
+}
+
+int HeByteStats::maximum() {
+  for (int i=255; i>=0; i--)
+    if (hist[i]) return i;
+  return -1;
+}
+
+unsigned long long HeByteStats::sum() {
+  unsigned long long s = 0;
+  for (int i=1; i<256; i++)
+    s += hist[i]*i;
+  return s;
+}
+
+/// Shannon entropy in bits per byte.
+double HeByteStats::entropy() {
+  double e = 0.0;
+  if (!count) return e;
+  for (int i=0; i<256; i++) {
+    if (!hist[i]) continue;
+    double p = (double)hist[i]/count;
+    e -= p*log(p);
+  }
+  return e/log(2.0);
+}
+
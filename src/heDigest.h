@@ -0,0 +1,110 @@
+// Copyright © 2003-2004 Matthias Melcher
+// Copyright © 2019-2020 Neil McNeight
+
+
+#ifndef HEDIGEST_H
+#define HEDIGEST_H
+
+#include <stddef.h>
+
+class HeThreadPool;
+
+// CRC32 (IEEE 802.3) and CRC32C (Castagnoli). Pass 0 to start a new checksum
+// or the result of a previous call to continue it.
+unsigned int heCrc32(unsigned int crc, const unsigned char *p, size_t n);
+unsigned int heCrc32c(unsigned int crc, const unsigned char *p, size_t n);
+
+/// Checksum of the concatenation of two blocks, given the checksum of each
+/// and the length of the second one.
+unsigned int heCrc32Combine(unsigned int crc1, unsigned int crc2,
+                            unsigned long long len2, char castagnoli);
+
+/// Count byte values. Uses four sets of counters so that runs of equal bytes
+/// do not stall on the same memory location.
+void heHistogram(unsigned long long hist[256], const unsigned char *p, size_t n);
+
+class HeXxh64 {
+  unsigned long long v[4], total_, seed_;
+  unsigned char buf[32];
+  int nBuf;
+public:
+  HeXxh64(unsigned long long seed=0) { init(seed); }
+  void init(unsigned long long seed=0);
+  void update(const unsigned char *p, size_t n);
+  unsigned long long digest();
+};
+
+/// Buffering and padding shared by the hashes that work on 64 byte blocks.
+class HeBlockHash {
+protected:
+  unsigned long long total_;
+  unsigned char buf[64];
+  int nBuf;
+  virtual void block(const unsigned char*) = 0;
+  void pad(char bigEndian);
+public:
+  virtual ~HeBlockHash() { }
+  void update(const unsigned char *p, size_t n);
+};
+
+class HeSha256 : public HeBlockHash {
+  unsigned int h[8];
+  virtual void block(const unsigned char*);
+public:
+  HeSha256() { init(); }
+  void init();
+  void digest(unsigned char out[32]);
+};
+
+class HeSha1 : public HeBlockHash {
+  unsigned int h[5];
+  virtual void block(const unsigned char*);
+public:
+  HeSha1() { init(); }
+  void init();
+  void digest(unsigned char out[20]);
+};
+
+class HeMd5 : public HeBlockHash {
+  unsigned int h[4];
+  virtual void block(const unsigned char*);
+public:
+  HeMd5() { init(); }
+  void init();
+  void digest(unsigned char out[16]);
+};
+
+// BLAKE3 splits its input into 1 kByte chunks that are the leaves of a
+// binary tree. Any subtree can be hashed on its own, starting at chunk
+// number 'chunk', and its chaining value joined with heBlake3Parent(). The
+// left subtree always holds the largest power of two number of chunks that
+// leaves at least one byte for the right one. 'root' is set for the top node
+// only; its chaining value is the hash.
+#define HE_BLAKE3_CHUNK 1024
+void heBlake3Subtree(const unsigned char *p, size_t n, unsigned long long chunk,
+                     char root, unsigned int cv[8]);
+void heBlake3Parent(const unsigned int left[8], const unsigned int right[8],
+                    char root, unsigned int cv[8]);
+void heBlake3Digest(const unsigned int cv[8], unsigned char out[32]);
+
+/// Histogram and checksums of a stream of bytes. Data can be added in any
+/// number of pieces; large pieces are split across the thread pool.
+class HeByteStats {
+  void addSerial(const unsigned char *p, size_t n);
+  static void jobCB(void*, int);
+public:
+  unsigned long long hist[256], count;
+  unsigned int crc32, crc32c;
+  HeXxh64 xxh64;
+  HeSha256 sha256;
+  HeByteStats() { reset(); }
+  void reset();
+  void add(const unsigned char *p, size_t n, HeThreadPool *pool=0);
+  int minimum();
+  int maximum();
+  unsigned long long sum();
+  double entropy();
+};
+
+#endif
+
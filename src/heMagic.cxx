@@ -0,0 +1,216 @@
+// Copyright © 2003-2004 Matthias Melcher
+// Copyright © 2019-2020 Neil McNeight
+
+#include "heMagic.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// bytes from the start of a format that verify functions may look at
+#define HE_MAGIC_VERIFY 1024
+
+/// DOS stub followed by a PE header at the offset stored at 0x3c.
+static char heVerifyPe(const unsigned char *p, size_t n) {
+  if (n<0x40) return 0;
+  size_t pe = p[0x3c]|(p[0x3d]<<8)|(p[0x3e]<<16)|((size_t)p[0x3f]<<24);
+  return pe+4<=n && pe>=0x40 && memcmp(p+pe, "PE\0\0", 4)==0;
+}
+
+/// The reserved flag bits of a gzip header are zero.
+static char heVerifyGzip(const unsigned char *p, size_t n) {
+  return n>=10 && (p[3]&0xe0)==0;
+}
+
+static char heVerifyId3(const unsigned char *p, size_t n) {
+  return n>=10 && p[3]<5 && p[4]!=0xff && !(p[6]&0x80) && !(p[7]&0x80)
+    && !(p[8]&0x80) && !(p[9]&0x80);
+}
+
+#define F HE_MAGIC_TOP
+static const HeMagicSig heMagicTable[] = {
+  { "ZIP archive",            0, 4, "PK\3\4", 0, 0, 0 },
+  { "empty ZIP archive",      0, 4, "PK\5\6", 0, F, 0 },
+  { "gzip data",              0, 3, "\x1f\x8b\x08", 0, 0, heVerifyGzip },
+  { "bzip2 data",             0, 10, "BZh01AY&SY", "\xff\xff\xff\xf0\xff\xff\xff\xff\xff\xff", 0, 0 },
+  { "xz data",                0, 6, "\xfd" "7zXZ\0", 0, 0, 0 },
+  { "7-Zip archive",          0, 6, "7z\xbc\xaf\x27\x1c", 0, 0, 0 },
+  { "RAR archive",            0, 6, "Rar!\x1a\x07", 0, 0, 0 },
+  { "Zstandard data",         0, 4, "\x28\xb5\x2f\xfd", 0, 0, 0 },
+  { "LZ4 data",               0, 4, "\x04\x22\x4d\x18", 0, 0, 0 },
+  { "tar archive",          257, 5, "ustar", 0, 0, 0 },
+  { "cpio archive",           0, 6, "070701", 0, 0, 0 },
+  { "ar archive",             0, 8, "!<arch>\n", 0, 0, 0 },
+  { "Microsoft Cabinet",      0, 8, "MSCF\0\0\0\0", 0, 0, 0 },
+  { "ISO 9660 image",     32769, 5, "CD001", 0, F, 0 },
+  { "PNG image",              0, 8, "\x89PNG\r\n\x1a\n", 0, 0, 0 },
+  { "JPEG image",             0, 4, "\xff\xd8\xff\xe0", "\xff\xff\xff\xf0", 0, 0 },
+  { "JPEG image",             0, 4, "\xff\xd8\xff\xdb", 0, 0, 0 },
+  { "GIF image",              0, 6, "GIF87a", "\xff\xff\xff\xff\xf0\xff", 0, 0 },
+  { "BMP image",              0, 2, "BM", 0, F, 0 },
+  { "TIFF image",             0, 4, "II*\0", 0, 0, 0 },
+  { "TIFF image",             0, 4, "MM\0*", 0, 0, 0 },
+  { "Windows icon",           0, 4, "\0\0\1\0", 0, F, 0 },
+  { "WebP image",             0, 12, "RIFF\0\0\0\0WEBP", "\xff\xff\xff\xff\0\0\0\0\xff\xff\xff\xff", 0, 0 },
+  { "WAVE audio",             0, 12, "RIFF\0\0\0\0WAVE", "\xff\xff\xff\xff\0\0\0\0\xff\xff\xff\xff", 0, 0 },
+  { "AVI video",              0, 12, "RIFF\0\0\0\0AVI ", "\xff\xff\xff\xff\0\0\0\0\xff\xff\xff\xff", 0, 0 },
+  { "MP3 audio with ID3 tag", 0, 3, "ID3", 0, 0, heVerifyId3 },
+  { "Ogg media",              0, 5, "OggS\0", 0, 0, 0 },
+  { "FLAC audio",             0, 4, "fLaC", 0, 0, 0 },
+  { "MPEG-4 media",           4, 4, "ftyp", 0, 0, 0 },
+  { "Matroska media",         0, 4, "\x1a\x45\xdf\xa3", 0, 0, 0 },
+  { "PDF document",           0, 5, "%PDF-", 0, 0, 0 },
+  { "OLE compound document",  0, 8, "\xd0\xcf\x11\xe0\xa1\xb1\x1a\xe1", 0, 0, 0 },
+  { "SQLite database",        0, 16, "SQLite format 3\0", 0, 0, 0 },
+  { "ELF executable",         0, 4, "\x7f" "ELF", 0, 0, 0 },
+  { "PE executable",          0, 2, "MZ", 0, 0, heVerifyPe },
+  { "DOS executable",         0, 2, "MZ", 0, F, 0 },
+  { "Mach-O executable",      0, 4, "\xfe\xed\xfa\xce", "\xff\xff\xff\xfe", 0, 0 },
+  { "Mach-O executable",      0, 4, "\xce\xfa\xed\xfe", "\xfe\xff\xff\xff", 0, 0 },
+  { "Java class or Mach-O universal binary", 0, 4, "\xca\xfe\xba\xbe", 0, 0, 0 },
+  { "Android DEX",            0, 4, "dex\n", 0, 0, 0 },
+  { "WebAssembly module",     0, 4, "\0asm", 0, F, 0 },
+  { "UTF-8 text with BOM",    0, 3, "\xef\xbb\xbf", 0, F, 0 },
+  { "UTF-16 text, little endian", 0, 2, "\xff\xfe", 0, F, 0 },
+  { "UTF-16 text, big endian", 0, 2, "\xfe\xff", 0, F, 0 },
+};
+#undef F
+
+#define HE_MAGIC_N (int)(sizeof(heMagicTable)/sizeof(heMagicTable[0]))
+
+HeMagic *HeMagic::shared() {
+  static HeMagic *magic = 0;
+  if (!magic) magic = new HeMagic();
+  return magic;
+}
+
+const HeMagicSig *HeMagic::sig(int i) {
+  return i>=0 && i<HE_MAGIC_N ? heMagicTable+i : 0;
+}
+
+HeMagic::HeMagic() {
+  node_ = 0;
+  nNodes_ = capNodes_ = 0;
+  nOffsets_ = 0;
+  head_ = HE_MAGIC_VERIFY;
+  margin_ = reach_ = 0;
+  memset(root_, 0xff, sizeof(root_));
+  for (int i=0; i<HE_MAGIC_N; i++) {
+    const HeMagicSig *s = heMagicTable+i;
+    int j;
+    insert(root_[0], i);
+    for (j=0; j<nOffsets_ && offsets_[j]!=s->offset; j++) { }
+    if (j==nOffsets_ && nOffsets_<8) offsets_[nOffsets_++] = s->offset;
+    if ((size_t)(s->offset+s->length)>head_) head_ = s->offset+s->length;
+    if (s->flags&HE_MAGIC_TOP) continue;
+    insert(root_[1], i);
+    if ((size_t)s->offset>margin_) margin_ = s->offset;
+    if ((size_t)s->length>reach_) reach_ = s->length;
+  }
+  reach_ += HE_MAGIC_VERIFY;
+}
+
+int HeMagic::newNode() {
+  if (nNodes_==capNodes_) {
+    capNodes_ = capNodes_ ? capNodes_*2 : 64;
+    node_ = (Node*)realloc(node_, capNodes_*sizeof(Node));
+  }
+  memset(node_+nNodes_, 0, sizeof(Node));
+  return nNodes_++;
+}
+
+int HeMagic::child(int n, unsigned char value, unsigned char mask) {
+  Node *nd = node_+n;
+  value &= mask;
+  for (int i=0; i<nd->nEdges; i++)
+    if (nd->edge[i].value==value && nd->edge[i].mask==mask)
+      return nd->edge[i].child;
+  int c = newNode();
+  nd = node_+n; // newNode() may have moved the nodes
+  nd->edge = (Edge*)realloc(nd->edge, (nd->nEdges+1)*sizeof(Edge));
+  nd->edge[nd->nEdges].value = value;
+  nd->edge[nd->nEdges].mask = mask;
+  nd->edge[nd->nEdges].child = c;
+  nd->nEdges++;
+  return c;
+}
+
+/// A first byte with a mask is entered under every value it matches.
+void HeMagic::insert(int *root, int sig) {
+  const HeMagicSig *s = heMagicTable+sig;
+  const unsigned char *b = (const unsigned char*)s->bytes;
+  const unsigned char *m = (const unsigned char*)s->mask;
+  for (int v=0; v<256; v++) {
+    unsigned char m0 = m ? m[0] : 0xff;
+    if ((v&m0)!=(b[0]&m0)) continue;
+    if (root[v]<0) root[v] = newNode();
+    int n = root[v];
+    for (int i=1; i<s->length; i++)
+      n = child(n, b[i], m ? m[i] : 0xff);
+    Node *nd = node_+n;
+    nd->sig = (int*)realloc(nd->sig, (nd->nSigs+1)*sizeof(int));
+    nd->sig[nd->nSigs++] = sig;
+  }
+}
+
+/// Signatures whose bytes are at 'p'. Several edges may match a byte when
+/// masks are involved, so the trie is walked depth first.
+int HeMagic::match(int *root, const unsigned char *p, size_t n, int *dst, int max) {
+  int stack[64], depth[64], sp = 0, found = 0;
+  if (!n || root[p[0]]<0) return 0;
+  stack[sp] = root[p[0]]; depth[sp] = 1; sp++;
+  while (sp>0) {
+    sp--;
+    Node *nd = node_+stack[sp];
+    int d = depth[sp];
+    for (int i=0; i<nd->nSigs && found<max; i++)
+      dst[found++] = nd->sig[i];
+    if ((size_t)d>=n) continue;
+    for (int i=0; i<nd->nEdges && sp<64; i++) {
+      if ((p[d]&nd->edge[i].mask)!=nd->edge[i].value) continue;
+      stack[sp] = nd->edge[i].child; depth[sp] = d+1; sp++;
+    }
+  }
+  return found;
+}
+
+char HeMagic::accept(int sig, const unsigned char *p, size_t n) {
+  const HeMagicSig *s = heMagicTable+sig;
+  return !s->verify || s->verify(p, n);
+}
+
+int HeMagic::identify(const unsigned char *p, size_t n) {
+  int ids[16], best = -1;
+  for (int j=0; j<nOffsets_; j++) {
+    size_t o = offsets_[j];
+    if (o>=n) continue;
+    int k = match(root_[0], p+o, n-o, ids, 16);
+    for (int i=0; i<k; i++) {
+      const HeMagicSig *s = heMagicTable+ids[i];
+      if ((size_t)s->offset!=o || !accept(ids[i], p, n)) continue;
+      if (best<0 || s->length>heMagicTable[best].length) best = ids[i];
+    }
+  }
+  return best;
+}
+
+int HeMagic::scan(const unsigned char *buf, size_t n, size_t first, size_t last,
+                  unsigned long long base, HeMagicHit *dst, int max)
+{
+  int ids[16], found = 0;
+  int *root = root_[1];
+  if (last>n) last = n;
+  for (size_t q=first; q<last && found<max; q++) {
+    if (root[buf[q]]<0) continue;
+    int k = match(root, buf+q, n-q, ids, 16);
+    for (int i=0; i<k && found<max; i++) {
+      const HeMagicSig *s = heMagicTable+ids[i];
+      if (q<(size_t)s->offset) continue;
+      size_t start = q-s->offset;
+      if (!accept(ids[i], buf+start, n-start)) continue;
+      dst[found].pos = base+start;
+      dst[found].sig = ids[i];
+      found++;
+    }
+  }
+  return found;
+}
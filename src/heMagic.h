@@ -0,0 +1,71 @@
+// Copyright © 2003-2004 Matthias Melcher
+// Copyright © 2019-2020 Neil McNeight
+
+
+#ifndef HEMAGIC_H
+#define HEMAGIC_H
+
+#include <stddef.h>
+
+// Recognizing file formats by their signatures. The built-in table is
+// compiled into a trie on first use. The root is a jump table indexed by
+// the first byte of a signature, so most positions of a file are rejected
+// with a single lookup, and the few that get further follow the edges of
+// the trie, which may carry a bit mask for bytes that vary.
+
+/// Only recognized at the start of a file. Short signatures would match
+/// all over the place in other data.
+#define HE_MAGIC_TOP 1
+
+struct HeMagicSig {
+  const char *name;
+  /// where the signature bytes are, counted from the start of the format
+  int offset;
+  int length;
+  const char *bytes;
+  /// bits of each byte that must match, or 0 for all of them
+  const char *mask;
+  int flags;
+  /// optional further check of the data at the start of the format
+  char (*verify)(const unsigned char *p, size_t n);
+};
+
+struct HeMagicHit {
+  unsigned long long pos;
+  int sig;
+};
+
+class HeMagic {
+  struct Edge { unsigned char value, mask; int child; };
+  struct Node { Edge *edge; int nEdges; int *sig; int nSigs; };
+  Node *node_;
+  int nNodes_, capNodes_;
+  // one trie over all signatures, one over those that can be embedded
+  int root_[2][256];
+  int offsets_[8], nOffsets_;
+  size_t head_, margin_, reach_;
+  int newNode();
+  int child(int node, unsigned char value, unsigned char mask);
+  void insert(int *root, int sig);
+  int match(int *root, const unsigned char *p, size_t n, int *dst, int max);
+  char accept(int sig, const unsigned char *p, size_t n);
+  HeMagic();
+public:
+  static HeMagic *shared();
+  static const HeMagicSig *sig(int i);
+  /// Format of the data at the start of a file, or -1. The longest of all
+  /// matching signatures wins. Pass the first head() bytes if there are.
+  int identify(const unsigned char *p, size_t n);
+  /// Formats embedded in 'buf', which holds 'n' bytes of a file starting
+  /// at 'base'. Only signatures found in [first, last) are reported, so
+  /// the pieces of a file can be scanned separately: each piece is read
+  /// with margin() bytes before and reach() bytes after it.
+  int scan(const unsigned char *buf, size_t n, size_t first, size_t last,
+           unsigned long long base, HeMagicHit *dst, int max);
+  size_t head() { return head_; }
+  size_t margin() { return margin_; }
+  size_t reach() { return reach_; }
+};
+
+#endif
+
@@ -0,0 +1,300 @@
+// Copyright © 2003-2004 Matthias Melcher
+// Copyright © 2019-2020 Neil McNeight
+
+#include "heMarks.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+HeMarkTree::HeMarkTree() {
+  node_ = 0;
+  nNodes_ = capNodes_ = 0;
+  free_ = -1;
+  root_ = -1;
+  count_ = notes_ = 0;
+  seed_ = 0x9e3779b9;
+}
+
+HeMarkTree::~HeMarkTree() {
+  clear();
+  if (node_) free(node_);
+}
+
+void HeMarkTree::clear() {
+  for (int i=0; i<nNodes_; i++)
+    if (node_[i].text) free(node_[i].text);
+  nNodes_ = 0;
+  free_ = -1;
+  root_ = -1;
+  count_ = notes_ = 0;
+}
+
+/// Nodes live in one array and are referred to by index, which is also the
+/// id of a mark. Removed nodes are chained through 'left'.
+int HeMarkTree::newNode() {
+  int i;
+  if (free_>=0) {
+    i = free_;
+    free_ = node_[i].left;
+  } else {
+    if (nNodes_==capNodes_) {
+      capNodes_ = capNodes_ ? capNodes_*2 : 256;
+      node_ = (Node*)realloc(node_, capNodes_*sizeof(Node));
+    }
+    i = nNodes_++;
+  }
+  Node &n = node_[i];
+  memset(&n, 0, sizeof(Node));
+  n.left = n.right = -1;
+  // xorshift, the priorities only need to be spread evenly
+  seed_ ^= seed_<<13; seed_ ^= seed_>>17; seed_ ^= seed_<<5;
+  n.prio = seed_;
+  count_++;
+  return i;
+}
+
+void HeMarkTree::freeNode(int i) {
+  if (node_[i].text) {
+    free(node_[i].text);
+    notes_--;
+  }
+  node_[i].text = 0;
+  node_[i].left = free_;
+  free_ = i;
+  count_--;
+}
+
+void HeMarkTree::push(int t) {
+  Node &n = node_[t];
+  if (!n.shift) return;
+  for (int k=0; k<2; k++) {
+    int c = k ? n.right : n.left;
+    if (c<0) continue;
+    Node &cn = node_[c];
+    cn.start += n.shift;
+    cn.end += n.shift;
+    cn.maxEnd += n.shift;
+    cn.shift += n.shift;
+  }
+  n.shift = 0;
+}
+
+void HeMarkTree::update(int t) {
+  Node &n = node_[t];
+  n.maxEnd = n.end;
+  if (n.left>=0 && node_[n.left].maxEnd>n.maxEnd) n.maxEnd = node_[n.left].maxEnd;
+  if (n.right>=0 && node_[n.right].maxEnd>n.maxEnd) n.maxEnd = node_[n.right].maxEnd;
+}
+
+/// Nodes are ordered by start, and by id if they start at the same byte.
+/// Everything before (key, id) goes to 'l', the rest to 'r'.
+void HeMarkTree::split(int t, unsigned long long key, int id, int *l, int *r) {
+  if (t<0) {
+    *l = *r = -1;
+    return;
+  }
+  push(t);
+  Node &n = node_[t];
+  if (n.start<key || (n.start==key && t<id)) {
+    split(n.right, key, id, &n.right, r);
+    *l = t;
+  } else {
+    split(n.left, key, id, l, &n.left);
+    *r = t;
+  }
+  update(t);
+}
+
+int HeMarkTree::merge(int l, int r) {
+  if (l<0) return r;
+  if (r<0) return l;
+  if (node_[l].prio>node_[r].prio) {
+    push(l);
+    node_[l].right = merge(node_[l].right, r);
+    update(l);
+    return l;
+  }
+  push(r);
+  node_[r].left = merge(l, node_[r].left);
+  update(r);
+  return r;
+}
+
+int HeMarkTree::add(unsigned long long start, unsigned long long end, int flags,
+                    const char *text)
+{
+  int a, b, i = newNode();
+  Node &n = node_[i];
+  n.start = start;
+  n.end = n.maxEnd = end>start ? end : start+1;
+  n.flags = flags;
+  if (text && *text) {
+    n.text = _strdup(text);
+    notes_++;
+  }
+  split(root_, start, i, &a, &b);
+  root_ = merge(merge(a, i), b);
+  return i;
+}
+
+int HeMarkTree::erase(int t, unsigned long long key, int id) {
+  if (t<0) return t;
+  push(t);
+  Node &n = node_[t];
+  if (t==id) {
+    int r = merge(n.left, n.right);
+    freeNode(t);
+    return r;
+  }
+  if (key<n.start || (key==n.start && id<t))
+    n.left = erase(n.left, key, id);
+  else
+    n.right = erase(n.right, key, id);
+  update(t);
+  return t;
+}
+
+void HeMarkTree::remove(const HeMark &m) {
+  root_ = erase(root_, m.start, m.id);
+}
+
+void HeMarkTree::text(int id, const char *text) {
+  Node &n = node_[id];
+  if (n.text) {
+    free(n.text);
+    notes_--;
+  }
+  n.text = 0;
+  if (text && *text) {
+    n.text = _strdup(text);
+    notes_++;
+  }
+}
+
+/// Marks that start before an edit and reach into it end where the edit
+/// ends now. Only subtrees that reach past 'pos' are visited.
+void HeMarkTree::fixEnds(int t, unsigned long long pos, unsigned long long nDel,
+                         unsigned long long nIns)
+{
+  if (t<0 || node_[t].maxEnd<=pos) return;
+  push(t);
+  Node &n = node_[t];
+  if (n.end>pos)
+    n.end = n.end>=pos+nDel ? n.end-nDel+nIns : pos;
+  fixEnds(n.left, pos, nDel, nIns);
+  fixEnds(n.right, pos, nDel, nIns);
+  update(t);
+}
+
+void HeMarkTree::flatten(int t, int *dst, int *n) {
+  if (t<0) return;
+  push(t);
+  flatten(node_[t].left, dst, n);
+  dst[(*n)++] = t;
+  flatten(node_[t].right, dst, n);
+}
+
+void HeMarkTree::edited(unsigned long long pos, unsigned long long nDel,
+                        unsigned long long nIns)
+{
+  if (nDel==nIns || root_<0) return;
+  int a, b, c, t;
+  split(root_, pos, -1, &a, &t);
+  split(t, pos+nDel, -1, &b, &c);
+  // everything behind the edit moves in one step
+  if (c>=0) {
+    Node &n = node_[c];
+    unsigned long long d = nIns-nDel;
+    n.start += d;
+    n.end += d;
+    n.maxEnd += d;
+    n.shift += d;
+  }
+  fixEnds(a, pos, nDel, nIns);
+  root_ = merge(a, c);
+  // marks that started in the deleted bytes now start where they did, or
+  // are gone with their bytes
+  if (b>=0) {
+    int i, n = 0, cnt = count_;
+    int *list = (int*)malloc(cnt*sizeof(int));
+    flatten(b, list, &n);
+    for (i=0; i<n; i++) {
+      int k = list[i];
+      if (node_[k].end<=pos+nDel) {
+        freeNode(k);
+        continue;
+      }
+      Node &m = node_[k];
+      m.end = m.end-nDel+nIns;
+      m.start = pos;
+      m.maxEnd = m.end;
+      m.left = m.right = -1;
+      m.shift = 0;
+      split(root_, pos, k, &a, &c);
+      root_ = merge(merge(a, k), c);
+    }
+    free(list);
+  }
+}
+
+void HeMarkTree::fill(int i, HeMark *m) {
+  Node &n = node_[i];
+  m->start = n.start;
+  m->end = n.end;
+  m->flags = n.flags;
+  m->text = n.text;
+  m->id = i;
+}
+
+int HeMarkTree::query(int t, unsigned long long first, unsigned long long last,
+                      HeMark *dst, int n, int max)
+{
+  if (t<0 || n>=max || node_[t].maxEnd<=first) return n;
+  push(t);
+  Node &nd = node_[t];
+  n = query(nd.left, first, last, dst, n, max);
+  // everything to the right starts even later
+  if (nd.start>=last || n>=max) return n;
+  if (nd.end>first)
+    fill(t, dst+n++);
+  return query(nd.right, first, last, dst, n, max);
+}
+
+int HeMarkTree::query(unsigned long long first, unsigned long long last,
+                      HeMark *dst, int max)
+{
+  return query(root_, first, last, dst, 0, max);
+}
+
+char HeMarkTree::next(unsigned long long pos, HeMark *m) {
+  int t = root_, found = -1;
+  while (t>=0) {
+    push(t);
+    if (node_[t].start>pos) {
+      found = t;
+      t = node_[t].left;
+    } else {
+      t = node_[t].right;
+    }
+  }
+  if (found<0) return 0;
+  fill(found, m);
+  return 1;
+}
+
+char HeMarkTree::previous(unsigned long long pos, HeMark *m) {
+  int t = root_, found = -1;
+  while (t>=0) {
+    push(t);
+    if (node_[t].start<pos) {
+      found = t;
+      t = node_[t].right;
+    } else {
+      t = node_[t].left;
+    }
+  }
+  if (found<0) return 0;
+  fill(found, m);
+  return 1;
+}
+
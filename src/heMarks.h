@@ -0,0 +1,80 @@
+// Copyright © 2003-2004 Matthias Melcher
+// Copyright © 2019-2020 Neil McNeight
+
+
+#ifndef HEMARKS_H
+#define HEMARKS_H
+
+// Bookmarks and annotated ranges of a document, kept in an interval tree:
+// a treap ordered by the start of each range, where every node also knows
+// the largest end in its subtree. Finding the marks on screen skips all
+// subtrees that end before it, so it takes O(log n + k). Inserting or
+// deleting bytes moves all marks behind the edit at once with a pending
+// shift on the root of their subtree, which is only passed down to the
+// children when a later operation walks through the node.
+
+#define HE_MARK_BOOKMARK 1
+
+/// A mark as returned by queries. 'id' stays the same while the mark exists.
+struct HeMark {
+  unsigned long long start, end;
+  int flags;
+  const char *text;
+  int id;
+};
+
+class HeMarkTree {
+  struct Node {
+    unsigned long long start, end, maxEnd;
+    /// added to all positions in both subtrees, but not passed on yet
+    unsigned long long shift;
+    unsigned int prio;
+    int left, right;
+    int flags;
+    char *text;
+  };
+  Node *node_;
+  int nNodes_, capNodes_, free_;
+  int root_, count_, notes_;
+  unsigned int seed_;
+  int newNode();
+  void freeNode(int i);
+  void push(int t);
+  void update(int t);
+  void split(int t, unsigned long long key, int id, int *l, int *r);
+  int merge(int l, int r);
+  int erase(int t, unsigned long long key, int id);
+  void fixEnds(int t, unsigned long long pos, unsigned long long nDel,
+               unsigned long long nIns);
+  void flatten(int t, int *dst, int *n);
+  int query(int t, unsigned long long first, unsigned long long last,
+            HeMark *dst, int n, int max);
+  void fill(int i, HeMark *m);
+public:
+  HeMarkTree();
+  ~HeMarkTree();
+  void clear();
+  /// Add a mark for [start, end). Returns its id.
+  int add(unsigned long long start, unsigned long long end, int flags,
+          const char *text);
+  /// Remove a mark as returned by a query.
+  void remove(const HeMark &m);
+  void text(int id, const char *text);
+  /// 'nDel' bytes at 'pos' were replaced by 'nIns' bytes. Marks whose bytes
+  /// are all gone are removed.
+  void edited(unsigned long long pos, unsigned long long nDel,
+              unsigned long long nIns);
+  /// Marks that overlap [first, last), ordered by their start. Returns the
+  /// number found, up to 'max'.
+  int query(unsigned long long first, unsigned long long last,
+            HeMark *dst, int max);
+  /// the first mark that starts after 'pos', or the last that starts before
+  char next(unsigned long long pos, HeMark *m);
+  char previous(unsigned long long pos, HeMark *m);
+  int count() { return count_; }
+  /// marks with a text
+  int notes() { return notes_; }
+};
+
+#endif
+
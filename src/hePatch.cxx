@@ -0,0 +1,521 @@
+// Copyright © 2003-2004 Matthias Melcher
+// Copyright © 2019-2020 Neil McNeight
+
+#include "hePatch.h"
+#include "heDigest.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef _MSC_VER
+#include <unistd.h>
+#else
+#include <corecrt_io.h>
+#endif
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <errno.h>
+
+#ifdef _MSC_VER
+#define ftruncate _chsize
+#endif
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+#define HE_PATCH_BUF (256<<10)
+#define HE_IPS_LIMIT 0x1000000
+#define HE_IPS_EOF   0x454F46
+
+//---- HeFileSource ------------------------------------------------------------
+
+char HeFileSource::open(const char *name) {
+  close();
+  fd = ::_open(name, O_RDONLY|O_BINARY, 0644);
+  if (fd==-1) return 0;
+  struct stat st;
+  if (fstat(fd, &st)==-1) {
+    close();
+    return 0;
+  }
+  size = st.st_size;
+  return 1;
+}
+
+void HeFileSource::close() {
+  if (fd!=-1)
+    ::_close(fd);
+  fd = -1;
+  size = 0;
+}
+
+/// Seeking and reading must not be torn apart by another thread.
+size_t HeFileSource::read(void *source, size_t pos, unsigned char *dst, size_t n) {
+  HeFileSource *f = (HeFileSource*)source;
+  size_t done = 0;
+  if (pos>=f->size) return 0;
+  if (n>f->size-pos) n = f->size-pos;
+  f->mutex_.lock();
+  if (::_lseek(f->fd, pos, SEEK_SET)!=-1) {
+    while (done<n) {
+      long k = ::_read(f->fd, dst+done, n-done);
+      if (k<=0) break;
+      done += k;
+    }
+  }
+  f->mutex_.unlock();
+  return done;
+}
+
+//---- streams -----------------------------------------------------------------
+
+/// Buffered output that keeps a running checksum of everything written.
+class HeOutStream {
+  unsigned char buf_[HE_PATCH_BUF];
+  size_t n_;
+public:
+  int fd;
+  unsigned int crc;
+  unsigned long long written;
+  char failed;
+  HeOutStream(int f) { fd = f; n_ = 0; crc = 0; written = 0; failed = 0; }
+  void flush() {
+    if (n_ && !failed && _write(fd, buf_, n_)!=(long)n_) failed = 1;
+    n_ = 0;
+  }
+  void put(const unsigned char *p, size_t n) {
+    crc = heCrc32(crc, p, n);
+    written += n;
+    while (n) {
+      size_t k = HE_PATCH_BUF-n_;
+      if (k>n) k = n;
+      memcpy(buf_+n_, p, k);
+      n_ += k; p += k; n -= k;
+      if (n_==HE_PATCH_BUF) flush();
+    }
+  }
+  void byte(unsigned char c) { put(&c, 1); }
+  void bytes(const char *s) { put((const unsigned char*)s, strlen(s)); }
+  void le32(unsigned int v) {
+    unsigned char b[4] = { (unsigned char)v, (unsigned char)(v>>8),
+                           (unsigned char)(v>>16), (unsigned char)(v>>24) };
+    put(b, 4);
+  }
+  void be(unsigned int v, int n) {
+    while (n--) byte((unsigned char)(v>>(8*n)));
+  }
+  /// BPS numbers: 7 bits per byte, the last byte has bit 7 set, and every
+  /// continuation takes away one, so that no number has two encodings.
+  void varint(unsigned long long v) {
+    for (;;) {
+      unsigned char x = v&0x7f;
+      v >>= 7;
+      if (!v) { byte(x|0x80); break; }
+      byte(x);
+      v--;
+    }
+  }
+};
+
+/// Buffered input that keeps a running checksum of everything read.
+class HeInStream {
+  unsigned char buf_[HE_PATCH_BUF];
+  size_t pos_, n_;
+public:
+  int fd;
+  unsigned int crc;
+  unsigned long long consumed;
+  char failed;
+  HeInStream(int f) { fd = f; pos_ = n_ = 0; crc = 0; consumed = 0; failed = 0; }
+  size_t get(unsigned char *dst, size_t n) {
+    size_t done = 0;
+    while (done<n) {
+      if (pos_==n_) {
+        long k = failed ? 0 : _read(fd, buf_, HE_PATCH_BUF);
+        if (k<=0) { failed = 1; break; }
+        pos_ = 0; n_ = k;
+      }
+      size_t k = n_-pos_;
+      if (k>n-done) k = n-done;
+      memcpy(dst+done, buf_+pos_, k);
+      pos_ += k; done += k;
+    }
+    crc = heCrc32(crc, dst, done);
+    consumed += done;
+    return done;
+  }
+  unsigned int byte() {
+    unsigned char c = 0;
+    get(&c, 1);
+    return c;
+  }
+  unsigned int le32() {
+    unsigned char b[4] = { 0, 0, 0, 0 };
+    get(b, 4);
+    return b[0]|(b[1]<<8)|(b[2]<<16)|((unsigned int)b[3]<<24);
+  }
+  unsigned int be(int n) {
+    unsigned int v = 0;
+    while (n--) v = (v<<8)|byte();
+    return v;
+  }
+  unsigned long long varint() {
+    unsigned long long v = 0, shift = 1;
+    for (int i=0; i<10 && !failed; i++) {
+      unsigned int x = byte();
+      v += (x&0x7f)*shift;
+      if (x&0x80) break;
+      shift <<= 7;
+      v += shift;
+    }
+    return v;
+  }
+};
+
+static const char *heCopyFrom(HeReadFunc read, void *src, size_t pos,
+                              unsigned long long n, HeOutStream &out)
+{
+  unsigned char *buf = (unsigned char*)malloc(HE_PATCH_BUF);
+  while (n) {
+    size_t k = n>HE_PATCH_BUF ? HE_PATCH_BUF : (size_t)n;
+    if (read(src, pos, buf, k)!=k) break;
+    out.put(buf, k);
+    pos += k; n -= k;
+  }
+  free(buf);
+  return n ? "Reading past the end of the source data" : 0;
+}
+
+static unsigned int heCrcOf(HeReadFunc read, void *src, size_t size) {
+  unsigned char *buf = (unsigned char*)malloc(HE_PATCH_BUF);
+  unsigned int crc = 0;
+  for (size_t pos=0; pos<size; ) {
+    size_t k = read(src, pos, buf, HE_PATCH_BUF);
+    if (!k) break;
+    crc = heCrc32(crc, buf, k);
+    pos += k;
+  }
+  free(buf);
+  return crc;
+}
+
+int hePatchFormat(const char *patchName) {
+  char sig[5];
+  int fd = _open(patchName, O_RDONLY|O_BINARY, 0644);
+  if (fd==-1) return -1;
+  long n = _read(fd, sig, 5);
+  ::_close(fd);
+  if (n>=4 && memcmp(sig, "BPS1", 4)==0) return HE_PATCH_BPS;
+  if (n==5 && memcmp(sig, "PATCH", 5)==0) return HE_PATCH_IPS;
+  return -1;
+}
+
+int hePatchFormatByName(const char *patchName) {
+  size_t n = strlen(patchName);
+  if (n>=4 && (strcmp(patchName+n-4, ".ips")==0 || strcmp(patchName+n-4, ".IPS")==0))
+    return HE_PATCH_IPS;
+  return HE_PATCH_BPS;
+}
+
+//---- creating patches --------------------------------------------------------
+
+/// Copies at the same offset need no address. Other copies store their
+/// distance to the end of the previous one, which is usually short.
+const char *heWriteBps(const char *patchName,
+                       HeReadFunc readA, void *a, size_t sizeA,
+                       HeReadFunc readB, void *b, size_t sizeB,
+                       HeAlignment *al)
+{
+  int fd = _open(patchName, O_WRONLY|O_CREAT|O_TRUNC|O_BINARY, 0644);
+  if (fd==-1) return strerror(errno);
+  HeOutStream *out = new HeOutStream(fd);
+  const char *err = 0;
+  unsigned long long sourceRel = 0;
+  out->bytes("BPS1");
+  out->varint(sizeA);
+  out->varint(sizeB);
+  out->varint(0);
+  for (int i=0; i<al->nOps && !err; i++) {
+    HeDiffOp *op = al->ops+i;
+    if (op->type==HE_DIFF_COPY && op->aPos==op->bPos) {
+      out->varint(((unsigned long long)(op->len-1)<<2)|0);
+    } else if (op->type==HE_DIFF_COPY) {
+      long long d = (long long)op->aPos-(long long)sourceRel;
+      out->varint(((unsigned long long)(op->len-1)<<2)|2);
+      out->varint(d<0 ? ((unsigned long long)-d<<1)|1 : (unsigned long long)d<<1);
+      sourceRel = op->aPos+op->len;
+    } else if (op->type==HE_DIFF_INSERT) {
+      out->varint(((unsigned long long)(op->len-1)<<2)|1);
+      err = heCopyFrom(readB, b, op->bPos, op->len, *out);
+    }
+  }
+  if (!err) {
+    out->le32(heCrcOf(readA, a, sizeA));
+    out->le32(heCrcOf(readB, b, sizeB));
+    out->le32(out->crc);
+    out->flush();
+    if (out->failed) err = strerror(errno);
+  }
+  delete out;
+  ::_close(fd);
+  if (err) unlink(patchName);
+  return err;
+}
+
+/// Differences that are less than six bytes apart go into one record,
+/// because a record header takes five. A record may not start at the offset
+/// that spells "EOF", so such a record starts one byte earlier.
+const char *heWriteIps(const char *patchName,
+                       HeReadFunc readA, void *a, size_t sizeA,
+                       HeReadFunc readB, void *b, size_t sizeB)
+{
+  if (sizeB>HE_IPS_LIMIT)
+    return "IPS patches can not address more than 16 MBytes";
+  // the truncation size has three bytes too, and 16 MBytes would wrap to 0
+  if (sizeA>sizeB && sizeB>=HE_IPS_LIMIT)
+    return "IPS patches can not truncate to 16 MBytes or more";
+  size_t nA = sizeA<sizeB ? sizeA : sizeB;
+  unsigned char *pa = (unsigned char*)malloc(nA+1);
+  unsigned char *pb = (unsigned char*)malloc(sizeB+1);
+  if (readA(a, 0, pa, nA)!=nA || readB(b, 0, pb, sizeB)!=sizeB) {
+    free(pa); free(pb);
+    return "Can't read the documents";
+  }
+  int fd = _open(patchName, O_WRONLY|O_CREAT|O_TRUNC|O_BINARY, 0644);
+  if (fd==-1) {
+    free(pa); free(pb);
+    return strerror(errno);
+  }
+  HeOutStream *out = new HeOutStream(fd);
+  out->bytes("PATCH");
+  size_t i = 0;
+  while (i<sizeB) {
+    if (i<nA) {
+      i += heMismatch(pa+i, pb+i, nA-i);
+      if (i>=sizeB) break;
+    }
+    size_t start = i, end = i+1, same = 0, j;
+    for (j=i+1; j<sizeB && j-start<0xffff; j++) {
+      if (j<nA && pa[j]==pb[j]) {
+        if (++same>=6) break;
+      } else {
+        same = 0;
+        end = j+1;
+      }
+    }
+    if (start==HE_IPS_EOF) {
+      start--;
+      if (end-start>0xffff) end--;
+    }
+    size_t n = end-start;
+    for (j=start+1; j<end && pb[j]==pb[start]; j++) { }
+    out->be(start, 3);
+    if (j==end && n>8) {
+      out->be(0, 2);
+      out->be(n, 2);
+      out->byte(pb[start]);
+    } else {
+      out->be(n, 2);
+      out->put(pb+start, n);
+    }
+    i = end;
+  }
+  out->bytes("EOF");
+  // truncation extension
+  if (sizeB<sizeA)
+    out->be(sizeB, 3);
+  out->flush();
+  const char *err = out->failed ? strerror(errno) : 0;
+  delete out;
+  ::_close(fd);
+  free(pa);
+  free(pb);
+  if (err) unlink(patchName);
+  return err;
+}
+
+//---- applying patches --------------------------------------------------------
+
+/// Copy from the part of the output that was already written. The source
+/// may overlap the destination, which repeats the bytes in between.
+static const char *heTargetCopy(HeOutStream &out, unsigned long long from,
+                                unsigned long long n)
+{
+  unsigned char *buf = (unsigned char*)malloc(HE_PATCH_BUF);
+  const char *err = 0;
+  out.flush();
+  while (n && !err) {
+    unsigned long long dist = out.written-from;
+    size_t k = n>HE_PATCH_BUF ? HE_PATCH_BUF : (size_t)n;
+    if (dist<k) k = (size_t)dist;
+    if (_lseek(out.fd, from, SEEK_SET)==-1 || _read(out.fd, buf, k)!=(long)k)
+      err = "Can't read back the output file";
+    else if (_lseek(out.fd, out.written, SEEK_SET)==-1)
+      err = "Can't write the output file";
+    else {
+      out.put(buf, k);
+      out.flush();
+      from += k; n -= k;
+    }
+  }
+  free(buf);
+  return err;
+}
+
+static const char *heApplyBps(HeFileSource &src, int patch, size_t patchSize,
+                              HeOutStream &out)
+{
+  unsigned char foot[12];
+  if (patchSize<19)
+    return "The patch is truncated";
+  if (_lseek(patch, patchSize-12, SEEK_SET)==-1 || _read(patch, foot, 12)!=12
+      || _lseek(patch, 0, SEEK_SET)==-1)
+    return "Can't read the patch";
+  unsigned int crcA = foot[0]|(foot[1]<<8)|(foot[2]<<16)|((unsigned int)foot[3]<<24);
+  unsigned int crcB = foot[4]|(foot[5]<<8)|(foot[6]<<16)|((unsigned int)foot[7]<<24);
+  unsigned int crcP = foot[8]|(foot[9]<<8)|(foot[10]<<16)|((unsigned int)foot[11]<<24);
+  HeInStream *in = new HeInStream(patch);
+  const char *err = 0;
+  unsigned char sig[4];
+  in->get(sig, 4);
+  unsigned long long sizeA = in->varint(), sizeB = in->varint();
+  unsigned long long meta = in->varint();
+  while (meta-- && !in->failed)
+    in->byte();
+  if (memcmp(sig, "BPS1", 4)!=0)
+    err = "This is not a BPS patch";
+  else if (sizeA!=src.size)
+    err = "The patch was made for a file of a different size";
+  else if (heCrcOf(HeFileSource::read, &src, src.size)!=crcA)
+    err = "The patch was made for a different file";
+  unsigned long long sourceRel = 0, targetRel = 0;
+  while (!err && in->consumed<patchSize-12) {
+    unsigned long long data = in->varint();
+    unsigned long long n = (data>>2)+1, d;
+    if (in->failed) break;
+    if (out.written+n>sizeB) {
+      err = "The patch is damaged";
+      break;
+    }
+    switch (data&3) {
+      case 0: // source read
+        err = heCopyFrom(HeFileSource::read, &src, out.written, n, out);
+        break;
+      case 1: { // target read
+        unsigned char buf[4096];
+        while (n && !in->failed) {
+          size_t k = n>sizeof(buf) ? sizeof(buf) : (size_t)n;
+          out.put(buf, in->get(buf, k));
+          n -= k;
+        }
+        break; }
+      case 2: // source copy
+        d = in->varint();
+        sourceRel += (d&1) ? -(long long)(d>>1) : (long long)(d>>1);
+        err = heCopyFrom(HeFileSource::read, &src, sourceRel, n, out);
+        sourceRel += n;
+        break;
+      case 3: // target copy
+        d = in->varint();
+        targetRel += (d&1) ? -(long long)(d>>1) : (long long)(d>>1);
+        if (targetRel>=out.written) {
+          err = "The patch is damaged";
+          break;
+        }
+        err = heTargetCopy(out, targetRel, n);
+        targetRel += n;
+        break;
+    }
+  }
+  if (!err) {
+    in->get(foot, 8);
+    if (in->failed || in->crc!=crcP)
+      err = "The patch is damaged";
+    else if (out.written!=sizeB || out.crc!=crcB)
+      err = "The patched file has the wrong checksum";
+  }
+  delete in;
+  return err;
+}
+
+static const char *heApplyIps(HeFileSource &src, int patch, HeOutStream &out) {
+  const char *err = heCopyFrom(HeFileSource::read, &src, 0, src.size, out);
+  out.flush();
+  HeInStream *in = new HeInStream(patch);
+  unsigned char *buf = (unsigned char*)malloc(0x10000);
+  in->get(buf, 5);
+  if (memcmp(buf, "PATCH", 5)!=0)
+    err = "This is not an IPS patch";
+  while (!err) {
+    unsigned int pos = in->be(3);
+    if (in->failed) {
+      err = "The patch is truncated";
+      break;
+    }
+    if (pos==HE_IPS_EOF) break;
+    unsigned int n = in->be(2);
+    if (n==0) {
+      n = in->be(2);
+      memset(buf, in->byte(), n);
+    } else {
+      in->get(buf, n);
+    }
+    if (in->failed)
+      err = "The patch is truncated";
+    else if (_lseek(out.fd, pos, SEEK_SET)==-1 || _write(out.fd, buf, n)!=(long)n)
+      err = strerror(errno);
+  }
+  if (!err) {
+    // an optional truncation follows the end marker
+    unsigned int size = in->be(3);
+    if (!in->failed && ftruncate(out.fd, size)==-1)
+      err = strerror(errno);
+  }
+  free(buf);
+  delete in;
+  return err;
+}
+
+const char *heApplyPatch(const char *sourceName, const char *patchName,
+                         const char *outName)
+{
+  HeFileSource src;
+  const char *err = 0;
+  if (!src.open(sourceName))
+    return strerror(errno);
+  int patch = _open(patchName, O_RDONLY|O_BINARY, 0644);
+  if (patch==-1)
+    return strerror(errno);
+  struct stat st;
+  if (fstat(patch, &st)==-1) {
+    ::_close(patch);
+    return strerror(errno);
+  }
+  int format = hePatchFormat(patchName);
+  if (format<0) {
+    ::_close(patch);
+    return "This is not a BPS or IPS patch";
+  }
+  int fd = _open(outName, O_RDWR|O_CREAT|O_TRUNC|O_BINARY, 0644);
+  if (fd==-1) {
+    ::_close(patch);
+    return strerror(errno);
+  }
+  HeOutStream *out = new HeOutStream(fd);
+  if (format==HE_PATCH_BPS)
+    err = heApplyBps(src, patch, st.st_size, *out);
+  else
+    err = heApplyIps(src, patch, *out);
+  out->flush();
+  if (!err && out->failed)
+    err = strerror(errno);
+  delete out;
+  ::_close(fd);
+  ::_close(patch);
+  if (err) unlink(outName);
+  return err;
+}
+
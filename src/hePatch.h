@@ -0,0 +1,58 @@
+// Copyright © 2003-2004 Matthias Melcher
+// Copyright © 2019-2020 Neil McNeight
+
+
+#ifndef HEPATCH_H
+#define HEPATCH_H
+
+#include "heDiff.h"
+
+// Binary patch files. BPS describes the new file as a list of copies from
+// the original, copies from what was already written and literal bytes,
+// and protects everything with CRC32 checksums. IPS is the older, simpler
+// format that only overwrites bytes and cannot address more than 16 MBytes.
+// Patches are applied while streaming from the original file to the output
+// through small buffers, so neither has to fit into memory.
+
+#define HE_PATCH_BPS 0
+#define HE_PATCH_IPS 1
+
+/// A file that any number of threads can read through HeReadFunc.
+class HeFileSource {
+  HeMutex mutex_;
+public:
+  int fd;
+  size_t size;
+  HeFileSource() { fd = -1; size = 0; }
+  ~HeFileSource() { close(); }
+  char open(const char *name);
+  void close();
+  static size_t read(void *source, size_t pos, unsigned char *dst, size_t n);
+};
+
+/// Format of a patch file by its signature, or -1.
+int hePatchFormat(const char *patchName);
+
+/// Format by file name extension. Anything but ".ips" is BPS.
+int hePatchFormatByName(const char *patchName);
+
+/// Write a patch that turns A into B, following the steps of an alignment
+/// of both. Returns an error message, or 0.
+const char *heWriteBps(const char *patchName,
+                       HeReadFunc readA, void *a, size_t sizeA,
+                       HeReadFunc readB, void *b, size_t sizeB,
+                       HeAlignment *al);
+
+/// IPS can not insert or delete, so this compares bytes at equal offsets.
+const char *heWriteIps(const char *patchName,
+                       HeReadFunc readA, void *a, size_t sizeA,
+                       HeReadFunc readB, void *b, size_t sizeB);
+
+/// Apply a patch in either format to 'sourceName' and write the result to
+/// 'outName', which must be a different file. Returns an error message, or
+/// 0. A failed output file is removed.
+const char *heApplyPatch(const char *sourceName, const char *patchName,
+                         const char *outName);
+
+#endif
+
@@ -0,0 +1,282 @@
+// Copyright © 2003-2004 Matthias Melcher
+// Copyright © 2019-2020 Neil McNeight
+
+#include "hePlugin.h"
+
+#include <FL/filename.H>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef WIN32
+#include <dlfcn.h>
+#endif
+
+double heSeconds();
+
+#ifdef WIN32
+#define HE_PLUGIN_SUFFIX ".dll"
+#elif defined(__APPLE__)
+#define HE_PLUGIN_SUFFIX ".dylib"
+#else
+#define HE_PLUGIN_SUFFIX ".so"
+#endif
+
+//---- host functions ------------------------------------------------------------
+
+static unsigned long long hePluginSize(HePluginDoc *doc) {
+  return doc->size();
+}
+
+static int hePluginLock(HePluginDoc *doc, unsigned long long pos,
+                        unsigned long long n, HePluginSpan span[2])
+{
+  if (n>HE_PLUGIN_MAX_LOCK) n = HE_PLUGIN_MAX_LOCK;
+  return doc->lock(pos, n, span);
+}
+
+static void hePluginUnlock(HePluginDoc *doc) {
+  doc->unlock();
+}
+
+static unsigned long long hePluginRead(HePluginDoc *doc, unsigned long long pos,
+                                       unsigned char *dst, unsigned long long n)
+{
+  unsigned long long done = 0;
+  while (done<n) {
+    HePluginSpan span[2];
+    int i, ns = hePluginLock(doc, pos+done, n-done, span);
+    unsigned long long k = 0;
+    for (i=0; i<ns; i++) {
+      memcpy(dst+done+k, span[i].data, (size_t)span[i].size);
+      k += span[i].size;
+    }
+    doc->unlock();
+    if (k==0) break;
+    done += k;
+  }
+  return done;
+}
+
+static int hePluginCancelled(HePluginTask *task) {
+  return task->cancelled();
+}
+
+static void hePluginNote(HePluginTask *task, unsigned long long pos,
+                         unsigned long long n, const char *text)
+{
+  task->note(pos, n, text);
+}
+
+static int hePluginThreads() {
+  // parallelFor() lets the calling thread help
+  return HeThreadPool::shared()->threads()+1;
+}
+
+static void hePluginParallelFor(int n, void (*func)(void*, int), void *data) {
+  HeThreadPool::shared()->parallelFor(n, func, data);
+}
+
+//---- HePluginTask --------------------------------------------------------------
+
+HePluginTask::HePluginTask(HePluginDoc *doc, const HePluginAnalysis *a) {
+  doc_ = doc;
+  analysis_ = a;
+  deadline_ = 0.0;
+  cancel_ = 0;
+  running_ = timedOut_ = 0;
+  err_ = 0;
+  note_ = 0;
+  nNotes_ = capNotes_ = 0;
+}
+
+HePluginTask::~HePluginTask() {
+  stop();
+  wait();
+  for (int i=0; i<nNotes_; i++)
+    free(note_[i].text);
+  if (note_)
+    free(note_);
+  if (err_)
+    free(err_);
+}
+
+void HePluginTask::start() {
+  double s = analysis_->seconds>0.0 ? analysis_->seconds : HE_PLUGIN_SECONDS;
+  deadline_ = heSeconds()+s;
+  running_ = 1;
+  HeThreadPool::shared()->post(jobCB, this);
+}
+
+void HePluginTask::jobCB(void *user_data, int) {
+  HePluginTask *t = (HePluginTask*)user_data;
+  const char *err = t->analysis_->run(t->analysis_->user, t->doc_, t);
+  t->mutex_.lock();
+  // the message may live in the plugin's own buffer
+  if (err) t->err_ = _strdup(err);
+  t->running_ = 0;
+  t->finished_.broadcast();
+  t->mutex_.unlock();
+}
+
+void HePluginTask::wait() {
+  mutex_.lock();
+  while (running_)
+    finished_.wait(mutex_);
+  mutex_.unlock();
+}
+
+char HePluginTask::done() {
+  mutex_.lock();
+  char d = !running_;
+  mutex_.unlock();
+  return d;
+}
+
+/// The time box is checked here, so a plugin that asks often enough can't
+/// run longer than it is allowed to.
+char HePluginTask::cancelled() {
+  if (cancel_) return 1;
+  if (heSeconds()>deadline_) {
+    timedOut_ = 1;
+    cancel_ = 1;
+  }
+  return cancel_;
+}
+
+void HePluginTask::note(unsigned long long pos, unsigned long long n,
+                        const char *text)
+{
+  mutex_.lock();
+  if (nNotes_==capNotes_) {
+    capNotes_ = capNotes_ ? capNotes_*2 : 64;
+    note_ = (Note*)realloc(note_, capNotes_*sizeof(Note));
+  }
+  Note &m = note_[nNotes_++];
+  m.pos = pos;
+  m.n = n;
+  m.text = _strdup(text ? text : "");
+  mutex_.unlock();
+}
+
+//---- HePluginList --------------------------------------------------------------
+
+HePluginList::HePluginList() {
+  lib_ = 0;
+  nLibs_ = 0;
+  err_[0] = 0;
+}
+
+HePluginList *HePluginList::shared() {
+  static HePluginList *list = 0;
+  if (!list) list = new HePluginList();
+  return list;
+}
+
+const HePluginHost *HePluginList::host() {
+  static const HePluginHost h = {
+    HE_PLUGIN_VERSION,
+    hePluginSize,
+    hePluginLock,
+    hePluginUnlock,
+    hePluginRead,
+    hePluginCancelled,
+    hePluginNote,
+    hePluginThreads,
+    hePluginParallelFor
+  };
+  return &h;
+}
+
+const char *HePluginList::load(const char *filename) {
+#ifdef WIN32
+  void *handle = (void*)LoadLibraryA(filename);
+  if (!handle) {
+    snprintf(err_, sizeof(err_), "%s: can't load library (error %lu)",
+             filename, (unsigned long)GetLastError());
+    return err_;
+  }
+  HePluginEntry entry = (HePluginEntry)GetProcAddress((HMODULE)handle,
+                                                      HE_PLUGIN_ENTRY);
+#else
+  void *handle = dlopen(filename, RTLD_NOW|RTLD_LOCAL);
+  if (!handle) {
+    snprintf(err_, sizeof(err_), "%s", dlerror());
+    return err_;
+  }
+  HePluginEntry entry = (HePluginEntry)dlsym(handle, HE_PLUGIN_ENTRY);
+#endif
+  const HePlugin *p = entry ? entry(host()) : 0;
+  if (!entry || !p || p->version<1 || p->version>HE_PLUGIN_VERSION) {
+    snprintf(err_, sizeof(err_), "%s: %s", filename,
+             !entry ? "not a mickey plugin"
+             : !p ? "the plugin refused to load"
+             : "the plugin needs a newer version of mickey");
+#ifdef WIN32
+    FreeLibrary((HMODULE)handle);
+#else
+    dlclose(handle);
+#endif
+    return err_;
+  }
+  lib_ = (Lib*)realloc(lib_, (nLibs_+1)*sizeof(Lib));
+  lib_[nLibs_].handle = handle;
+  lib_[nLibs_].plugin = p;
+  nLibs_++;
+  return 0;
+}
+
+const char *HePluginList::loadFolder(const char *dir) {
+  struct dirent **list;
+  int i, n = fl_filename_list(dir, &list);
+  char first[sizeof(err_)];
+  first[0] = 0;
+  for (i=0; i<n; i++) {
+    const char *e = list[i]->d_name;
+    size_t k = strlen(e), ks = strlen(HE_PLUGIN_SUFFIX);
+    if (k<=ks || strcmp(e+k-ks, HE_PLUGIN_SUFFIX)!=0)
+      continue;
+    char path[2048];
+    snprintf(path, sizeof(path), "%s/%s", dir, e);
+    const char *err = load(path);
+    if (err && !first[0]) strcpy(first, err);
+  }
+  if (n>0)
+    fl_filename_free_list(&list, n);
+  if (!first[0]) return 0;
+  strcpy(err_, first);
+  return err_;
+}
+
+int HePluginList::columns() {
+  int i, n = 0;
+  for (i=0; i<nLibs_; i++)
+    n += lib_[i].plugin->nColumns;
+  return n;
+}
+
+const HePluginColumnType *HePluginList::column(int k) {
+  for (int i=0; i<nLibs_; i++) {
+    const HePlugin *p = lib_[i].plugin;
+    if (k<p->nColumns) return p->columns+k;
+    k -= p->nColumns;
+  }
+  return 0;
+}
+
+int HePluginList::analyses() {
+  int i, n = 0;
+  for (i=0; i<nLibs_; i++)
+    n += lib_[i].plugin->nAnalyses;
+  return n;
+}
+
+const HePluginAnalysis *HePluginList::analysis(int k) {
+  for (int i=0; i<nLibs_; i++) {
+    const HePlugin *p = lib_[i].plugin;
+    if (k<p->nAnalyses) return p->analyses+k;
+    k -= p->nAnalyses;
+  }
+  return 0;
+}
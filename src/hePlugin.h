@@ -0,0 +1,82 @@
+// Copyright © 2003-2004 Matthias Melcher
+// Copyright © 2019-2020 Neil McNeight
+
+
+#ifndef HEPLUGIN_H
+#define HEPLUGIN_H
+
+// The editor's side of the plugin interface in hePluginApi.h: loading the
+// libraries, the host functions, and running analyses in the background.
+
+#include "hePluginApi.h"
+#include "heThread.h"
+
+/// What plugins see of a document. Called from worker threads.
+struct HePluginDoc {
+  virtual ~HePluginDoc() { }
+  virtual unsigned long long size() = 0;
+  virtual int lock(unsigned long long pos, unsigned long long n,
+                   HePluginSpan *span) = 0;
+  virtual void unlock() = 0;
+};
+
+/// One run of an analysis on the shared thread pool. The owner polls
+/// done() from the main thread and deletes the task once it is; the
+/// destructor waits for a task that is still running.
+struct HePluginTask {
+  struct Note {
+    unsigned long long pos, n;
+    char *text;
+  };
+  HePluginDoc *doc_;
+  const HePluginAnalysis *analysis_;
+  double deadline_;
+  volatile char cancel_;
+  char running_, timedOut_;
+  char *err_;
+  Note *note_;
+  int nNotes_, capNotes_;
+  HeMutex mutex_;
+  HeCondition finished_;
+  static void jobCB(void*, int);
+  HePluginTask(HePluginDoc*, const HePluginAnalysis*);
+  ~HePluginTask();
+  void start();
+  void stop() { cancel_ = 1; }
+  char stopped() { return cancel_; }
+  void wait();
+  char done();
+  char cancelled();
+  void note(unsigned long long pos, unsigned long long n, const char *text);
+  const char *name() { return analysis_->name; }
+  /// the plugin's error message, or 0
+  const char *error() { return err_; }
+  char timedOut() { return timedOut_; }
+  int notes() { return nNotes_; }
+  const Note &noteAt(int i) { return note_[i]; }
+};
+
+/// All plugins that were loaded. They stay loaded until the program ends.
+class HePluginList {
+  struct Lib {
+    void *handle;
+    const HePlugin *plugin;
+  };
+  Lib *lib_;
+  int nLibs_;
+  char err_[1024];
+public:
+  HePluginList();
+  static HePluginList *shared();
+  static const HePluginHost *host();
+  /// Returns an error message, or 0.
+  const char *load(const char *filename);
+  /// Load all libraries in a folder. Returns the first error, or 0.
+  const char *loadFolder(const char *dir);
+  int columns();
+  const HePluginColumnType *column(int i);
+  int analyses();
+  const HePluginAnalysis *analysis(int i);
+};
+
+#endif
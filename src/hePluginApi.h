@@ -0,0 +1,119 @@
+// Copyright © 2003-2004 Matthias Melcher
+// Copyright © 2019-2020 Neil McNeight
+
+
+#ifndef HEPLUGINAPI_H
+#define HEPLUGINAPI_H
+
+// The interface between mickey and analyser plugins. It is plain C, and it
+// is all a plugin needs to include. A plugin is a shared library (.so,
+// .dylib or .dll) that exports
+//
+//   const HePlugin *mickeyPlugin(const HePluginHost *host);
+//
+// mickey calls it once after loading the library, keeps the description it
+// returns for as long as it runs, and never unloads the library. Plugins
+// are loaded from the "plugins" folder next to the preferences, and with
+// "mickey -plugin file".
+//
+// A plugin provides column types and analyses:
+//
+// - A column shows a line of text next to every row of the hex view, like
+//   a disassembly or decoded fields. rowText() is called while the view is
+//   drawn, on the main thread, so it must be quick. Rows that don't fit into
+//   the time a redraw may take are left blank until the next one.
+// - An analysis runs on a worker thread and annotates the document. It must
+//   call cancelled() every few milliseconds and return as soon as that says
+//   so: when its time runs out, when the document is edited or closed, or
+//   when the user stops it. Its annotations show up when it returns, and are
+//   dropped if it was cancelled.
+//
+// Plugins can't change the document. lock() gives direct views of up to
+// HE_PLUGIN_MAX_LOCK bytes; the editor can't change the document until
+// unlock(), so keep locks short. Any plugin function may be called again
+// for another document while it runs.
+//
+// Structures only grow at the end, and 'version' tells which fields exist.
+
+#define HE_PLUGIN_VERSION 1
+#define HE_PLUGIN_ENTRY "mickeyPlugin"
+#define HE_PLUGIN_MAX_LOCK (1<<20)
+/// time box of analyses that don't give one
+#define HE_PLUGIN_SECONDS 30.0
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct HePluginDoc HePluginDoc;
+typedef struct HePluginTask HePluginTask;
+
+/// Direct view of contiguous bytes of the document.
+typedef struct HePluginSpan {
+  const unsigned char *data;
+  unsigned long long size;
+} HePluginSpan;
+
+typedef struct HePluginHost {
+  /// HE_PLUGIN_VERSION of the editor
+  int version;
+  unsigned long long (*size)(HePluginDoc *doc);
+  /// Views of the bytes from 'pos', no more than 'n' or HE_PLUGIN_MAX_LOCK,
+  /// in one or two spans. Returns the number of spans. unlock() must be
+  /// called even if there are none.
+  int (*lock)(HePluginDoc *doc, unsigned long long pos, unsigned long long n,
+              HePluginSpan span[2]);
+  void (*unlock)(HePluginDoc *doc);
+  /// Copy up to 'n' bytes from 'pos', and return how many were copied.
+  unsigned long long (*read)(HePluginDoc *doc, unsigned long long pos,
+                             unsigned char *dst, unsigned long long n);
+  /// Nonzero if the analysis must return now.
+  int (*cancelled)(HePluginTask *task);
+  /// Annotate 'n' bytes at 'pos'. May be called from any thread.
+  void (*note)(HePluginTask *task, unsigned long long pos,
+               unsigned long long n, const char *text);
+  /// Number of threads that parallelFor() can use.
+  int (*threads)(void);
+  /// Call func(data, i) for every i in [0, n) on the worker threads, and
+  /// return when all calls returned. The calling thread helps.
+  void (*parallelFor)(int n, void (*func)(void *data, int index), void *data);
+} HePluginHost;
+
+typedef struct HePluginColumnType {
+  const char *name;
+  /// width of the column in characters
+  int chars;
+  /// Write the text for the 'n' bytes of the row at 'pos' to 'text', at
+  /// most 'max' bytes including the final 0.
+  void (*rowText)(void *user, HePluginDoc *doc, unsigned long long pos,
+                  int n, char *text, int max);
+  void *user;
+} HePluginColumnType;
+
+typedef struct HePluginAnalysis {
+  /// label in the Tools/Plugins menu
+  const char *name;
+  /// time box in seconds, or 0 for HE_PLUGIN_SECONDS
+  double seconds;
+  /// Returns 0, or an error message.
+  const char *(*run)(void *user, HePluginDoc *doc, HePluginTask *task);
+  void *user;
+} HePluginAnalysis;
+
+typedef struct HePlugin {
+  /// HE_PLUGIN_VERSION the plugin was built with
+  int version;
+  const char *name;
+  int nColumns;
+  const HePluginColumnType *columns;
+  int nAnalyses;
+  const HePluginAnalysis *analyses;
+} HePlugin;
+
+typedef const HePlugin *(*HePluginEntry)(const HePluginHost *host);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,155 @@
+// Copyright © 2003-2004 Matthias Melcher
+// Copyright © 2019-2020 Neil McNeight
+
+#include "heProfile.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#ifndef WIN32
+#include <time.h>
+#endif
+
+#ifdef _MSC_VER
+#define HE_THREAD_LOCAL __declspec(thread)
+#else
+#define HE_THREAD_LOCAL __thread
+#endif
+
+/// A finished zone ('X'), or the value of a counter ('C').
+struct HeTraceEvent {
+  double t0, dur;
+  unsigned long long value;
+  int tid;
+  short id;
+  char type;
+};
+
+static const char *heZoneNames[HE_ZONES] = {
+  "load", "save", "move gap", "draw", "search"
+};
+static const char *heCounterNames[HE_COUNTERS] = {
+  "memmove bytes", "memmoves", "rows drawn", "rows reused"
+};
+
+volatile unsigned long long heCounters[HE_COUNTERS];
+static HeZoneStats heZones[HE_ZONES];
+static HeTraceEvent heEvents[HE_TRACE_EVENTS];
+static volatile unsigned long long heNextEvent = 0;
+static volatile long heNextTid = 0;
+static HE_THREAD_LOCAL long heTid = 0;
+
+static double heProfileClock() {
+#ifdef WIN32
+  LARGE_INTEGER f, t;
+  QueryPerformanceFrequency(&f);
+  QueryPerformanceCounter(&t);
+  return (double)t.QuadPart/(double)f.QuadPart;
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec*1e-9;
+#endif
+}
+
+// set before main(), so no thread has to race for it
+static double heProfileStart = heProfileClock();
+
+double heProfileNow() {
+  return heProfileClock()-heProfileStart;
+}
+
+/// Small numbers for threads, in the order they first leave an event.
+static int heThreadId() {
+  if (!heTid) {
+#ifdef WIN32
+    heTid = InterlockedIncrement(&heNextTid);
+#else
+    heTid = __sync_add_and_fetch(&heNextTid, 1);
+#endif
+  }
+  return (int)heTid;
+}
+
+static HeTraceEvent &heNewEvent() {
+#ifdef WIN32
+  unsigned long long i = InterlockedExchangeAdd64((volatile LONGLONG*)&heNextEvent, 1);
+#else
+  unsigned long long i = __sync_fetch_and_add(&heNextEvent, 1);
+#endif
+  return heEvents[i&(HE_TRACE_EVENTS-1)];
+}
+
+void heProfileZone(int zone, double t0, double t1, unsigned long long bytes) {
+  HeZoneStats &z = heZones[zone];
+  z.calls++;
+  z.total += t1-t0;
+  z.last = t1-t0;
+  z.bytes += bytes;
+  z.lastBytes = bytes;
+  HeTraceEvent &e = heNewEvent();
+  e.t0 = t0;
+  e.dur = t1-t0;
+  e.value = bytes;
+  e.tid = heThreadId();
+  e.id = (short)zone;
+  e.type = 'X';
+}
+
+void heProfileSample() {
+  double t = heProfileNow();
+  int tid = heThreadId();
+  for (int i=0; i<HE_COUNTERS; i++) {
+    HeTraceEvent &e = heNewEvent();
+    e.t0 = t;
+    e.dur = 0.0;
+    e.value = heCounters[i];
+    e.tid = tid;
+    e.id = (short)i;
+    e.type = 'C';
+  }
+}
+
+const HeZoneStats &heZoneStats(int zone) {
+  return heZones[zone];
+}
+
+const char *heZoneName(int zone) {
+  return heZoneNames[zone];
+}
+
+const char *heCounterName(int counter) {
+  return heCounterNames[counter];
+}
+
+/// Events are written oldest first, times in microseconds. An event that
+/// another thread writes while we save may come out garbled.
+const char *heWriteTrace(const char *filename) {
+  FILE *f = fopen(filename, "wb");
+  if (!f) return strerror(errno);
+  unsigned long long i, last = heNextEvent, first = 0;
+  if (last>HE_TRACE_EVENTS) first = last-HE_TRACE_EVENTS;
+  fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n"
+          "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,"
+          "\"args\":{\"name\":\"mickey\"}}");
+  for (i=first; i<last; i++) {
+    const HeTraceEvent &e = heEvents[i&(HE_TRACE_EVENTS-1)];
+    if (e.type=='X')
+      fprintf(f, ",\n{\"name\":\"%s\",\"cat\":\"mickey\",\"ph\":\"X\","
+              "\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,"
+              "\"args\":{\"bytes\":%llu}}", heZoneNames[e.id], e.tid,
+              e.t0*1e6, e.dur*1e6, e.value);
+    else if (e.type=='C')
+      fprintf(f, ",\n{\"name\":\"%s\",\"ph\":\"C\",\"pid\":1,\"tid\":%d,"
+              "\"ts\":%.3f,\"args\":{\"value\":%llu}}", heCounterNames[e.id],
+              e.tid, e.t0*1e6, e.value);
+  }
+  fprintf(f, "\n]}\n");
+  if (ferror(f)) {
+    fclose(f);
+    return "Can't write the trace";
+  }
+  if (fclose(f)!=0) return strerror(errno);
+  return 0;
+}
@@ -0,0 +1,83 @@
+// Copyright © 2003-2004 Matthias Melcher
+// Copyright © 2019-2020 Neil McNeight
+
+
+#ifndef HEPROFILE_H
+#define HEPROFILE_H
+
+// Counters and timed zones that are always on, cheap enough for the paths
+// that matter: loading, saving, moving the gap, drawing and searching.
+// Every zone that ends leaves an event in a ring buffer, which can be saved
+// as a Chrome trace (chrome://tracing or ui.perfetto.dev) when somebody
+// reports that mickey is slow.
+//
+//   void HeDocument::saveFile() {
+//     HeScope scope(HE_ZONE_SAVE);
+//     ...
+//     scope.bytes(n);
+//   }
+//
+// The statistics of a zone are kept for the main thread. Counters and trace
+// events may come from any thread.
+
+#ifdef WIN32
+#include <windows.h>
+#endif
+
+#define HE_COUNT_MEMMOVE_BYTES 0
+#define HE_COUNT_MEMMOVES      1
+#define HE_COUNT_ROWS_DRAWN    2
+#define HE_COUNT_ROWS_REUSED   3
+#define HE_COUNTERS            4
+
+#define HE_ZONE_LOAD   0
+#define HE_ZONE_SAVE   1
+#define HE_ZONE_GAP    2
+#define HE_ZONE_DRAW   3
+#define HE_ZONE_SEARCH 4
+#define HE_ZONES       5
+
+/// events kept for the trace, a power of two
+#define HE_TRACE_EVENTS 32768
+
+struct HeZoneStats {
+  unsigned long long calls, bytes, lastBytes;
+  /// in seconds
+  double total, last;
+};
+
+extern volatile unsigned long long heCounters[HE_COUNTERS];
+
+inline void heCount(int counter, unsigned long long n) {
+#ifdef WIN32
+  InterlockedExchangeAdd64((volatile LONGLONG*)&heCounters[counter], (LONGLONG)n);
+#else
+  __sync_fetch_and_add(&heCounters[counter], n);
+#endif
+}
+
+/// Seconds since the first call, from the finest clock there is.
+double heProfileNow();
+void heProfileZone(int zone, double t0, double t1, unsigned long long bytes);
+/// Put the current counter values into the trace.
+void heProfileSample();
+const HeZoneStats &heZoneStats(int zone);
+const char *heZoneName(int zone);
+const char *heCounterName(int counter);
+/// Write the events in the ring buffer as Chrome trace JSON. Returns an
+/// error message, or 0.
+const char *heWriteTrace(const char *filename);
+
+/// Times the block it is declared in.
+class HeScope {
+  int zone_;
+  double t0_;
+  unsigned long long bytes_;
+public:
+  HeScope(int zone) { zone_ = zone; bytes_ = 0; t0_ = heProfileNow(); }
+  ~HeScope() { heProfileZone(zone_, t0_, heProfileNow(), bytes_); }
+  /// bytes processed, for the throughput
+  void bytes(unsigned long long n) { bytes_ = n; }
+};
+
+#endif
@@ -0,0 +1,1734 @@
+// Copyright © 2003-2004 Matthias Melcher
+// Copyright © 2019-2020 Neil McNeight
+
+#include "heScript.h"
+#include "heDigest.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+// value types
+#define V_NIL   0
+#define V_INT   1
+#define V_STR   2
+#define V_ARRAY 3
+#define V_SPAN  4
+
+// tokens
+#define T_END   0
+#define T_NAME  1
+#define T_NUM   2
+#define T_STR   3
+#define T_PUNCT 4
+
+// instructions, followed by up to two operands
+#define OP_HALT       0
+#define OP_CONST      1
+#define OP_NIL        2
+#define OP_POP        3
+#define OP_DUP2       4
+#define OP_LOCAL      5
+#define OP_SETLOCAL   6
+#define OP_GLOBAL     7
+#define OP_SETGLOBAL  8
+#define OP_INDEX      9
+#define OP_SETINDEX   10
+#define OP_NEG        11
+#define OP_NOT        12
+#define OP_BNOT       13
+#define OP_JUMP       14
+#define OP_JFALSE     15
+#define OP_JFALSEKEEP 16
+#define OP_JTRUEKEEP  17
+#define OP_CALL       18
+#define OP_NATIVE     19
+#define OP_RET        20
+#define OP_ARRAY      21
+#define OP_BINARY     32
+
+// bytes a bulk function looks at per lock
+#define HE_SCRIPT_STEP (4<<20)
+#define HE_SCRIPT_MAX_CALLS 10000
+#define HE_SCRIPT_MAX_STACK (16<<20)
+#define HE_SCRIPT_POLL (1<<20)
+// how deeply expressions and blocks may nest before the compiler gives up,
+// well before it runs out of stack
+#define HE_SCRIPT_MAX_DEPTH 256
+
+struct HeSObj {
+  int type, refs;
+  size_t n, cap;
+  unsigned char *bytes;
+  HeSValue *items;
+  HeSObj *prev, *next;
+};
+
+struct HeSValue {
+  int type;
+  /// the number, or where a span starts
+  long long i;
+  /// length of a span
+  unsigned long long n;
+  HeSObj *o;
+};
+
+struct HeSFunc {
+  char *name;
+  /// where the code starts, or -1 while it is only called
+  int entry;
+  int nParams, nLocals;
+  /// where it was first called
+  int line;
+};
+
+struct HeSLoop {
+  int cont;
+  int *breaks, nBreaks;
+  HeSLoop *outer;
+};
+
+struct HeSFrame {
+  int ret, base, func;
+};
+
+// binary operators from the lowest to the highest precedence; the first two
+// only evaluate their right side if they have to
+static const char *heSBinary[][4] = {
+  { "||" }, { "&&" }, { "|" }, { "^" }, { "&" }, { "==", "!=" },
+  { "<", ">", "<=", ">=" }, { "<<", ">>" }, { "+", "-" }, { "*", "/", "%" }
+};
+#define HE_S_LEVELS (int)(sizeof(heSBinary)/sizeof(heSBinary[0]))
+#define B_OR   8
+#define B_XOR  12
+#define B_AND  16
+#define B_EQ   20
+#define B_NE   21
+#define B_LT   24
+#define B_GT   25
+#define B_LE   26
+#define B_GE   27
+#define B_SHL  28
+#define B_SHR  29
+#define B_ADD  32
+#define B_SUB  33
+#define B_MUL  36
+#define B_DIV  37
+#define B_MOD  38
+
+static const char *heSKeywords[] = {
+  "var", "if", "else", "while", "for", "break", "continue", "return",
+  "function", "nil", 0
+};
+
+static const HeSValue heSNil = { V_NIL, 0, 0, 0 };
+
+static inline char heSTrue(const HeSValue &v) {
+  switch (v.type) {
+    case V_INT: return v.i!=0;
+    case V_STR:
+    case V_ARRAY: return v.o->n!=0;
+    case V_SPAN: return v.n!=0;
+  }
+  return 0;
+}
+
+static inline HeSValue heSInt(long long i) {
+  HeSValue v = { V_INT, i, 0, 0 };
+  return v;
+}
+
+//---- built-in functions -------------------------------------------------------
+
+typedef const char *(*HeSNativeFunc)(HeScript*, HeSValue *a, int n, HeSValue *r,
+                                     int arg);
+
+struct HeSNative {
+  const char *name;
+  HeSNativeFunc func;
+  int minArgs, maxArgs;
+  /// passed on to the function: width, byte order and sign of integers
+  int arg;
+};
+
+#define HE_S_BIG    0x10
+#define HE_S_SIGNED 0x20
+
+/// Bytes 'from' to 'to' of the document, one contiguous run after the
+/// other, read under the host's lock one piece at a time.
+struct HeSWalker {
+  HeScriptHost *host;
+  unsigned long long pos, end;
+  HeScriptSpan span[2];
+  int ns, cur;
+  char locked;
+  HeSWalker(HeScriptHost *h, unsigned long long from, unsigned long long to) {
+    host = h; pos = from; end = to;
+    ns = cur = 0;
+    locked = 0;
+  }
+  ~HeSWalker() { if (locked) host->unlock(); }
+  char next(const unsigned char **p, size_t *n) {
+    for (;;) {
+      if (locked && cur<ns) {
+        *p = span[cur].data;
+        *n = (size_t)span[cur].size;
+        cur++;
+        return 1;
+      }
+      if (locked) {
+        host->unlock();
+        locked = 0;
+      }
+      if (pos>=end) return 0;
+      unsigned long long k = end-pos;
+      if (k>HE_SCRIPT_STEP) k = HE_SCRIPT_STEP;
+      ns = host->lock(pos, k, span);
+      locked = 1;
+      cur = 0;
+      pos = ns ? pos+k : end;
+    }
+  }
+};
+
+static char heSInRange(HeScript *s, long long pos, unsigned long long n) {
+  unsigned long long size = s->host()->size();
+  return pos>=0 && (unsigned long long)pos<=size && n<=size-pos;
+}
+
+/// Copy n bytes from the document. Bytes past its end read as zero, and
+/// the return value is 0 if there were any.
+static char heSRead(HeScriptHost *h, unsigned long long pos, unsigned char *dst,
+                    size_t n)
+{
+  HeSWalker w(h, pos, pos+n);
+  const unsigned char *p;
+  size_t k;
+  while (n && w.next(&p, &k)) {
+    if (k>n) k = n;
+    memcpy(dst, p, k);
+    dst += k;
+    n -= k;
+  }
+  memset(dst, 0, n);
+  return n==0;
+}
+
+static long long heSDecode(const unsigned char *p, int width, int arg) {
+  unsigned long long v = 0;
+  int i;
+  if (arg&HE_S_BIG)
+    for (i=0; i<width; i++) v = v<<8 | p[i];
+  else
+    for (i=width-1; i>=0; i--) v = v<<8 | p[i];
+  if ((arg&HE_S_SIGNED) && width<8 && (v>>(width*8-1)&1))
+    v |= ~0ULL<<(width*8);
+  return (long long)v;
+}
+
+/// The bytes of a string, a span or a single byte value. Spans are copied
+/// to '*tmp', which the caller frees. A span is checked again each time it
+/// is used, because the document may have shrunk since it was made.
+static const char *heSBytes(HeScript *s, const HeSValue &v,
+                            const unsigned char **p, size_t *n,
+                            unsigned char **tmp, unsigned char *byte)
+{
+  *tmp = 0;
+  if (v.type==V_STR) {
+    *p = v.o->bytes;
+    *n = v.o->n;
+  } else if (v.type==V_INT) {
+    *byte = (unsigned char)v.i;
+    *p = byte;
+    *n = 1;
+  } else if (v.type==V_SPAN) {
+    if (!heSInRange(s, v.i, v.n)) return "span past the end of the document";
+    *tmp = (unsigned char*)malloc(v.n ? (size_t)v.n : 1);
+    if (!*tmp) return "not enough memory";
+    if (!heSRead(s->host(), v.i, *tmp, (size_t)v.n)) {
+      free(*tmp);
+      *tmp = 0;
+      return "span past the end of the document";
+    }
+    *p = *tmp;
+    *n = (size_t)v.n;
+  } else {
+    return "bytes must be a string, a span or a number";
+  }
+  return 0;
+}
+
+/// Position of the first 'm' bytes equal to 'f' in p[pos, n), or 'n'.
+static size_t heSFindBytes(const unsigned char *p, size_t n, size_t pos,
+                           const unsigned char *f, size_t m)
+{
+  if (m>n) return n;
+  const unsigned char *end = p+n-m+1;
+  const unsigned char *q = p+pos;
+  while (q<end) {
+    q = (const unsigned char*)memchr(q, f[0], end-q);
+    if (!q) break;
+    if (memcmp(q+1, f+1, m-1)==0) return q-p;
+    q++;
+  }
+  return n;
+}
+
+/// Find 'f' in the document between 'from' and 'to'. Each run is searched
+/// where it lies; only the last m-1 bytes of a run are kept, to find
+/// matches that continue in the next one.
+static long long heSFind(HeScriptHost *h, const unsigned char *f, size_t m,
+                         unsigned long long from, unsigned long long to)
+{
+  if (m==0 || to<from || to-from<m) return -1;
+  HeSWalker w(h, from, to);
+  unsigned char *carry = (unsigned char*)malloc(2*m);
+  size_t nc = 0, n;
+  unsigned long long at = from;
+  const unsigned char *p;
+  long long found = -1;
+  while (found<0 && w.next(&p, &n)) {
+    if (nc) {
+      size_t k = n<m-1 ? n : m-1;
+      memcpy(carry+nc, p, k);
+      size_t r = heSFindBytes(carry, nc+k, 0, f, m);
+      if (r<nc+k) found = (long long)(at-nc+r);
+    }
+    if (found<0) {
+      size_t r = heSFindBytes(p, n, 0, f, m);
+      if (r<n) found = (long long)(at+r);
+    }
+    if (n>=m-1) {
+      memcpy(carry, p+n-(m-1), m-1);
+      nc = m-1;
+    } else {
+      memcpy(carry+nc, p, n);
+      nc += n;
+      if (nc>m-1) {
+        memmove(carry, carry+nc-(m-1), m-1);
+        nc = m-1;
+      }
+    }
+    at += n;
+  }
+  free(carry);
+  return found;
+}
+
+static void heSAppend(char **buf, size_t *n, size_t *cap, const char *text,
+                      size_t len)
+{
+  if (*n+len>*cap) {
+    *cap = (*n+len)*2+64;
+    *buf = (char*)realloc(*buf, *cap);
+  }
+  memcpy(*buf+*n, text, len);
+  *n += len;
+}
+
+/// The text for a value, as print() shows it. Returns an error message, or 0.
+static const char *heSFormat(HeScript *s, const HeSValue &v, char **buf,
+                             size_t *n, size_t *cap, int depth)
+{
+  char num[32];
+  const char *text = num, *err = 0;
+  size_t len = 0;
+  unsigned char *tmp = 0, byte;
+  switch (v.type) {
+    case V_NIL: text = "nil"; len = 3; break;
+    case V_INT: len = snprintf(num, sizeof(num), "%lld", v.i); break;
+    case V_STR: text = (const char*)v.o->bytes; len = v.o->n; break;
+    case V_SPAN: {
+      const unsigned char *p;
+      err = heSBytes(s, v, &p, &len, &tmp, &byte);
+      if (err) return err;
+      text = (const char*)p;
+      break; }
+    case V_ARRAY:
+      heSAppend(buf, n, cap, "[", 1);
+      for (size_t i=0; i<v.o->n && !err; i++) {
+        if (i) heSAppend(buf, n, cap, ", ", 2);
+        if (depth<8) err = heSFormat(s, v.o->items[i], buf, n, cap, depth+1);
+        else heSAppend(buf, n, cap, "...", 3);
+      }
+      if (err) return err;
+      text = "]"; len = 1;
+      break;
+  }
+  heSAppend(buf, n, cap, text, len);
+  if (tmp) free(tmp);
+  return 0;
+}
+
+static const char *nSize(HeScript *s, HeSValue*, int, HeSValue *r, int) {
+  *r = heSInt((long long)s->host()->size());
+  return 0;
+}
+
+static const char *nInt(HeScript *s, HeSValue *a, int, HeSValue *r, int arg) {
+  int width = arg&15;
+  unsigned char buf[8];
+  if (a[0].type!=V_INT) return "the position must be a number";
+  if (!heSInRange(s, a[0].i, width)) return "read past the end of the document";
+  heSRead(s->host(), a[0].i, buf, width);
+  *r = heSInt(heSDecode(buf, width, arg));
+  return 0;
+}
+
+/// Arrays of integers are decoded straight from the buffer; only an element
+/// that is split between two runs is put together first.
+static const char *nInts(HeScript *s, HeSValue *a, int n, HeSValue *r, int arg) {
+  int width = arg&15;
+  if (a[0].type!=V_INT || a[1].type!=V_INT || a[1].i<0)
+    return "position and count must be numbers";
+  if (n>2 && heSTrue(a[2])) arg |= HE_S_BIG;
+  if (a[1].i>HE_SCRIPT_MAX_STACK || !heSInRange(s, a[0].i, a[1].i*width))
+    return "read past the end of the document";
+  s->newArray((int)a[1].i, r);
+  HeSValue *item = r->o->items;
+  HeSWalker w(s->host(), a[0].i, a[0].i+a[1].i*width);
+  unsigned char part[8];
+  int nPart = 0;
+  const unsigned char *p;
+  size_t k;
+  while (w.next(&p, &k)) {
+    if (nPart) {
+      while (nPart<width && k) { part[nPart++] = *p++; k--; }
+      if (nPart<width) continue;
+      *item++ = heSInt(heSDecode(part, width, arg));
+      nPart = 0;
+    }
+    size_t i, m = k/width;
+    for (i=0; i<m; i++, p+=width)
+      *item++ = heSInt(heSDecode(p, width, arg));
+    for (k-=m*width; k; k--) part[nPart++] = *p++;
+  }
+  return 0;
+}
+
+static const char *nSpan(HeScript *s, HeSValue *a, int, HeSValue *r, int) {
+  if (a[0].type!=V_INT || a[1].type!=V_INT || a[1].i<0)
+    return "position and length must be numbers";
+  if (!heSInRange(s, a[0].i, a[1].i)) return "span past the end of the document";
+  r->type = V_SPAN;
+  r->i = a[0].i;
+  r->n = a[1].i;
+  return 0;
+}
+
+static const char *nLen(HeScript*, HeSValue *a, int, HeSValue *r, int) {
+  if (a[0].type==V_STR || a[0].type==V_ARRAY) *r = heSInt((long long)a[0].o->n);
+  else if (a[0].type==V_SPAN) *r = heSInt((long long)a[0].n);
+  else return "len() needs a string, an array or a span";
+  return 0;
+}
+
+static const char *nStr(HeScript *s, HeSValue *a, int, HeSValue *r, int) {
+  char *buf = 0;
+  size_t n = 0, cap = 0;
+  const char *err = heSFormat(s, a[0], &buf, &n, &cap, 0);
+  if (!err) s->newString(buf, n, r);
+  free(buf);
+  return err;
+}
+
+static const char *nHex(HeScript *s, HeSValue *a, int n, HeSValue *r, int) {
+  if (a[0].type==V_INT) {
+    char buf[40];
+    int digits = n>1 && a[1].type==V_INT ? (int)a[1].i : 1;
+    if (digits<1) digits = 1;
+    if (digits>16) digits = 16;
+    snprintf(buf, sizeof(buf), "%0*llx", digits, (unsigned long long)a[0].i);
+    s->newString(buf, strlen(buf), r);
+    return 0;
+  }
+  static const char digit[] = "0123456789abcdef";
+  const unsigned char *p;
+  unsigned char *tmp, byte;
+  size_t i, m;
+  const char *err = heSBytes(s, a[0], &p, &m, &tmp, &byte);
+  if (err) return err;
+  char *buf = (char*)malloc(m*3+1);
+  for (i=0; i<m; i++) {
+    buf[i*3] = digit[p[i]>>4];
+    buf[i*3+1] = digit[p[i]&15];
+    buf[i*3+2] = ' ';
+  }
+  s->newString(buf, m ? m*3-1 : 0, r);
+  free(buf);
+  if (tmp) free(tmp);
+  return 0;
+}
+
+/// find() and count() share their arguments: pattern, from and to.
+static const char *heSFindArgs(HeScript *s, HeSValue *a, int n,
+                               const unsigned char **p, size_t *m,
+                               unsigned char **tmp, unsigned char *byte,
+                               unsigned long long *from, unsigned long long *to)
+{
+  const char *err = heSBytes(s, a[0], p, m, tmp, byte);
+  if (err) return err;
+  unsigned long long size = s->host()->size();
+  *from = 0;
+  *to = size;
+  if (n>1 && a[1].type==V_INT) *from = a[1].i<0 ? 0 : a[1].i;
+  if (n>2 && a[2].type==V_INT) *to = a[2].i<0 ? 0 : a[2].i;
+  if (*to>size) *to = size;
+  return 0;
+}
+
+static const char *nFind(HeScript *s, HeSValue *a, int n, HeSValue *r, int) {
+  const unsigned char *p;
+  unsigned char *tmp, byte;
+  size_t m;
+  unsigned long long from, to;
+  const char *err = heSFindArgs(s, a, n, &p, &m, &tmp, &byte, &from, &to);
+  if (err) return err;
+  *r = heSInt(heSFind(s->host(), p, m, from, to));
+  if (tmp) free(tmp);
+  return 0;
+}
+
+static const char *nCount(HeScript *s, HeSValue *a, int n, HeSValue *r, int) {
+  const unsigned char *p;
+  unsigned char *tmp, byte;
+  size_t m;
+  unsigned long long from, to;
+  const char *err = heSFindArgs(s, a, n, &p, &m, &tmp, &byte, &from, &to);
+  if (err) return err;
+  long long found, count = 0;
+  while ((found = heSFind(s->host(), p, m, from, to))>=0) {
+    count++;
+    from = found+m;
+  }
+  *r = heSInt(count);
+  if (tmp) free(tmp);
+  return 0;
+}
+
+static const char *nHash(HeScript *s, HeSValue *a, int, HeSValue *r, int) {
+  if (a[0].type!=V_STR || a[1].type!=V_INT || a[2].type!=V_INT || a[2].i<0)
+    return "hash() needs a name, a position and a length";
+  if (!heSInRange(s, a[1].i, a[2].i)) return "hash past the end of the document";
+  char name[16];
+  size_t i, nn = a[0].o->n<15 ? a[0].o->n : 15;
+  memcpy(name, a[0].o->bytes, nn);
+  name[nn] = 0;
+  HeBlockHash *bh = 0;
+  HeSha256 sha256;
+  HeSha1 sha1;
+  HeMd5 md5;
+  HeXxh64 xxh;
+  int kind;
+  if (strcmp(name, "crc32")==0) kind = 0;
+  else if (strcmp(name, "crc32c")==0) kind = 1;
+  else if (strcmp(name, "xxh64")==0) kind = 2;
+  else if (strcmp(name, "sha256")==0) { kind = 3; bh = &sha256; }
+  else if (strcmp(name, "sha1")==0) { kind = 3; bh = &sha1; }
+  else if (strcmp(name, "md5")==0) { kind = 3; bh = &md5; }
+  else return "unknown hash";
+  unsigned int crc = 0;
+  HeSWalker w(s->host(), a[1].i, a[1].i+a[2].i);
+  const unsigned char *p;
+  size_t k;
+  while (w.next(&p, &k)) {
+    switch (kind) {
+      case 0: crc = heCrc32(crc, p, k); break;
+      case 1: crc = heCrc32c(crc, p, k); break;
+      case 2: xxh.update(p, k); break;
+      default: bh->update(p, k); break;
+    }
+  }
+  if (kind<2) { *r = heSInt(crc); return 0; }
+  if (kind==2) { *r = heSInt((long long)xxh.digest()); return 0; }
+  unsigned char out[32];
+  size_t nOut = 32;
+  if (bh==&sha256) sha256.digest(out);
+  else if (bh==&sha1) { sha1.digest(out); nOut = 20; }
+  else { md5.digest(out); nOut = 16; }
+  char text[65];
+  for (i=0; i<nOut; i++) sprintf(text+2*i, "%02x", out[i]);
+  s->newString(text, 2*nOut, r);
+  return 0;
+}
+
+/// write(), insert() and remove() differ in how many bytes they replace.
+static const char *nReplace(HeScript *s, HeSValue *a, int, HeSValue *r, int arg) {
+  if (a[0].type!=V_INT) return "the position must be a number";
+  const unsigned char *p = 0;
+  unsigned char *tmp = 0, byte;
+  size_t m = 0;
+  unsigned long long nDel;
+  if (arg==2) {
+    if (a[1].type!=V_INT || a[1].i<0) return "the length must be a number";
+    nDel = a[1].i;
+  } else {
+    const char *err = heSBytes(s, a[1], &p, &m, &tmp, &byte);
+    if (err) return err;
+    nDel = arg==0 ? m : 0;
+  }
+  const char *err = 0;
+  if (!heSInRange(s, a[0].i, nDel))
+    err = "change past the end of the document";
+  else
+    err = s->host()->replace(a[0].i, nDel, p, m);
+  if (tmp) free(tmp);
+  return err;
+}
+
+static const char *nNote(HeScript *s, HeSValue *a, int, HeSValue *r, int) {
+  if (a[0].type!=V_INT || a[1].type!=V_INT || a[1].i<0 || a[2].type!=V_STR)
+    return "note() needs a position, a length and a text";
+  if (!heSInRange(s, a[0].i, a[1].i)) return "note past the end of the document";
+  char *text = (char*)malloc(a[2].o->n+1);
+  memcpy(text, a[2].o->bytes, a[2].o->n);
+  text[a[2].o->n] = 0;
+  s->host()->note(a[0].i, a[1].i, text);
+  free(text);
+  return 0;
+}
+
+static const char *nPrint(HeScript *s, HeSValue *a, int n, HeSValue*, int) {
+  char *buf = 0;
+  size_t len = 0, cap = 0;
+  const char *err = 0;
+  for (int i=0; i<n && !err; i++)
+    err = heSFormat(s, a[i], &buf, &len, &cap, 0);
+  if (!err) {
+    heSAppend(&buf, &len, &cap, "\n", 1);
+    s->host()->print(buf, len);
+  }
+  free(buf);
+  return err;
+}
+
+static const char *nArray(HeScript *s, HeSValue *a, int n, HeSValue *r, int) {
+  if (a[0].type!=V_INT || a[0].i<0 || a[0].i>HE_SCRIPT_MAX_STACK)
+    return "array() needs a size";
+  s->newArray((int)a[0].i, r);
+  if (n>1)
+    for (long long i=0; i<a[0].i; i++)
+      s->set(*r, i, a[1]);
+  return 0;
+}
+
+static const char *nPush(HeScript *s, HeSValue *a, int, HeSValue*, int) {
+  if (a[0].type!=V_ARRAY) return "push() needs an array";
+  s->push(a[0], a[1]);
+  return 0;
+}
+
+static const HeSNative heSNatives[] = {
+  { "size", nSize, 0, 0, 0 },
+  { "u8", nInt, 1, 1, 1 },
+  { "u16", nInt, 1, 1, 2 },
+  { "u32", nInt, 1, 1, 4 },
+  { "u64", nInt, 1, 1, 8 },
+  { "u16be", nInt, 1, 1, 2|HE_S_BIG },
+  { "u32be", nInt, 1, 1, 4|HE_S_BIG },
+  { "u64be", nInt, 1, 1, 8|HE_S_BIG },
+  { "s8", nInt, 1, 1, 1|HE_S_SIGNED },
+  { "s16", nInt, 1, 1, 2|HE_S_SIGNED },
+  { "s32", nInt, 1, 1, 4|HE_S_SIGNED },
+  { "s64", nInt, 1, 1, 8|HE_S_SIGNED },
+  { "s16be", nInt, 1, 1, 2|HE_S_BIG|HE_S_SIGNED },
+  { "s32be", nInt, 1, 1, 4|HE_S_BIG|HE_S_SIGNED },
+  { "s64be", nInt, 1, 1, 8|HE_S_BIG|HE_S_SIGNED },
+  { "u8s", nInts, 2, 3, 1 },
+  { "u16s", nInts, 2, 3, 2 },
+  { "u32s", nInts, 2, 3, 4 },
+  { "u64s", nInts, 2, 3, 8 },
+  { "span", nSpan, 2, 2, 0 },
+  { "len", nLen, 1, 1, 0 },
+  { "str", nStr, 1, 1, 0 },
+  { "hex", nHex, 1, 2, 0 },
+  { "find", nFind, 1, 3, 0 },
+  { "count", nCount, 1, 3, 0 },
+  { "hash", nHash, 3, 3, 0 },
+  { "write", nReplace, 2, 2, 0 },
+  { "insert", nReplace, 2, 2, 1 },
+  { "remove", nReplace, 2, 2, 2 },
+  { "note", nNote, 3, 3, 0 },
+  { "print", nPrint, 0, 64, 0 },
+  { "array", nArray, 1, 2, 0 },
+  { "push", nPush, 2, 2, 0 },
+  { 0 }
+};
+
+static int heSFindNative(const char *name) {
+  for (int i=0; heSNatives[i].name; i++)
+    if (strcmp(heSNatives[i].name, name)==0)
+      return i;
+  return -1;
+}
+
+//---- HeScript -------------------------------------------------------------------
+
+HeScript::HeScript() {
+  code_ = lines_ = 0;
+  nCode_ = capCode_ = 0;
+  const_ = 0;
+  nConst_ = capConst_ = 0;
+  func_ = 0;
+  nFuncs_ = 0;
+  global_ = 0;
+  globalValue_ = 0;
+  nGlobals_ = 0;
+  tokStr_ = 0;
+  tokLen_ = tokCap_ = 0;
+  local_ = 0;
+  nLocals_ = maxLocals_ = capLocals_ = 0;
+  loop_ = 0;
+  stack_ = 0;
+  sp_ = capStack_ = 0;
+  objects_ = 0;
+  host_ = 0;
+}
+
+HeScript::~HeScript() {
+  clear();
+}
+
+void HeScript::clear() {
+  int i;
+  while (objects_)
+    freeObj(objects_);
+  for (i=0; i<nFuncs_; i++) free(func_[i].name);
+  for (i=0; i<nGlobals_; i++) free(global_[i]);
+  for (i=0; i<nLocals_; i++) free(local_[i]);
+  free(code_); free(lines_);
+  free(const_);
+  free(func_);
+  free(global_); free(globalValue_);
+  free(local_);
+  free(tokStr_);
+  free(stack_);
+  code_ = lines_ = 0;
+  nCode_ = capCode_ = 0;
+  const_ = 0;
+  nConst_ = capConst_ = 0;
+  func_ = 0;
+  nFuncs_ = 0;
+  global_ = 0;
+  globalValue_ = 0;
+  nGlobals_ = 0;
+  local_ = 0;
+  nLocals_ = maxLocals_ = capLocals_ = 0;
+  tokStr_ = 0;
+  tokLen_ = tokCap_ = 0;
+  stack_ = 0;
+  sp_ = capStack_ = 0;
+  while (loop_) {
+    HeSLoop *l = loop_;
+    loop_ = l->outer;
+    free(l->breaks);
+    free(l);
+  }
+}
+
+//---- objects ----
+
+HeSObj *HeScript::newObj(int type) {
+  HeSObj *o = (HeSObj*)calloc(1, sizeof(HeSObj));
+  o->type = type;
+  o->refs = 1;
+  o->next = objects_;
+  if (objects_) objects_->prev = o;
+  objects_ = o;
+  return o;
+}
+
+/// Objects are counted, but arrays can refer to themselves, so all of them
+/// are also kept in a list that is freed with the script.
+void HeScript::freeObj(HeSObj *o) {
+  if (o->prev) o->prev->next = o->next;
+  else objects_ = o->next;
+  if (o->next) o->next->prev = o->prev;
+  free(o->bytes);
+  free(o->items);
+  free(o);
+}
+
+inline void HeScript::retain(const HeSValue &v) {
+  if (v.o) v.o->refs++;
+}
+
+void HeScript::release(HeSValue &v) {
+  HeSObj *o = v.o;
+  v.o = 0;
+  if (!o || --o->refs>0) return;
+  // an array that contains itself never gets here, it is freed with the
+  // script
+  if (o->type==V_ARRAY)
+    for (size_t i=0; i<o->n; i++)
+      release(o->items[i]);
+  freeObj(o);
+}
+
+void HeScript::newString(const void *data, size_t n, HeSValue *r) {
+  HeSObj *o = newObj(V_STR);
+  o->bytes = (unsigned char*)malloc(n ? n : 1);
+  if (n) memcpy(o->bytes, data, n);
+  o->n = o->cap = n;
+  r->type = V_STR;
+  r->i = 0; r->n = 0;
+  r->o = o;
+}
+
+void HeScript::newArray(int n, HeSValue *r) {
+  HeSObj *o = newObj(V_ARRAY);
+  o->items = (HeSValue*)calloc(n ? n : 1, sizeof(HeSValue));
+  o->n = o->cap = n;
+  r->type = V_ARRAY;
+  r->i = 0; r->n = 0;
+  r->o = o;
+}
+
+void HeScript::set(HeSValue &array, long long i, const HeSValue &v) {
+  HeSValue &item = array.o->items[i];
+  retain(v);
+  release(item);
+  item = v;
+}
+
+void HeScript::push(HeSValue &array, const HeSValue &v) {
+  HeSObj *o = array.o;
+  if (o->n==o->cap) {
+    o->cap = o->cap ? o->cap*2 : 16;
+    o->items = (HeSValue*)realloc(o->items, o->cap*sizeof(HeSValue));
+  }
+  retain(v);
+  o->items[o->n++] = v;
+}
+
+//---- compiler ----
+
+void HeScript::fail(const char *msg, const char *arg) {
+  if (error_) return;
+  snprintf(errBuf_, sizeof(errBuf_), msg, arg);
+  error_ = errBuf_;
+  errLine_ = line_;
+}
+
+void HeScript::next() {
+  tok_[0] = 0;
+  tokType_ = T_END;
+  if (error_) return;
+  for (;;) {
+    while (isspace((unsigned char)*p_)) {
+      if (*p_=='\n') line_++;
+      p_++;
+    }
+    if (p_[0]=='/' && p_[1]=='/') {
+      while (*p_ && *p_!='\n') p_++;
+    } else if (p_[0]=='/' && p_[1]=='*') {
+      for (p_+=2; *p_ && !(p_[0]=='*' && p_[1]=='/'); p_++)
+        if (*p_=='\n') line_++;
+      if (*p_) p_ += 2;
+    } else break;
+  }
+  if (!*p_) return;
+  int n = 0;
+  if (isalpha((unsigned char)*p_) || *p_=='_') {
+    while ((isalnum((unsigned char)*p_) || *p_=='_') && n<63)
+      tok_[n++] = *p_++;
+    tok_[n] = 0;
+    tokType_ = T_NAME;
+  } else if (isdigit((unsigned char)*p_)) {
+    char *end;
+    tokValue_ = (long long)strtoull(p_, &end, (p_[0]=='0' && (p_[1]|0x20)=='x') ? 16 : 10);
+    p_ = end;
+    tokType_ = T_NUM;
+    strcpy(tok_, "number");
+  } else if (*p_=='"' || *p_=='\'') {
+    char quote = *p_++;
+    tokLen_ = 0;
+    while (*p_ && *p_!=quote && *p_!='\n') {
+      int c = (unsigned char)*p_++;
+      if (c=='\\') {
+        c = (unsigned char)*p_++;
+        switch (c) {
+          case 'n': c = '\n'; break;
+          case 'r': c = '\r'; break;
+          case 't': c = '\t'; break;
+          case '0': c = 0; break;
+          case 'x':
+            if (isxdigit((unsigned char)p_[0]) && isxdigit((unsigned char)p_[1])) {
+              char hex[3] = { p_[0], p_[1], 0 };
+              c = (int)strtol(hex, 0, 16);
+              p_ += 2;
+            }
+            break;
+          case 0: p_--; break;
+        }
+      }
+      if (tokLen_==tokCap_) {
+        tokCap_ = tokCap_ ? tokCap_*2 : 64;
+        tokStr_ = (char*)realloc(tokStr_, tokCap_);
+      }
+      tokStr_[tokLen_++] = (char)c;
+    }
+    if (*p_!=quote) { fail("string not closed"); return; }
+    p_++;
+    // a single character in single quotes is a number, as in C
+    if (quote=='\'' && tokLen_==1) {
+      tokValue_ = (unsigned char)tokStr_[0];
+      tokType_ = T_NUM;
+      strcpy(tok_, "number");
+    } else {
+      tokType_ = T_STR;
+      strcpy(tok_, "string");
+    }
+  } else {
+    static const char *ops[] = {
+      "<<=", ">>=", "<<", ">>", "<=", ">=", "==", "!=", "&&", "||",
+      "+=", "-=", "*=", "/=", "%=", "&=", "|=", "^=", 0
+    };
+    tokType_ = T_PUNCT;
+    for (int i=0; ops[i]; i++) {
+      size_t k = strlen(ops[i]);
+      if (strncmp(p_, ops[i], k)==0) {
+        memcpy(tok_, p_, k);
+        tok_[k] = 0;
+        p_ += k;
+        return;
+      }
+    }
+    tok_[0] = *p_++; tok_[1] = 0;
+  }
+}
+
+char HeScript::accept(const char *tok) {
+  if (tokType_==T_NAME || tokType_==T_PUNCT) {
+    if (strcmp(tok_, tok)==0) {
+      next();
+      return 1;
+    }
+  }
+  return 0;
+}
+
+char HeScript::expect(const char *tok) {
+  if (accept(tok)) return 1;
+  char buf[80];
+  snprintf(buf, sizeof(buf), "'%s' expected", tok);
+  fail("%s", buf);
+  return 0;
+}
+
+int HeScript::emit(int op) {
+  if (nCode_+3>capCode_) {
+    capCode_ = capCode_ ? capCode_*2 : 1024;
+    code_ = (int*)realloc(code_, capCode_*sizeof(int));
+    lines_ = (int*)realloc(lines_, capCode_*sizeof(int));
+  }
+  lastOp_ = nCode_;
+  lines_[nCode_] = line_;
+  code_[nCode_++] = op;
+  return lastOp_;
+}
+
+int HeScript::emit(int op, int a) {
+  int at = emit(op);
+  lines_[nCode_] = line_;
+  code_[nCode_++] = a;
+  return at;
+}
+
+int HeScript::emit(int op, int a, int b) {
+  int at = emit(op, a);
+  lines_[nCode_] = line_;
+  code_[nCode_++] = b;
+  return at;
+}
+
+/// Let the jump at 'at' go to 'target'.
+void HeScript::patch(int at, int target) {
+  code_[at+1] = target;
+}
+
+int HeScript::addConst(const HeSValue &v) {
+  if (nConst_==capConst_) {
+    capConst_ = capConst_ ? capConst_*2 : 64;
+    const_ = (HeSValue*)realloc(const_, capConst_*sizeof(HeSValue));
+  }
+  const_[nConst_] = v;
+  return nConst_++;
+}
+
+int HeScript::findFunc(const char *name, char create) {
+  int i;
+  for (i=0; i<nFuncs_; i++)
+    if (strcmp(func_[i].name, name)==0)
+      return i;
+  if (!create) return -1;
+  func_ = (HeSFunc*)realloc(func_, (nFuncs_+1)*sizeof(HeSFunc));
+  HeSFunc &f = func_[nFuncs_];
+  f.name = _strdup(name);
+  f.entry = -1;
+  f.nParams = f.nLocals = 0;
+  f.line = line_;
+  return nFuncs_++;
+}
+
+/// Later declarations hide earlier ones.
+int HeScript::findLocal(const char *name) {
+  for (int i=nLocals_-1; i>=0; i--)
+    if (strcmp(local_[i], name)==0)
+      return i;
+  return -1;
+}
+
+int HeScript::findGlobal(const char *name, char create) {
+  int i;
+  for (i=0; i<nGlobals_; i++)
+    if (strcmp(global_[i], name)==0)
+      return i;
+  if (!create) return -1;
+  global_ = (char**)realloc(global_, (nGlobals_+1)*sizeof(char*));
+  global_[nGlobals_] = _strdup(name);
+  return nGlobals_++;
+}
+
+/// Emit the store for a new variable, whose value is on the stack.
+void HeScript::declare(const char *name) {
+  for (int i=0; heSKeywords[i]; i++)
+    if (strcmp(heSKeywords[i], name)==0)
+      fail("'%s' can't be a name", name);
+  if (heSFindNative(name)>=0)
+    fail("'%s' is a built-in function", name);
+  if (curFunc_<0)
+    emit(OP_SETGLOBAL, findGlobal(name, 1));
+  else
+    emit(OP_SETLOCAL, addLocal(name));
+}
+
+/// Local variables and parameters are numbered in the order they are
+/// declared. Slots of variables whose block ended are used again.
+int HeScript::addLocal(const char *name) {
+  if (nLocals_==capLocals_) {
+    capLocals_ = capLocals_ ? capLocals_*2 : 32;
+    local_ = (char**)realloc(local_, capLocals_*sizeof(char*));
+  }
+  local_[nLocals_] = _strdup(name);
+  if (nLocals_+1>maxLocals_) maxLocals_ = nLocals_+1;
+  return nLocals_++;
+}
+
+/// Forget the variables declared since a block started.
+void HeScript::endScope(int nLocals) {
+  while (nLocals_>nLocals)
+    free(local_[--nLocals_]);
+}
+
+void HeScript::parseName() {
+  char name[64];
+  strcpy(name, tok_);
+  next();
+  if (accept("(")) {
+    int argc = 0;
+    if (!accept(")")) {
+      do {
+        parseExpr();
+        argc++;
+      } while (!error_ && accept(","));
+      expect(")");
+    }
+    int k = heSFindNative(name);
+    if (k>=0) {
+      if (argc<heSNatives[k].minArgs || argc>heSNatives[k].maxArgs)
+        fail("wrong number of arguments for '%s'", name);
+      emit(OP_NATIVE, k, argc);
+    } else {
+      emit(OP_CALL, findFunc(name, 1), argc);
+    }
+    lvalueAt_ = -1;
+    return;
+  }
+  int i = curFunc_>=0 ? findLocal(name) : -1;
+  if (i>=0) {
+    lvalueAt_ = emit(OP_LOCAL, i);
+  } else if ((i = findGlobal(name, 0))>=0) {
+    lvalueAt_ = emit(OP_GLOBAL, i);
+  } else {
+    fail("unknown variable '%s'", name);
+    lvalueAt_ = -1;
+  }
+}
+
+void HeScript::parsePrimary() {
+  lvalueAt_ = -1;
+  if (tokType_==T_NUM) {
+    emit(OP_CONST, addConst(heSInt(tokValue_)));
+    next();
+  } else if (tokType_==T_STR) {
+    HeSValue v;
+    newString(tokStr_, tokLen_, &v);
+    emit(OP_CONST, addConst(v));
+    next();
+  } else if (accept("(")) {
+    parseExpr();
+    expect(")");
+  } else if (accept("[")) {
+    int n = 0;
+    if (!accept("]")) {
+      do {
+        parseExpr();
+        n++;
+      } while (!error_ && accept(","));
+      expect("]");
+    }
+    emit(OP_ARRAY, n);
+    lvalueAt_ = -1;
+  } else if (accept("nil")) {
+    emit(OP_NIL);
+  } else if (tokType_==T_NAME) {
+    parseName();
+  } else {
+    fail("expression expected");
+    return;
+  }
+  while (!error_ && accept("[")) {
+    parseExpr();
+    expect("]");
+    lvalueAt_ = emit(OP_INDEX);
+  }
+}
+
+/// Every nested expression passes through here, so this is where the
+/// nesting is counted.
+void HeScript::parseUnary() {
+  if (depth_>=HE_SCRIPT_MAX_DEPTH) {
+    fail("nested too deeply");
+    return;
+  }
+  depth_++;
+  if (accept("-")) { parseUnary(); emit(OP_NEG); lvalueAt_ = -1; }
+  else if (accept("!")) { parseUnary(); emit(OP_NOT); lvalueAt_ = -1; }
+  else if (accept("~")) { parseUnary(); emit(OP_BNOT); lvalueAt_ = -1; }
+  else if (accept("+")) parseUnary();
+  else parsePrimary();
+  depth_--;
+}
+
+/// Binary operators are numbered OP_BINARY+level*4+i in the table above.
+void HeScript::parseBinary(int level) {
+  if (level==HE_S_LEVELS) {
+    parseUnary();
+    return;
+  }
+  parseBinary(level+1);
+  for (;;) {
+    int i;
+    for (i=0; i<4 && heSBinary[level][i]; i++)
+      if (tokType_==T_PUNCT && strcmp(tok_, heSBinary[level][i])==0)
+        break;
+    if (i==4 || !heSBinary[level][i]) return;
+    next();
+    if (level<2) {
+      int j = emit(level==0 ? OP_JTRUEKEEP : OP_JFALSEKEEP, 0);
+      parseBinary(level+1);
+      patch(j, nCode_);
+    } else {
+      parseBinary(level+1);
+      emit(OP_BINARY+level*4+i);
+    }
+    lvalueAt_ = -1;
+  }
+}
+
+/// The expression before the operator was compiled as a load, which is
+/// turned into a store.
+void HeScript::parseAssignment(const char *op) {
+  int at = lvalueAt_;
+  if (at<0 || at!=lastOp_) {
+    fail("can't assign to this");
+    return;
+  }
+  int bin = -1;
+  if (op[1]) {
+    char base[4];
+    strcpy(base, op);
+    base[strlen(base)-1] = 0;
+    for (int level=2; level<HE_S_LEVELS && bin<0; level++)
+      for (int i=0; i<4 && heSBinary[level][i]; i++)
+        if (strcmp(heSBinary[level][i], base)==0)
+          bin = OP_BINARY+level*4+i;
+  }
+  int kind = code_[at], slot = code_[at+1];
+  if (kind==OP_INDEX) {
+    nCode_ = at;
+    if (bin>=0) {
+      emit(OP_DUP2);
+      emit(OP_INDEX);
+    }
+    parseExpr();
+    if (bin>=0) emit(bin);
+    emit(OP_SETINDEX);
+  } else {
+    if (bin<0) nCode_ = at;
+    parseExpr();
+    if (bin>=0) emit(bin);
+    emit(kind==OP_LOCAL ? OP_SETLOCAL : OP_SETGLOBAL, slot);
+  }
+}
+
+/// An assignment or an expression whose value is not used.
+void HeScript::parseSimple() {
+  parseExpr();
+  if (tokType_==T_PUNCT && tok_[strlen(tok_)-1]=='=' && strcmp(tok_, "==")
+      && strcmp(tok_, "!=") && strcmp(tok_, "<=") && strcmp(tok_, ">="))
+  {
+    char op[4];
+    strcpy(op, tok_);
+    next();
+    parseAssignment(op);
+  } else {
+    emit(OP_POP);
+  }
+}
+
+void HeScript::parseVar() {
+  do {
+    if (tokType_!=T_NAME) {
+      fail("variable name expected");
+      return;
+    }
+    char name[64];
+    strcpy(name, tok_);
+    next();
+    if (accept("=")) parseExpr();
+    else emit(OP_NIL);
+    // declared after the value, so 'var x = x' can use an outer 'x'
+    declare(name);
+  } while (!error_ && accept(","));
+  expect(";");
+}
+
+void HeScript::parseFunction() {
+  if (curFunc_>=0 || loop_) {
+    fail("functions can only be declared outside of functions and loops");
+    return;
+  }
+  if (tokType_!=T_NAME) {
+    fail("function name expected");
+    return;
+  }
+  if (heSFindNative(tok_)>=0) {
+    fail("'%s' is a built-in function", tok_);
+    return;
+  }
+  int f = findFunc(tok_, 1);
+  if (func_[f].entry>=0) {
+    fail("function '%s' is declared twice", tok_);
+    return;
+  }
+  next();
+  int skip = emit(OP_JUMP, 0);
+  func_[f].entry = nCode_;
+  curFunc_ = f;
+  nLocals_ = maxLocals_ = 0;
+  expect("(");
+  if (!accept(")")) {
+    do {
+      if (tokType_!=T_NAME) {
+        fail("parameter name expected");
+        break;
+      }
+      addLocal(tok_);
+      next();
+    } while (!error_ && accept(","));
+    expect(")");
+  }
+  func_[f].nParams = nLocals_;
+  if (tokType_!=T_PUNCT || strcmp(tok_, "{")) fail("'{' expected");
+  parseBlock();
+  emit(OP_NIL);
+  emit(OP_RET);
+  func_[f].nLocals = maxLocals_;
+  endScope(0);
+  curFunc_ = -1;
+  patch(skip, nCode_);
+}
+
+/// Nested statements always go through here, so this is where they are
+/// counted.
+void HeScript::parseBlock() {
+  if (depth_>=HE_SCRIPT_MAX_DEPTH) {
+    fail("nested too deeply");
+    return;
+  }
+  depth_++;
+  if (!accept("{")) {
+    parseStatement();
+  } else {
+    int nLocals = nLocals_;
+    while (!error_ && !accept("}")) {
+      if (tokType_==T_END) { fail("'}' expected"); break; }
+      parseStatement();
+    }
+    endScope(nLocals);
+  }
+  depth_--;
+}
+
+/// Loops keep the jumps of their 'break' statements until they know where
+/// they end.
+void HeScript::parseLoop(int cont) {
+  HeSLoop *l = (HeSLoop*)calloc(1, sizeof(HeSLoop));
+  l->cont = cont;
+  l->outer = loop_;
+  loop_ = l;
+  parseBlock();
+  emit(OP_JUMP, cont);
+  for (int i=0; i<l->nBreaks; i++)
+    patch(l->breaks[i], nCode_);
+  loop_ = l->outer;
+  free(l->breaks);
+  free(l);
+}
+
+void HeScript::parseStatement() {
+  if (accept(";")) return;
+  if (tokType_==T_PUNCT && strcmp(tok_, "{")==0) {
+    parseBlock();
+  } else if (accept("var")) {
+    parseVar();
+  } else if (accept("function")) {
+    parseFunction();
+  } else if (accept("if")) {
+    expect("(");
+    parseExpr();
+    expect(")");
+    int j = emit(OP_JFALSE, 0);
+    parseBlock();
+    if (accept("else")) {
+      int k = emit(OP_JUMP, 0);
+      patch(j, nCode_);
+      parseBlock();
+      patch(k, nCode_);
+    } else {
+      patch(j, nCode_);
+    }
+  } else if (accept("while")) {
+    int top = nCode_;
+    expect("(");
+    parseExpr();
+    expect(")");
+    int j = emit(OP_JFALSE, 0);
+    parseLoop(top);
+    patch(j, nCode_);
+  } else if (accept("for")) {
+    // init; top: cond; jfalse end; jump body; step: ...; jump top; body: ...
+    // jump step; end:
+    int nLocals = nLocals_;
+    expect("(");
+    if (accept("var")) parseVar();
+    else if (!accept(";")) { parseSimple(); expect(";"); }
+    int top = nCode_, j = -1;
+    if (!accept(";")) {
+      parseExpr();
+      j = emit(OP_JFALSE, 0);
+      expect(";");
+    }
+    int toBody = emit(OP_JUMP, 0);
+    int step = nCode_;
+    if (!accept(")")) {
+      parseSimple();
+      expect(")");
+    }
+    emit(OP_JUMP, top);
+    patch(toBody, nCode_);
+    parseLoop(step);
+    if (j>=0) patch(j, nCode_);
+    endScope(nLocals);
+  } else if (accept("break")) {
+    if (!loop_) {
+      fail("'break' outside of a loop");
+      return;
+    }
+    loop_->breaks = (int*)realloc(loop_->breaks, (loop_->nBreaks+1)*sizeof(int));
+    loop_->breaks[loop_->nBreaks++] = emit(OP_JUMP, 0);
+    expect(";");
+  } else if (accept("continue")) {
+    if (!loop_) {
+      fail("'continue' outside of a loop");
+      return;
+    }
+    emit(OP_JUMP, loop_->cont);
+    expect(";");
+  } else if (accept("return")) {
+    if (tokType_==T_PUNCT && strcmp(tok_, ";")==0) emit(OP_NIL);
+    else parseExpr();
+    // outside of functions, 'return' ends the script
+    if (curFunc_<0) {
+      emit(OP_POP);
+      emit(OP_HALT);
+    } else {
+      emit(OP_RET);
+    }
+    expect(";");
+  } else {
+    parseSimple();
+    expect(";");
+  }
+}
+
+const char *HeScript::compile(const char *text, int *line) {
+  clear();
+  p_ = text;
+  line_ = 1;
+  errLine_ = 0;
+  error_ = 0;
+  curFunc_ = -1;
+  depth_ = 0;
+  lvalueAt_ = lastOp_ = -1;
+  next();
+  while (!error_ && tokType_!=T_END)
+    parseStatement();
+  emit(OP_HALT);
+  for (int i=0; i<nFuncs_ && !error_; i++) {
+    if (func_[i].entry<0) {
+      line_ = func_[i].line;
+      fail("unknown function '%s'", func_[i].name);
+    }
+  }
+  if (line) *line = errLine_;
+  if (error_) {
+    // the message stays in errBuf_
+    clear();
+    return error_;
+  }
+  globalValue_ = (HeSValue*)calloc(nGlobals_ ? nGlobals_ : 1, sizeof(HeSValue));
+  return 0;
+}
+
+//---- machine ----
+
+const char *HeScript::runtime(const char *msg, int pc) {
+  snprintf(runErr_, sizeof(runErr_), "Line %d: %s.", lines_[pc], msg);
+  return runErr_;
+}
+
+void HeScript::growStack(int n) {
+  while (sp_+n>capStack_) {
+    capStack_ = capStack_ ? capStack_*2 : 256;
+    stack_ = (HeSValue*)realloc(stack_, capStack_*sizeof(HeSValue));
+  }
+}
+
+static int heSCompare(const HeSValue &a, const HeSValue &b) {
+  if (a.type==V_STR && b.type==V_STR) {
+    size_t n = a.o->n<b.o->n ? a.o->n : b.o->n;
+    int c = memcmp(a.o->bytes, b.o->bytes, n);
+    if (c) return c;
+    return a.o->n<b.o->n ? -1 : a.o->n>b.o->n ? 1 : 0;
+  }
+  return a.i<b.i ? -1 : a.i>b.i ? 1 : 0;
+}
+
+static char heSEqual(const HeSValue &a, const HeSValue &b) {
+  if (a.type!=b.type) return 0;
+  if (a.type==V_STR) return heSCompare(a, b)==0;
+  return a.i==b.i && a.n==b.n && a.o==b.o;
+}
+
+/// Apply a binary operator to 'a' and 'b' and leave the result in 'a'.
+/// Integers wrap around, and '>>' shifts in zeros.
+const char *HeScript::binary(int op, HeSValue *a, const HeSValue &b) {
+  op -= OP_BINARY;
+  if (op==B_EQ || op==B_NE) {
+    char eq = heSEqual(*a, b);
+    release(*a);
+    *a = heSInt(op==B_EQ ? eq : !eq);
+    return 0;
+  }
+  if (a->type==V_STR && b.type==V_STR) {
+    if (op==B_ADD) {
+      HeSValue r;
+      newString(0, 0, &r);
+      HeSObj *o = r.o;
+      o->n = o->cap = a->o->n+b.o->n;
+      o->bytes = (unsigned char*)realloc(o->bytes, o->n ? o->n : 1);
+      memcpy(o->bytes, a->o->bytes, a->o->n);
+      memcpy(o->bytes+a->o->n, b.o->bytes, b.o->n);
+      release(*a);
+      *a = r;
+      return 0;
+    }
+    if (op>=B_LT && op<=B_GE) {
+      int c = heSCompare(*a, b);
+      release(*a);
+      *a = heSInt(op==B_LT ? c<0 : op==B_GT ? c>0 : op==B_LE ? c<=0 : c>=0);
+      return 0;
+    }
+  }
+  if (a->type!=V_INT || b.type!=V_INT)
+    return "numbers expected";
+  unsigned long long x = a->i, y = b.i, r = 0;
+  switch (op) {
+    case B_OR: r = x|y; break;
+    case B_XOR: r = x^y; break;
+    case B_AND: r = x&y; break;
+    case B_LT: r = a->i<b.i; break;
+    case B_GT: r = a->i>b.i; break;
+    case B_LE: r = a->i<=b.i; break;
+    case B_GE: r = a->i>=b.i; break;
+    case B_SHL: r = y>63 ? 0 : x<<y; break;
+    case B_SHR: r = y>63 ? 0 : x>>y; break;
+    case B_ADD: r = x+y; break;
+    case B_SUB: r = x-y; break;
+    case B_MUL: r = x*y; break;
+    case B_DIV:
+    case B_MOD:
+      if (b.i==0) return "division by zero";
+      if (b.i==-1) r = op==B_DIV ? 0-x : 0;
+      else r = op==B_DIV ? a->i/b.i : a->i%b.i;
+      break;
+  }
+  a->i = (long long)r;
+  return 0;
+}
+
+const char *HeScript::index(const HeSValue &a, const HeSValue &i, HeSValue *r) {
+  if (i.type!=V_INT) return "index must be a number";
+  unsigned long long k = i.i;
+  switch (a.type) {
+    case V_STR:
+      if (k>=a.o->n) return "index out of range";
+      *r = heSInt(a.o->bytes[k]);
+      return 0;
+    case V_ARRAY:
+      if (k>=a.o->n) return "index out of range";
+      *r = a.o->items[k];
+      retain(*r);
+      return 0;
+    case V_SPAN: {
+      if (k>=a.n) return "index out of range";
+      unsigned char c;
+      if (!heSInRange(this, a.i+k, 1) || !heSRead(host_, a.i+k, &c, 1))
+        return "span past the end of the document";
+      *r = heSInt(c);
+      return 0; }
+  }
+  return "only strings, arrays and spans have elements";
+}
+
+/// Elements of a span are bytes of the document, so assigning to them
+/// patches it.
+const char *HeScript::setIndex(HeSValue &a, const HeSValue &i, const HeSValue &v) {
+  if (i.type!=V_INT) return "index must be a number";
+  unsigned long long k = i.i;
+  if (a.type==V_ARRAY) {
+    if (k>=a.o->n) return "index out of range";
+    set(a, k, v);
+    return 0;
+  }
+  if (a.type==V_SPAN) {
+    if (k>=a.n) return "index out of range";
+    if (v.type!=V_INT || v.i<-128 || v.i>255) return "a byte must be a number from 0 to 255";
+    if (!heSInRange(this, a.i+k, 1)) return "span past the end of the document";
+    unsigned char c = (unsigned char)v.i;
+    return host_->replace(a.i+k, 1, &c, 1);
+  }
+  if (a.type==V_STR) return "strings can't be changed";
+  return "only arrays and spans can be changed";
+}
+
+const char *HeScript::run(HeScriptHost *host) {
+  if (!code_) return "No script.";
+  host_ = host;
+  HeSFrame *frame = 0;
+  int nFrames = 0, capFrames = 0;
+  int pc = 0, base = 0, budget = HE_SCRIPT_POLL;
+  const char *err = 0;
+  char msg[100];
+  sp_ = 0;
+  growStack(64);
+  while (!err) {
+    int op = code_[pc];
+    int at = pc;
+    if (sp_+2>capStack_) growStack(2);
+    HeSValue *top = stack_+sp_-1;
+    switch (op) {
+      case OP_HALT:
+        goto done;
+      case OP_CONST:
+        stack_[sp_] = const_[code_[pc+1]];
+        retain(stack_[sp_++]);
+        pc += 2;
+        break;
+      case OP_NIL:
+        stack_[sp_++] = heSNil;
+        pc++;
+        break;
+      case OP_POP:
+        release(*top);
+        sp_--;
+        pc++;
+        break;
+      case OP_DUP2:
+        stack_[sp_] = top[-1];
+        stack_[sp_+1] = top[0];
+        retain(top[-1]);
+        retain(top[0]);
+        sp_ += 2;
+        pc++;
+        break;
+      case OP_LOCAL:
+        stack_[sp_] = stack_[base+code_[pc+1]];
+        retain(stack_[sp_++]);
+        pc += 2;
+        break;
+      case OP_SETLOCAL:
+        release(stack_[base+code_[pc+1]]);
+        stack_[base+code_[pc+1]] = *top;
+        sp_--;
+        pc += 2;
+        break;
+      case OP_GLOBAL:
+        stack_[sp_] = globalValue_[code_[pc+1]];
+        retain(stack_[sp_++]);
+        pc += 2;
+        break;
+      case OP_SETGLOBAL:
+        release(globalValue_[code_[pc+1]]);
+        globalValue_[code_[pc+1]] = *top;
+        sp_--;
+        pc += 2;
+        break;
+      case OP_INDEX: {
+        HeSValue r = heSNil;
+        err = index(top[-1], top[0], &r);
+        release(top[-1]);
+        release(top[0]);
+        top[-1] = r;
+        sp_--;
+        pc++;
+        break; }
+      case OP_SETINDEX:
+        err = setIndex(top[-2], top[-1], top[0]);
+        release(top[-2]);
+        release(top[-1]);
+        release(top[0]);
+        sp_ -= 3;
+        pc++;
+        break;
+      case OP_NEG:
+      case OP_BNOT:
+        if (top->type!=V_INT) { err = "number expected"; break; }
+        top->i = op==OP_NEG ? (long long)(0-(unsigned long long)top->i) : ~top->i;
+        pc++;
+        break;
+      case OP_NOT: {
+        char t = heSTrue(*top);
+        release(*top);
+        *top = heSInt(!t);
+        pc++;
+        break; }
+      case OP_JUMP:
+        // loops and calls jump back, so this is where long scripts pass by
+        if (code_[pc+1]<=pc && --budget==0) {
+          budget = HE_SCRIPT_POLL;
+          if (host_->poll()) err = "stopped";
+        }
+        pc = code_[pc+1];
+        break;
+      case OP_JFALSE: {
+        char t = heSTrue(*top);
+        release(*top);
+        sp_--;
+        pc = t ? pc+2 : code_[pc+1];
+        break; }
+      case OP_JFALSEKEEP:
+      case OP_JTRUEKEEP:
+        if (heSTrue(*top)==(op==OP_JTRUEKEEP)) {
+          pc = code_[pc+1];
+        } else {
+          release(*top);
+          sp_--;
+          pc += 2;
+        }
+        break;
+      case OP_CALL: {
+        HeSFunc &f = func_[code_[pc+1]];
+        int argc = code_[pc+2];
+        if (argc!=f.nParams) {
+          snprintf(msg, sizeof(msg), "'%.60s' needs %d arguments",
+                   f.name, f.nParams);
+          err = msg;
+          break;
+        }
+        if (nFrames>=HE_SCRIPT_MAX_CALLS) { err = "too many nested calls"; break; }
+        if (--budget==0) {
+          budget = HE_SCRIPT_POLL;
+          if (host_->poll()) { err = "stopped"; break; }
+        }
+        if (nFrames==capFrames) {
+          capFrames = capFrames ? capFrames*2 : 64;
+          frame = (HeSFrame*)realloc(frame, capFrames*sizeof(HeSFrame));
+        }
+        frame[nFrames].ret = pc+3;
+        frame[nFrames].base = base;
+        frame[nFrames++].func = code_[pc+1];
+        base = sp_-argc;
+        growStack(f.nLocals-argc+2);
+        for (; sp_<base+f.nLocals; sp_++)
+          stack_[sp_] = heSNil;
+        pc = f.entry;
+        break; }
+      case OP_RET: {
+        HeSValue r = *top;
+        sp_--;
+        while (sp_>base)
+          release(stack_[--sp_]);
+        stack_[sp_++] = r;
+        HeSFrame &fr = frame[--nFrames];
+        pc = fr.ret;
+        base = fr.base;
+        break; }
+      case OP_NATIVE: {
+        const HeSNative &nat = heSNatives[code_[pc+1]];
+        int i, argc = code_[pc+2];
+        HeSValue r = heSNil, *args = stack_+sp_-argc;
+        err = nat.func(this, args, argc, &r, nat.arg);
+        for (i=0; i<argc; i++) release(args[i]);
+        sp_ -= argc;
+        stack_[sp_++] = r;
+        pc += 3;
+        break; }
+      case OP_ARRAY: {
+        int i, n = code_[pc+1];
+        HeSValue r;
+        newArray(n, &r);
+        // the elements move from the stack into the array
+        for (i=0; i<n; i++) r.o->items[i] = stack_[sp_-n+i];
+        sp_ -= n;
+        stack_[sp_++] = r;
+        pc += 2;
+        break; }
+      default:
+        if (op>=OP_BINARY) {
+          err = binary(op, top-1, *top);
+          release(*top);
+          sp_--;
+          pc++;
+        } else {
+          err = "bad instruction";
+        }
+        break;
+    }
+    if (err) err = runtime(err, at);
+    else if (sp_>HE_SCRIPT_MAX_STACK) err = runtime("out of memory", at);
+  }
+done:
+  while (sp_>0)
+    release(stack_[--sp_]);
+  for (int i=0; i<nGlobals_; i++)
+    release(globalValue_[i]);
+  memset(globalValue_, 0, nGlobals_*sizeof(HeSValue));
+  free(frame);
+  host_ = 0;
+  return err;
+}
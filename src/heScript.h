@@ -0,0 +1,175 @@
+// Copyright © 2003-2004 Matthias Melcher
+// Copyright © 2019-2020 Neil McNeight
+
+
+#ifndef HESCRIPT_H
+#define HESCRIPT_H
+
+#include <stddef.h>
+
+// A small scripting language to analyse and patch documents:
+//
+//   // list the chunks of a PNG file
+//   var pos = 8;
+//   while (pos+12 <= size()) {
+//     var n = u32be(pos);
+//     print(hex(pos, 8), " ", str(span(pos+4, 4)), " ", n);
+//     if (find("IEND", pos+4, pos+8)>=0) break;
+//     pos += n+12;
+//   }
+//
+// Values are 64 bit integers, byte strings, arrays and spans. A span is a
+// view of the document, not a copy: indexing it reads a byte from the
+// document, assigning to an element patches it, and both are checked
+// against the bounds of the span. str() turns a span into a string.
+// Statements are var, if/else, while, for, break, continue, return,
+// assignments (=, +=, -=, ...) and calls. Functions are declared with
+// 'function name(a, b) { ... }' and may be called before they are declared.
+// Variables declared outside of functions are global.
+//
+// Scripts are compiled into code for a stack machine. Anything that runs
+// over many bytes is a built-in function that works directly on the
+// document buffer, one piece at a time:
+//
+//   size()                   bytes in the document
+//   u8(pos) u16(pos) ...     unsigned and signed integers: u8, u16, u32,
+//   s8(pos) s16(pos) ...     u64, s8, s16, s32, s64; append "be" for
+//                            big endian, as in u32be(pos)
+//   u16s(pos, n [, big])     arrays of n integers; also u8s, u32s, u64s
+//   span(pos, n)             a view of n bytes
+//   str(x) hex(x [, digits]) a span as a string, or a number as text
+//   len(x)                   length of a string, array or span
+//   find(pattern, from [, to])  position of a string or span, or -1
+//   count(pattern [, from, to]) number of matches that don't overlap
+//   hash(name, pos, n)       "crc32", "crc32c" and "xxh64" give numbers,
+//                            "md5", "sha1" and "sha256" hex strings
+//   write(pos, data)         overwrite bytes with a string, span or byte
+//   insert(pos, data)        insert bytes
+//   remove(pos, n)           delete bytes
+//   note(pos, n, text)       annotate bytes, where the host can show it
+//   print(...)               write values and a line feed to the output
+//   array(n [, value])       a new array; push(array, value) appends
+//
+// Everything a script does to the document goes through HeScriptHost, so
+// the same script runs in the editor and in batch mode.
+
+/// Direct view of contiguous bytes of the document.
+struct HeScriptSpan {
+  const unsigned char *data;
+  unsigned long long size;
+};
+
+class HeScriptHost {
+public:
+  virtual ~HeScriptHost() { }
+  virtual unsigned long long size() = 0;
+  /// Views of the 'n' bytes at 'pos', in at most two spans. Returns the
+  /// number of spans. They stay valid until unlock().
+  virtual int lock(unsigned long long pos, unsigned long long n,
+                   HeScriptSpan *span) = 0;
+  virtual void unlock() = 0;
+  /// Replace 'nDel' bytes at 'pos' by 'nIns' bytes. Returns an error
+  /// message, or 0.
+  virtual const char *replace(unsigned long long pos, unsigned long long nDel,
+                              const unsigned char *data,
+                              unsigned long long nIns) = 0;
+  virtual void print(const char *text, size_t n) = 0;
+  virtual void note(unsigned long long pos, unsigned long long n,
+                    const char *text) { }
+  /// Called about every million instructions. Return 1 to stop the script.
+  virtual char poll() { return 0; }
+};
+
+struct HeSValue;
+struct HeSObj;
+struct HeSFunc;
+struct HeSLoop;
+
+class HeScript {
+  // code
+  int *code_, *lines_;
+  int nCode_, capCode_;
+  HeSValue *const_;
+  int nConst_, capConst_;
+  HeSFunc *func_;
+  int nFuncs_;
+  char **global_;
+  HeSValue *globalValue_;
+  int nGlobals_;
+  // compiler state
+  const char *p_, *error_;
+  char errBuf_[160];
+  int line_, errLine_;
+  char tok_[64];
+  int tokType_;
+  long long tokValue_;
+  char *tokStr_;
+  int tokLen_, tokCap_;
+  char **local_;
+  int nLocals_, maxLocals_, capLocals_;
+  int curFunc_;
+  /// how deeply the expressions and blocks being compiled are nested
+  int depth_;
+  /// the instruction that loaded the last expression, if it can be assigned
+  int lvalueAt_, lastOp_;
+  HeSLoop *loop_;
+  // machine state
+  HeSValue *stack_;
+  int sp_, capStack_;
+  HeSObj *objects_;
+  HeScriptHost *host_;
+  char runErr_[200];
+  void next();
+  char accept(const char *tok);
+  char expect(const char *tok);
+  void fail(const char *msg, const char *arg=0);
+  int emit(int op);
+  int emit(int op, int a);
+  int emit(int op, int a, int b);
+  void patch(int at, int target);
+  int addConst(const HeSValue &v);
+  int findFunc(const char *name, char create);
+  int findLocal(const char *name);
+  int findGlobal(const char *name, char create);
+  int addLocal(const char *name);
+  void declare(const char *name);
+  void endScope(int nLocals);
+  void parseName();
+  void parsePrimary();
+  void parseUnary();
+  void parseBinary(int level);
+  void parseExpr() { parseBinary(0); }
+  void parseAssignment(const char *op);
+  void parseSimple();
+  void parseStatement();
+  void parseBlock();
+  void parseLoop(int cont);
+  void parseFunction();
+  void parseVar();
+  void clear();
+  HeSObj *newObj(int type);
+  void freeObj(HeSObj *o);
+  void retain(const HeSValue &v);
+  void release(HeSValue &v);
+  const char *binary(int op, HeSValue *a, const HeSValue &b);
+  const char *index(const HeSValue &a, const HeSValue &i, HeSValue *r);
+  const char *setIndex(HeSValue &a, const HeSValue &i, const HeSValue &v);
+  const char *runtime(const char *msg, int pc);
+  void growStack(int n);
+public:
+  HeScript();
+  ~HeScript();
+  /// Returns an error message, or 0. 'line' is set to where it happened.
+  const char *compile(const char *text, int *line);
+  /// Run the compiled script. Returns an error message with the line it
+  /// happened in, or 0.
+  const char *run(HeScriptHost *host);
+  // for the built-in functions
+  HeScriptHost *host() { return host_; }
+  void newString(const void *data, size_t n, HeSValue *r);
+  void newArray(int n, HeSValue *r);
+  void set(HeSValue &array, long long i, const HeSValue &v);
+  void push(HeSValue &array, const HeSValue &v);
+};
+
+#endif
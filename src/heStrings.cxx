@@ -0,0 +1,285 @@
+// Copyright © 2003-2004 Matthias Melcher
+// Copyright © 2019-2020 Neil McNeight
+
+#include "heStrings.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP>=2)
+# include <emmintrin.h>
+# define HE_STR_SSE2 1
+#endif
+#ifdef _MSC_VER
+# include <intrin.h>
+#endif
+
+// byte classes: printable ASCII including tab, and bytes that may start a
+// UTF-8 character of two to four bytes
+#define HE_STR_PRINT 1
+#define HE_STR_LEAD  2
+
+static unsigned char heStrClass[256];
+
+static void heInitClasses() {
+  if (heStrClass[' ']) return;
+  for (int c=0; c<256; c++) {
+    unsigned char k = 0;
+    if ((c>=0x20 && c<0x7f) || c=='\t') k |= HE_STR_PRINT;
+    if (c>=0xc2 && c<=0xf4) k |= HE_STR_LEAD;
+    heStrClass[c] = k;
+  }
+}
+
+#ifdef HE_STR_SSE2
+
+static inline int heCtz(unsigned m) {
+#ifdef _MSC_VER
+  unsigned long i;
+  _BitScanForward(&i, m);
+  return (int)i;
+#else
+  return __builtin_ctz(m);
+#endif
+}
+
+/// one bit for each of the 16 bytes that is printable ASCII
+static inline unsigned hePrintMask(__m128i v) {
+  __m128i lo = _mm_cmpgt_epi8(v, _mm_set1_epi8(0x1f));
+  __m128i hi = _mm_cmplt_epi8(v, _mm_set1_epi8(0x7f));
+  __m128i tab = _mm_cmpeq_epi8(v, _mm_set1_epi8('\t'));
+  return _mm_movemask_epi8(_mm_or_si128(_mm_and_si128(lo, hi), tab));
+}
+
+/// One bit for each byte in 0xc2..0xf4 that is followed by a continuation
+/// byte; the last one can't be checked and is always reported. The
+/// compares are signed.
+static inline unsigned heLeadMask(__m128i v) {
+  __m128i lo = _mm_cmpgt_epi8(v, _mm_set1_epi8((char)0xc1));
+  __m128i hi = _mm_cmplt_epi8(v, _mm_set1_epi8((char)0xf5));
+  unsigned lead = _mm_movemask_epi8(_mm_and_si128(lo, hi));
+  unsigned cont = _mm_movemask_epi8(_mm_cmplt_epi8(v, _mm_set1_epi8((char)0xc0)));
+  return lead & ((cont>>1)|0x8000);
+}
+
+/// Bit 2*i is set if the i-th of eight UTF-16 units is printable ASCII.
+/// 'hi' is the index of the byte that must be zero.
+static inline unsigned heText16Mask(const unsigned char *p, int hi) {
+  __m128i v = _mm_loadu_si128((const __m128i*)p);
+  unsigned z = _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_setzero_si128()));
+  unsigned pm = hePrintMask(v);
+  return (hi ? pm&(z>>1) : z&(pm>>1)) & 0x5555;
+}
+
+#endif
+
+/// number of leading bytes of p[0, n) that are printable ASCII
+static size_t heTextRun(const unsigned char *p, size_t n) {
+  size_t i = 0;
+#ifdef HE_STR_SSE2
+  for (; i+16<=n; i+=16) {
+    unsigned m = hePrintMask(_mm_loadu_si128((const __m128i*)(p+i)));
+    if (m!=0xffff) return i+heCtz(~m&0xffff);
+  }
+#endif
+  while (i<n && (heStrClass[p[i]]&HE_STR_PRINT)) i++;
+  return i;
+}
+
+/// number of leading bytes of p[0, n) that cannot start a string
+static size_t heTextGap(const unsigned char *p, size_t n, char utf8) {
+  size_t i = 0;
+#ifdef HE_STR_SSE2
+  for (; i+16<=n; i+=16) {
+    __m128i v = _mm_loadu_si128((const __m128i*)(p+i));
+    unsigned m = hePrintMask(v);
+    if (utf8) m |= heLeadMask(v);
+    if (m) return i+heCtz(m);
+  }
+#endif
+  unsigned char want = utf8 ? HE_STR_PRINT|HE_STR_LEAD : HE_STR_PRINT;
+  while (i<n && !(heStrClass[p[i]]&want)) i++;
+  return i;
+}
+
+/// Length of the printable UTF-8 character of two or more bytes at 'p', or
+/// 0 if there is none. Overlong forms, surrogates and C1 controls are
+/// rejected.
+static int heUtf8Len(const unsigned char *p, size_t n) {
+  unsigned c = p[0];
+  int len = c<0xc2 ? 0 : c<0xe0 ? 2 : c<0xf0 ? 3 : c<0xf5 ? 4 : 0;
+  if (!len || (size_t)len>n) return 0;
+  for (int i=1; i<len; i++)
+    if ((p[i]&0xc0)!=0x80) return 0;
+  unsigned c1 = p[1];
+  if ((c==0xc2 || c==0xe0) && c1<0xa0) return 0;
+  if (c==0xed && c1>0x9f) return 0;
+  if (c==0xf0 && c1<0x90) return 0;
+  if (c==0xf4 && c1>0x8f) return 0;
+  return len;
+}
+
+static void heFind8(const unsigned char *buf, size_t n, size_t first, size_t last,
+                    unsigned long long base, int types, int minChars,
+                    HeStringList *dst)
+{
+  char utf8 = (types&HE_STR_UTF8)!=0;
+  size_t q = first;
+  // a character that started in the piece before belongs to that piece
+  if (utf8) {
+    for (size_t k=1; k<=HE_STR_MARGIN && k<=first; k++) {
+      size_t len = heUtf8Len(buf+first-k, n-(first-k));
+      if (len>k) { q = first-k+len; break; }
+    }
+  }
+  size_t start0 = q;
+  while (q<last) {
+    q += heTextGap(buf+q, last-q, utf8);
+    if (q>=last) break;
+    size_t start = q;
+    unsigned chars = 0;
+    int type = HE_STR_ASCII;
+    while (q<last) {
+      size_t k = heTextRun(buf+q, last-q);
+      q += k; chars += (unsigned)k;
+      if (q>=last || !utf8) break;
+      int len = heUtf8Len(buf+q, n-q);
+      if (!len) break;
+      q += len; chars++;
+      type = HE_STR_UTF8;
+    }
+    if (q==start) { q++; continue; }
+    if (start==start0 || q>=last || (chars>=(unsigned)minChars && (type&types)))
+      dst->add(base+start, (unsigned)(q-start), chars, type);
+  }
+}
+
+static inline char heIsText16(const unsigned char *p, int hi) {
+  return !p[hi] && (heStrClass[p[1-hi]]&HE_STR_PRINT);
+}
+
+/// UTF-16 strings of characters in the ASCII range, like 'strings -el'.
+/// Both alignments are searched.
+static void heFind16(const unsigned char *buf, size_t n, size_t first, size_t last,
+                     unsigned long long base, char big, int minChars,
+                     HeStringList *dst)
+{
+  int type = big ? HE_STR_UTF16BE : HE_STR_UTF16LE;
+  int hi = big ? 0 : 1;
+  for (int phase=0; phase<2; phase++) {
+    size_t q = first + (((base+first)^phase)&1);
+    size_t start0 = q;
+    while (q<last && q+1<n) {
+#ifdef HE_STR_SSE2
+      if (q+16<=n) {
+        unsigned m = heText16Mask(buf+q, hi);
+        if (!m) { q += 16; continue; }
+        q += heCtz(m);
+        if (q>=last) break;
+      }
+#endif
+      if (!heIsText16(buf+q, hi)) { q += 2; continue; }
+      size_t start = q;
+      unsigned chars = 0;
+#ifdef HE_STR_SSE2
+      while (q+16<=last && heText16Mask(buf+q, hi)==0x5555) { q += 16; chars += 8; }
+#endif
+      while (q<last && q+1<n && heIsText16(buf+q, hi)) { q += 2; chars++; }
+      if (start==start0 || q>=last || chars>=(unsigned)minChars)
+        dst->add(base+start, (unsigned)(q-start), chars, type);
+    }
+  }
+}
+
+void heFindStrings(const unsigned char *buf, size_t n, size_t first, size_t last,
+                   unsigned long long base, int types, int minChars,
+                   HeStringList *dst)
+{
+  heInitClasses();
+  if (last>n) last = n;
+  if (first>=last) return;
+  if (types&(HE_STR_ASCII|HE_STR_UTF8))
+    heFind8(buf, n, first, last, base, types, minChars, dst);
+  if (types&HE_STR_UTF16LE)
+    heFind16(buf, n, first, last, base, 0, minChars, dst);
+  if (types&HE_STR_UTF16BE)
+    heFind16(buf, n, first, last, base, 1, minChars, dst);
+}
+
+//---- HeStringList ----
+
+void HeStringList::add(unsigned long long pos, unsigned int len, unsigned int chars, int type) {
+  if (n==cap) {
+    cap = cap ? cap*2 : 64;
+    run = (HeStringRun*)realloc(run, cap*sizeof(HeStringRun));
+  }
+  HeStringRun &r = run[n++];
+  r.pos = pos; r.len = len; r.chars = chars; r.type = type;
+}
+
+void HeStringList::clear() {
+  free(run);
+  run = 0;
+  n = cap = 0;
+}
+
+static int heCompareRuns(const void *a, const void *b) {
+  const HeStringRun *ra = (const HeStringRun*)a, *rb = (const HeStringRun*)b;
+  if (ra->pos!=rb->pos) return ra->pos<rb->pos ? -1 : 1;
+  return ra->type-rb->type;
+}
+
+void HeStringList::sort() {
+  if (n>1) qsort(run, n, sizeof(HeStringRun), heCompareRuns);
+}
+
+//---- HeStringMerger ----
+
+HeStringMerger::HeStringMerger(HeStringList *dst, int types, int minChars)
+: dst_(dst),
+  types_(types),
+  minChars_(minChars)
+{
+  memset(hasPending_, 0, sizeof(hasPending_));
+}
+
+void HeStringMerger::emit(const HeStringRun &r) {
+  if (r.chars>=(unsigned)minChars_ && (r.type&types_))
+    dst_->add(r.pos, r.len, r.chars, r.type);
+}
+
+void HeStringMerger::add(const HeStringRun &r, unsigned long long pieceEnd) {
+  // ASCII and UTF-8 can continue each other, UTF-16 only in the same
+  // byte order and alignment
+  int s = 0;
+  if (r.type==HE_STR_UTF16LE) s = 1+(int)(r.pos&1);
+  else if (r.type==HE_STR_UTF16BE) s = 3+(int)(r.pos&1);
+  HeStringRun cur = r;
+  if (hasPending_[s]) {
+    HeStringRun &p = pending_[s];
+    if (p.pos+p.len==r.pos && (unsigned long long)p.len+r.len<0xffffffffULL) {
+      cur = p;
+      cur.len += r.len;
+      cur.chars += r.chars;
+      if (r.type==HE_STR_UTF8) cur.type = HE_STR_UTF8;
+    } else {
+      emit(p);
+    }
+    hasPending_[s] = 0;
+  }
+  if (cur.pos+cur.len>=pieceEnd) {
+    pending_[s] = cur;
+    hasPending_[s] = 1;
+  } else {
+    emit(cur);
+  }
+}
+
+void HeStringMerger::finish() {
+  for (int s=0; s<5; s++) {
+    if (hasPending_[s]) emit(pending_[s]);
+    hasPending_[s] = 0;
+  }
+  dst_->sort();
+}
+
@@ -0,0 +1,68 @@
+// Copyright © 2003-2004 Matthias Melcher
+// Copyright © 2019-2020 Neil McNeight
+
+
+#ifndef HESTRINGS_H
+#define HESTRINGS_H
+
+#include <stddef.h>
+
+// Finding text in binary data, like the Unix 'strings' tool. Bytes are
+// classified sixteen at a time with SSE2 where available, so the gaps
+// between strings and the long runs of plain ASCII are crossed at memory
+// speed; only the borders and multibyte characters are looked at one by
+// one. A document is scanned in pieces. Strings that cross the border of a
+// piece are reported in parts, which HeStringMerger joins again.
+
+// string types, also used as a mask of the types to look for
+#define HE_STR_ASCII    1
+#define HE_STR_UTF8     2
+#define HE_STR_UTF16LE  4
+#define HE_STR_UTF16BE  8
+#define HE_STR_ALL      15
+
+/// Bytes that a piece must be read with before and after it, so that
+/// multibyte characters on its borders are recognized.
+#define HE_STR_MARGIN 3
+
+struct HeStringRun {
+  unsigned long long pos;
+  /// length in bytes and in characters
+  unsigned int len, chars;
+  int type;
+};
+
+/// A growing array of strings. Zero it before use, release it with clear().
+struct HeStringList {
+  HeStringRun *run;
+  int n, cap;
+  void add(unsigned long long pos, unsigned int len, unsigned int chars, int type);
+  void clear();
+  void sort();
+};
+
+/// Find strings of at least 'minChars' characters that start in
+/// buf[first, last), where 'buf' holds 'n' bytes, and add them to 'dst' at
+/// their index in 'buf' plus 'base'. Strings that touch 'first' or 'last'
+/// are reported even if they are shorter, because they may continue in the
+/// next piece.
+void heFindStrings(const unsigned char *buf, size_t n, size_t first, size_t last,
+                   unsigned long long base, int types, int minChars,
+                   HeStringList *dst);
+
+/// Joins the strings of consecutive pieces. Pass all strings of a piece
+/// with the end of that piece, piece after piece, then call finish().
+class HeStringMerger {
+  HeStringList *dst_;
+  HeStringRun pending_[5];
+  char hasPending_[5];
+  int types_, minChars_;
+  void emit(const HeStringRun &r);
+public:
+  HeStringMerger(HeStringList *dst, int types, int minChars);
+  void add(const HeStringRun &r, unsigned long long pieceEnd);
+  void finish();
+};
+
+#endif
+
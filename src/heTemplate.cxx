@@ -0,0 +1,1102 @@
+// Copyright © 2003-2004 Matthias Melcher
+// Copyright © 2019-2020 Neil McNeight
+
+#include "heTemplate.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+// expression operators
+#define E_NUM       0
+#define E_NAME      1
+#define E_MEMBER    2
+#define E_INDEX     3
+#define E_SIZEOF    4
+#define E_OFFSETOF  5
+#define E_FILESIZE  6
+#define E_NEG       7
+#define E_NOT       8
+#define E_BNOT      9
+#define E_BINARY    10
+
+// tokens
+#define T_END   0
+#define T_NAME  1
+#define T_NUM   2
+#define T_PUNCT 3
+
+// array elements are cached in pages of this many
+#define HE_TPL_PAGE 1024
+// structures nested deeper than this are not laid out, which stops
+// recursive templates that never end
+#define HE_TPL_MAX_DEPTH 64
+
+struct HeTplExpr {
+  int op;
+  long long value;
+  char *name;
+  HeTplExpr *a, *b;
+  HeTplExpr *link;
+};
+
+// binary operators from the lowest to the highest precedence
+static const char *heTplBinary[][4] = {
+  { "||" }, { "&&" }, { "|" }, { "^" }, { "&" }, { "==", "!=" },
+  { "<", ">", "<=", ">=" }, { "<<", ">>" }, { "+", "-" }, { "*", "/", "%" }
+};
+#define HE_TPL_LEVELS (int)(sizeof(heTplBinary)/sizeof(heTplBinary[0]))
+
+static const char *heTplBasicName[HE_TPL_NBASIC] = {
+  0, "u8", "u16", "u32", "u64", "s8", "s16", "s32", "s64", "f32", "f64", "char"
+};
+static const int heTplBasicSize[HE_TPL_NBASIC] = {
+  0, 1, 2, 4, 8, 1, 2, 4, 8, 4, 8, 1
+};
+
+//---- HeTemplate ---------------------------------------------------------------
+
+HeTemplate::HeTemplate() {
+  types_ = 0;
+  exprs_ = 0;
+  stmts_ = 0;
+  usesFileSize_ = 0;
+  memset(basic_, 0, sizeof(basic_));
+  for (int big=0; big<2; big++) {
+    for (int i=1; i<HE_TPL_NBASIC; i++) {
+      HeTplType *t = &basic_[big][i];
+      t->name = (char*)heTplBasicName[i];
+      t->basic = i;
+      t->size = heTplBasicSize[i];
+      t->big = big;
+      t->defined = 1;
+    }
+  }
+  memset(&root_, 0, sizeof(root_));
+  root_.name = (char*)"";
+  root_.size = -1;
+  root_.defined = 1;
+}
+
+HeTemplate::~HeTemplate() {
+  clear();
+}
+
+void HeTemplate::clear() {
+  while (types_) {
+    HeTplType *t = types_;
+    types_ = t->next;
+    free(t->name);
+    free(t);
+  }
+  while (exprs_) {
+    HeTplExpr *e = exprs_;
+    exprs_ = e->link;
+    if (e->name) free(e->name);
+    free(e);
+  }
+  while (stmts_) {
+    HeTplStmt *s = stmts_;
+    stmts_ = s->link;
+    if (s->name) free(s->name);
+    free(s);
+  }
+  root_.body = 0;
+  root_.size = -1;
+  root_.hasUsed = 0;
+  usesFileSize_ = 0;
+}
+
+void HeTemplate::fail(const char *msg, const char *arg) {
+  if (error_) return;
+  snprintf(errBuf_, sizeof(errBuf_), msg, arg);
+  error_ = errBuf_;
+  errLine_ = line_;
+}
+
+void HeTemplate::next() {
+  tok_[0] = 0;
+  tokType_ = T_END;
+  if (error_) return;
+  for (;;) {
+    while (isspace((unsigned char)*p_)) {
+      if (*p_=='\n') line_++;
+      p_++;
+    }
+    if (p_[0]=='/' && p_[1]=='/') {
+      while (*p_ && *p_!='\n') p_++;
+    } else if (p_[0]=='/' && p_[1]=='*') {
+      for (p_+=2; *p_ && !(p_[0]=='*' && p_[1]=='/'); p_++)
+        if (*p_=='\n') line_++;
+      if (*p_) p_ += 2;
+    } else break;
+  }
+  if (!*p_) return;
+  int n = 0;
+  if (isalpha((unsigned char)*p_) || *p_=='_') {
+    while ((isalnum((unsigned char)*p_) || *p_=='_') && n<63)
+      tok_[n++] = *p_++;
+    tok_[n] = 0;
+    tokType_ = T_NAME;
+  } else if (isdigit((unsigned char)*p_)) {
+    char *end;
+    tokValue_ = (long long)strtoull(p_, &end, (p_[0]=='0' && (p_[1]|0x20)=='x') ? 16 : 10);
+    p_ = end;
+    tokType_ = T_NUM;
+    strcpy(tok_, "number");
+  } else if (*p_=='\'') {
+    tokValue_ = (unsigned char)p_[1];
+    if (p_[1]=='\\') {
+      switch (p_[2]) {
+        case 'n': tokValue_ = '\n'; break;
+        case 'r': tokValue_ = '\r'; break;
+        case 't': tokValue_ = '\t'; break;
+        case '0': tokValue_ = 0; break;
+        default: tokValue_ = (unsigned char)p_[2]; break;
+      }
+      p_++;
+    }
+    if (!p_[1] || p_[2]!='\'') { fail("bad character constant"); return; }
+    p_ += 3;
+    tokType_ = T_NUM;
+    strcpy(tok_, "number");
+  } else {
+    static const char *pairs[] = { "<<", ">>", "<=", ">=", "==", "!=", "&&", "||", 0 };
+    tokType_ = T_PUNCT;
+    for (int i=0; pairs[i]; i++) {
+      if (p_[0]==pairs[i][0] && p_[1]==pairs[i][1]) {
+        tok_[0] = *p_++; tok_[1] = *p_++; tok_[2] = 0;
+        return;
+      }
+    }
+    tok_[0] = *p_++; tok_[1] = 0;
+  }
+}
+
+char HeTemplate::accept(const char *tok) {
+  if (tokType_==T_NAME || tokType_==T_PUNCT) {
+    if (strcmp(tok_, tok)==0) {
+      next();
+      return 1;
+    }
+  }
+  return 0;
+}
+
+char HeTemplate::expect(const char *tok) {
+  if (accept(tok)) return 1;
+  char buf[80];
+  snprintf(buf, sizeof(buf), "'%s' expected", tok);
+  fail("%s", buf);
+  return 0;
+}
+
+/// Basic type names may end in "be" or "le"; without, the endianness of the
+/// last 'endian' statement is used. Structures may be used before they are
+/// defined.
+HeTplType *HeTemplate::findType(const char *name, char create) {
+  char base[64];
+  int big = big_;
+  strcpy(base, name);
+  int n = strlen(base);
+  if (n>2 && (strcmp(base+n-2, "be")==0 || strcmp(base+n-2, "le")==0)) {
+    big = base[n-2]=='b';
+    base[n-2] = 0;
+  }
+  if (base[0]=='i') base[0] = 's';
+  for (int i=1; i<HE_TPL_NBASIC; i++)
+    if (strcmp(base, heTplBasicName[i])==0)
+      return &basic_[big][i];
+  HeTplType *t;
+  for (t=types_; t; t=t->next)
+    if (strcmp(t->name, name)==0)
+      return t;
+  if (!create) return 0;
+  t = (HeTplType*)calloc(1, sizeof(HeTplType));
+  t->name = _strdup(name);
+  t->basic = HE_TPL_STRUCT;
+  t->size = -2;
+  t->line = line_;
+  t->next = types_;
+  types_ = t;
+  return t;
+}
+
+HeTplExpr *HeTemplate::newExpr(int op, HeTplExpr *a, HeTplExpr *b) {
+  HeTplExpr *e = (HeTplExpr*)calloc(1, sizeof(HeTplExpr));
+  e->op = op;
+  e->a = a;
+  e->b = b;
+  e->link = exprs_;
+  exprs_ = e;
+  return e;
+}
+
+HeTplStmt *HeTemplate::newStmt(int kind) {
+  HeTplStmt *s = (HeTplStmt*)calloc(1, sizeof(HeTplStmt));
+  s->kind = kind;
+  s->line = line_;
+  s->link = stmts_;
+  stmts_ = s;
+  return s;
+}
+
+HeTplExpr *HeTemplate::parsePrimary() {
+  HeTplExpr *e = 0;
+  if (tokType_==T_NUM) {
+    e = newExpr(E_NUM, 0, 0);
+    e->value = tokValue_;
+    next();
+  } else if (accept("(")) {
+    e = parseExpr();
+    expect(")");
+  } else if (accept("filesize")) {
+    e = newExpr(E_FILESIZE, 0, 0);
+    usesFileSize_ = 1;
+  } else if (tokType_==T_NAME && (strcmp(tok_, "sizeof")==0 || strcmp(tok_, "offsetof")==0)) {
+    int op = tok_[0]=='s' ? E_SIZEOF : E_OFFSETOF;
+    next();
+    expect("(");
+    e = newExpr(op, parsePrimary(), 0);
+    expect(")");
+    return e;
+  } else if (tokType_==T_NAME) {
+    e = newExpr(E_NAME, 0, 0);
+    e->name = _strdup(tok_);
+    next();
+  } else {
+    fail("expression expected");
+    return newExpr(E_NUM, 0, 0);
+  }
+  for (;;) {
+    if (accept(".")) {
+      if (tokType_!=T_NAME) { fail("field name expected"); break; }
+      e = newExpr(E_MEMBER, e, 0);
+      e->name = _strdup(tok_);
+      next();
+    } else if (accept("[")) {
+      e = newExpr(E_INDEX, e, parseExpr());
+      expect("]");
+    } else break;
+  }
+  return e;
+}
+
+HeTplExpr *HeTemplate::parseUnary() {
+  if (accept("-")) return newExpr(E_NEG, parseUnary(), 0);
+  if (accept("!")) return newExpr(E_NOT, parseUnary(), 0);
+  if (accept("~")) return newExpr(E_BNOT, parseUnary(), 0);
+  if (accept("+")) return parseUnary();
+  return parsePrimary();
+}
+
+/// Binary operators are numbered E_BINARY+level*4+i in the table above.
+HeTplExpr *HeTemplate::parseBinary(int level) {
+  if (level==HE_TPL_LEVELS) return parseUnary();
+  HeTplExpr *e = parseBinary(level+1);
+  for (;;) {
+    int i;
+    for (i=0; i<4 && heTplBinary[level][i]; i++)
+      if (tokType_==T_PUNCT && strcmp(tok_, heTplBinary[level][i])==0)
+        break;
+    if (i==4 || !heTplBinary[level][i]) return e;
+    next();
+    e = newExpr(E_BINARY+level*4+i, e, parseBinary(level+1));
+  }
+}
+
+HeTplStmt *HeTemplate::parseBlock() {
+  if (!accept("{"))
+    return parseStatement();
+  HeTplStmt *first = 0, **tail = &first;
+  while (!error_ && !accept("}")) {
+    if (tokType_==T_END) { fail("'}' expected"); break; }
+    *tail = parseStatement();
+    while (*tail) tail = &(*tail)->next;
+  }
+  return first;
+}
+
+/// A declaration may name several fields of the same type, so this returns
+/// a list.
+HeTplStmt *HeTemplate::parseStatement() {
+  if (accept("if")) {
+    HeTplStmt *s = newStmt(HE_TPL_IF);
+    expect("(");
+    s->cond = parseExpr();
+    expect(")");
+    s->body = parseBlock();
+    if (accept("else"))
+      s->other = parseBlock();
+    return s;
+  }
+  if (accept(";"))
+    return 0;
+  if (tokType_!=T_NAME) {
+    fail("type name expected");
+    return 0;
+  }
+  HeTplType *type = findType(tok_, 1);
+  HeTplStmt *first = 0, **tail = &first;
+  next();
+  do {
+    if (tokType_!=T_NAME) {
+      fail("field name expected");
+      break;
+    }
+    HeTplStmt *s = newStmt(HE_TPL_FIELD);
+    s->name = _strdup(tok_);
+    s->type = type;
+    next();
+    if (accept("[")) {
+      s->count = parseExpr();
+      expect("]");
+    }
+    if (accept("@"))
+      s->at = parseExpr();
+    *tail = s;
+    tail = &s->next;
+  } while (!error_ && accept(","));
+  expect(";");
+  return first;
+}
+
+void HeTemplate::markUsed(HeTplStmt *list, const char *name) {
+  for (HeTplStmt *s=list; s; s=s->next) {
+    if (s->kind==HE_TPL_IF) {
+      markUsed(s->body, name);
+      markUsed(s->other, name);
+    } else if (strcmp(s->name, name)==0) {
+      s->used = 1;
+    }
+  }
+}
+
+/// Fields are referred to by name only, so every field of that name counts.
+void HeTemplate::markUsed(HeTplExpr *e) {
+  if (!e->name) return;
+  markUsed(root_.body, e->name);
+  for (HeTplType *t=types_; t; t=t->next)
+    markUsed(t->body, e->name);
+}
+
+char HeTemplate::hasUsed(HeTplStmt *list) {
+  for (HeTplStmt *s=list; s; s=s->next) {
+    if (s->kind==HE_TPL_IF) {
+      if (hasUsed(s->body) || hasUsed(s->other)) return 1;
+    } else if (s->used || s->type->hasUsed) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/// Structures have a fixed size if they contain no conditions, no placed
+/// fields and only arrays of a constant size.
+long long HeTemplate::staticSize(HeTplType *t, int depth) {
+  if (t->size!=-2) return t->size;
+  t->size = -1; // in case it contains itself
+  long long size = 0;
+  for (HeTplStmt *s=t->body; s; s=s->next) {
+    if (s->kind==HE_TPL_IF || s->at) return -1;
+    long long n = 1;
+    if (s->count) {
+      if (s->count->op!=E_NUM) return -1;
+      n = s->count->value;
+    }
+    long long fs = staticSize(s->type, depth+1);
+    if (fs<0) return -1;
+    size += fs*n;
+  }
+  return t->size = size;
+}
+
+const char *HeTemplate::compile(const char *text, int *line) {
+  clear();
+  p_ = text;
+  line_ = 1;
+  errLine_ = 0;
+  error_ = 0;
+  big_ = 0;
+  HeTplStmt **tail = &root_.body;
+  next();
+  while (tokType_!=T_END && !error_) {
+    if (accept("endian")) {
+      if (accept("big")) big_ = 1;
+      else if (accept("little")) big_ = 0;
+      else fail("'big' or 'little' expected");
+      expect(";");
+    } else if (accept("struct")) {
+      if (tokType_!=T_NAME) { fail("structure name expected"); break; }
+      HeTplType *t = findType(tok_, 1);
+      if (t->basic || t->defined) { fail("'%s' is already defined", tok_); break; }
+      t->line = line_;
+      next();
+      expect("{");
+      HeTplStmt **body = &t->body;
+      while (!error_ && !accept("}")) {
+        if (tokType_==T_END) { fail("'}' expected"); break; }
+        *body = parseStatement();
+        while (*body) body = &(*body)->next;
+      }
+      t->defined = 1;
+      accept(";");
+    } else {
+      *tail = parseStatement();
+      while (*tail) tail = &(*tail)->next;
+    }
+  }
+  for (HeTplType *t=types_; t && !error_; t=t->next) {
+    if (!t->defined) {
+      line_ = t->line;
+      fail("structure '%s' is not defined", t->name);
+    }
+  }
+  if (error_) {
+    if (line) *line = errLine_;
+    const char *err = error_;
+    clear();
+    error_ = err;
+    return errBuf_;
+  }
+  for (HeTplExpr *e=exprs_; e; e=e->link)
+    markUsed(e);
+  for (HeTplType *t=types_; t; t=t->next)
+    staticSize(t, 0);
+  // 'hasUsed' spreads outwards through structures containing structures
+  char changed = 1;
+  while (changed) {
+    changed = 0;
+    for (HeTplType *t=types_; t; t=t->next) {
+      if (!t->hasUsed && hasUsed(t->body)) {
+        t->hasUsed = 1;
+        changed = 1;
+      }
+    }
+  }
+  root_.hasUsed = hasUsed(root_.body);
+  if (line) *line = 0;
+  return 0;
+}
+
+//---- HeTplTree ----------------------------------------------------------------
+
+HeTplTree::HeTplTree(HeTemplate *t, HeReadFunc read, void *data, unsigned long long size) {
+  tpl_ = t;
+  read_ = read;
+  data_ = data;
+  fileSize_ = size;
+  error_[0] = 0;
+  line_ = 0;
+  laying_ = errNode_ = stale_ = 0;
+  staleHit_ = 0;
+  root_ = newNode(0, t->root(), 0, 0, 0);
+  root_->expanded = 1;
+}
+
+HeTplTree::~HeTplTree() {
+  freeNode(root_);
+}
+
+HeTplNode *HeTplTree::newNode(HeTplStmt *s, HeTplType *t, HeTplNode *parent,
+                              long long index, unsigned long long pos)
+{
+  HeTplNode *n = (HeTplNode*)calloc(1, sizeof(HeTplNode));
+  n->stmt = s;
+  n->type = t;
+  n->parent = parent;
+  n->index = index;
+  n->pos = pos;
+  n->count = -1;
+  n->tail = -1;
+  n->depth = parent ? parent->depth+1 : 0;
+  if (t->size>=0) {
+    n->size = t->size;
+    n->sizeKnown = 1;
+  }
+  return n;
+}
+
+void HeTplTree::freeNode(HeTplNode *n) {
+  if (!n) return;
+  if (n==errNode_) errNode_ = 0;
+  if (n==stale_) { stale_ = 0; staleHit_ = 1; }
+  for (int i=0; i<n->nChildren; i++)
+    freeNode(n->child[i]);
+  if (n->child) free(n->child);
+  if (n->page) {
+    freeElements(n, 0);
+    free(n->page);
+  }
+  if (n->ends) free(n->ends);
+  if (n->open) free(n->open);
+  free(n);
+}
+
+/// Drop the cached elements from 'from' on, and forget that they were open.
+void HeTplTree::freeElements(HeTplNode *n, long long from) {
+  if (!n->page) return;
+  long long nPages = (n->count+HE_TPL_PAGE-1)/HE_TPL_PAGE;
+  for (long long p=from/HE_TPL_PAGE; p<nPages; p++) {
+    HeTplNode **pg = n->page[p];
+    if (!pg) continue;
+    int i0 = p==from/HE_TPL_PAGE ? (int)(from%HE_TPL_PAGE) : 0;
+    for (int i=i0; i<HE_TPL_PAGE; i++) {
+      freeNode(pg[i]);
+      pg[i] = 0;
+    }
+    if (i0==0) {
+      free(pg);
+      n->page[p] = 0;
+    }
+  }
+  while (n->nOpen>0 && n->open[n->nOpen-1]>=from)
+    n->nOpen--;
+}
+
+void HeTplTree::runtimeError(const char *fmt, const char *arg) {
+  if (error_[0]) return;
+  errNode_ = laying_;
+  int n = snprintf(error_, sizeof(error_), "line %d: ", line_);
+  snprintf(error_+n, sizeof(error_)-n, fmt, arg);
+}
+
+/// Find a field by name: first among the fields of the structure being laid
+/// out, then among those that came before it in the enclosing structures.
+HeTplNode *HeTplTree::lookup(HeTplNode *scope, const char *name) {
+  HeTplNode *from = 0;
+  for (HeTplNode *n=scope; n; from=n, n=n->parent) {
+    if (n->count>=0 || n->type->basic) continue;
+    int limit = from ? (int)from->index : n->nChildren;
+    if (limit>n->nChildren) limit = n->nChildren;
+    for (int i=limit-1; i>=0; i--)
+      if (strcmp(n->child[i]->stmt->name, name)==0)
+        return n->child[i];
+  }
+  runtimeError("unknown field '%s'", name);
+  return 0;
+}
+
+HeTplNode *HeTplTree::resolve(HeTplNode *scope, HeTplExpr *e) {
+  HeTplNode *n;
+  switch (e->op) {
+    case E_NAME:
+      return lookup(scope, e->name);
+    case E_MEMBER:
+      n = resolve(scope, e->a);
+      if (!n) return 0;
+      if (n->count<0 && !n->type->basic) {
+        layout(n);
+        for (int i=0; i<n->nChildren; i++)
+          if (strcmp(n->child[i]->stmt->name, e->name)==0)
+            return n->child[i];
+      }
+      runtimeError("no field '%s'", e->name);
+      return 0;
+    case E_INDEX:
+      n = resolve(scope, e->a);
+      if (!n) return 0;
+      if (n->count<0) {
+        runtimeError("'%s' is not an array", n->stmt->name);
+        return 0;
+      } else {
+        long long i = eval(scope, e->b);
+        HeTplNode *el = element(n, i);
+        if (!el) runtimeError("index out of range in '%s'", n->stmt->name);
+        return el;
+      }
+  }
+  runtimeError("%s", "field expected");
+  return 0;
+}
+
+long long HeTplTree::eval(HeTplNode *scope, HeTplExpr *e) {
+  HeTplNode *n;
+  long long a, b;
+  switch (e->op) {
+    case E_NUM: return e->value;
+    case E_NAME:
+    case E_MEMBER:
+    case E_INDEX:
+      n = resolve(scope, e);
+      return n ? number(n) : 0;
+    case E_SIZEOF:
+      n = resolve(scope, e->a);
+      return n ? (long long)size(n) : 0;
+    case E_OFFSETOF:
+      n = resolve(scope, e->a);
+      return n ? (long long)n->pos : 0;
+    case E_FILESIZE: return (long long)fileSize_;
+    case E_NEG: return -eval(scope, e->a);
+    case E_NOT: return !eval(scope, e->a);
+    case E_BNOT: return ~eval(scope, e->a);
+  }
+  a = eval(scope, e->a);
+  int op = e->op-E_BINARY;
+  if (op==0 && a) return 1;  // ||
+  if (op==4 && !a) return 0; // &&
+  b = eval(scope, e->b);
+  switch (op) {
+    case 0: case 4: return b!=0;
+    case 8: return a|b;
+    case 12: return a^b;
+    case 16: return a&b;
+    case 20: return a==b;
+    case 21: return a!=b;
+    case 24: return a<b;
+    case 25: return a>b;
+    case 26: return a<=b;
+    case 27: return a>=b;
+    case 28: return b<0 || b>63 ? 0 : (long long)((unsigned long long)a<<b);
+    case 29: return b<0 || b>63 ? 0 : a>>b;
+    case 32: return a+b;
+    case 33: return a-b;
+    case 36: return a*b;
+    case 37:
+    case 38:
+      if (!b) {
+        runtimeError("%s", "division by zero");
+        return 0;
+      }
+      return op==37 ? a/b : a%b;
+  }
+  return 0;
+}
+
+/// Lay out the statements of a structure. Fields that were laid out before
+/// an edit are kept if they are still in the same place.
+void HeTplTree::run(HeTplNode *n, HeTplStmt *list, HeTplNode **old, int nOld) {
+  for (HeTplStmt *s=list; s; s=s->next) {
+    line_ = s->line;
+    if (s->kind==HE_TPL_IF) {
+      if (eval(n, s->cond))
+        run(n, s->body, old, nOld);
+      else if (s->other)
+        run(n, s->other, old, nOld);
+      continue;
+    }
+    unsigned long long pos;
+    if (s->at) {
+      pos = (unsigned long long)eval(n, s->at);
+    } else if (n->tail>=0) {
+      HeTplNode *t = n->child[n->tail];
+      pos = t->pos+size(t);
+      line_ = s->line;
+    } else {
+      pos = n->pos;
+    }
+    long long count = -1;
+    if (s->count) {
+      count = eval(n, s->count);
+      if (count<0) count = 0;
+      // every element takes at least a byte, or there would be no end
+      unsigned long long max = fileSize_>pos ? fileSize_-pos : 0;
+      if (s->type->size>0) max /= s->type->size;
+      if ((unsigned long long)count>max) {
+        line_ = s->line;
+        runtimeError("array '%s' runs past the end of the file", s->name);
+        count = (long long)max;
+      }
+    }
+    int i = n->nChildren;
+    HeTplNode *c = 0;
+    if (i<nOld && old[i] && old[i]->stmt==s && old[i]->pos==pos && old[i]->count==count) {
+      c = old[i];
+      old[i] = 0;
+    } else {
+      c = newNode(s, s->type, n, i, pos);
+      c->count = count;
+      if (count>=0) {
+        c->sizeKnown = 0;
+        if (s->type->size>=0) {
+          c->size = count*s->type->size;
+          c->sizeKnown = 1;
+        }
+      }
+    }
+    if ((i&15)==0)
+      n->child = (HeTplNode**)realloc(n->child, (i+16)*sizeof(HeTplNode*));
+    n->child[i] = c;
+    n->nChildren++;
+    if (!s->at) n->tail = i;
+  }
+}
+
+void HeTplTree::layout(HeTplNode *n) {
+  if (n->laidOut || n->count>=0 || n->type->basic) return;
+  HeTplNode *outer = laying_;
+  laying_ = n;
+  if (n->depth>HE_TPL_MAX_DEPTH) {
+    runtimeError("%s", "structures are nested too deeply");
+    n->laidOut = 1;
+    laying_ = outer;
+    return;
+  }
+  HeTplNode **old = n->child;
+  int nOld = n->nChildren;
+  n->child = 0;
+  n->nChildren = 0;
+  n->tail = -1;
+  n->laidOut = 2; // laying out
+  run(n, n->type->body, old, nOld);
+  n->laidOut = 1;
+  laying_ = outer;
+  for (int i=0; i<nOld; i++)
+    freeNode(old[i]);
+  if (old) free(old);
+}
+
+unsigned long long HeTplTree::size(HeTplNode *n) {
+  if (n->sizeKnown) return n->size;
+  unsigned long long s = 0;
+  if (n->count>=0) {
+    s = n->count ? elementPos(n, n->count)-n->pos : 0;
+  } else {
+    layout(n);
+    if (n->tail>=0) {
+      HeTplNode *t = n->child[n->tail];
+      s = t->pos+size(t)-n->pos;
+    }
+    if (n->laidOut==2) return s; // not complete yet
+  }
+  n->size = s;
+  n->sizeKnown = 1;
+  return s;
+}
+
+/// Elements of a varying size must be measured one after the other. Those
+/// that are not cached are laid out only for that and dropped again.
+unsigned long long HeTplTree::elementPos(HeTplNode *a, long long i) {
+  if (a->type->size>=0)
+    return a->pos+(unsigned long long)i*a->type->size;
+  if (i==0) return a->pos;
+  if (i>a->nEnds) {
+    a->ends = (unsigned long long*)realloc(a->ends, i*sizeof(unsigned long long));
+    for (long long j=a->nEnds; j<i; j++) {
+      unsigned long long start = j ? a->ends[j-1] : a->pos;
+      HeTplNode *e = a->page && a->page[j/HE_TPL_PAGE] ? a->page[j/HE_TPL_PAGE][j%HE_TPL_PAGE] : 0;
+      if (e) {
+        a->ends[j] = start+size(e);
+      } else {
+        e = newNode(a->stmt, a->type, a, j, start);
+        a->ends[j] = start+size(e);
+        freeNode(e);
+      }
+      a->nEnds = j+1;
+    }
+  }
+  return a->ends[i-1];
+}
+
+HeTplNode *HeTplTree::element(HeTplNode *a, long long i) {
+  if (a->count<0 || i<0 || i>=a->count) return 0;
+  if (!a->page)
+    a->page = (HeTplNode***)calloc((a->count+HE_TPL_PAGE-1)/HE_TPL_PAGE, sizeof(HeTplNode**));
+  HeTplNode **&pg = a->page[i/HE_TPL_PAGE];
+  if (!pg)
+    pg = (HeTplNode**)calloc(HE_TPL_PAGE, sizeof(HeTplNode*));
+  HeTplNode *&e = pg[i%HE_TPL_PAGE];
+  if (!e) {
+    unsigned long long pos = elementPos(a, i);
+    e = newNode(a->stmt, a->type, a, i, pos);
+  }
+  return e;
+}
+
+long long HeTplTree::number(HeTplNode *n) {
+  unsigned char buf[8];
+  int basic = n->type->basic;
+  if (!basic || n->count>=0) return 0;
+  int sz = (int)n->type->size;
+  if ((int)read_(data_, n->pos, buf, sz)<sz) return 0;
+  unsigned long long v = 0;
+  for (int i=0; i<sz; i++)
+    v |= (unsigned long long)buf[n->type->big ? sz-1-i : i]<<(8*i);
+  if (basic>=HE_TPL_S8 && basic<=HE_TPL_S64 && sz<8 && (v>>(8*sz-1)))
+    v |= ~0ULL<<(8*sz);
+  if (basic==HE_TPL_F32) {
+    unsigned int u = (unsigned int)v;
+    float f;
+    memcpy(&f, &u, 4);
+    return (long long)f;
+  }
+  if (basic==HE_TPL_F64) {
+    double d;
+    memcpy(&d, &v, 8);
+    return (long long)d;
+  }
+  return (long long)v;
+}
+
+/// Walk what was evaluated so far. If a field that expressions refer to was
+/// changed, everything laid out after it may be different now and is
+/// dropped, in this structure and in all that contain it. Fields before it
+/// and other values are kept; values are read from the document when they
+/// are shown anyway.
+char HeTplTree::invalidate(HeTplNode *n, unsigned long long first, unsigned long long last) {
+  if (n->count>=0) {
+    if (n->type->basic) {
+      if (!n->stmt->used) return 0;
+      return n->pos<last && n->pos+n->size>first;
+    }
+    if (!n->type->hasUsed) return 0;
+    if (n->type->size<0 && n->nEnds>0) {
+      // elements that were measured but not kept are laid out again to
+      // see if the edit hit a field their size depends on
+      long long lo = 0, hi = n->nEnds;
+      while (lo<hi) {
+        long long mid = (lo+hi)/2;
+        if (n->ends[mid]>first) hi = mid; else lo = mid+1;
+      }
+      for (long long j=lo; j<n->nEnds; j++) {
+        unsigned long long start = j ? n->ends[j-1] : n->pos;
+        if (start>=last) break;
+        HeTplNode *e = n->page && n->page[j/HE_TPL_PAGE] ? n->page[j/HE_TPL_PAGE][j%HE_TPL_PAGE] : 0;
+        char hit;
+        if (e) {
+          layout(e);
+          hit = invalidate(e, first, last);
+        } else {
+          e = newNode(n->stmt, n->type, n, j, start);
+          layout(e);
+          hit = invalidate(e, first, last);
+          freeNode(e);
+        }
+        if (hit) {
+          freeElements(n, j+1);
+          n->nEnds = j;
+          n->sizeKnown = 0;
+          n->rowsValid = 0;
+          return 1;
+        }
+      }
+    }
+    if (!n->page) return 0;
+    long long nPages = (n->count+HE_TPL_PAGE-1)/HE_TPL_PAGE;
+    for (long long p=0; p<nPages; p++) {
+      HeTplNode **pg = n->page[p];
+      if (!pg) continue;
+      for (int i=0; i<HE_TPL_PAGE; i++) {
+        if (!pg[i] || !invalidate(pg[i], first, last)) continue;
+        // elements do not see each other, but those of a varying size
+        // move when one of them changes size
+        long long j = pg[i]->index;
+        if (n->type->size<0) {
+          freeElements(n, j+1);
+          if (n->nEnds>j) n->nEnds = j;
+          n->sizeKnown = 0;
+        }
+        n->rowsValid = 0;
+        return 1;
+      }
+    }
+    return 0;
+  }
+  if (n->type->basic)
+    return n->stmt->used && n->pos<last && n->pos+n->size>first;
+  if (!n->type->hasUsed) return 0;
+  for (int i=0; i<n->nChildren; i++) {
+    if (!invalidate(n->child[i], first, last)) continue;
+    for (int j=i+1; j<n->nChildren; j++)
+      freeNode(n->child[j]);
+    n->nChildren = i+1;
+    n->laidOut = 0;
+    if (n==stale_) staleHit_ = 1;
+    if (n->type->size<0) n->sizeKnown = 0;
+    n->rowsValid = 0;
+    return 1;
+  }
+  return 0;
+}
+
+/// Inserting or deleting bytes moves everything behind them, so all fields
+/// from 'pos' to the end of the file count as changed. An error stays until
+/// the structure that raised it is dropped or laid out again.
+void HeTplTree::edited(unsigned long long pos, unsigned long long nDel, unsigned long long nIns) {
+  char old[sizeof(error_)];
+  strcpy(old, error_);
+  stale_ = errNode_;
+  staleHit_ = !errNode_;
+  error_[0] = 0;
+  errNode_ = 0;
+  fileSize_ += nIns-nDel;
+  if (nDel==nIns) {
+    invalidate(root_, pos, pos+nIns);
+  } else if (tpl_->usesFileSize_) {
+    freeNode(root_);
+    root_ = newNode(0, tpl_->root(), 0, 0, 0);
+    root_->expanded = 1;
+  } else {
+    invalidate(root_, pos, ~0ULL);
+  }
+  if (old[0] && !staleHit_ && !error_[0]) {
+    strcpy(error_, old);
+    errNode_ = stale_;
+  }
+  stale_ = 0;
+}
+
+void HeTplTree::dirtyRows(HeTplNode *n) {
+  for (; n; n=n->parent)
+    n->rowsValid = 0;
+}
+
+long long HeTplTree::rowsOf(HeTplNode *n) {
+  if (n->rowsValid) return n->rows;
+  long long r = 1;
+  if (n->expanded) {
+    if (n->count>=0) {
+      r += n->count;
+      for (int k=0; k<n->nOpen; k++)
+        r += rowsOf(element(n, n->open[k]))-1;
+    } else if (!n->type->basic) {
+      layout(n);
+      for (int i=0; i<n->nChildren; i++)
+        r += rowsOf(n->child[i]);
+    }
+  }
+  n->rows = r;
+  n->rowsValid = 1;
+  return r;
+}
+
+long long HeTplTree::rows() {
+  return rowsOf(root_)-1;
+}
+
+/// Only elements that are open take more than one row, so the element at a
+/// row is found by skipping over those.
+HeTplNode *HeTplTree::find(HeTplNode *n, long long row, int *depth) {
+  if (row==0) return n;
+  row--;
+  (*depth)++;
+  if (n->count>=0) {
+    long long extra = 0;
+    for (int k=0; k<n->nOpen; k++) {
+      long long start = n->open[k]+extra;
+      if (row<start) break;
+      HeTplNode *e = element(n, n->open[k]);
+      long long r = rowsOf(e);
+      if (row<start+r) return find(e, row-start, depth);
+      extra += r-1;
+    }
+    return element(n, row-extra);
+  }
+  for (int i=0; i<n->nChildren; i++) {
+    long long r = rowsOf(n->child[i]);
+    if (row<r) return find(n->child[i], row, depth);
+    row -= r;
+  }
+  return 0;
+}
+
+HeTplNode *HeTplTree::row(long long r, int *depth) {
+  *depth = -1;
+  rowsOf(root_);
+  return find(root_, r+1, depth);
+}
+
+char HeTplTree::expandable(HeTplNode *n) {
+  return n->count>0 || (n->count<0 && !n->type->basic);
+}
+
+void HeTplTree::expand(HeTplNode *n, char e) {
+  if (!expandable(n) || n->expanded==e) return;
+  n->expanded = e;
+  HeTplNode *a = n->parent;
+  if (a && a->count>=0) {
+    // keep the open elements of the array sorted
+    int k;
+    if (e) {
+      a->open = (long long*)realloc(a->open, (a->nOpen+1)*sizeof(long long));
+      for (k=a->nOpen; k>0 && a->open[k-1]>n->index; k--)
+        a->open[k] = a->open[k-1];
+      a->open[k] = n->index;
+      a->nOpen++;
+    } else {
+      for (k=0; k<a->nOpen && a->open[k]!=n->index; k++) { }
+      if (k<a->nOpen) {
+        memmove(a->open+k, a->open+k+1, (a->nOpen-k-1)*sizeof(long long));
+        a->nOpen--;
+      }
+    }
+  }
+  dirtyRows(n);
+}
+
+void HeTplTree::name(HeTplNode *n, char *dst, int max) {
+  if (n->parent && n->parent->count>=0)
+    snprintf(dst, max, "[%lld]", n->index);
+  else if (n->stmt)
+    snprintf(dst, max, "%s", n->stmt->name);
+  else
+    dst[0] = 0;
+}
+
+void HeTplTree::value(HeTplNode *n, char *dst, int max) {
+  unsigned char buf[32];
+  int basic = n->type->basic;
+  dst[0] = 0;
+  if (n->count>=0) {
+    int k = 0, len = n->count<32 ? (int)n->count : 32;
+    if (basic==HE_TPL_CHAR) {
+      len = (int)read_(data_, n->pos, buf, len);
+      k = snprintf(dst, max, "\"");
+      for (int i=0; i<len && k<max-8; i++) {
+        if (buf[i]==0) break;
+        if (buf[i]>=32 && buf[i]<127 && buf[i]!='"' && buf[i]!='\\')
+          dst[k++] = buf[i];
+        else
+          k += snprintf(dst+k, max-k, "\\x%02X", buf[i]);
+      }
+      snprintf(dst+k, max-k, len<n->count ? "\"..." : "\"");
+    } else if (basic==HE_TPL_U8 || basic==HE_TPL_S8) {
+      len = (int)read_(data_, n->pos, buf, len>16 ? 16 : len);
+      for (int i=0; i<len && k<max-4; i++)
+        k += snprintf(dst+k, max-k, i ? " %02X" : "%02X", buf[i]);
+      if (len<n->count && k<max-4) snprintf(dst+k, max-k, " ...");
+    } else {
+      snprintf(dst, max, "%s[%lld]", n->type->name, n->count);
+    }
+    return;
+  }
+  if (!basic) {
+    snprintf(dst, max, "%s", n->type->name);
+    return;
+  }
+  if (basic==HE_TPL_F32 || basic==HE_TPL_F64) {
+    int sz = (int)n->type->size;
+    unsigned long long v = 0;
+    if ((int)read_(data_, n->pos, buf, sz)<sz) return;
+    for (int i=0; i<sz; i++)
+      v |= (unsigned long long)buf[n->type->big ? sz-1-i : i]<<(8*i);
+    if (sz==4) {
+      unsigned int u = (unsigned int)v;
+      float f;
+      memcpy(&f, &u, 4);
+      snprintf(dst, max, "%g", f);
+    } else {
+      double d;
+      memcpy(&d, &v, 8);
+      snprintf(dst, max, "%g", d);
+    }
+    return;
+  }
+  if (n->pos+n->type->size>fileSize_) {
+    snprintf(dst, max, "(end of file)");
+    return;
+  }
+  long long v = number(n);
+  if (basic==HE_TPL_CHAR) {
+    if (v>=32 && v<127)
+      snprintf(dst, max, "'%c' (0x%02X)", (int)v, (int)v);
+    else
+      snprintf(dst, max, "0x%02X", (int)(v&0xff));
+  } else if (basic>=HE_TPL_S8 && basic<=HE_TPL_S64) {
+    snprintf(dst, max, "%lld (0x%llX)", v,
+             (unsigned long long)v&(~0ULL>>(64-8*n->type->size)));
+  } else {
+    snprintf(dst, max, "%llu (0x%llX)", (unsigned long long)v, (unsigned long long)v);
+  }
+}
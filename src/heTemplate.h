@@ -0,0 +1,201 @@
+// Copyright © 2003-2004 Matthias Melcher
+// Copyright © 2019-2020 Neil McNeight
+
+
+#ifndef HETEMPLATE_H
+#define HETEMPLATE_H
+
+#include "heDiff.h"
+
+// Structure templates describe the layout of binary data in a small C-like
+// language:
+//
+//   endian little;
+//   struct Entry { u32 offset; u16 size; char name[size-6]; }
+//   struct Header {
+//     char magic[4];
+//     u32 count, table;
+//     if (count>0) { Entry entries[count] @ table; }
+//   }
+//   Header header;
+//
+// Basic types are u8, u16, u32, u64, s8, s16, s32, s64, f32, f64 and char,
+// optionally with a "be" or "le" suffix. A field follows the one before it,
+// unless '@' places it at an absolute offset. Array sizes, offsets and
+// conditions may use earlier fields, 'filesize', sizeof(field) and
+// offsetof(field).
+//
+// A template is compiled once and then evaluated lazily: a structure is laid
+// out when it is displayed, or when a later field needs its size. Arrays of
+// elements with a fixed size are not parsed at all; element 'i' is simply at
+// pos+i*size. Edits only discard what came after a field that some
+// expression refers to.
+
+struct HeTplExpr;
+struct HeTplType;
+
+#define HE_TPL_FIELD 0
+#define HE_TPL_IF    1
+
+struct HeTplStmt {
+  int kind, line;
+  char *name;
+  HeTplType *type;
+  /// array size, or 0 for a single value
+  HeTplExpr *count;
+  /// absolute position, or 0 to follow the previous field
+  HeTplExpr *at;
+  HeTplExpr *cond;
+  HeTplStmt *body, *other;
+  HeTplStmt *next, *link;
+  /// some expression refers to this field by name
+  char used;
+};
+
+// basic types
+#define HE_TPL_STRUCT 0
+#define HE_TPL_U8     1
+#define HE_TPL_U16    2
+#define HE_TPL_U32    3
+#define HE_TPL_U64    4
+#define HE_TPL_S8     5
+#define HE_TPL_S16    6
+#define HE_TPL_S32    7
+#define HE_TPL_S64    8
+#define HE_TPL_F32    9
+#define HE_TPL_F64    10
+#define HE_TPL_CHAR   11
+#define HE_TPL_NBASIC 12
+
+struct HeTplType {
+  char *name;
+  int basic;
+  /// size in bytes, or -1 if it depends on the data
+  long long size;
+  char big, defined;
+  int line;
+  /// the layout depends on fields inside that expressions refer to
+  char hasUsed;
+  HeTplStmt *body;
+  HeTplType *next;
+};
+
+class HeTemplate {
+  friend class HeTplTree;
+  HeTplType *types_;
+  HeTplType basic_[2][HE_TPL_NBASIC];
+  HeTplType root_;
+  HeTplExpr *exprs_;
+  HeTplStmt *stmts_;
+  char usesFileSize_;
+  // parser state
+  const char *p_, *error_;
+  char errBuf_[128];
+  int line_, errLine_;
+  char tok_[64];
+  int tokType_;
+  long long tokValue_;
+  char big_;
+  void next();
+  char accept(const char *tok);
+  char expect(const char *tok);
+  void fail(const char *msg, const char *arg=0);
+  HeTplType *findType(const char *name, char create);
+  HeTplExpr *newExpr(int op, HeTplExpr *a, HeTplExpr *b);
+  HeTplStmt *newStmt(int kind);
+  HeTplExpr *parsePrimary();
+  HeTplExpr *parseUnary();
+  HeTplExpr *parseBinary(int level);
+  HeTplExpr *parseExpr() { return parseBinary(0); }
+  HeTplStmt *parseStatement();
+  HeTplStmt *parseBlock();
+  void markUsed(HeTplExpr *e);
+  void markUsed(HeTplStmt *list, const char *name);
+  char hasUsed(HeTplStmt *list);
+  long long staticSize(HeTplType *t, int depth);
+  void clear();
+public:
+  HeTemplate();
+  ~HeTemplate();
+  /// Returns an error message, or 0. 'line' is set to where it happened.
+  const char *compile(const char *text, int *line);
+  HeTplType *root() { return &root_; }
+};
+
+/// One evaluated field, array element or structure.
+struct HeTplNode {
+  HeTplStmt *stmt;
+  HeTplType *type;
+  HeTplNode *parent;
+  /// element number inside an array, or position among the parent's fields
+  long long index;
+  unsigned long long pos, size;
+  /// number of elements, or -1 if this is not an array
+  long long count;
+  char sizeKnown, laidOut, expanded, rowsValid;
+  int depth;
+  long long rows;
+  // structures: the fields laid out so far, and the last one placed
+  // sequentially, which ends the structure
+  HeTplNode **child;
+  int nChildren, tail;
+  // arrays: cached elements in pages of HE_TPL_PAGE, the end of every
+  // element measured so far if their size varies, and the expanded ones
+  HeTplNode ***page;
+  unsigned long long *ends;
+  long long nEnds;
+  long long *open;
+  int nOpen;
+};
+
+/// The evaluated tree of a template over a document.
+class HeTplTree {
+  HeTemplate *tpl_;
+  HeReadFunc read_;
+  void *data_;
+  unsigned long long fileSize_;
+  HeTplNode *root_;
+  char error_[256];
+  int line_;
+  /// the structure being laid out, and the one that raised error_
+  HeTplNode *laying_, *errNode_;
+  /// while an edit is applied: the node of the previous error, and whether
+  /// it will be laid out again, which finds the error again if it remains
+  HeTplNode *stale_;
+  char staleHit_;
+  HeTplNode *newNode(HeTplStmt *s, HeTplType *t, HeTplNode *parent,
+                     long long index, unsigned long long pos);
+  void freeNode(HeTplNode *n);
+  void freeElements(HeTplNode *n, long long from);
+  void layout(HeTplNode *n);
+  void run(HeTplNode *n, HeTplStmt *s, HeTplNode **old, int nOld);
+  unsigned long long elementPos(HeTplNode *array, long long i);
+  long long rowsOf(HeTplNode *n);
+  void dirtyRows(HeTplNode *n);
+  HeTplNode *lookup(HeTplNode *scope, const char *name);
+  HeTplNode *resolve(HeTplNode *scope, HeTplExpr *e);
+  long long eval(HeTplNode *scope, HeTplExpr *e);
+  char invalidate(HeTplNode *n, unsigned long long first, unsigned long long last);
+  void runtimeError(const char *fmt, const char *arg);
+  HeTplNode *find(HeTplNode *n, long long row, int *depth);
+public:
+  HeTplTree(HeTemplate*, HeReadFunc read, void *data, unsigned long long size);
+  ~HeTplTree();
+  /// Tell the tree that 'nDel' bytes at 'pos' were replaced by 'nIns' bytes.
+  void edited(unsigned long long pos, unsigned long long nDel, unsigned long long nIns);
+  /// visible rows, not counting the root itself
+  long long rows();
+  HeTplNode *row(long long r, int *depth);
+  unsigned long long size(HeTplNode*);
+  HeTplNode *element(HeTplNode *array, long long i);
+  char expandable(HeTplNode*);
+  void expand(HeTplNode*, char);
+  void name(HeTplNode*, char *dst, int n);
+  void value(HeTplNode*, char *dst, int n);
+  long long number(HeTplNode*);
+  /// first problem found while evaluating, or 0
+  const char *error() { return error_[0] ? error_ : 0; }
+};
+
+#endif
+
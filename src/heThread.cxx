@@ -0,0 +1,174 @@
+// Copyright © 2003-2004 Matthias Melcher
+// Copyright © 2019-2020 Neil McNeight
+
+#include "heThread.h"
+
+#include <stdlib.h>
+
+#ifndef WIN32
+#include <unistd.h>
+#endif
+
+int heCpuCount() {
+#ifdef WIN32
+  SYSTEM_INFO si;
+  GetSystemInfo(&si);
+  return si.dwNumberOfProcessors;
+#else
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+  return n<1 ? 1 : (int)n;
+#endif
+}
+
+//---- HeMutex -----------------------------------------------------------------
+
+#ifdef WIN32
+
+HeMutex::HeMutex() { InitializeCriticalSection(&cs); }
+HeMutex::~HeMutex() { DeleteCriticalSection(&cs); }
+void HeMutex::lock() { EnterCriticalSection(&cs); }
+void HeMutex::unlock() { LeaveCriticalSection(&cs); }
+
+HeCondition::HeCondition() { InitializeConditionVariable(&cv); }
+HeCondition::~HeCondition() { }
+void HeCondition::wait(HeMutex &m) { SleepConditionVariableCS(&cv, &m.cs, INFINITE); }
+void HeCondition::signal() { WakeConditionVariable(&cv); }
+void HeCondition::broadcast() { WakeAllConditionVariable(&cv); }
+
+#else
+
+HeMutex::HeMutex() { pthread_mutex_init(&mx, 0); }
+HeMutex::~HeMutex() { pthread_mutex_destroy(&mx); }
+void HeMutex::lock() { pthread_mutex_lock(&mx); }
+void HeMutex::unlock() { pthread_mutex_unlock(&mx); }
+
+HeCondition::HeCondition() { pthread_cond_init(&cv, 0); }
+HeCondition::~HeCondition() { pthread_cond_destroy(&cv); }
+void HeCondition::wait(HeMutex &m) { pthread_cond_wait(&cv, &m.mx); }
+void HeCondition::signal() { pthread_cond_signal(&cv); }
+void HeCondition::broadcast() { pthread_cond_broadcast(&cv); }
+
+#endif
+
+//---- HeThreadPool ------------------------------------------------------------
+
+HeThreadPool::HeThreadPool(int n) {
+  if (n<1) n = heCpuCount();
+  head = tail = 0;
+  quit = 0;
+  nThreads = 0;
+#ifdef WIN32
+  thread = (HANDLE*)malloc(n*sizeof(HANDLE));
+  for (int i=0; i<n; i++) {
+    thread[nThreads] = CreateThread(0, 0, workerMain, this, 0, 0);
+    if (thread[nThreads]) nThreads++;
+  }
+#else
+  thread = (pthread_t*)malloc(n*sizeof(pthread_t));
+  for (int i=0; i<n; i++) {
+    if (pthread_create(thread+nThreads, 0, workerMain, this)==0)
+      nThreads++;
+  }
+#endif
+}
+
+HeThreadPool::~HeThreadPool() {
+  mutex.lock();
+  quit = 1;
+  wake.broadcast();
+  mutex.unlock();
+  for (int i=0; i<nThreads; i++) {
+#ifdef WIN32
+    WaitForSingleObject(thread[i], INFINITE);
+    CloseHandle(thread[i]);
+#else
+    pthread_join(thread[i], 0);
+#endif
+  }
+  free(thread);
+}
+
+HeThreadPool *HeThreadPool::shared() {
+  static HeThreadPool *pool = 0;
+  if (!pool) pool = new HeThreadPool();
+  return pool;
+}
+
+void HeThreadPool::append(Batch *b) {
+  b->link = 0;
+  if (tail) tail->link = b;
+  else head = b;
+  tail = b;
+}
+
+void HeThreadPool::unlink(Batch *b) {
+  Batch *p = 0, *q = head;
+  while (q && q!=b) { p = q; q = q->link; }
+  if (!q) return;
+  if (p) p->link = b->link;
+  else head = b->link;
+  if (tail==b) tail = p;
+}
+
+/// Run the next job of a batch. Called and returns with the mutex locked.
+void HeThreadPool::runIndex(Batch *b) {
+  int ix = b->next++;
+  if (b->next==b->n)
+    unlink(b);
+  mutex.unlock();
+  b->func(b->data, ix);
+  mutex.lock();
+  if (++b->done==b->n) {
+    if (b->detached) free(b);
+    else finished.broadcast();
+  }
+}
+
+#ifdef WIN32
+DWORD WINAPI HeThreadPool::workerMain(void *user_data) {
+#else
+void *HeThreadPool::workerMain(void *user_data) {
+#endif
+  HeThreadPool *p = (HeThreadPool*)user_data;
+  p->mutex.lock();
+  for (;;) {
+    while (!p->head && !p->quit)
+      p->wake.wait(p->mutex);
+    if (p->quit) break;
+    p->runIndex(p->head);
+  }
+  p->mutex.unlock();
+  return 0;
+}
+
+void HeThreadPool::post(HeJobFunc func, void *data, int n) {
+  if (n<1) return;
+  Batch *b = (Batch*)malloc(sizeof(Batch));
+  b->func = func; b->data = data;
+  b->n = n; b->next = b->done = 0;
+  b->detached = 1;
+  mutex.lock();
+  append(b);
+  wake.broadcast();
+  mutex.unlock();
+}
+
+void HeThreadPool::parallelFor(int n, HeJobFunc func, void *data) {
+  if (n<1) return;
+  if (n==1 || nThreads==0) {
+    for (int i=0; i<n; i++) func(data, i);
+    return;
+  }
+  Batch b;
+  b.func = func; b.data = data;
+  b.n = n; b.next = b.done = 0;
+  b.detached = 0;
+  mutex.lock();
+  append(&b);
+  wake.broadcast();
+  while (b.next<b.n)
+    runIndex(&b);
+  while (b.done<b.n)
+    finished.wait(mutex);
+  mutex.unlock();
+}
@@ -0,0 +1,81 @@
+// Copyright © 2003-2004 Matthias Melcher
+// Copyright © 2019-2020 Neil McNeight
+
+
+#ifndef HETHREAD_H
+#define HETHREAD_H
+
+#ifdef WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+
+int heCpuCount();
+
+class HeMutex {
+  friend class HeCondition;
+#ifdef WIN32
+  CRITICAL_SECTION cs;
+#else
+  pthread_mutex_t mx;
+#endif
+public:
+  HeMutex();
+  ~HeMutex();
+  void lock();
+  void unlock();
+};
+
+class HeCondition {
+#ifdef WIN32
+  CONDITION_VARIABLE cv;
+#else
+  pthread_cond_t cv;
+#endif
+public:
+  HeCondition();
+  ~HeCondition();
+  void wait(HeMutex&);
+  void signal();
+  void broadcast();
+};
+
+typedef void (*HeJobFunc)(void *data, int index);
+
+/// A fixed set of worker threads. parallelFor() splits work into indexed jobs
+/// and lets the calling thread help until they are all done, so it may be
+/// called from within another job. post() runs work in the background.
+class HeThreadPool {
+  struct Batch {
+    HeJobFunc func;
+    void *data;
+    int n, next, done;
+    char detached;
+    Batch *link;
+  };
+  HeMutex mutex;
+  HeCondition wake, finished;
+  Batch *head, *tail;
+  int nThreads;
+#ifdef WIN32
+  HANDLE *thread;
+  static DWORD WINAPI workerMain(void*);
+#else
+  pthread_t *thread;
+  static void *workerMain(void*);
+#endif
+  char quit;
+  void append(Batch*);
+  void unlink(Batch*);
+  void runIndex(Batch*);
+public:
+  HeThreadPool(int n=0);
+  ~HeThreadPool();
+  static HeThreadPool *shared();
+  int threads() { return nThreads; }
+  void post(HeJobFunc func, void *data, int n=1);
+  void parallelFor(int n, HeJobFunc func, void *data);
+};
+
+#endif
@@ -0,0 +1,271 @@
+// Copyright © 2003-2004 Matthias Melcher
+// Copyright © 2019-2020 Neil McNeight
+
+#include "heTransform.h"
+#include "heThread.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP>=2)
+# include <emmintrin.h>
+# define HE_XF_SSE2 1
+#endif
+
+// blocks from this size are shared between threads, in chunks that keep
+// byte swaps aligned
+#define HE_XF_PARALLEL (16<<20)
+#define HE_XF_CHUNK (4<<20)
+
+const char *heTransformInit(HeTransform *t, int op,
+                            const unsigned char *pattern, int n)
+{
+  static const unsigned char ones[1] = { 0xff };
+  t->op = op;
+  switch (op) {
+    case HE_XF_FILL:
+    case HE_XF_XOR:
+    case HE_XF_ADD:
+    case HE_XF_SUB:
+      if (n<1) return "The pattern is empty.";
+      if (n>HE_XF_MAX_PATTERN) return "The pattern is too long.";
+      break;
+    case HE_XF_NOT:
+      pattern = ones; n = 1;
+      break;
+    case HE_XF_SWAP16:
+    case HE_XF_SWAP32:
+    case HE_XF_SWAP64:
+      t->period = 0;
+      return 0;
+    default:
+      return "Unknown operation.";
+  }
+  int a = n, b = 16;
+  while (b) { int r = a%b; a = b; b = r; }
+  t->period = 16*n/a;
+  for (int i=0; i<t->period+16; i++) {
+    unsigned char c = pattern[i%n];
+    // subtracting is adding the negated pattern
+    t->table[i] = op==HE_XF_SUB ? (unsigned char)-c : c;
+  }
+  return 0;
+}
+
+int heTransformWidth(int op) {
+  switch (op) {
+    case HE_XF_SWAP16: return 2;
+    case HE_XF_SWAP32: return 4;
+    case HE_XF_SWAP64: return 8;
+  }
+  return 1;
+}
+
+//---- pattern operations ----
+
+// 'j' is the position in the pattern table of p[0]
+
+static void heFillPattern(unsigned char *p, size_t n, const unsigned char *tab,
+                          size_t period, size_t j)
+{
+  size_t i = 0;
+#ifdef HE_XF_SSE2
+  for (; i+16<=n; i+=16) {
+    _mm_storeu_si128((__m128i*)(p+i), _mm_loadu_si128((const __m128i*)(tab+j)));
+    j += 16; if (j>=period) j -= period;
+  }
+#endif
+  for (; i<n; i++) {
+    p[i] = tab[j];
+    if (++j==period) j = 0;
+  }
+}
+
+static void heXorPattern(unsigned char *p, size_t n, const unsigned char *tab,
+                         size_t period, size_t j)
+{
+  size_t i = 0;
+#ifdef HE_XF_SSE2
+  for (; i+16<=n; i+=16) {
+    __m128i v = _mm_loadu_si128((const __m128i*)(p+i));
+    __m128i k = _mm_loadu_si128((const __m128i*)(tab+j));
+    _mm_storeu_si128((__m128i*)(p+i), _mm_xor_si128(v, k));
+    j += 16; if (j>=period) j -= period;
+  }
+#endif
+  for (; i<n; i++) {
+    p[i] ^= tab[j];
+    if (++j==period) j = 0;
+  }
+}
+
+static void heAddPattern(unsigned char *p, size_t n, const unsigned char *tab,
+                         size_t period, size_t j)
+{
+  size_t i = 0;
+#ifdef HE_XF_SSE2
+  for (; i+16<=n; i+=16) {
+    __m128i v = _mm_loadu_si128((const __m128i*)(p+i));
+    __m128i k = _mm_loadu_si128((const __m128i*)(tab+j));
+    _mm_storeu_si128((__m128i*)(p+i), _mm_add_epi8(v, k));
+    j += 16; if (j>=period) j -= period;
+  }
+#endif
+  for (; i<n; i++) {
+    p[i] += tab[j];
+    if (++j==period) j = 0;
+  }
+}
+
+//---- byte swaps ----
+
+#ifdef HE_XF_SSE2
+static inline __m128i heSwapBytes16(__m128i v) {
+  return _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+}
+#endif
+
+/// Reverse the bytes of each 'w' byte element of p[0, n). 'n' is a multiple
+/// of 'w'.
+static void heSwapBytes(unsigned char *p, size_t n, int w) {
+  size_t i = 0;
+#ifdef HE_XF_SSE2
+  for (; i+16<=n; i+=16) {
+    __m128i v = heSwapBytes16(_mm_loadu_si128((const __m128i*)(p+i)));
+    if (w==4) {
+      v = _mm_shufflelo_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+      v = _mm_shufflehi_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+    } else if (w==8) {
+      v = _mm_shufflelo_epi16(v, _MM_SHUFFLE(0, 1, 2, 3));
+      v = _mm_shufflehi_epi16(v, _MM_SHUFFLE(0, 1, 2, 3));
+    }
+    _mm_storeu_si128((__m128i*)(p+i), v);
+  }
+#endif
+  for (; i<n; i+=w) {
+    unsigned char *a = p+i, *b = p+i+w-1;
+    while (a<b) {
+      unsigned char c = *a; *a++ = *b; *b-- = c;
+    }
+  }
+}
+
+static void heTransformBlock(const HeTransform *t, unsigned char *p, size_t n,
+                             unsigned long long phase)
+{
+  size_t j = t->period ? (size_t)(phase%t->period) : 0;
+  switch (t->op) {
+    case HE_XF_FILL:
+      heFillPattern(p, n, t->table, t->period, j);
+      break;
+    case HE_XF_XOR:
+    case HE_XF_NOT:
+      heXorPattern(p, n, t->table, t->period, j);
+      break;
+    case HE_XF_ADD:
+    case HE_XF_SUB:
+      heAddPattern(p, n, t->table, t->period, j);
+      break;
+    default: {
+      int w = heTransformWidth(t->op);
+      heSwapBytes(p, n-n%w, w);
+      break;
+    }
+  }
+}
+
+//---- threads ----
+
+struct HeTransformJob {
+  const HeTransform *t;
+  unsigned char *p;
+  size_t n;
+  unsigned long long phase;
+};
+
+static void heTransformCB(void *data, int index) {
+  HeTransformJob *j = (HeTransformJob*)data;
+  size_t first = (size_t)index*HE_XF_CHUNK, n = HE_XF_CHUNK;
+  if (first+n>j->n) n = j->n-first;
+  heTransformBlock(j->t, j->p+first, n, j->phase+first);
+}
+
+void heTransform(const HeTransform *t, unsigned char *p, size_t n,
+                 unsigned long long phase, HeThreadPool *pool)
+{
+  if (!pool || pool->threads()<2 || n<HE_XF_PARALLEL) {
+    heTransformBlock(t, p, n, phase);
+    return;
+  }
+  HeTransformJob j;
+  j.t = t;
+  j.p = p;
+  j.n = n;
+  j.phase = phase;
+  pool->parallelFor((int)((n+HE_XF_CHUNK-1)/HE_XF_CHUNK), heTransformCB, &j);
+}
+
+struct HeTransformRowsJob {
+  const HeTransform *t;
+  unsigned char *p;
+  size_t width, stride, rows, chunk;
+};
+
+static void heTransformRowsCB(void *data, int index) {
+  HeTransformRowsJob *j = (HeTransformRowsJob*)data;
+  size_t first = (size_t)index*j->chunk, n = j->chunk;
+  if (first+n>j->rows) n = j->rows-first;
+  unsigned char *p = j->p+first*j->stride;
+  for (size_t i=0; i<n; i++, p+=j->stride)
+    heTransformBlock(j->t, p, j->width, 0);
+}
+
+void heTransformRows(const HeTransform *t, unsigned char *p, size_t width,
+                     size_t stride, size_t rows, HeThreadPool *pool)
+{
+  HeTransformRowsJob j;
+  j.t = t;
+  j.p = p;
+  j.width = width;
+  j.stride = stride;
+  j.rows = rows;
+  if (!pool || pool->threads()<2 || width*rows<HE_XF_PARALLEL) {
+    j.chunk = rows;
+    heTransformRowsCB(&j, 0);
+    return;
+  }
+  j.chunk = HE_XF_CHUNK/width+1;
+  pool->parallelFor((int)((rows+j.chunk-1)/j.chunk), heTransformRowsCB, &j);
+}
+
+//---- hex input ----
+
+static int heHexDigit(char c) {
+  if (c>='0' && c<='9') return c-'0';
+  c |= 0x20;
+  if (c>='a' && c<='f') return c-'a'+10;
+  return -1;
+}
+
+int heParseHexBytes(const char *text, unsigned char *dst, int max) {
+  int n = 0;
+  const char *p = text;
+  for (;;) {
+    while (*p==' ' || *p=='\t' || *p==',') p++;
+    if (!*p) break;
+    if (p[0]=='0' && (p[1]|0x20)=='x') p += 2;
+    const char *q = p;
+    while (heHexDigit(*q)>=0) q++;
+    if (q==p || (*q && *q!=' ' && *q!='\t' && *q!=',')) return -1;
+    // an odd number of digits has an implied leading zero
+    if ((q-p)&1) {
+      if (n>=max) return -1;
+      dst[n++] = (unsigned char)heHexDigit(*p++);
+    }
+    for (; p<q; p+=2) {
+      if (n>=max) return -1;
+      dst[n++] = (unsigned char)(heHexDigit(p[0])<<4 | heHexDigit(p[1]));
+    }
+  }
+  return n;
+}
@@ -0,0 +1,61 @@
+// Copyright © 2003-2004 Matthias Melcher
+// Copyright © 2019-2020 Neil McNeight
+
+
+#ifndef HETRANSFORM_H
+#define HETRANSFORM_H
+
+#include <stddef.h>
+
+class HeThreadPool;
+
+// Bulk operations on the bytes of a selection. A repeating pattern of up to
+// HE_XF_MAX_PATTERN bytes is expanded once into a table that a pointer
+// walks through sixteen bytes at a time, so the inner loops are plain SSE2
+// loads and stores for any pattern length. Large blocks are split between
+// the threads of a pool; column blocks are split by rows.
+
+#define HE_XF_FILL    0
+#define HE_XF_XOR     1
+#define HE_XF_ADD     2
+#define HE_XF_SUB     3
+#define HE_XF_NOT     4
+#define HE_XF_SWAP16  5
+#define HE_XF_SWAP32  6
+#define HE_XF_SWAP64  7
+
+#define HE_XF_MAX_PATTERN 64
+
+struct HeTransform {
+  int op;
+  /// the pattern, repeated for lcm(length, 16) bytes plus 16
+  unsigned char table[16*HE_XF_MAX_PATTERN+16];
+  int period;
+};
+
+/// Prepare 't' for one of the operations above. Fill, XOR, add and subtract
+/// need a pattern of 1 to HE_XF_MAX_PATTERN bytes. Returns an error message,
+/// or 0.
+const char *heTransformInit(HeTransform *t, int op,
+                            const unsigned char *pattern, int n);
+
+/// Element size of a byte swap, or 1.
+int heTransformWidth(int op);
+
+/// Apply 't' to p[0, n), where p[0] is byte 'phase' of the transformed range.
+/// The pattern starts over at phase 0, and byte swaps need 'phase' to be a
+/// multiple of the element size; an incomplete element at the end is left
+/// alone.
+void heTransform(const HeTransform *t, unsigned char *p, size_t n,
+                 unsigned long long phase, HeThreadPool *pool=0);
+
+/// Apply 't' to 'rows' runs of 'width' bytes that start 'stride' bytes
+/// apart, like the columns of a table. The pattern starts over in every row.
+void heTransformRows(const HeTransform *t, unsigned char *p, size_t width,
+                     size_t stride, size_t rows, HeThreadPool *pool=0);
+
+/// Read bytes written in hex, like "de ad be ef" or "0xCAFE". Returns the
+/// number of bytes, or -1 if the text is not hex or there are more than 'max'.
+int heParseHexBytes(const char *text, unsigned char *dst, int max);
+
+#endif
@@ -6,13 +6,10 @@
 // TODO:
 // - ERROR: OS X Shift+Cmd menu shortcut doesn't work
 // - statusbar
-//    o show unicode, utf8, 64bit hex
-//    o HeInput does not support 64bithex or signed decimal
 //    o allow user input and replace bytes in document/jump to address
 //    o show affected bytes for above input in hex display
 //    o enter key should stay in same field, but advance cursor in doc
 //    o allow clicking for relative and absolute cursor positioning
-//    o LSB/MSB selector
 //    o write protection indicator/button/dialog
 // - make selection work like text editor (more than 1 selected shows no cursor)
 // - triple choice on close dialog: save, don't save, cancel
@@ -40,18 +37,9 @@
 // - ask if user is sure to overwrite a file
 // - make previous/next line visible when scrolling
 // - file and directory drag 'n drop
-// - user marks (see VisualC F2)
-// - user annotations with separate text column
-// - annotated areas, structs, classes
-// - file format description, scripting
 // - tab key to change between hex and text editing
 // - meaning of 'search' field could change between ASCII and HEX depending
 //   on the active editing window... .
-// - file type recognition
-// - file analysing script
-// - file analysing plugins
-// - create and apply patch files
-// - visual file diff
 // - make editor into a widget/plugin
 // - internationalisation
 // - menu graying
@@ -92,6 +80,29 @@
 // - statusbar
 //    o show address, selection, selection size
 //    o show byte, word, dword, float, double, ASCII
+//    o show unicode, utf8, 64bit hex, signed, half float, LEB128, time
+//    o LSB/MSB selector
+// - selection statistics: histogram, entropy, checksums
+// - document digests (CRC32, MD5, SHA-1, SHA-256, BLAKE3) and verification
+// - visual file diff
+// - aligned diff of files with inserted and deleted bytes
+// - create and apply patch files (BPS, IPS)
+// - file type recognition, embedded files
+// - structure templates: structs, arrays, offsets, conditions
+// - strings: ASCII, UTF-8, UTF-16LE/BE
+// - user marks (see VisualC F2), annotated areas with separate text column
+// - fill, XOR, add, subtract, invert and byte swap the selection
+// - block selection (Alt+drag, Shift+Alt+arrows): copy, cut, type, transform
+// - export selection to a file, insert file at cursor
+// - copy, export and import as xxd dump, C array, Intel HEX, S-record, base64;
+//   "mickey -convert" on the command line
+// - "mickey -batch": patch, overwrite and replace bytes in many files
+//   without a window, one worker thread per file
+// - scripts: spans, integers and bulk searches on the document, in the
+//   script panel and with "mickey -batch -x"
+// - plugins (C interface in hePluginApi.h): columns and time boxed
+//   background analyses
+// - performance counters and timed zones, overlay, Chrome trace export
 
 #ifdef __APPLE__
 #define MM_OS "OS X"
@@ -130,12 +141,32 @@
 #define MM_APPNAME UL"mickey hex editor"
 #define MM_WEB UL"http://www.github.com/McNeight/mickey/"
 
+#define MM_WHEEL_ROWS 3
+#define MM_STATUS_DELAY (1.0/60.0)
+#define MM_MAP_DELAY 0.25
+#define MM_MAP_POLL 0.1
+// how often the performance overlay is refreshed, in seconds
+#define MM_OVERLAY_RATE 0.5
+#define MM_STATS_STEP (16<<20)
+#define MM_IO_STEP (16<<20)
+#define MM_GAP_MIN 2048
+#define MM_GAP_KEEP (1<<20)
+#define MM_HUGE_MIN (32<<20)
+#define MM_HUGE_PAGE (2<<20)
+
 #include "hexEdit.h"
+#include "heDiff.h"
+#include "hePatch.h"
+#include "heBatch.h"
 
 #include <FL/Fl.H>
 #include <FL/Fl_Double_Window.H>
 #include <FL/Fl_Group.H>
 #include <FL/Fl_Box.H>
+#include <FL/Fl_Output.H>
+#include <FL/Fl_Check_Button.H>
+#include <FL/Fl_Text_Buffer.H>
+#include <FL/Fl_Text_Editor.H>
 #include <FL/Fl_Scrollbar.H>
 #include <FL/Fl_draw.H>
 #include <FL/Fl_message.H>
@@ -149,9 +180,11 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <math.h>
 
 #ifndef _MSC_VER
 #include <unistd.h>
+#include <sys/time.h>
 #else
 #include <corecrt_io.h>
 #endif
@@ -161,6 +194,10 @@
 #include <errno.h>
 #include <stdarg.h>
 
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
+
 #include "iconEmpty24.xpm"
 #include "iconNew24.xpm"
 #include "iconOpen24.xpm"
@@ -176,9 +213,37 @@ int fixedFontWidth = 6;
 
 char appname[] = MM_APPNAME;
 
+HeDrawCounters heDrawCounters;
+
+/// Wall clock time in seconds, for profiling.
+double heSeconds() {
+#ifdef WIN32
+  return GetTickCount()/1000.0;
+#else
+  struct timeval tv;
+  gettimeofday(&tv, 0);
+  return tv.tv_sec + tv.tv_usec/1000000.0;
+#endif
+}
+
 //---- HeApp -------------------------------------------------------------------
 
 HeApp::HeApp(int argc, char **argv) {
+  // the menu lists the analyses of the plugins, so load them first
+  char path[2048];
+  prefs.pluginFolder(path, sizeof(path));
+  const char *err = fl_filename_isdir(path)
+                  ? HePluginList::shared()->loadFolder(path) : 0;
+  if (err)
+    fl_alert("Can't load plugin\n%s", err);
+  int i;
+  for (i=1; i+1<argc; i++) {
+    if (strcmp(argv[i], "-plugin")==0) {
+      err = HePluginList::shared()->load(argv[++i]);
+      if (err)
+        fl_alert("Can't load plugin\n%s", err);
+    }
+  }
   if (prefs.winflags&1)
     window = new Fl_Double_Window(prefs.winx, prefs.winy,
                                   prefs.winw, prefs.winh, appname);
@@ -194,8 +259,10 @@ HeApp::HeApp(int argc, char **argv) {
   window->resizable(doclist);
   //++ for testing only:
   //++ doclist->add("demo.o");
-  for (int i=1;i<argc;) {
-    if (Fl::arg(argc, argv, i)==0 && i<argc)
+  for (i=1;i<argc;) {
+    if (strcmp(argv[i], "-plugin")==0)
+      i += 2;
+    else if (Fl::arg(argc, argv, i)==0 && i<argc)
       doclist->add(argv[i++]);
   }
   window->show(argc, argv);
@@ -239,6 +306,12 @@ void HeApp::newDocument(const char *filename) {
 char HeApp::closeDocument(HeDocument *doc) {
   if (!doc) doc = document();
   if (!doc) return true;
+  // the script's host would be deleted while it is on the stack
+  if (doc->manager()->scriptRunning()) {
+    fl_alert("A script is still running on this document.\n"
+             "Please stop it first.");
+    return false;
+  }
   if (doc->close()) {
     doclist->remove(doc);
     window->redraw();
@@ -257,7 +330,26 @@ Fl_Menu_Item HeMenubar::itemList[] = {
   {   UL"New", MM_CMD+'n', newCB, 0, 0, MM_MENUSTYLE },
   {   UL"Open...", MM_CMD+'o', openCB, 0, FL_MENU_DIVIDER, MM_MENUSTYLE },
   {   UL"Save", MM_CMD+'s', saveCB, 0, 0, MM_MENUSTYLE },
-  {   UL"Save &As...", FL_SHIFT+MM_CMD+'s', saveAsCB, 0, 0, MM_MENUSTYLE },
+  {   UL"Save &As...", FL_SHIFT+MM_CMD+'s', saveAsCB, 0, FL_MENU_DIVIDER,
+    MM_MENUSTYLE },
+  {   UL"&Insert File...", 0, insertFileCB, 0, 0, MM_MENUSTYLE },
+  {   UL"&Export Selection...", 0, exportCB, 0, 0, MM_MENUSTYLE },
+  {   UL"Export Selection &As", 0, 0, 0, FL_SUBMENU, MM_MENUSTYLE },
+  {     UL"&Hex Dump (xxd)...", 0, exportAsCB, (void*)HE_CONV_XXD, 0, MM_MENUSTYLE },
+  {     UL"&C Array...", 0, exportAsCB, (void*)HE_CONV_C, 0, MM_MENUSTYLE },
+  {     UL"&Intel HEX...", 0, exportAsCB, (void*)HE_CONV_IHEX, 0, MM_MENUSTYLE },
+  {     UL"&Motorola S-Record...", 0, exportAsCB, (void*)HE_CONV_SREC, 0,
+    MM_MENUSTYLE },
+  {     UL"&Base64...", 0, exportAsCB, (void*)HE_CONV_BASE64, 0, MM_MENUSTYLE },
+  {     0 },
+  {   UL"I&mport", 0, 0, 0, FL_SUBMENU|FL_MENU_DIVIDER, MM_MENUSTYLE },
+  {     UL"&Hex Dump (xxd)...", 0, importCB, (void*)HE_CONV_XXD, 0, MM_MENUSTYLE },
+  {     UL"&C Array...", 0, importCB, (void*)HE_CONV_C, 0, MM_MENUSTYLE },
+  {     UL"&Intel HEX...", 0, importCB, (void*)HE_CONV_IHEX, 0, MM_MENUSTYLE },
+  {     UL"&Motorola S-Record...", 0, importCB, (void*)HE_CONV_SREC, 0,
+    MM_MENUSTYLE },
+  {     UL"&Base64...", 0, importCB, (void*)HE_CONV_BASE64, 0, MM_MENUSTYLE },
+  {     0 },
   {   UL"Close", MM_CMD+'w', closeCB, 0, FL_MENU_DIVIDER, MM_MENUSTYLE },
   {   UL"E&xit mickey", MM_CMD+'q', quitCB, 0, 0, MM_MENUSTYLE },
   {   0 },
@@ -267,19 +359,66 @@ Fl_Menu_Item HeMenubar::itemList[] = {
     MM_MENUSTYLE },
   {   UL"C&ut", MM_CMD+'x', cutCB, 0, 0, MM_MENUSTYLE },
   {   UL"Copy", MM_CMD+'c', copyCB, 0, 0, MM_MENUSTYLE },
+  {   UL"Copy &As", 0, 0, 0, FL_SUBMENU, MM_MENUSTYLE },
+  {     UL"&Hex Dump (xxd)", 0, copyAsCB, (void*)HE_CONV_XXD, 0, MM_MENUSTYLE },
+  {     UL"&C Array", 0, copyAsCB, (void*)HE_CONV_C, 0, MM_MENUSTYLE },
+  {     UL"&Intel HEX", 0, copyAsCB, (void*)HE_CONV_IHEX, 0, MM_MENUSTYLE },
+  {     UL"&Motorola S-Record", 0, copyAsCB, (void*)HE_CONV_SREC, 0,
+    MM_MENUSTYLE },
+  {     UL"&Base64", 0, copyAsCB, (void*)HE_CONV_BASE64, 0, MM_MENUSTYLE },
+  {     0 },
   {   UL"Paste", MM_CMD+'v', pasteCB, 0, 0, MM_MENUSTYLE },
   {   UL"Delete", 0, 0, 0, FL_MENU_INACTIVE, MM_MENUSTYLE },
-  {   UL"Select &All", MM_CMD+'a', 0, 0, FL_MENU_INACTIVE|FL_MENU_DIVIDER,
+  {   UL"Select &All", MM_CMD+'a', 0, 0, FL_MENU_INACTIVE, MM_MENUSTYLE },
+  {   UL"Bloc&k Selection", MM_CMD+'b', blockCB, 0, FL_MENU_DIVIDER,
     MM_MENUSTYLE },
   {   UL"Insert", MM_CMD+'i', insertModeCB, (void*)1, 0, MM_MENUSTYLE },
-  {   UL"Overwrite", FL_SHIFT+MM_CMD+'i', insertModeCB, 0, 0, MM_MENUSTYLE },
+  {   UL"Overwrite", FL_SHIFT+MM_CMD+'i', insertModeCB, 0, FL_MENU_DIVIDER,
+    MM_MENUSTYLE },
+  {   UL"Toggle &Bookmark", MM_CMD+FL_F+2, bookmarkCB, 0, 0, MM_MENUSTYLE },
+  {   UL"&Next Mark", FL_F+2, nextMarkCB, 0, 0, MM_MENUSTYLE },
+  {   UL"Pre&vious Mark", FL_SHIFT+FL_F+2, previousMarkCB, 0, 0, MM_MENUSTYLE },
+  {   UL"Annotate Selection...", MM_CMD+'e', annotateCB, 0, 0, MM_MENUSTYLE },
+  {   UL"&Remove Marks", 0, removeMarkCB, 0, FL_MENU_DIVIDER, MM_MENUSTYLE },
+  {   UL"&Transform Selection", 0, 0, 0, FL_SUBMENU, MM_MENUSTYLE },
+  {     UL"&Fill...", 0, transformCB, (void*)HE_XF_FILL, 0, MM_MENUSTYLE },
+  {     UL"&XOR...", 0, transformCB, (void*)HE_XF_XOR, 0, MM_MENUSTYLE },
+  {     UL"&Add...", 0, transformCB, (void*)HE_XF_ADD, 0, MM_MENUSTYLE },
+  {     UL"&Subtract...", 0, transformCB, (void*)HE_XF_SUB, 0, MM_MENUSTYLE },
+  {     UL"&Invert Bits", 0, transformCB, (void*)HE_XF_NOT, FL_MENU_DIVIDER,
+    MM_MENUSTYLE },
+  {     UL"Swap &16 Bit Byte Order", 0, transformCB, (void*)HE_XF_SWAP16, 0,
+    MM_MENUSTYLE },
+  {     UL"Swap &32 Bit Byte Order", 0, transformCB, (void*)HE_XF_SWAP32, 0,
+    MM_MENUSTYLE },
+  {     UL"Swap &64 Bit Byte Order", 0, transformCB, (void*)HE_XF_SWAP64, 0,
+    MM_MENUSTYLE },
+  {     0 },
   {   0 },
   { UL"Find", 0, 0, 0, FL_SUBMENU, MM_MENUSTYLE },
   {   UL"Find", MM_CMD+'f', 0, 0, FL_MENU_INACTIVE, MM_MENUSTYLE },
   {   UL"Find && &Replace", MM_CMD+'h', 0, 0, FL_MENU_INACTIVE, MM_MENUSTYLE },
   {   UL"Find &Next", MM_CMD+'g', 0, 0, FL_MENU_INACTIVE, MM_MENUSTYLE },
   {   0 },
+  { UL"Tools", 0, 0, 0, FL_SUBMENU, MM_MENUSTYLE },
+  {   UL"Selection &Statistics...", MM_CMD+'t', statisticsCB, 0, 0,
+    MM_MENUSTYLE },
+  {   UL"Hash &Document...", FL_SHIFT+MM_CMD+'h', hashCB, 0, 0,
+    MM_MENUSTYLE },
+  {   UL"St&rings...", 0, stringsCB, 0, 0, MM_MENUSTYLE },
+  {   UL"Scr&ipt...", 0, scriptCB, 0, 0, MM_MENUSTYLE },
+  {   UL"Structure &Template...", FL_SHIFT+MM_CMD+'t', structureCB, 0,
+    FL_MENU_DIVIDER, MM_MENUSTYLE },
+  {   UL"&Compare Files...", FL_SHIFT+MM_CMD+'c', compareCB, 0,
+    FL_MENU_DIVIDER, MM_MENUSTYLE },
+  {   UL"Create &Patch...", 0, createPatchCB, 0, 0, MM_MENUSTYLE },
+  {   UL"&Apply Patch...", 0, applyPatchCB, 0, 0, MM_MENUSTYLE },
+  {   0 },
   { UL"Help", 0, 0, 0, FL_SUBMENU, MM_MENUSTYLE },
+  {   UL"Performance &Overlay", 0, overlayCB, 0, FL_MENU_TOGGLE,
+    MM_MENUSTYLE },
+  {   UL"Save Performance &Trace...", 0, traceCB, 0, FL_MENU_DIVIDER,
+    MM_MENUSTYLE },
   {   UL"About mickey...", 0, aboutCB, 0, 0, MM_MENUSTYLE },
   {   0 },
   { 0 }
@@ -291,6 +430,16 @@ HeMenubar::HeMenubar(int x, int y, int w, int h, HeApp *a)
   app = a;
   menu = new Fl_Menu_Bar(x, y, w, h);
   menu->menu(itemList);
+  HePluginList *plugins = HePluginList::shared();
+  int i, n = plugins->analyses();
+  for (i=0; i<n; i++) {
+    char path[256];
+    // a slash in the name would make a submenu
+    snprintf(path, sizeof(path), "Tools/Plugins/%s", plugins->analysis(i)->name);
+    menu->add(path, 0, pluginCB, (void*)(size_t)i);
+  }
+  if (n)
+    menu->add("Tools/Plugins/Stop All", 0, stopPluginsCB, 0, 0);
   end();
 }
 
@@ -322,6 +471,26 @@ void HeMenubar::saveAsCB(Fl_Widget*, void*) {
     app->document()->saveFile(filename);
 }
 
+void HeMenubar::insertFileCB(Fl_Widget*, void*) {
+  if (!app->document()) return;
+  app->document()->manager()->insertFile();
+}
+
+void HeMenubar::exportCB(Fl_Widget*, void*) {
+  if (!app->document()) return;
+  app->document()->manager()->exportSelection();
+}
+
+void HeMenubar::exportAsCB(Fl_Widget*, void *userdata) {
+  if (!app->document()) return;
+  app->document()->manager()->exportAs((int)(size_t)userdata);
+}
+
+void HeMenubar::importCB(Fl_Widget*, void *userdata) {
+  if (!app->document()) return;
+  app->document()->manager()->importAs((int)(size_t)userdata);
+}
+
 void HeMenubar::closeCB(Fl_Widget*, void*) {
   if (!app->document()) return;
   app->closeDocument();
@@ -341,6 +510,11 @@ void HeMenubar::copyCB(Fl_Widget*, void*) {
   app->document()->manager()->copyToClipboard();
 }
 
+void HeMenubar::copyAsCB(Fl_Widget*, void *userdata) {
+  if (!app->document()) return;
+  app->document()->manager()->copyAs((int)(size_t)userdata);
+}
+
 void HeMenubar::pasteCB(Fl_Widget*, void*) {
   if (!app->document()) return;
   app->document()->manager()->pasteFromClipboard();
@@ -353,6 +527,166 @@ void HeMenubar::insertModeCB(Fl_Widget*, void *userdata) {
   app->document()->manager()->insertMode(i);
 }
 
+void HeMenubar::bookmarkCB(Fl_Widget*, void*) {
+  if (!app->document()) return;
+  app->document()->manager()->toggleBookmark();
+}
+
+void HeMenubar::nextMarkCB(Fl_Widget*, void*) {
+  if (!app->document()) return;
+  app->document()->manager()->nextMark();
+}
+
+void HeMenubar::previousMarkCB(Fl_Widget*, void*) {
+  if (!app->document()) return;
+  app->document()->manager()->previousMark();
+}
+
+void HeMenubar::annotateCB(Fl_Widget*, void*) {
+  if (!app->document()) return;
+  app->document()->manager()->annotateSelection();
+}
+
+void HeMenubar::removeMarkCB(Fl_Widget*, void*) {
+  if (!app->document()) return;
+  app->document()->manager()->removeMarks();
+}
+
+void HeMenubar::transformCB(Fl_Widget*, void *userdata) {
+  if (!app->document()) return;
+  app->document()->manager()->transformSelection((int)(size_t)userdata);
+}
+
+void HeMenubar::blockCB(Fl_Widget*, void*) {
+  if (!app->document()) return;
+  HeDocumentManager *m = app->document()->manager();
+  m->blockMode(!m->blockMode());
+}
+
+void HeMenubar::statisticsCB(Fl_Widget*, void*) {
+  if (!app->document()) return;
+  app->document()->manager()->showStatistics();
+}
+
+void HeMenubar::hashCB(Fl_Widget*, void*) {
+  if (!app->document()) return;
+  app->document()->manager()->showHashPanel();
+}
+
+void HeMenubar::structureCB(Fl_Widget*, void*) {
+  if (!app->document()) return;
+  app->document()->manager()->showStructure();
+}
+
+void HeMenubar::stringsCB(Fl_Widget*, void*) {
+  if (!app->document()) return;
+  app->document()->manager()->showStrings();
+}
+
+void HeMenubar::scriptCB(Fl_Widget*, void*) {
+  if (!app->document()) return;
+  app->document()->manager()->showScript();
+}
+
+void HeMenubar::pluginCB(Fl_Widget*, void *userdata) {
+  if (!app->document()) return;
+  const HePluginAnalysis *a = HePluginList::shared()->analysis((int)(size_t)userdata);
+  if (a) app->document()->manager()->plugins()->run(a);
+}
+
+void HeMenubar::stopPluginsCB(Fl_Widget*, void*) {
+  if (!app->document()) return;
+  app->document()->manager()->plugins()->stop();
+}
+
+/// Compare the current document's file with another one, side by side.
+void HeMenubar::compareCB(Fl_Widget*, void*) {
+  char nameA[2048];
+  const char *name = app->document() ? app->document()->filename() : 0;
+  if (!name)
+    name = fl_file_chooser("Compare File", 0, 0);
+  if (!name) return;
+  strncpy(nameA, name, 2047); nameA[2047] = 0;
+  const char *nameB = fl_file_chooser("Compare With", 0, nameA);
+  if (!nameB) return;
+  HeDiffWindow *dw = new HeDiffWindow(app, nameA, nameB);
+  dw->show();
+}
+
+/// Write the changes of the current document against its file on disk.
+/// BPS patches follow an alignment, so inserted and deleted bytes only cost
+/// their own size.
+void HeMenubar::createPatchCB(Fl_Widget*, void*) {
+  HeDocument *doc = app->document();
+  if (!doc) return;
+  if (!doc->filename()) {
+    fl_alert("A patch describes the changes to a file.\n"
+             "Please save the document first.");
+    return;
+  }
+  HePatchJob *job = doc->manager()->patch();
+  if (job->busy()) {
+    fl_alert("A patch is still being created for this document.");
+    return;
+  }
+  const char *name = fl_file_chooser
+    ( "Create Patch", "Patch Files (*.{bps,ips})", 0);
+  if (!name) return;
+  job->start(name);
+}
+
+/// Patch a file into a new one. Both are streamed, they are not loaded.
+void HeMenubar::applyPatchCB(Fl_Widget*, void*) {
+  char patchName[2048], sourceName[2048];
+  const char *name = fl_file_chooser
+    ( "Apply Patch", "Patch Files (*.{bps,ips})", 0);
+  if (!name) return;
+  strncpy(patchName, name, 2047); patchName[2047] = 0;
+  name = fl_file_chooser
+    ( "Original File", 0, app->document() ? app->document()->filename() : 0);
+  if (!name) return;
+  strncpy(sourceName, name, 2047); sourceName[2047] = 0;
+  const char *outName = fl_file_chooser("Save Patched File As", 0, sourceName);
+  if (!outName) return;
+  if (strcmp(outName, sourceName)==0) {
+    fl_alert("The patched file must not replace the original file.");
+    return;
+  }
+  const char *err = heApplyPatch(sourceName, patchName, outName);
+  if (err)
+    fl_alert("Can't apply patch \n\"%s\".\n%s.", patchName, err);
+  else if (fl_ask("The patched file was written.\nDo you want to open it?"))
+    app->newDocument(outName);
+}
+
+void HeMenubar::overlayCB(Fl_Widget *w, void*) {
+  char on = ((Fl_Menu_*)w)->mvalue()->value()!=0;
+  HeColumnGroup::overlay(on);
+  // the numbers change without anything being drawn, after a search say
+  if (on)
+    Fl::add_timeout(MM_OVERLAY_RATE, overlayTimerCB);
+  else
+    Fl::remove_timeout(overlayTimerCB);
+  if (app->document())
+    app->document()->manager()->columns()->redraw();
+}
+
+void HeMenubar::overlayTimerCB(void*) {
+  if (app->document())
+    app->document()->manager()->columns()->damage(FL_DAMAGE_USER1);
+  Fl::repeat_timeout(MM_OVERLAY_RATE, overlayTimerCB);
+}
+
+/// Save what happened lately for chrome://tracing or ui.perfetto.dev.
+void HeMenubar::traceCB(Fl_Widget*, void*) {
+  const char *name = fl_file_chooser("Save Performance Trace", "*.json",
+                                     "mickey-trace.json");
+  if (!name) return;
+  const char *err = heWriteTrace(name);
+  if (err)
+    fl_alert("Can't write trace file \n\"%s\".\n%s.", name, err);
+}
+
 void HeMenubar::aboutCB(Fl_Widget*, void*) {
   fl_message(UL"mickey " MM_VERSION"\n" MM_COPYRIGHT"\n\n"
              "a free cross platform hex editor\n\n"
@@ -538,6 +872,56 @@ void HeDocumentList::add(const char *filename) {
 
 //---- HeDocument --------------------------------------------------------------
 
+static size_t heHugeRound(size_t n) {
+  return (n+MM_HUGE_PAGE-1) & ~(size_t)(MM_HUGE_PAGE-1);
+}
+
+/// Resize a block of 'n' bytes to 'newN' bytes, or allocate one if 'p' is 0.
+/// The contents stay, but the block may move. On Linux, large blocks can be
+/// mapped with transparent huge pages if the preferences say so, which saves
+/// most TLB misses when the gap moves across a big file; '*mapped' tells
+/// which kind of block it is. Both realloc() and mremap() can often grow a
+/// block in place. Returns 0 and keeps the block if there is no memory.
+static unsigned char *heResizeMemory(unsigned char *p, size_t n, size_t newN,
+                                     char *mapped)
+{
+#ifdef __linux__
+  if (*mapped) {
+    size_t m = heHugeRound(n), newM = heHugeRound(newN);
+    if (m==newM) return p;
+    void *q = mremap(p, m, newM, MREMAP_MAYMOVE);
+    if (q==MAP_FAILED) return 0;
+    madvise(q, newM, MADV_HUGEPAGE);
+    return (unsigned char*)q;
+  }
+  if (prefs.hugepages && newN>=MM_HUGE_MIN) {
+    size_t newM = heHugeRound(newN);
+    void *q = mmap(0, newM, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if (q!=MAP_FAILED) {
+      madvise(q, newM, MADV_HUGEPAGE);
+      if (p) {
+        memcpy(q, p, n<newN ? n : newN);
+        free(p);
+      }
+      *mapped = 1;
+      return (unsigned char*)q;
+    }
+  }
+#endif
+  return (unsigned char*)realloc(p, newN);
+}
+
+static void heFreeMemory(unsigned char *p, size_t n, char mapped) {
+  if (!p) return;
+#ifdef __linux__
+  if (mapped) {
+    munmap(p, heHugeRound(n));
+    return;
+  }
+#endif
+  free(p);
+}
+
 HeDocument::HeDocument(int x, int y, int w, int h, HeApp *a)
 : Fl_Group(x, y, w, h, "unnamed")
 {
@@ -547,25 +931,38 @@ HeDocument::HeDocument(int x, int y, int w, int h, HeApp *a)
   filename_ = 0;
   shortname = 0;
   labelname = 0;
+  tooltip_ = 0;
   size_ = 0;
   gap = 0;
-  gapSize = 2048;
-  buffer_ = (unsigned char*)malloc(size_+gapSize+2);
+  gapSize = MM_GAP_MIN;
+  mapped_ = 0;
+  buffer_ = heResizeMemory(0, 0, size_+gapSize+2, &mapped_);
   file_ = -1;
+  mtime_ = 0;
+  changed_ = false;
+  nListeners_ = 0;
+  fileType_ = new HeFileType(this);
+  marks_ = new HeDocumentMarks(this);
   manager_ = new HeDocumentManager(x, y, w, h, this);
+  manager_->addLayer(marks_);
   end();
   resizable(manager_);
 }
 
 HeDocument::~HeDocument() {
+  // delete the views first, their background jobs may still read the buffer
+  clear();
+  delete fileType_;
+  delete marks_;
   if (filename_)
     free(filename_);
   if (shortname)
     free(shortname);
   if (labelname)
     free(labelname);
-  if (buffer_)
-    free(buffer_);
+  if (tooltip_)
+    free(tooltip_);
+  heFreeMemory(buffer_, size_+gapSize+2, mapped_);
   if (file_!=-1)
     ::_close(file_);
 }
@@ -586,14 +983,37 @@ void HeDocument::filename(const char *name) {
   if (!changed())
     labelname[n] = 0;
   label(labelname);
-  tooltip(filename_);
+  updateTooltip();
+}
+
+/// The tab tooltip shows the full path and what is known about the format.
+void HeDocument::updateTooltip() {
+  char type[1024];
+  if (!filename_) return;
+  fileType_->describe(type, sizeof(type));
+  if (tooltip_) free(tooltip_);
+  tooltip_ = (char*)malloc(strlen(filename_)+strlen(type)+2);
+  strcpy(tooltip_, filename_);
+  if (type[0]) {
+    strcat(tooltip_, "\n");
+    strcat(tooltip_, type);
+  }
+  tooltip(tooltip_);
 }
 
 void HeDocument::loadFile(const char *name) {
   if (!name) return;
+  HeScope scope(HE_ZONE_LOAD);
   size_t n = 0;
+  heIndex oldSize = size_;
   filename(name);
+  // the old contents are dropped, but the buffer stays until we know more
+  dataLock_.lock();
+  gap = 0;
+  gapSize += size_;
   size_ = 0;
+  dataLock_.unlock();
+  mtime_ = 0;
   file_ = _open(filename(), O_RDONLY, 0644);
   if (file_==-1) {
     fl_alert("Can't open file \n\"%s\"\nfor reading.\n%s.",
@@ -607,34 +1027,58 @@ void HeDocument::loadFile(const char *name) {
              filename(), strerror(errno));
     goto cleanReturn;
   }
-  size_ = st.st_size;
-  if (size_==0) return;
-  if (buffer_)
-    free(buffer_);
-  gap = size_; gapSize = 2048;
-  buffer_ = (unsigned char*)malloc(size_+gapSize+2);
-  n = _read(file_, buffer_, size_);
+  // empty files take the same path, so they get their marks and file type
+  dataLock_.lock();
+  heFreeMemory(buffer_, gapSize+2, mapped_);
+  gap = size_ = st.st_size; gapSize = MM_GAP_MIN;
+  mapped_ = 0;
+  buffer_ = heResizeMemory(0, 0, size_+gapSize+2, &mapped_);
+  n = buffer_ ? _read(file_, buffer_, size_) : (size_t)-1;
   if (n==(size_t)-1) {
+    size_ = 0;
+    heFreeMemory(buffer_, gap+gapSize+2, mapped_);
+    buffer_ = 0;
+    gap = gapSize = 0;
+    dataLock_.unlock();
     fl_alert("Can't read contents of file \n\"%s\".\n%s.\n"
              "Assuming empty file.",
              filename(), strerror(errno));
-    size_ = 0;
-    free(buffer_); buffer_ = 0;
     goto cleanReturn;
   } else if (n<(size_t)size_) {
+    gapSize += size_-(heIndex)n;
+    gap = size_ = (heIndex)n;
+    dataLock_.unlock();
     fl_alert("File \n\"%s\"\ntruncated while reading."
              "Editing file is not recommended.",
              filename());
-    size_ = n;
+  } else {
+    mtime_ = st.st_mtime;
+    dataLock_.unlock();
   }
 cleanReturn:
   if (file_!=-1)
     ::_close(file_);
+  file_ = -1;
+  scope.bytes(size_);
   clearChanged();
+  notify(0, oldSize, size_);
+  if (filename()) {
+    char sidecar[2048];
+    HeDocumentMarks::sidecarName(filename(), sidecar, sizeof(sidecar));
+    marks_->load(sidecar);
+  }
+  fileType_->start();
   manager()->update();
 }
 
 void HeDocument::saveFile(const char *name) {
+  // the patch job is still reading the file we would overwrite
+  if (manager_ && manager_->patch()->busy()) {
+    fl_alert("A patch is still being created from this file.\n"
+             "Please save when it is done.");
+    return;
+  }
+  HeScope scope(HE_ZONE_SAVE);
   if (name)
     filename(name);
   else
@@ -655,8 +1099,15 @@ void HeDocument::saveFile(const char *name) {
   } else if (n1+n2<(size_t)size_) {
     fl_alert("File \"%s\"\ntruncated while writing!",
              filename());
+  } else {
+    scope.bytes(n1+n2);
   }
+  struct stat st;
+  mtime_ = fstat(out, &st)==0 && n1+n2==(size_t)size_ ? st.st_mtime : 0;
   ::_close(out);
+  char sidecar[2048];
+  HeDocumentMarks::sidecarName(filename(), sidecar, sizeof(sidecar));
+  marks_->save(sidecar);
   clearChanged();
 }
 
@@ -685,60 +1136,374 @@ unsigned char HeDocument::byteAt(heIndex i) {
 }
 
 void HeDocument::byteAt(heIndex i, unsigned char c) {
-  if (i>size_ || !buffer_) return;
-  if (i>=gap) i+=gapSize;
-  buffer_[i] = c;
-  if (!changed_) setChanged();
+  if (i>=size_ || !buffer_) return;
+  replaceBytes(i, 1, &c, 1);
 }
 
 unsigned char *HeDocument::blockAt(heIndex start, heIndex n) {
   if (gap<=start) return buffer_+gapSize+start;
   if (gap>=start+n) return buffer_+start;
+  dataLock_.lock();
   moveGapTo(start);
+  dataLock_.unlock();
   return buffer_+gapSize+start;
 }
 
+/// Copy up to 'n' bytes starting at 'pos' and return the number of bytes
+/// copied. This is the only way for background threads to access the data.
+heIndex HeDocument::read(heIndex pos, unsigned char *dst, heIndex n) {
+  dataLock_.lock();
+  if (pos>=size_ || !buffer_) n = 0;
+  else if (n>size_-pos) n = size_-pos;
+  heIndex n1 = 0;
+  if (pos<gap) {
+    n1 = gap-pos;
+    if (n1>n) n1 = n;
+    memcpy(dst, buffer_+pos, n1);
+  }
+  if (n1<n)
+    memcpy(dst+n1, buffer_+gapSize+pos+n1, n-n1);
+  dataLock_.unlock();
+  return n;
+}
+
+/// Write 'n' bytes at 'pos' to the file 'fd' straight from the buffer. The
+/// data is locked for one piece at a time, so background jobs can go on.
+/// Returns 0 and leaves errno set if writing fails.
+char HeDocument::writeBytes(int fd, heIndex pos, heIndex n) {
+  while (n>0) {
+    HeDataSpan span[2];
+    heIndex k = n<MM_IO_STEP ? n : MM_IO_STEP;
+    int i, ns = lockData(pos, k, span);
+    if (ns==0) k = 0;
+    for (i=0; i<ns; i++) {
+      const unsigned char *p = span[i].data;
+      heIndex m = span[i].size;
+      while (m>0) {
+        int w = (int)_write(fd, p, m);
+        if (w<=0) {
+          unlockData();
+          if (w==0) errno = ENOSPC;
+          return 0;
+        }
+        p += w; m -= w;
+      }
+    }
+    unlockData();
+    if (k==0) break;
+    pos += k; n -= k;
+  }
+  return 1;
+}
+
+/// Write 'n' bytes at 'pos' to the file 'fd'. As long as the document was
+/// not changed since it was loaded or saved, its file still holds the same
+/// bytes, and on Linux copy_file_range() lets the kernel copy them from
+/// there, or share the blocks on file systems that can, without the data
+/// passing through user memory. Anything the kernel can't copy is written
+/// from the buffer.
+char HeDocument::exportBytes(int fd, heIndex pos, heIndex n) {
+#ifdef __linux__
+  if (!changed_ && filename_ && mtime_) {
+    int in = ::_open(filename_, O_RDONLY, 0);
+    struct stat st;
+    if (in!=-1 && fstat(in, &st)==0 && st.st_size==(off_t)size_
+        && st.st_mtime==mtime_) {
+      loff_t off = pos;
+      while (n>0) {
+        ssize_t k = copy_file_range(in, &off, fd, 0, n, 0);
+        if (k<=0) break;
+        pos += (heIndex)k; n -= (heIndex)k;
+      }
+    }
+    if (in!=-1)
+      ::_close(in);
+  }
+#endif
+  return writeBytes(fd, pos, n);
+}
+
+/// Insert the contents of the file 'name' at 'pos', as one edit. The file
+/// is read straight into the gap, so it is never held in a second buffer,
+/// and the data is not locked while reading, because background jobs never
+/// look into the gap. Returns the number of bytes inserted.
+heIndex HeDocument::insertFile(heIndex pos, const char *name) {
+  if (!buffer_) return 0;
+  int in = ::_open(name, O_RDONLY, 0);
+  if (in==-1) {
+    fl_alert("Can't open file \n\"%s\"\nfor reading.\n%s.",
+             name, strerror(errno));
+    return 0;
+  }
+  struct stat st;
+  if (fstat(in, &st)==-1 || st.st_size==0) {
+    ::_close(in);
+    return 0;
+  }
+  if ((unsigned long long)st.st_size+size_+gapSize > (heIndex)-1 - 2) {
+    ::_close(in);
+    fl_alert("File \n\"%s\"\nis too large to be inserted.", name);
+    return 0;
+  }
+  heIndex n = (heIndex)st.st_size, done = 0;
+  if (pos>size_) pos = size_;
+  dataLock_.lock();
+  char ok = n<=gapSize || addToGap(n-gapSize);
+  if (ok) moveGapTo(pos);
+  dataLock_.unlock();
+  if (!ok) {
+    ::_close(in);
+    fl_alert("Not enough memory to insert %u bytes.", n);
+    return 0;
+  }
+  while (done<n) {
+    heIndex k = n-done<MM_IO_STEP ? n-done : MM_IO_STEP;
+    int r = (int)::_read(in, buffer_+gap+done, k);
+    if (r<=0) {
+      if (r<0)
+        fl_alert("Can't read contents of file \n\"%s\".\n%s.",
+                 name, strerror(errno));
+      break;
+    }
+    done += r;
+  }
+  ::_close(in);
+  if (done==0) return 0;
+  dataLock_.lock();
+  gap += done;
+  gapSize -= done;
+  size_ += done;
+  dataLock_.unlock();
+  if (!changed_) setChanged();
+  notify(pos, 0, done);
+  redraw();
+  return done;
+}
+
+/// read() for code that does not know about documents.
+size_t HeDocument::readCB(void *doc, size_t pos, unsigned char *dst, size_t n) {
+  return ((HeDocument*)doc)->read((heIndex)pos, dst, (heIndex)n);
+}
+
+/// Give direct access to the bytes [pos, pos+n) as up to two spans, one on
+/// either side of the gap, and return the number of spans. The document stays
+/// locked until unlockData() is called, so keep it short.
+int HeDocument::lockData(heIndex pos, heIndex n, HeDataSpan *span) {
+  int ns = 0;
+  dataLock_.lock();
+  if (pos>=size_ || !buffer_) return 0;
+  if (n>size_-pos) n = size_-pos;
+  if (pos<gap) {
+    heIndex n1 = gap-pos;
+    if (n1>n) n1 = n;
+    span[ns].data = buffer_+pos;
+    span[ns++].size = n1;
+    pos += n1; n -= n1;
+  }
+  if (n) {
+    span[ns].data = buffer_+gapSize+pos;
+    span[ns++].size = n;
+  }
+  return ns;
+}
+
+void HeDocument::unlockData() {
+  dataLock_.unlock();
+}
+
+void HeDocument::addListener(HeEditListener *l) {
+  if (nListeners_>=HE_MAX_LISTENERS) return;
+  listeners_[nListeners_++] = l;
+}
+
+void HeDocument::removeListener(HeEditListener *l) {
+  int i, j;
+  for (i=j=0; i<nListeners_; i++)
+    if (listeners_[i]!=l) listeners_[j++] = listeners_[i];
+  nListeners_ = j;
+}
+
+void HeDocument::notify(heIndex pos, heIndex nDel, heIndex nIns) {
+  for (int i=0; i<nListeners_; i++)
+    listeners_[i]->edited(pos, nDel, nIns);
+}
+
 void HeDocument::moveGapTo(heIndex pos) {
   if (gap==pos) return;
   if (gapSize) {
-    if (pos<gap) {
-      heIndex n = gap-pos;
+    HeScope scope(HE_ZONE_GAP);
+    heIndex n = pos<gap ? gap-pos : pos-gap;
+    if (pos<gap)
       memmove(buffer_+gap+gapSize-n, buffer_+pos, n);
-    } else {
-      heIndex n = pos-gap;
+    else
       memmove(buffer_+gap, buffer_+gap+gapSize, n);
-    }
+    heCount(HE_COUNT_MEMMOVE_BYTES, n);
+    heCount(HE_COUNT_MEMMOVES, 1);
+    scope.bytes(n);
   }
   gap = pos;
 }
 
-void HeDocument::addToGap(heIndex n) {
-  unsigned char *b2 = (unsigned char*)malloc(size_+gapSize+n);
-  memcpy(b2, buffer_, gap);
-  memcpy(b2+gap+gapSize+n, buffer_+gap+gapSize, size_-gap);
-  free(buffer_);
+/// Give the buffer room for 'capacity' bytes of data and gap. The bytes
+/// behind the gap move to the new end of the buffer. Two more bytes are
+/// always allocated, so that byteAt() may look at the end of the document.
+char HeDocument::resizeBuffer(heIndex capacity) {
+  heIndex oldCapacity = size_+gapSize, tail = size_-gap;
+  if (capacity<size_) return 0;
+  if (capacity<oldCapacity) {
+    memmove(buffer_+capacity-tail, buffer_+oldCapacity-tail, tail);
+    heCount(HE_COUNT_MEMMOVE_BYTES, tail);
+  }
+  unsigned char *b2 = heResizeMemory(buffer_, (size_t)oldCapacity+2,
+                                     (size_t)capacity+2, &mapped_);
+  if (!b2) {
+    // a smaller block can't fail, but put the tail back anyway
+    if (capacity<oldCapacity)
+      memmove(buffer_+oldCapacity-tail, buffer_+capacity-tail, tail);
+    return 0;
+  }
   buffer_ = b2;
-  gapSize += n;
+  if (capacity>oldCapacity) {
+    memmove(buffer_+capacity-tail, buffer_+oldCapacity-tail, tail);
+    heCount(HE_COUNT_MEMMOVE_BYTES, tail);
+  }
+  gapSize = capacity-size_;
+  return 1;
+}
+
+/// Make the gap at least 'n' bytes larger. The buffer grows by half its size
+/// or more, so that typing or pasting piece by piece copies the document
+/// only a few times.
+char HeDocument::addToGap(heIndex n) {
+  unsigned long long capacity = (unsigned long long)size_+gapSize;
+  unsigned long long need = capacity+n, grow = capacity+capacity/2+MM_GAP_MIN;
+  unsigned long long maxCapacity = (heIndex)-1 - 2;
+  if (need>maxCapacity) return 0;
+  if (grow>maxCapacity) grow = maxCapacity;
+  if (grow>need && resizeBuffer((heIndex)grow)) return 1;
+  return resizeBuffer((heIndex)need);
+}
+
+/// After deleting a large part of the document, give the memory of the gap
+/// back to the system, except for some room for the next inserts.
+void HeDocument::releaseGap() {
+  if (gapSize<=MM_GAP_KEEP || gapSize<=size_) return;
+  heIndex keep = size_/4;
+  if (keep<MM_GAP_KEEP) keep = MM_GAP_KEEP;
+  resizeBuffer(size_+keep);
 }
 
 void HeDocument::deleteBytes(heIndex first, heIndex n) {
-  if (first+n>size_)
-    n = size_-first;
-  moveGapTo(first);
-  gapSize+=n;
-  size_-=n;
+  replaceBytes(first, n, 0, 0);
+}
+
+/// Insert 'n' zero bytes.
+void HeDocument::insertBytes(heIndex first, heIndex n) {
+  replaceBytes(first, 0, 0, n);
+}
+
+void HeDocument::insertBytes(heIndex pos, const unsigned char *data, heIndex n) {
+  replaceBytes(pos, 0, data, n);
+}
+
+/// Replace 'nDel' bytes at 'pos' with 'nIns' bytes from 'data', or with
+/// zeros if 'data' is 0. The data is copied into the gap in one go, and
+/// listeners hear about it once. Bytes that are only overwritten are copied
+/// in place without moving the gap.
+void HeDocument::replaceBytes(heIndex pos, heIndex nDel,
+                              const unsigned char *data, heIndex nIns)
+{
+  if (!buffer_) return;
+  if (pos>size_) pos = size_;
+  if (nDel>size_-pos) nDel = size_-pos;
+  if (nDel==0 && nIns==0) return;
+  dataLock_.lock();
+  if (nDel==nIns) {
+    heIndex n1 = 0;
+    if (pos<gap) {
+      n1 = gap-pos;
+      if (n1>nIns) n1 = nIns;
+      if (data) memcpy(buffer_+pos, data, n1);
+      else memset(buffer_+pos, 0, n1);
+    }
+    if (n1<nIns) {
+      if (data) memcpy(buffer_+gapSize+pos+n1, data+n1, nIns-n1);
+      else memset(buffer_+gapSize+pos+n1, 0, nIns-n1);
+    }
+  } else {
+    if (nIns>gapSize+nDel && !addToGap(nIns-gapSize-nDel)) {
+      dataLock_.unlock();
+      fl_alert("Not enough memory to insert %u bytes.", nIns);
+      return;
+    }
+    moveGapTo(pos);
+    gapSize += nDel;
+    size_ -= nDel;
+    if (data) memcpy(buffer_+gap, data, nIns);
+    else memset(buffer_+gap, 0, nIns);
+    gap += nIns;
+    gapSize -= nIns;
+    size_ += nIns;
+    if (nDel>nIns) releaseGap();
+  }
+  dataLock_.unlock();
   if (!changed_) setChanged();
+  notify(pos, nDel, nIns);
   redraw();
 }
 
-void HeDocument::insertBytes(heIndex first, heIndex n) {
-  moveGapTo(first);
-  if (gapSize<n)
-    addToGap(n+16384);
-  gap+=n;
-  gapSize-=n;
-  size_+=n;
+/// Apply a bulk operation to 'n' bytes at 'pos' in place, as one edit.
+/// Large ranges are shared between the threads of the pool. A byte swap
+/// needs its elements in one piece, so if the gap splits one, the gap moves
+/// by a few bytes first.
+void HeDocument::transformBytes(heIndex pos, heIndex n, const HeTransform *t) {
+  if (!buffer_ || pos>=size_) return;
+  if (n>size_-pos) n = size_-pos;
+  if (n==0) return;
+  dataLock_.lock();
+  heIndex w = heTransformWidth(t->op), n1 = 0;
+  if (gap>pos && gap<pos+n && (gap-pos)%w)
+    moveGapTo(gap-(gap-pos)%w);
+  if (pos<gap) {
+    n1 = gap-pos;
+    if (n1>n) n1 = n;
+    heTransform(t, buffer_+pos, n1, 0, HeThreadPool::shared());
+  }
+  if (n1<n)
+    heTransform(t, buffer_+gapSize+pos+n1, n-n1, n1, HeThreadPool::shared());
+  dataLock_.unlock();
+  if (!changed_) setChanged();
+  notify(pos, n, n);
+  redraw();
+}
+
+/// Apply a bulk operation to the rows of a block in place, as one edit.
+/// The rows in front of the gap and behind it are two strided runs; a row
+/// that the gap splits is moved behind it first.
+void HeDocument::transformBlock(const HeBlock &b, const HeTransform *t) {
+  if (!buffer_ || !b.rows || !b.width) return;
+  heIndex n = (b.rows-1)*b.stride+b.width, k = 0;
+  if (b.first>=size_ || n>size_-b.first) return;
+  dataLock_.lock();
+  if (gap>b.first) {
+    k = (gap-b.first)/b.stride;
+    if (k>=b.rows) {
+      k = b.rows;
+    } else {
+      heIndex row = b.first+k*b.stride;
+      if (gap>=row+b.width) k++;
+      else moveGapTo(row);
+    }
+  }
+  if (k>0)
+    heTransformRows(t, buffer_+b.first, b.width, b.stride, k,
+                    HeThreadPool::shared());
+  if (k<b.rows)
+    heTransformRows(t, buffer_+gapSize+b.first+k*b.stride, b.width, b.stride,
+                    b.rows-k, HeThreadPool::shared());
+  dataLock_.unlock();
   if (!changed_) setChanged();
+  notify(b.first, n, n);
   redraw();
 }
 
@@ -760,47 +1525,400 @@ void HeDocument::clearChanged() {
   redraw();
 }
 
-//---- HeDocumentManager ---------------------------------------------------------
+//---- HeFileType --------------------------------------------------------------
 
-HeDocumentManager::HeDocumentManager(int x, int y, int w, int h, HeDocument *d)
-: Fl_Group(x, y, w, h)
-{
+// bytes per scanning job
+#define HE_TYPE_PIECE (1<<20)
+
+HeFileType::HeFileType(HeDocument *d) {
   doc = d;
-  cursor_ = 1;
-  selection_ = 1;
-  insertMode_ = 0;
-  int sbh = 3*fontHeight()+12;
-  status = new HeStatusBar(x+2, y+2, w-4, sbh, this);
-  column = new HeColumnGroup(x+2, y+sbh, w-4, h-sbh, this);
-  resizable(column);
-  end();
-  cursor(0);
+  type_ = -1;
+  hits_ = pieceHits_ = 0;
+  nHits_ = nPieces_ = 0;
+  nPieceHits_ = 0;
+  size_ = 0;
+  running_ = 0;
+  scheduled_ = polling_ = 0;
+  cancel_ = 0;
+  doc->addListener(this);
 }
 
-void HeDocumentManager::layout() {
-  column->layout();
+HeFileType::~HeFileType() {
+  if (scheduled_)
+    Fl::remove_timeout(restartCB, this);
+  if (polling_)
+    Fl::remove_timeout(pollCB, this);
+  cancelAndWait();
+  doc->removeListener(this);
+  if (hits_) free(hits_);
+  if (pieceHits_) free(pieceHits_);
+  if (nPieceHits_) free(nPieceHits_);
 }
 
-void HeDocumentManager::update() {
-  column->layout();
-  status->update();
-  redraw();
+void HeFileType::edited(heIndex, heIndex, heIndex) {
+  cancel_ = 1;
+  if (!scheduled_) {
+    scheduled_ = 1;
+    Fl::add_timeout(MM_MAP_DELAY, restartCB, this);
+  }
 }
 
-void HeDocumentManager::setFont() {
-  fl_font(FL_COURIER, MM_FIXED_SIZE);
+void HeFileType::restartCB(void *user_data) {
+  HeFileType *t = (HeFileType*)user_data;
+  t->scheduled_ = 0;
+  t->start();
 }
 
-int HeDocumentManager::fontHeight() {
-  return fixedFontHeight;
+/// The format is found right away, the first bytes are all it takes. The
+/// embedded files are left to the jobs.
+void HeFileType::start() {
+  HeMagic *magic = HeMagic::shared();
+  if (scheduled_) {
+    Fl::remove_timeout(restartCB, this);
+    scheduled_ = 0;
+  }
+  cancelAndWait();
+  size_ = doc->size();
+  unsigned char *head = (unsigned char*)malloc(magic->head());
+  heIndex n = doc->read(0, head, (heIndex)magic->head());
+  type_ = n ? magic->identify(head, n) : -1;
+  free(head);
+  nHits_ = 0;
+  nPieces_ = (int)(((unsigned long long)size_+HE_TYPE_PIECE-1)/HE_TYPE_PIECE);
+  if (nPieces_) {
+    pieceHits_ = (HeMagicHit*)realloc(pieceHits_,
+                   nPieces_*HE_TYPE_PIECE_HITS*sizeof(HeMagicHit));
+    nPieceHits_ = (int*)realloc(nPieceHits_, nPieces_*sizeof(int));
+    memset(nPieceHits_, 0, nPieces_*sizeof(int));
+    cancel_ = 0;
+    running_ = nPieces_;
+    HeThreadPool::shared()->post(pieceCB, this, nPieces_);
+    if (!polling_) {
+      polling_ = 1;
+      Fl::add_timeout(MM_MAP_POLL, pollCB, this);
+    }
+  }
+  doc->updateTooltip();
 }
 
-int HeDocumentManager::fontAscent() {
-  return fixedFontAscent;
+void HeFileType::cancelAndWait() {
+  mutex_.lock();
+  if (running_) {
+    cancel_ = 1;
+    while (running_)
+      idle_.wait(mutex_);
+  }
+  mutex_.unlock();
 }
 
-int HeDocumentManager::fontWidth() {
-  return fixedFontWidth;
+void HeFileType::pieceCB(void *user_data, int index) {
+  HeFileType *t = (HeFileType*)user_data;
+  HeMagic *magic = HeMagic::shared();
+  if (!t->cancel_) {
+    unsigned long long first = (unsigned long long)index*HE_TYPE_PIECE;
+    unsigned long long from = first>magic->margin() ? first-magic->margin() : 0;
+    size_t max = (size_t)(first-from)+HE_TYPE_PIECE+magic->reach();
+    unsigned char *buf = (unsigned char*)malloc(max);
+    heIndex n = t->doc->read((heIndex)from, buf, (heIndex)max);
+    t->nPieceHits_[index] = magic->scan(buf, n, (size_t)(first-from),
+                                        (size_t)(first-from)+HE_TYPE_PIECE,
+                                        from, t->pieceHits_+index*HE_TYPE_PIECE_HITS,
+                                        HE_TYPE_PIECE_HITS);
+    free(buf);
+  }
+  t->mutex_.lock();
+  t->running_--;
+  t->idle_.broadcast();
+  t->mutex_.unlock();
+}
+
+void HeFileType::pollCB(void *user_data) {
+  HeFileType *t = (HeFileType*)user_data;
+  if (t->running_>0) {
+    Fl::repeat_timeout(MM_MAP_POLL, pollCB, user_data);
+    return;
+  }
+  t->polling_ = 0;
+  if (!t->cancel_)
+    t->collect();
+  t->doc->updateTooltip();
+}
+
+/// Join the hits of all pieces in file order.
+void HeFileType::collect() {
+  int i, n = 0;
+  for (i=0; i<nPieces_; i++)
+    n += nPieceHits_[i];
+  if (n>HE_TYPE_MAX_HITS) n = HE_TYPE_MAX_HITS;
+  hits_ = (HeMagicHit*)realloc(hits_, (n ? n : 1)*sizeof(HeMagicHit));
+  nHits_ = 0;
+  for (i=0; i<nPieces_ && nHits_<n; i++) {
+    int k = nPieceHits_[i];
+    if (k>n-nHits_) k = n-nHits_;
+    memcpy(hits_+nHits_, pieceHits_+i*HE_TYPE_PIECE_HITS, k*sizeof(HeMagicHit));
+    nHits_ += k;
+  }
+}
+
+/// A few lines for the tooltip. Repeated hits of the same format, like the
+/// headers of all members of an archive, are listed once.
+int HeFileType::describe(char *dst, int n) {
+  int len = 0, listed = 0, more = 0, last = type_;
+  dst[0] = 0;
+  if (!size_) return 0;
+  len += snprintf(dst+len, n-len, "Type: %s",
+                  type_>=0 ? HeMagic::sig(type_)->name : "unknown");
+  for (int i=0; i<nHits_; i++) {
+    const HeMagicHit &h = hits_[i];
+    if (h.pos==0 || h.sig==last) continue;
+    last = h.sig;
+    if (listed==4 || len>=n-80) { more++; continue; }
+    len += snprintf(dst+len, n-len, "%s%s at 0x%llX",
+                    listed ? ", " : "\nContains: ",
+                    HeMagic::sig(h.sig)->name, h.pos);
+    listed++;
+  }
+  if (more && len<n-80)
+    len += snprintf(dst+len, n-len, " (+%d more)", more);
+  if (busy() && len<n-80)
+    len += snprintf(dst+len, n-len, "\nLooking for embedded files...");
+  return len;
+}
+
+//---- HeDocumentMarks -----------------------------------------------------------
+
+HeDocumentMarks::HeDocumentMarks(HeDocument *d) {
+  doc = d;
+  doc->addListener(this);
+}
+
+HeDocumentMarks::~HeDocumentMarks() {
+  doc->removeListener(this);
+}
+
+void HeDocumentMarks::edited(heIndex pos, heIndex nDel, heIndex nIns) {
+  tree_.edited(pos, nDel, nIns);
+}
+
+Fl_Color HeDocumentMarks::color(const HeMark &m) {
+  static const Fl_Color notes[] = {
+    fl_rgb_color(255, 240, 160), fl_rgb_color(200, 240, 190),
+    fl_rgb_color(240, 210, 250), fl_rgb_color(250, 215, 180)
+  };
+  if (m.flags & HE_MARK_BOOKMARK)
+    return fl_rgb_color(120, 210, 230);
+  return notes[m.id&3];
+}
+
+int HeDocumentMarks::spans(heIndex first, heIndex last, HeSpan *dst, int max) {
+  HeMark m[HE_MAX_SPANS];
+  int i, n = tree_.query(first, last, m, max<HE_MAX_SPANS ? max : HE_MAX_SPANS);
+  for (i=0; i<n; i++) {
+    dst[i].first = m[i].start>first ? (heIndex)m[i].start : first;
+    dst[i].last = m[i].end<last ? (heIndex)m[i].end : last;
+    dst[i].attr = (m[i].flags & HE_MARK_BOOKMARK) ? HE_BOOKMARK : HE_HIGHLIGHT;
+    dst[i].color = color(m[i]);
+  }
+  return n;
+}
+
+void HeDocumentMarks::toggleBookmark(heIndex pos) {
+  HeMark m[HE_MAX_SPANS];
+  int i, n = tree_.query(pos, pos+1, m, HE_MAX_SPANS);
+  for (i=0; i<n; i++) {
+    if ((m[i].flags & HE_MARK_BOOKMARK) && m[i].start==pos) {
+      tree_.remove(m[i]);
+      return;
+    }
+  }
+  tree_.add(pos, pos+1, HE_MARK_BOOKMARK, 0);
+}
+
+void HeDocumentMarks::annotate(heIndex first, heIndex last, const char *text) {
+  tree_.add(first, last, 0, text);
+}
+
+/// Remove all marks on the byte at 'pos'.
+void HeDocumentMarks::removeAt(heIndex pos) {
+  HeMark m[HE_MAX_SPANS];
+  int i, n = tree_.query(pos, pos+1, m, HE_MAX_SPANS);
+  for (i=0; i<n; i++)
+    tree_.remove(m[i]);
+}
+
+void HeDocumentMarks::sidecarName(const char *filename, char *dst, int n) {
+  snprintf(dst, n, "%s.notes", filename);
+}
+
+// first line of every sidecar file we write
+#define MM_MARKS_SIGNATURE "# mickey marks v1"
+
+/// A file of the same name may belong to the user. Returns 1 if 'f' starts
+/// with our signature, and leaves it at the second line.
+static char heIsSidecar(FILE *f) {
+  char line[64];
+  if (!fgets(line, sizeof(line), f)) return 0;
+  size_t n = strlen(MM_MARKS_SIGNATURE);
+  return strncmp(line, MM_MARKS_SIGNATURE, n)==0
+      && (line[n]=='\n' || line[n]=='\r' || line[n]==0);
+}
+
+/// Returns 1 if there is no file 'filename', or if it is one of ours.
+static char heMayWriteSidecar(const char *filename) {
+  FILE *f = fopen(filename, "rb");
+  if (!f) return errno==ENOENT;
+  char ours = heIsSidecar(f);
+  fclose(f);
+  return ours;
+}
+
+/// The sidecar file has one mark per line, ordered by position:
+///
+///   B 0x1234
+///   A 0x1000 0x1010 text of the annotation
+///
+/// A bookmark covers one byte, an annotation the bytes [start, end). Lines
+/// starting with '#' are ignored. The first line is MM_MARKS_SIGNATURE; a
+/// file without it is not ours and is ignored. A missing file is no error.
+char HeDocumentMarks::load(const char *filename) {
+  char line[4096];
+  int bad = 0;
+  tree_.clear();
+  FILE *f = fopen(filename, "rb");
+  if (!f) {
+    if (errno==ENOENT) return 1;
+    fl_alert("Can't open annotations \n\"%s\"\n%s.", filename, strerror(errno));
+    return 0;
+  }
+  if (!heIsSidecar(f)) {
+    fclose(f);
+    return 1;
+  }
+  while (fgets(line, sizeof(line), f)) {
+    unsigned long long a, b;
+    int n = 0;
+    char *p = line+strlen(line);
+    while (p>line && (p[-1]=='\n' || p[-1]=='\r')) *--p = 0;
+    if (line[0]=='#' || line[0]==0) continue;
+    if (line[0]=='B' && sscanf(line+1, "%llx", &a)==1 && a<doc->size())
+      tree_.add(a, a+1, HE_MARK_BOOKMARK, 0);
+    else if (line[0]=='A' && sscanf(line+1, "%llx %llx %n", &a, &b, &n)>=2
+             && n>0 && a<b && a<doc->size())
+      tree_.add(a, b<doc->size() ? b : doc->size(), 0, line+1+n);
+    else
+      bad++;
+  }
+  fclose(f);
+  if (bad)
+    fl_alert("%d lines of annotations \n\"%s\"\ncould not be read.", bad, filename);
+  return 1;
+}
+
+/// Write all marks, or remove the file if there are none left. A file of
+/// the same name that we did not write is left alone.
+char HeDocumentMarks::save(const char *filename) {
+  int i, n = tree_.count();
+  if (!heMayWriteSidecar(filename)) {
+    if (n==0) return 1;
+    fl_alert("Can't write annotations \n\"%s\"\n"
+             "A file of that name is in the way.", filename);
+    return 0;
+  }
+  if (n==0) {
+    ::remove(filename);
+    return 1;
+  }
+  FILE *f = fopen(filename, "wb");
+  if (!f) {
+    fl_alert("Can't write annotations \n\"%s\"\n%s.", filename, strerror(errno));
+    return 0;
+  }
+  HeMark *m = (HeMark*)malloc(n*sizeof(HeMark));
+  n = tree_.query(0, ~0ULL, m, n);
+  fprintf(f, MM_MARKS_SIGNATURE "\n# bookmarks and annotations of %s\n",
+          fl_filename_name(doc->filename()));
+  for (i=0; i<n; i++) {
+    if (m[i].flags & HE_MARK_BOOKMARK)
+      fprintf(f, "B 0x%08llX\n", m[i].start);
+    else
+      fprintf(f, "A 0x%08llX 0x%08llX %s\n", m[i].start, m[i].end,
+              m[i].text ? m[i].text : "");
+  }
+  free(m);
+  char ok = ferror(f)==0;
+  if (fclose(f)!=0) ok = 0;
+  if (!ok)
+    fl_alert("Can't write annotations \n\"%s\"\n%s.", filename, strerror(errno));
+  return ok;
+}
+
+//---- HeDocumentManager ---------------------------------------------------------
+
+HeDocumentManager::HeDocumentManager(int x, int y, int w, int h, HeDocument *d)
+: Fl_Group(x, y, w, h)
+{
+  doc = d;
+  cursor_ = 1;
+  selection_ = 1;
+  insertMode_ = 0;
+  block_ = 0;
+  blockStride_ = 1;
+  blockColumn_ = 0;
+  nLayers_ = 0;
+  stats_ = 0;
+  hash_ = 0;
+  struct_ = 0;
+  strings_ = 0;
+  script_ = 0;
+  plugins_ = new HeDocumentPlugins(this);
+  patch_ = new HePatchJob(this);
+  int sbh = 3*fontHeight()+12;
+  status = new HeStatusBar(x+2, y+2, w-4, sbh, this);
+  column = new HeColumnGroup(x+2, y+sbh, w-4, h-sbh, this);
+  resizable(column);
+  end();
+  cursor(0);
+}
+
+HeDocumentManager::~HeDocumentManager() {
+  if (stats_)
+    delete stats_;
+  if (hash_)
+    delete hash_;
+  if (struct_)
+    delete struct_;
+  if (strings_)
+    delete strings_;
+  if (script_)
+    delete script_;
+  delete plugins_;
+  delete patch_;
+}
+
+void HeDocumentManager::layout() {
+  column->layout();
+}
+
+void HeDocumentManager::update() {
+  column->layout();
+  status->update();
+  redraw();
+}
+
+void HeDocumentManager::setFont() {
+  fl_font(FL_COURIER, MM_FIXED_SIZE);
+}
+
+int HeDocumentManager::fontHeight() {
+  return fixedFontHeight;
+}
+
+int HeDocumentManager::fontAscent() {
+  return fixedFontAscent;
+}
+
+int HeDocumentManager::fontWidth() {
+  return fixedFontWidth;
 }
 
 int HeDocumentManager::spaceWidth() {
@@ -809,9 +1927,13 @@ int HeDocumentManager::spaceWidth() {
 
 int HeDocumentManager::attributeAt(heIndex ix) {
   int ret = 0;
+  HeBlock b;
   if (ix==cursor_)
     ret |= HE_CURSOR;
-  if (selection_>cursor_) {
+  if (block(&b)) {
+    if (ix>=b.first && (ix-b.first)/b.stride<b.rows
+        && (ix-b.first)%b.stride<b.width) ret |= HE_SELECTED;
+  } else if (selection_>cursor_) {
     if (ix>=cursor_ && ix<=selection_) ret |= HE_SELECTED;
   } else if (selection_<cursor_) {
     if (ix<=cursor_ && ix>=selection_) ret |= HE_SELECTED;
@@ -821,9 +1943,70 @@ int HeDocumentManager::attributeAt(heIndex ix) {
   return ret;
 }
 
+/// Collect the highlighted byte ranges within [first, last), typically one
+/// row of a column. Layer spans come first, then the selection and finally
+/// the cursor, so drawing them in order puts the cursor on top.
+int HeDocumentManager::rowSpans(heIndex first, heIndex last,
+                                HeSpan *dst, int max) {
+  int i, n = 0;
+  HeBlock bk;
+  for (i=0; i<nLayers_ && n<max; i++)
+    n += layers_[i]->spans(first, last, dst+n, max-n);
+  if (block(&bk)) {
+    // one run for each row of the block
+    heIndex r = first>bk.first ? (first-bk.first)/bk.stride : 0;
+    for (; r<bk.rows && n<max; r++) {
+      heIndex a = bk.first+r*bk.stride, b = a+bk.width;
+      if (a>=last) break;
+      if (a<first) a = first;
+      if (b>last) b = last;
+      if (a<b) {
+        dst[n].first = a; dst[n].last = b;
+        dst[n].attr = HE_SELECTED;
+        dst[n].color = fl_rgb_color(180, 200, 255);
+        n++;
+      }
+    }
+  } else if (selection_!=cursor_ && n<max) {
+    heIndex a = cursor_, b = selection_;
+    if (a>b) { a = selection_; b = cursor_; }
+    b++; // selections include both ends
+    if (a<first) a = first;
+    if (b>last) b = last;
+    if (a<b) {
+      dst[n].first = a; dst[n].last = b;
+      dst[n].attr = HE_SELECTED;
+      dst[n].color = fl_rgb_color(180, 200, 255);
+      n++;
+    }
+  }
+  if (cursor_>=first && cursor_<last && n<max) {
+    dst[n].first = cursor_; dst[n].last = cursor_+1;
+    dst[n].attr = HE_CURSOR;
+    dst[n].color = fl_rgb_color(255, 180, 180);
+    n++;
+  }
+  return n;
+}
+
+void HeDocumentManager::addLayer(HeHighlightLayer *layer) {
+  if (nLayers_>=HE_MAX_LAYERS) return;
+  layers_[nLayers_++] = layer;
+  redraw();
+}
+
+void HeDocumentManager::removeLayer(HeHighlightLayer *layer) {
+  int i, j;
+  for (i=j=0; i<nLayers_; i++)
+    if (layers_[i]!=layer) layers_[j++] = layers_[i];
+  nLayers_ = j;
+  redraw();
+}
+
 void HeDocumentManager::select(heIndex a, heIndex b, bool toggle) {
   //++ untested
   //++ toggle support missing
+  block_ = 0;
   selection_ = a;
   cursor(b, true);
   /*
@@ -860,7 +2043,69 @@ void HeDocumentManager::extendSelection(heIndex a, heIndex b) {
   */
 }
 
+/// In block mode, the selection is the rectangle that has the cursor and
+/// the other end of the selection in opposite corners, at the row width the
+/// view had when block mode started. Moving the cursor without extending
+/// the selection ends block mode.
+void HeDocumentManager::blockMode(char on) {
+  if (on && !block_)
+    blockStride_ = column->bytesPerRow();
+  blockColumn_ = 0;
+  if (block_!=on) {
+    block_ = on;
+    column->redraw();
+  }
+}
+
+/// The block that is selected, clipped to the rows that are all inside the
+/// document. Returns 0 if the selection is not a block.
+char HeDocumentManager::block(HeBlock *b) {
+  if (!block_ || selection_==cursor_) return 0;
+  heIndex s = blockStride_, a = cursor_, z = selection_;
+  if (a>z) { a = selection_; z = cursor_; }
+  heIndex c0 = a%s, c1 = z%s;
+  if (c0>c1) { heIndex t = c0; c0 = c1; c1 = t; }
+  b->stride = s;
+  b->first = a-a%s+c0;
+  b->width = c1-c0+1;
+  b->rows = z/s-a/s+1;
+  heIndex size = doc->size();
+  while (b->rows && (b->first>=size
+         || (b->rows-1)*s+b->width>size-b->first))
+    b->rows--;
+  return 1;
+}
+
+/// Typing into a block writes the same byte at the same column of every row,
+/// starting at the block's first column. The bits in 'keep' stay as they
+/// were, so the hex column can write one nibble at a time. 'advance' moves
+/// on to the next column, and back to the first one after the last.
+/// Returns 0 if the selection is not a block.
+char HeDocumentManager::typeInBlock(unsigned char value, unsigned char keep,
+                                    char advance)
+{
+  HeBlock bk;
+  if (!block(&bk)) return 0;
+  if (!bk.rows) return 1;
+  if (blockColumn_>=bk.width) blockColumn_ = 0;
+  heIndex first = bk.first+blockColumn_, n = (bk.rows-1)*bk.stride+1, r;
+  unsigned char *buf = (unsigned char*)malloc(n);
+  if (!buf) return 1;
+  doc->read(first, buf, n);
+  for (r=0; r<bk.rows; r++) {
+    unsigned char &b = buf[r*bk.stride];
+    b = (b&keep)|(value&~keep);
+  }
+  doc->replaceBytes(first, n, buf, n);
+  free(buf);
+  if (advance)
+    blockColumn_ = (blockColumn_+1)%bk.width;
+  return 1;
+}
+
 void HeDocumentManager::cursor(heIndex c, bool extend) {
+  if (!extend) block_ = 0;
+  blockColumn_ = 0;
   if (c==cursor_ && (c==selection_ || !extend))
     return;
   if (c>doc->size()) c = doc->size();
@@ -876,11 +2121,29 @@ void HeDocumentManager::cursor(heIndex c, bool extend) {
   cursor_ = c;
   if (!extend) selection_ = c;
   status->cursor(selection_, cursor_);
-  redraw();
+  if (stats_)
+    stats_->selectionChanged();
+  column->redraw();
 }
 
 void HeDocumentManager::deleteSelection() {
-  if (selection_>cursor_) {
+  HeBlock bk;
+  if (block(&bk)) {
+    // squeeze the columns out of a copy of the rows, and replace the rows
+    // with it in one edit
+    if (!bk.rows) return;
+    heIndex n = (bk.rows-1)*bk.stride+bk.width, k = 0;
+    unsigned char *buf = (unsigned char*)malloc(n);
+    doc->read(bk.first, buf, n);
+    for (heIndex r=0; r<bk.rows; r++) {
+      heIndex s = r*bk.stride+bk.width, e = r+1<bk.rows ? s-bk.width+bk.stride : n;
+      memmove(buf+k, buf+s, e-s);
+      k += e-s;
+    }
+    doc->replaceBytes(bk.first, n, buf, k);
+    free(buf);
+    cursor(bk.first);
+  } else if (selection_>cursor_) {
     doc->deleteBytes(cursor_, selection_-cursor_+1);
     cursor(cursor_);
   } else if (selection_<cursor_) {
@@ -889,19 +2152,38 @@ void HeDocumentManager::deleteSelection() {
   }
 }
 
+/// Typed text and pasted data replace the selection, or are inserted or
+/// written over the bytes at the cursor, as a single edit. Overwriting past
+/// the end of the document appends.
 void HeDocumentManager::insert(const char *text, heIndex len) {
-  bool ins = insertMode() || cursor_==doc->size();
-  if (selection_!=cursor_) {
-    deleteSelection();
-    ins = true;
+  heIndex pos = cursor_, nDel = 0;
+  HeBlock bk;
+  if (block(&bk)) {
+    // A block is written over in place: text that fits into a row goes
+    // into every row, anything longer fills the block row by row. Typed
+    // keys go through typeInBlock().
+    if (!bk.rows || !len) return;
+    heIndex n = (bk.rows-1)*bk.stride+bk.width, r, k = 0;
+    unsigned char *buf = (unsigned char*)malloc(n);
+    doc->read(bk.first, buf, n);
+    for (r=0; r<bk.rows && k<len; r++) {
+      heIndex m = len-k<bk.width ? len-k : bk.width;
+      memcpy(buf+r*bk.stride, text+k, m);
+      if (len>bk.width) k += m;
+    }
+    doc->replaceBytes(bk.first, n, buf, n);
+    free(buf);
+    return;
   }
-  heIndex dst = cursor_;
-  if (ins)
-    doc->insertBytes(dst, len);
-  for (heIndex i=0; i<len; i++) {
-    doc->byteAt(dst++, (unsigned char)text[i]);
+  if (selection_!=cursor_) {
+    pos = cursor_<selection_ ? cursor_ : selection_;
+    nDel = (cursor_<selection_ ? selection_-cursor_ : cursor_-selection_)+1;
+  } else if (!insertMode()) {
+    nDel = doc->size()-pos<len ? doc->size()-pos : len;
   }
-  cursor(dst);
+  doc->replaceBytes(pos, nDel, (const unsigned char*)text, len);
+  selection_ = cursor_;
+  cursor(pos+len);
 }
 
 void HeDocumentManager::cutToClipboard() {
@@ -910,7 +2192,16 @@ void HeDocumentManager::cutToClipboard() {
 }
 
 void HeDocumentManager::copyToClipboard() {
-  if (selection_>cursor_) {
+  HeBlock bk;
+  if (block(&bk)) {
+    // the rows of a block, one after the other
+    if (!bk.rows) return;
+    unsigned char *buf = (unsigned char*)malloc(bk.rows*bk.width);
+    for (heIndex r=0; r<bk.rows; r++)
+      doc->read(bk.first+r*bk.stride, buf+r*bk.width, bk.width);
+    Fl::copy((char*)buf, bk.rows*bk.width, 1);
+    free(buf);
+  } else if (selection_>cursor_) {
     int n = selection_-cursor_+1;
     char *src = (char*)doc->blockAt(cursor_, n);
     Fl::copy(src, n, 1);
@@ -927,7 +2218,8 @@ void HeDocumentManager::pasteFromClipboard() {
 
 bool HeDocumentManager::searchNext(const unsigned short *txt, int len) {
   //++ simple search
-  heIndex pos = selection_ + 1, size = doc->size();
+  HeScope scope(HE_ZONE_SEARCH);
+  heIndex start = selection_ + 1, pos = start, size = doc->size();
   int i;
   for (;pos<size;pos++) {
     for (i=0; i<len; i++) {
@@ -935,20 +2227,300 @@ bool HeDocumentManager::searchNext(const unsigned short *txt, int len) {
       if (txt[i]!=b) break; //++ handle modifier flags in txt
     }
     if (i==len) {
+      scope.bytes(pos-start);
       select(pos, pos+len-1, false);
       return true;
     }
   }
+  scope.bytes(pos>start ? pos-start : 0);
   //++ continue search at beginning of file
   return false;
 }
 
+void HeDocumentManager::showStatistics() {
+  if (!stats_)
+    stats_ = new HeStatsPanel(this);
+  stats_->show();
+  stats_->selectionChanged();
+}
+
+void HeDocumentManager::showHashPanel() {
+  if (!hash_) {
+    hash_ = new HeHashPanel(this);
+    hash_->start();
+  }
+  hash_->show();
+}
+
+void HeDocumentManager::showStructure() {
+  if (!struct_)
+    struct_ = new HeStructPanel(this);
+  struct_->show();
+  if (!struct_->loaded())
+    struct_->choose();
+}
+
+void HeDocumentManager::toggleBookmark() {
+  doc->marks()->toggleBookmark(cursor_);
+  doc->setChanged();
+  column->redraw();
+}
+
+void HeDocumentManager::nextMark() {
+  HeMark m;
+  if (doc->marks()->tree()->next(cursor_, &m))
+    cursor((heIndex)m.start);
+}
+
+void HeDocumentManager::previousMark() {
+  HeMark m;
+  if (doc->marks()->tree()->previous(cursor_, &m))
+    cursor((heIndex)m.start);
+}
+
+/// Annotate the selected bytes, or the byte at the cursor.
+void HeDocumentManager::annotateSelection() {
+  heIndex a = cursor_, b = selection_;
+  if (a>b) { a = selection_; b = cursor_; }
+  if (a>=doc->size()) return;
+  if (b>=doc->size()) b = doc->size()-1;
+  const char *text = fl_input("Annotation for 0x%X..0x%X:", "", a, b);
+  if (!text || !*text) return;
+  char *line = _strdup(text), *p;
+  // the sidecar file keeps one annotation per line
+  for (p=line; *p; p++)
+    if (*p=='\n' || *p=='\r') *p = ' ';
+  doc->marks()->annotate(a, b+1, line);
+  free(line);
+  doc->setChanged();
+  update();
+}
+
+void HeDocumentManager::removeMarks() {
+  doc->marks()->removeAt(cursor_);
+  doc->setChanged();
+  update();
+}
+
+/// Fill, XOR, add or subtract a pattern the user types in hex, invert, or
+/// swap the byte order of the selection, or of the byte at the cursor.
+void HeDocumentManager::transformSelection(int op) {
+  static const char *prompt[] = {
+    "Fill 0x%X..0x%X with the hex bytes:",
+    "XOR 0x%X..0x%X with the hex bytes:",
+    "Add the hex bytes to 0x%X..0x%X:",
+    "Subtract the hex bytes from 0x%X..0x%X:"
+  };
+  static char lastPattern[256] = "00";
+  heIndex a = cursor_, b = selection_;
+  if (a>b) { a = selection_; b = cursor_; }
+  if (a>=doc->size()) return;
+  if (b>=doc->size()) b = doc->size()-1;
+  unsigned char pattern[HE_XF_MAX_PATTERN];
+  int n = 0;
+  if (op<=HE_XF_SUB) {
+    const char *text = fl_input(prompt[op], lastPattern, a, b);
+    if (!text) return;
+    n = heParseHexBytes(text, pattern, HE_XF_MAX_PATTERN);
+    if (n<0) {
+      fl_alert("Please enter up to %d bytes in hex, like \"de ad be ef\".",
+               HE_XF_MAX_PATTERN);
+      return;
+    }
+    strncpy(lastPattern, text, sizeof(lastPattern)-1);
+  }
+  HeTransform t;
+  const char *err = heTransformInit(&t, op, pattern, n);
+  if (err) {
+    fl_alert("%s", err);
+    return;
+  }
+  HeBlock bk;
+  if (block(&bk))
+    doc->transformBlock(bk, &t);
+  else
+    doc->transformBytes(a, b-a+1, &t);
+  update();
+}
+
+/// Write the selected bytes to a file. The rows of a block selection are
+/// written one after the other.
+void HeDocumentManager::exportSelection() {
+  if (selection_==cursor_) {
+    fl_alert("Please select the bytes to export first.");
+    return;
+  }
+  heIndex a = cursor_, b = selection_;
+  if (a>b) { a = selection_; b = cursor_; }
+  if (b>=doc->size()) b = doc->size()-1;
+  const char *name = fl_file_chooser("Export Selection", 0, 0);
+  if (!name) return;
+  int out = _open(name, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+  if (out==-1) {
+    fl_alert("Can't open file \n\"%s\"\nfor writing.\n%s.",
+             name, strerror(errno));
+    return;
+  }
+  char ok = 1;
+  HeBlock bk;
+  if (block(&bk)) {
+    for (heIndex r=0; r<bk.rows && ok; r++)
+      ok = doc->writeBytes(out, bk.first+r*bk.stride, bk.width);
+  } else if (a<=b) {
+    ok = doc->exportBytes(out, a, b-a+1);
+  }
+  if (!ok)
+    fl_alert("Can't write selection to file \n\"%s\".\n%s.",
+             name, strerror(errno));
+  ::_close(out);
+}
+
+/// Insert a file at the cursor and select it.
+void HeDocumentManager::insertFile() {
+  const char *name = fl_file_chooser("Insert File", 0, 0);
+  if (!name) return;
+  heIndex pos = cursor_ < doc->size() ? cursor_ : doc->size();
+  heIndex n = doc->insertFile(pos, name);
+  if (n)
+    select(pos, pos+n-1, false);
+}
+
+/// Convert the selection to a text format. The text is written to 'f' one
+/// piece at a time, or collected in 'out' if 'f' is 0. The data is locked
+/// only while a piece is formatted. The rows of a block follow each other
+/// as if they were one run of bytes.
+char HeDocumentManager::encodeSelection(int format, FILE *f, HeText *out) {
+  heIndex a = cursor_, b = selection_;
+  if (a>b) { a = selection_; b = cursor_; }
+  if (b>=doc->size()) b = doc->size()-1;
+  HeBlock bk;
+  if (!block(&bk)) {
+    bk.first = a;
+    bk.width = bk.stride = a<=b ? b-a+1 : 0;
+    bk.rows = 1;
+  }
+  const char *name = doc->filename() ? fl_filename_name(doc->filename()) : 0;
+  HeEncoder enc(format, bk.first, (unsigned long long)bk.rows*bk.width, name);
+  for (heIndex r=0; r<bk.rows; r++) {
+    heIndex pos = bk.first+r*bk.stride, n = bk.width;
+    while (n>0) {
+      HeDataSpan span[2];
+      heIndex k = n<MM_IO_STEP ? n : MM_IO_STEP;
+      int i, ns = doc->lockData(pos, k, span);
+      for (i=0; i<ns; i++)
+        enc.add(span[i].data, span[i].size, out);
+      doc->unlockData();
+      if (ns==0) break;
+      if (f) {
+        if (fwrite(out->text, 1, out->n, f)!=out->n) return 0;
+        out->n = 0;
+      }
+      pos += k; n -= k;
+    }
+  }
+  enc.finish(out);
+  if (f) {
+    if (fwrite(out->text, 1, out->n, f)!=out->n) return 0;
+    out->n = 0;
+  }
+  return 1;
+}
+
+void HeDocumentManager::copyAs(int format) {
+  if (selection_==cursor_) {
+    fl_alert("Please select the bytes to copy first.");
+    return;
+  }
+  HeText text;
+  memset(&text, 0, sizeof(text));
+  encodeSelection(format, 0, &text);
+  Fl::copy(text.text, (int)text.n, 1);
+  text.clear();
+}
+
+void HeDocumentManager::exportAs(int format) {
+  if (selection_==cursor_) {
+    fl_alert("Please select the bytes to export first.");
+    return;
+  }
+  const char *name = fl_file_chooser("Export Selection As", 0, 0);
+  if (!name) return;
+  FILE *f = fopen(name, "wb");
+  if (!f) {
+    fl_alert("Can't open file \n\"%s\"\nfor writing.\n%s.",
+             name, strerror(errno));
+    return;
+  }
+  HeText text;
+  memset(&text, 0, sizeof(text));
+  char ok = encodeSelection(format, f, &text);
+  if (fclose(f)!=0) ok = 0;
+  if (!ok)
+    fl_alert("Can't write selection to file \n\"%s\".\n%s.",
+             name, strerror(errno));
+  text.clear();
+}
+
+/// Decode a file in one of the text formats and insert the bytes at the
+/// cursor. Addresses in the file count from the first one, and holes
+/// between records are filled with zeros.
+void HeDocumentManager::importAs(int format) {
+  const char *name = fl_file_chooser("Import", 0, 0);
+  if (!name) return;
+  FILE *f = fopen(name, "rb");
+  if (!f) {
+    fl_alert("Can't open file \n\"%s\"\nfor reading.\n%s.",
+             name, strerror(errno));
+    return;
+  }
+  HeBytes bytes;
+  memset(&bytes, 0, sizeof(bytes));
+  HeDecoder dec(format, &bytes);
+  char *buf = (char*)malloc(1<<20);
+  const char *err = 0;
+  size_t n;
+  while (!err && (n = fread(buf, 1, 1<<20, f))>0)
+    err = dec.add(buf, n);
+  if (!err && ferror(f)) err = strerror(errno);
+  if (!err) err = dec.finish();
+  fclose(f);
+  free(buf);
+  if (err) {
+    fl_alert("Can't import file \n\"%s\".\n%s", name, err);
+  } else if ((unsigned long long)bytes.n+doc->size() > (heIndex)-1 - 2) {
+    fl_alert("File \n\"%s\"\nis too large to be inserted.", name);
+  } else if (bytes.n) {
+    heIndex pos = cursor_ < doc->size() ? cursor_ : doc->size();
+    doc->insertBytes(pos, bytes.data, (heIndex)bytes.n);
+    select(pos, pos+(heIndex)bytes.n-1, false);
+  }
+  bytes.clear();
+}
+
+void HeDocumentManager::showStrings() {
+  if (!strings_)
+    strings_ = new HeStringsPanel(this);
+  strings_->show();
+}
+
+void HeDocumentManager::showScript() {
+  if (!script_)
+    script_ = new HeScriptPanel(this);
+  script_->show();
+}
+
+char HeDocumentManager::scriptRunning() {
+  return script_ && script_->running();
+}
+
 //---- HeStatusBar -------------------------------------------------------------
 
 HeStatusBar::HeStatusBar(int x, int y, int w, int h, HeDocumentManager *m)
 : Fl_Group(x, y, w, h)
 {
   byteOrder_ = 0;
+  cursor_ = selection_ = 0;
+  pending_ = 0;
   manager = m;
   doc = manager->document();
   int fw = m->fontWidth(), fh = m->fontHeight();
@@ -962,7 +2534,7 @@ HeStatusBar::HeStatusBar(int x, int y, int w, int h, HeDocumentManager *m)
   offs = new HeInput(slct->x()+wlb+w10, y+2, w10, fh, "offset:", 16, 10);
   //-- second line: integer data
   dtab = new HeCycleButton(x+2, y+fh+3, 27, fh+1,
-                           4, "hex", "bin", "oct", "dec");
+                           5, "hex", "bin", "oct", "dec", "sgn");
   dtab->callback(cycleDataBaseCB, this);
   int gx = x+30, gy = y+fh+4, gw = w-61;
   hexGrp = new Fl_Group(gx, gy, gw, fh);
@@ -970,8 +2542,9 @@ HeStatusBar::HeStatusBar(int x, int y, int w, int h, HeDocumentManager *m)
     d1x = new HeInput(gx+wlb, gy, 2*fw+ow, fh, "data 1:", 16, 2);
     d2x = new HeInput(d1x->x()+d1x->w()+wsb, gy, 4*fw+ow, fh, "2:", 16, 4);
     d4x = new HeInput(d2x->x()+d2x->w()+wsb, gy, 8*fw+ow, fh, "4:", 16, 8);
+    d8x = new HeInput(d4x->x()+d4x->w()+wsb, gy, 16*fw+ow, fh, "8:", 16, 16);
   }
-  end();
+  hexGrp->end();
   binGrp = new Fl_Group(gx, gy, gw, fh);
   {
     d1b = new HeInput(gx+wlb, gy, 8*fw+ow, fh, "data 1:", 2, 8);
@@ -995,13 +2568,55 @@ HeStatusBar::HeStatusBar(int x, int y, int w, int h, HeDocumentManager *m)
   }
   decGrp->end();
   decGrp->hide();
-  //-- third line: text and fp data
-  // char, utf8, unicode, float, double
+  sdcGrp = new Fl_Group(gx, gy, gw, fh);
+  {
+    d1s = new HeInput(gx+wlb, gy, 4*fw+ow, fh, "data 1:", -10);
+    d2s = new HeInput(d1s->x()+d1s->w()+wsb, gy, 6*fw+ow, fh, "2:", -10);
+    d4s = new HeInput(d2s->x()+d2s->w()+wsb, gy, 11*fw+ow, fh, "4:", -10);
+  }
+  sdcGrp->end();
+  sdcGrp->hide();
+  //-- third line: text, floating point, 64 bit, variable length and time
+  dinb = new HeCycleButton(x+2, y+2*fh+5, 27, fh+1,
+                           5, "txt", "flt", "i64", "leb", "time");
+  dinb->callback(cycleInspectorCB, this);
   gy =  y+2*fh+6;
-  d1c = new HeInput(gx+wlb, gy, 3*fw+ow, fh, "char:", 0);
-  //++ half float: d2f = new HeInput(x+wlb+30, y+fh*2+6, fw+ow, fh, "text: c");
-  d4f = new HeInput(d1c->x()+d1c->w()+wlb, gy, 13*fw+ow, fh, "float:", 100);
-  d8f = new HeInput(d4f->x()+d4f->w()+wlb, gy, 13*fw+ow, fh, "double:", 101);
+  txtGrp = new Fl_Group(gx, gy, gw, fh);
+  {
+    d1c = new HeInput(gx+wlb, gy, 3*fw+ow, fh, "char:", 0);
+    u8c = new HeInput(d1c->x()+d1c->w()+wlb, gy, 10*fw+ow, fh, "utf-8:", 0);
+    u16c = new HeInput(u8c->x()+u8c->w()+wlb, gy, 10*fw+ow, fh, "utf-16:", 0);
+  }
+  txtGrp->end();
+  fltGrp = new Fl_Group(gx, gy, gw, fh);
+  {
+    d2f = new HeInput(gx+wlb, gy, 9*fw+ow, fh, "half:", 100);
+    d4f = new HeInput(d2f->x()+d2f->w()+wlb, gy, 13*fw+ow, fh, "float:", 100);
+    d8f = new HeInput(d4f->x()+d4f->w()+wlb, gy, 13*fw+ow, fh, "double:", 101);
+  }
+  fltGrp->end();
+  fltGrp->hide();
+  i64Grp = new Fl_Group(gx, gy, gw, fh);
+  {
+    d8u = new HeInput(gx+wsb+10, gy, 20*fw+ow, fh, "u64:", 10);
+    d8s = new HeInput(d8u->x()+d8u->w()+wsb+10, gy, 20*fw+ow, fh, "s64:", -10);
+  }
+  i64Grp->end();
+  i64Grp->hide();
+  lebGrp = new Fl_Group(gx, gy, gw, fh);
+  {
+    vlu = new HeInput(gx+wlb, gy, 20*fw+ow, fh, "uleb:", 0);
+    vls = new HeInput(vlu->x()+vlu->w()+wlb, gy, 20*fw+ow, fh, "sleb:", 0);
+  }
+  lebGrp->end();
+  lebGrp->hide();
+  timGrp = new Fl_Group(gx, gy, gw, fh);
+  {
+    tm4 = new HeInput(gx+wlb, gy, 19*fw+ow, fh, "unix:", 0);
+    tm8 = new HeInput(tm4->x()+tm4->w()+wlb, gy, 19*fw+ow, fh, "ftime:", 0);
+  }
+  timGrp->end();
+  timGrp->hide();
 
   // flags: (RO,R/W) (INS/OVR) (LSB/MSB)
   blsb = new HeCycleButton(x+w-30, y+1, 27, fh+1, 2, "LSB", "MSB");
@@ -1021,7 +2636,31 @@ HeStatusBar::HeStatusBar(int x, int y, int w, int h, HeDocumentManager *m)
   resizable(rw);
 }
 
+HeStatusBar::~HeStatusBar() {
+  if (pending_)
+    Fl::remove_timeout(cursorTimeoutCB, this);
+}
+
+/// Cursor changes arrive for every key repeat. Remember the latest position
+/// and refresh the fields at most once per MM_STATUS_DELAY, so that
+/// formatting the status bar never makes keyboard input lag behind.
 void HeStatusBar::cursor(heIndex a, heIndex b) {
+  selection_ = a;
+  cursor_ = b;
+  if (!pending_) {
+    pending_ = 1;
+    Fl::add_timeout(MM_STATUS_DELAY, cursorTimeoutCB, this);
+  }
+}
+
+void HeStatusBar::cursorTimeoutCB(void *user_data) {
+  HeStatusBar *sb = (HeStatusBar*)user_data;
+  sb->pending_ = 0;
+  sb->updateCursor();
+}
+
+void HeStatusBar::updateCursor() {
+  heIndex a = selection_, b = cursor_;
   crsr->value(b);
   slct->value(a);
   if (a>b) offs->value(a-b);
@@ -1029,54 +2668,179 @@ void HeStatusBar::cursor(heIndex a, heIndex b) {
   updateData();
 }
 
+// Helpers for decoding the bytes under the cursor in the status bar
+
+/// Assemble an 'n' byte unsigned integer in LSB (msb==0) or MSB order.
+static unsigned long long heUnpack(const unsigned char *u, int n, int msb) {
+  unsigned long long v = 0;
+  for (int i=0; i<n; i++)
+    v |= (unsigned long long)u[msb ? n-1-i : i] << (8*i);
+  return v;
+}
+
+static unsigned long long heSignExtend(unsigned long long v, int n) {
+  int sh = 64-8*n;
+  return (unsigned long long)(((long long)(v<<sh))>>sh);
+}
+
+static double heHalfToDouble(unsigned int h) {
+  int e = (h>>10)&31, m = h&1023;
+  double f;
+  if (e==0) f = ldexp((double)m, -24);
+  else if (e==31) f = m ? HUGE_VAL-HUGE_VAL : HUGE_VAL;
+  else f = ldexp((double)(m+1024), e-25);
+  return (h&0x8000) ? -f : f;
+}
+
+static int heUtf8Encode(unsigned int c, char *dst) {
+  if (c<0x80) { dst[0] = c; return 1; }
+  if (c<0x800) {
+    dst[0] = 0xc0|(c>>6); dst[1] = 0x80|(c&0x3f); return 2;
+  }
+  if (c<0x10000) {
+    dst[0] = 0xe0|(c>>12); dst[1] = 0x80|((c>>6)&0x3f);
+    dst[2] = 0x80|(c&0x3f); return 3;
+  }
+  dst[0] = 0xf0|(c>>18); dst[1] = 0x80|((c>>12)&0x3f);
+  dst[2] = 0x80|((c>>6)&0x3f); dst[3] = 0x80|(c&0x3f); return 4;
+}
+
+/// Decode one UTF-8 sequence, return its length or 0 if it is invalid.
+static int heUtf8Decode(const unsigned char *u, int n, unsigned int &c) {
+  int i, len;
+  if (u[0]<0x80) { c = u[0]; return 1; }
+  else if ((u[0]&0xe0)==0xc0) { c = u[0]&0x1f; len = 2; }
+  else if ((u[0]&0xf0)==0xe0) { c = u[0]&0x0f; len = 3; }
+  else if ((u[0]&0xf8)==0xf0) { c = u[0]&0x07; len = 4; }
+  else return 0;
+  if (len>n) return 0;
+  for (i=1; i<len; i++) {
+    if ((u[i]&0xc0)!=0x80) return 0;
+    c = (c<<6)|(u[i]&0x3f);
+  }
+  static const unsigned int minimum[] = { 0, 0, 0x80, 0x800, 0x10000 };
+  if (c<minimum[len] || c>0x10ffff || (c>=0xd800 && c<0xe000)) return 0;
+  return len;
+}
+
+/// Decode one UTF-16 character, return its length in bytes or 0.
+static int heUtf16Decode(const unsigned char *u, int msb, unsigned int &c) {
+  unsigned int w1 = heUnpack(u, 2, msb), w2 = heUnpack(u+2, 2, msb);
+  if (w1<0xd800 || w1>=0xe000) { c = w1; return 2; }
+  if (w1>=0xdc00 || w2<0xdc00 || w2>=0xe000) return 0;
+  c = 0x10000+((w1-0xd800)<<10)+(w2-0xdc00);
+  return 4;
+}
+
+static void heFormatChar(char *buf, int len, unsigned int c) {
+  if (!len) { strcpy(buf, "invalid"); return; }
+  int n = sprintf(buf, "U+%04X", c);
+  if (c>=32 && c!=127 && (c<0x80 || c>=0xa0)) {
+    buf[n++] = ' ';
+    n += heUtf8Encode(c, buf+n);
+  }
+  buf[n] = 0;
+}
+
+/// Decode an unsigned or signed LEB128 number, return its length or 0.
+static int heLeb128(const unsigned char *u, int n, int sgn,
+                    unsigned long long &v) {
+  int i, shift = 0;
+  v = 0;
+  for (i=0; i<n && i<10; i++) {
+    v |= (unsigned long long)(u[i]&0x7f)<<shift;
+    shift += 7;
+    if (!(u[i]&0x80)) {
+      if (sgn && shift<64 && (u[i]&0x40))
+        v |= ~0ULL<<shift;
+      return i+1;
+    }
+  }
+  return 0;
+}
+
+/// Write seconds since 1970 as a UTC date and time.
+static void heFormatTime(char *buf, long long t) {
+  long long z = t/86400, s = t%86400;
+  if (s<0) { s += 86400; z--; }
+  // convert days to a civil date in the proleptic Gregorian calendar
+  z += 719468;
+  long long era = (z>=0 ? z : z-146096)/146097;
+  long long doe = z-era*146097;
+  long long yoe = (doe-doe/1460+doe/36524-doe/146096)/365;
+  long long doy = doe-(365*yoe+yoe/4-yoe/100);
+  long long mp = (5*doy+2)/153;
+  int d = (int)(doy-(153*mp+2)/5+1), m = (int)(mp<10 ? mp+3 : mp-9);
+  long long y = yoe+era*400+(m<=2);
+  if (y<0 || y>9999) { strcpy(buf, "out of range"); return; }
+  sprintf(buf, "%04d-%02d-%02d %02d:%02d:%02d", (int)y, m, d,
+          (int)(s/3600), (int)(s/60%60), (int)(s%60));
+}
+
+/// Decode the 16 bytes at the cursor. All values come from a single read of
+/// the document; only the fields in visible groups are formatted.
 void HeStatusBar::updateData() {
-  heIndex ix = manager->cursor();
-  //++ fill these more elegant using a 'union'
-  int i;
-  union { unsigned char u[8]; float f; double d; } ff;
-  for (i=0; i<8; i++) ff.u[i] = doc->byteAt(ix+i);
-  heIndex v0 = doc->byteAt(ix);
-  heIndex v1 = doc->byteAt(ix+1);
-  heIndex v2 = doc->byteAt(ix+2);
-  heIndex v3 = doc->byteAt(ix+3);
+  unsigned char u[16];
+  char buf[80];
+  int msb = byteOrder_;
+  heIndex n = doc->read(manager->cursor(), u, 16);
+  if (n<16) memset(u+n, 0, 16-n);
+  unsigned long long v1 = u[0], v2 = heUnpack(u, 2, msb);
+  unsigned long long v4 = heUnpack(u, 4, msb), v8 = heUnpack(u, 8, msb);
   if (hexGrp->visible()) {
-    d1x->value(v0);
-    if (byteOrder_) {
-      d2x->value(v1+(v0<<8));
-      d4x->value(v3+(v2<<8)+(v1<<16)+(v0<<24));
-    } else {
-      d2x->value(v0+(v1<<8));
-      d4x->value(v0+(v1<<8)+(v2<<16)+(v3<<24));
-    }
+    d1x->value64(v1);
+    d2x->value64(v2);
+    d4x->value64(v4);
+    d8x->value64(v8);
   } else if (binGrp->visible()) {
-    d1b->value(v0);
-    if (byteOrder_) {
-      d2b->value(v1+(v0<<8));
-    } else {
-      d2b->value(v0+(v1<<8));
-    }
+    d1b->value64(v1);
+    d2b->value64(v2);
   } else if (octGrp->visible()) {
-    d1o->value(v0);
-    if (byteOrder_) {
-      d2o->value(v1+(v0<<8));
-      d4o->value(v3+(v2<<8)+(v1<<16)+(v0<<24));
-    } else {
-      d2o->value(v0+(v1<<8));
-      d4o->value(v0+(v1<<8)+(v2<<16)+(v3<<24));
-    }
+    d1o->value64(v1);
+    d2o->value64(v2);
+    d4o->value64(v4);
   } else if (decGrp->visible()) {
-    d1d->value(v0);
-    if (byteOrder_) {
-      d2d->value(v1+(v0<<8));
-      d4d->value(v3+(v2<<8)+(v1<<16)+(v0<<24));
-    } else {
-      d2d->value(v0+(v1<<8));
-      d4d->value(v0+(v1<<8)+(v2<<16)+(v3<<24));
-    }
+    d1d->value64(v1);
+    d2d->value64(v2);
+    d4d->value64(v4);
+  } else if (sdcGrp->visible()) {
+    d1s->value64(heSignExtend(v1, 1));
+    d2s->value64(heSignExtend(v2, 2));
+    d4s->value64(heSignExtend(v4, 4));
+  }
+  if (txtGrp->visible()) {
+    unsigned int c = 0;
+    d1c->value64(v1);
+    heFormatChar(buf, heUtf8Decode(u, n, c), c);
+    u8c->value(buf);
+    heFormatChar(buf, heUtf16Decode(u, msb, c), c);
+    u16c->value(buf);
+  } else if (fltGrp->visible()) {
+    union { unsigned int i; float f; } f4;
+    union { unsigned long long i; double d; } f8;
+    f4.i = (unsigned int)v4;
+    f8.i = v8;
+    d2f->value(heHalfToDouble((unsigned int)v2));
+    d4f->value(f4.f);
+    d8f->value(f8.d);
+  } else if (i64Grp->visible()) {
+    d8u->value64(v8);
+    d8s->value64(v8);
+  } else if (lebGrp->visible()) {
+    unsigned long long v;
+    if (heLeb128(u, n, 0, v)) sprintf(buf, "%llu", v);
+    else strcpy(buf, "invalid");
+    vlu->value(buf);
+    if (heLeb128(u, n, 1, v)) sprintf(buf, "%lld", (long long)v);
+    else strcpy(buf, "invalid");
+    vls->value(buf);
+  } else if (timGrp->visible()) {
+    heFormatTime(buf, (long long)heSignExtend(v4, 4));
+    tm4->value(buf);
+    // FILETIME counts 100ns intervals since 1601
+    heFormatTime(buf, (long long)(v8/10000000)-11644473600LL);
+    tm8->value(buf);
   }
-  d1c->value(v0);
-  d4f->value(ff.f);
-  d8f->value(ff.d);
 }
 
 void HeStatusBar::updateFlags() {
@@ -1097,18 +2861,32 @@ void HeStatusBar::cycleDataBaseCB(Fl_Widget*, void *user_data) {
   HeStatusBar *sb = (HeStatusBar*)user_data;
   sb->dtab->incr();
   switch (sb->dtab->value()) {
-    case 0: sb->decGrp->hide(); sb->hexGrp->show(); break;
+    case 0: sb->sdcGrp->hide(); sb->hexGrp->show(); break;
     case 1: sb->hexGrp->hide(); sb->binGrp->show(); break;
     case 2: sb->binGrp->hide(); sb->octGrp->show(); break;
     case 3: sb->octGrp->hide(); sb->decGrp->show(); break;
+    case 4: sb->decGrp->hide(); sb->sdcGrp->show(); break;
   }
   sb->updateData();
 }
 
-void HeStatusBar::lsbMsbModeCB(Fl_Widget*, void *user_data) {
+void HeStatusBar::cycleInspectorCB(Fl_Widget*, void *user_data) {
   HeStatusBar *sb = (HeStatusBar*)user_data;
-  sb->blsb->incr();
-  sb->byteOrder(sb->blsb->value());
+  sb->dinb->incr();
+  switch (sb->dinb->value()) {
+    case 0: sb->timGrp->hide(); sb->txtGrp->show(); break;
+    case 1: sb->txtGrp->hide(); sb->fltGrp->show(); break;
+    case 2: sb->fltGrp->hide(); sb->i64Grp->show(); break;
+    case 3: sb->i64Grp->hide(); sb->lebGrp->show(); break;
+    case 4: sb->lebGrp->hide(); sb->timGrp->show(); break;
+  }
+  sb->updateData();
+}
+
+void HeStatusBar::lsbMsbModeCB(Fl_Widget*, void *user_data) {
+  HeStatusBar *sb = (HeStatusBar*)user_data;
+  sb->blsb->incr();
+  sb->byteOrder(sb->blsb->value());
 }
 
 void HeStatusBar::readOnlyModeCB(Fl_Widget*, void *user_data) {
@@ -1132,13 +2910,27 @@ HeColumnGroup::HeColumnGroup(int x, int y, int w, int h, HeDocumentManager *m)
   doc = m->document();
   mgr = m;
   scroll = 0;
+  linked_ = 0;
+  linkMap_ = 0;
+  syncing_ = 0;
+  marks_ = 0;
   bytesPerRow_ = 8;
   rows_ = 20;
   rowsPerPage_ = 10;
   topByte_ = 0;
+  backBuffer_ = shiftBuffer_ = 0;
+  backW_ = backH_ = 0;
+  backTopRow_ = 0;
   createStandardColumns();
 }
 
+HeColumnGroup::~HeColumnGroup() {
+  if (backBuffer_)
+    fl_delete_offscreen(backBuffer_);
+  if (shiftBuffer_)
+    fl_delete_offscreen(shiftBuffer_);
+}
+
 
 void HeColumnGroup::createStandardColumns() {
   begin();
@@ -1147,6 +2939,13 @@ void HeColumnGroup::createStandardColumns() {
   new HeHexColumn(x()+100, y(), 195, h(), mgr);
   new HeSeperatorColumn(x()+295, y(), 5, h(), mgr);
   new HeTextColumn(x()+300, y(), 160, h(), mgr);
+  HePluginList *plugins = HePluginList::shared();
+  for (int i=0; i<plugins->columns(); i++) {
+    new HeSeperatorColumn(x()+460, y(), 5, h(), mgr);
+    new HePluginColumn(x()+465, y(), 0, h(), mgr, plugins->column(i));
+  }
+  new HeNoteColumn(x()+460, y(), 0, h(), mgr);
+  new HeOverviewColumn(x()+w()-32, y(), 18, h(), mgr);
   scroll = new HeScrollbarColumn(x()+w()-14, y(), 14, h(), mgr);
   end();
   resize(x(), y(), w(), h());
@@ -1167,13 +2966,20 @@ void HeColumnGroup::resize(int wx, int wy, int ww, int wh) {
   rowsPerPage_ = wh / mgr->fontHeight();
   topByte(topByte_);
   Fl_Widget::resize(wx, wy, ww, wh);
+  // columns that do not scroll with the rows are aligned to the right
+  int right = children(), wright = 0;
+  while (right>0 && !((HeColumn*)child(right-1))->rowAligned()) {
+    wfixed = wflex = 0;
+    ((HeColumn*)child(--right))->getWidth(wfixed, wflex);
+    wright += wfixed+bytesPerRow_*wflex;
+  }
   for (i=0; i<children(); i++) {
     wfixed = wflex = 0;
     HeColumn *ci = (HeColumn*)child(i);
     ci->getWidth(wfixed, wflex);
     int wdt = wfixed+bytesPerRow_*wflex;
-    if (i==children()-1)
-      wx = w()-wdt;
+    if (i==right)
+      wx = x()+w()-wright;
     ci->resize(wx, wy, wdt, wh);
     wx += wdt;
     ci->layout();
@@ -1184,19 +2990,216 @@ void HeColumnGroup::topByte(heIndex v) {
   topByte_ = v;
   topLeftByte_ = v - (v % bytesPerRow());
   scroll->value(topRow());
-  redraw();
+  scrolled();
 }
 
 void HeColumnGroup::topRow(heIndex v) {
   topLeftByte_ = topByte_ = v*bytesPerRow();
   scroll->value(topRow());
-  redraw();
+  scrolled();
+}
+
+void HeColumnGroup::scrollRows(int n) {
+  heIndex r = topRow(), last = 0;
+  if (rows_>rowsPerPage_)
+    last = rows_-rowsPerPage_;
+  if (n<0 && (heIndex)-n>r) r = 0;
+  else r += n;
+  if (r>last) r = last;
+  if (r!=topRow())
+    topRow(r);
+}
+
+/// The top row changed. Instead of redrawing every row of every column, mark
+/// the group for scrolling; draw() will shift the back buffer and render only
+/// the rows that came into view.
+void HeColumnGroup::scrolled() {
+  // the linked view must not scroll us back, the map may not be reversible
+  if (linked_ && !syncing_) {
+    heIndex pos = linkMap_ ? linkMap_->mapOffset(topByte_) : topByte_;
+    if (linked_->topByte()!=pos) {
+      linked_->syncing_ = 1;
+      linked_->topByte(pos);
+      linked_->syncing_ = 0;
+    }
+  }
+  damage(FL_DAMAGE_SCROLL);
+  for (int i=0; i<children(); i++) {
+    HeColumn *ci = (HeColumn*)child(i);
+    if (!ci->rowAligned()) ci->redraw();
+  }
+}
+
+/// Render rows [r0, r1) of a column into the current drawing surface.
+/// The last row also covers the partial line at the bottom of the column.
+void HeColumnGroup::drawColumnRows(HeColumn *ci, int r0, int r1) {
+  int ch = mgr->fontHeight();
+  int yt = ci->y()+r0*ch, yb = ci->y()+r1*ch;
+  if (r1>=ci->lineCount()) yb = ci->y()+ci->h();
+  if (yb<=yt) return;
+  fl_push_clip(ci->x(), yt, ci->w(), yb-yt);
+  ci->drawRows(r0, r1);
+  fl_pop_clip();
+}
+
+/// Shift the back buffer by the number of rows scrolled since the last frame
+/// and render the rows that were exposed. Large jumps redraw everything.
+void HeColumnGroup::scrollBackBuffer() {
+  int i, ch = mgr->fontHeight(), nLines = h()/ch;
+  int delta;
+  if (topRow()>=backTopRow_) delta = (int)(topRow()-backTopRow_);
+  else delta = -(int)(backTopRow_-topRow());
+  if (delta==0) return;
+  int r0 = 0, r1 = nLines;
+  if (delta<nLines && delta>-nLines) {
+    heCount(HE_COUNT_ROWS_REUSED, nLines-(delta>0 ? delta : -delta));
+    if (!shiftBuffer_)
+      shiftBuffer_ = fl_create_offscreen(backW_, backH_);
+    fl_begin_offscreen(shiftBuffer_);
+    if (delta>0) {
+      fl_copy_offscreen(x(), y(), w(), (nLines-delta)*ch,
+                        backBuffer_, x(), y()+delta*ch);
+      r0 = nLines-delta;
+    } else {
+      fl_copy_offscreen(x(), y()-delta*ch, w(), (nLines+delta)*ch,
+                        backBuffer_, x(), y());
+      r1 = -delta;
+    }
+    fl_copy_offscreen(x(), y()+nLines*ch, w(), h()-nLines*ch,
+                      backBuffer_, x(), y()+nLines*ch);
+    fl_end_offscreen();
+    Fl_Offscreen t = backBuffer_; backBuffer_ = shiftBuffer_; shiftBuffer_ = t;
+  }
+  heCount(HE_COUNT_ROWS_DRAWN, r1-r0);
+  fl_begin_offscreen(backBuffer_);
+  for (i=0; i<children(); i++) {
+    HeColumn *ci = (HeColumn*)child(i);
+    if (ci->rowAligned())
+      drawColumnRows(ci, r0, r1);
+  }
+  fl_end_offscreen();
+}
+
+/// Columns that scroll with the document rows are rendered into an offscreen
+/// back buffer the size of the window up to our bottom right corner, so that
+/// columns can keep drawing at their window coordinates. A small scroll only
+/// shifts the buffer and renders the newly exposed rows, a damaged column is
+/// rendered on its own, and everything else redraws the full page.
+void HeColumnGroup::draw() {
+  int i, n = children();
+  uchar d = damage();
+  int bw = x()+w(), bh = y()+h();
+  // only the overlay needs new numbers
+  if (d==FL_DAMAGE_USER1 && backBuffer_) {
+    if (overlay_) drawOverlay();
+    return;
+  }
+  HeScope scope(HE_ZONE_DRAW);
+  if (!backBuffer_ || backW_!=bw || backH_!=bh) {
+    if (backBuffer_) fl_delete_offscreen(backBuffer_);
+    if (shiftBuffer_) fl_delete_offscreen(shiftBuffer_);
+    backBuffer_ = fl_create_offscreen(bw, bh);
+    shiftBuffer_ = 0;
+    backW_ = bw; backH_ = bh;
+    d = FL_DAMAGE_ALL;
+  }
+  if (d & ~(FL_DAMAGE_CHILD|FL_DAMAGE_SCROLL)) {
+    heCount(HE_COUNT_ROWS_DRAWN, h()/mgr->fontHeight());
+    fl_begin_offscreen(backBuffer_);
+    for (i=0; i<n; i++) {
+      HeColumn *ci = (HeColumn*)child(i);
+      if (ci->rowAligned())
+        drawColumnRows(ci, 0, ci->lineCount());
+    }
+    fl_end_offscreen();
+    fl_rectf(x(), y(), w(), h(), color());
+  } else {
+    if (d & FL_DAMAGE_SCROLL)
+      scrollBackBuffer();
+    fl_begin_offscreen(backBuffer_);
+    for (i=0; i<n; i++) {
+      HeColumn *ci = (HeColumn*)child(i);
+      if (ci->rowAligned() && ci->damage())
+        drawColumnRows(ci, 0, ci->lineCount());
+    }
+    fl_end_offscreen();
+  }
+  backTopRow_ = topRow();
+  for (i=0; i<n; i++) {
+    HeColumn *ci = (HeColumn*)child(i);
+    if (ci->rowAligned()) {
+      if ((d & ~FL_DAMAGE_CHILD) || ci->damage())
+        fl_copy_offscreen(ci->x(), ci->y(), ci->w(), ci->h(),
+                          backBuffer_, ci->x(), ci->y());
+      ci->clear_damage();
+    } else if (d & ~(FL_DAMAGE_CHILD|FL_DAMAGE_SCROLL)) {
+      draw_child(*ci);
+    } else {
+      update_child(*ci);
+    }
+  }
+  heProfileSample();
+  if (overlay_)
+    drawOverlay();
+}
+
+char HeColumnGroup::overlay_ = 0;
+
+/// Frame time, memory moved for the gap, rows the back buffer saved us from
+/// drawing, and the speed of the last search, load and save. The overlay
+/// sits at the right end of the rows.
+void HeColumnGroup::drawOverlay() {
+  char line[5][80];
+  const HeZoneStats &draw = heZoneStats(HE_ZONE_DRAW);
+  const HeZoneStats &search = heZoneStats(HE_ZONE_SEARCH);
+  const HeZoneStats &load = heZoneStats(HE_ZONE_LOAD);
+  const HeZoneStats &save = heZoneStats(HE_ZONE_SAVE);
+  unsigned long long drawn = heCounters[HE_COUNT_ROWS_DRAWN];
+  unsigned long long reused = heCounters[HE_COUNT_ROWS_REUSED];
+  snprintf(line[0], 80, "frame %7.2f ms, %llu frames", draw.last*1000.0,
+           draw.calls);
+  snprintf(line[1], 80, "memmove %.1f MB in %llu moves",
+           heCounters[HE_COUNT_MEMMOVE_BYTES]/1e6,
+           heCounters[HE_COUNT_MEMMOVES]);
+  snprintf(line[2], 80, "rows reused %.0f%%",
+           drawn+reused ? 100.0*reused/(drawn+reused) : 0.0);
+  snprintf(line[3], 80, "search %.3f GB/s",
+           search.last>0.0 ? search.lastBytes/search.last/1e9 : 0.0);
+  snprintf(line[4], 80, "load %.0f MB/s, save %.0f MB/s",
+           load.last>0.0 ? load.lastBytes/load.last/1e6 : 0.0,
+           save.last>0.0 ? save.lastBytes/save.last/1e6 : 0.0);
+  int i, right = x(), wmax = 0;
+  for (i=0; i<children(); i++) {
+    HeColumn *ci = (HeColumn*)child(i);
+    if (ci->rowAligned() && ci->x()+ci->w()>right)
+      right = ci->x()+ci->w();
+  }
+  mgr->setFont();
+  for (i=0; i<5; i++) {
+    int wi = (int)fl_width(line[i]);
+    if (wi>wmax) wmax = wi;
+  }
+  int ch = mgr->fontHeight(), ca = mgr->fontAscent();
+  int ox = right-wmax-12, oy = y()+4;
+  if (ox<x()) ox = x();
+  fl_push_clip(x(), y(), w(), h());
+  fl_color(255, 255, 200);
+  fl_rectf(ox, oy, wmax+8, 5*ch+4);
+  fl_color(FL_DARK3);
+  fl_rect(ox, oy, wmax+8, 5*ch+4);
+  fl_color(FL_BLACK);
+  for (i=0; i<5; i++)
+    fl_draw(line[i], ox+4, oy+2+i*ch+ca);
+  fl_pop_clip();
 }
 
 int HeColumnGroup::handle(int event) {
   switch (event) {
     case FL_KEYBOARD: {
       bool xt = ((Fl::event_state()&FL_SHIFT)!=0);
+      // Shift+Alt selects a block
+      if (xt && (Fl::event_state()&FL_ALT))
+        mgr->blockMode(1);
       switch (Fl::event_key()) {
         case FL_Up:
           if (cursor()>=(heIndex)bytesPerRow_)
@@ -1251,82 +3254,2467 @@ int HeColumnGroup::handle(int event) {
     case FL_PASTE:
       mgr->insert(Fl::event_text(), Fl::event_length());
       return 1;
+    case FL_MOUSEWHEEL:
+      if (Fl::event_dy()==0) break;
+      scrollRows(Fl::event_dy()*MM_WHEEL_ROWS);
+      return 1;
+  }
+  return Fl_Group::handle(event);
+}
+
+//---- HeColumn ----------------------------------------------------------------
+
+HeColumn::HeColumn(int x, int y, int w, int h, HeDocumentManager *m)
+: Fl_Group(x, y, w, h)
+{
+  end();
+  box(FL_FLAT_BOX);
+  manager = m;
+  doc = m->document();
+  layout();
+}
+
+int HeColumn::handle(int event) {
+  switch (event) {
+    case FL_KEYBOARD:
+      break;
+  }
+  return Fl_Group::handle(event);
+}
+
+void HeColumn::layout() {
+  lines = h() / manager->fontHeight();
+  redraw();
+}
+
+void HeColumn::draw() {
+  drawRows(0, lines);
+  draw_label();
+}
+
+/// Draw the background of rows [r0, r1), shading every other row.
+void HeColumn::draw_bg(int r0, int r1) {
+  int i, ch = manager->fontHeight();
+  int yt = y()+r0*ch, yb = y()+r1*ch;
+  if (r1>=lines) yb = y()+h();
+  fl_color(color());
+  fl_rectf(x(), yt, w(), yb-yt);
+  fl_color(0xc8c8c800);
+  for (i=r0+((column()->topRow()+r0)&1); i<r1; i+=2) {
+    int yp = i*ch + y();
+    fl_rectf(x(), yp, w(), ch);
+  }
+  heDrawCounters.drawCalls += 1+(r1-r0)/2;
+}
+
+heIndex HeColumn::eventRow() {
+  int py = Fl::event_y() - y() - 2; //++ why -2 ???
+  py /= manager->fontHeight();
+  return column()->topRow()+py;
+}
+
+//---- HeSeperatorColumn -------------------------------------------------------
+
+HeScrollbarColumn::HeScrollbarColumn(int x, int y, int w, int h,
+                                     HeDocumentManager *cm)
+: HeColumn(x, y, w, h, cm)
+{
+  begin();
+  scroll = new Fl_Scrollbar(x, y, w, h-14);
+  scroll->type(FL_VERTICAL);
+  scroll->callback(scrollCB, this);
+  end();
+  resizable(scroll);
+}
+
+void HeScrollbarColumn::getWidth(int &fixed, int &perByte) {
+  fixed += 14;
+  perByte += 0;
+}
+
+void HeScrollbarColumn::layout() {
+  HeColumn::layout();
+  value(column()->topRow());
+}
+
+/// Draw the scroll marks as short ticks along the left edge of the trough.
+void HeScrollbarColumn::draw() {
+  Fl_Group::draw();
+  HeScrollMarks *marks = column()->marks();
+  heIndex size = doc->size();
+  int sx = scroll->x(), sy = scroll->y()+scroll->w();
+  int th = scroll->h()-2*scroll->w();
+  if (!marks || !size || th<=0) return;
+  fl_color(FL_RED);
+  for (int i=0; i<th; i++) {
+    heIndex a = (heIndex)((unsigned long long)size*i/th);
+    heIndex b = (heIndex)((unsigned long long)size*(i+1)/th);
+    if (marks->marked(a, b>a ? b : a+1))
+      fl_xyline(sx+1, sy+i, sx+3);
+  }
+}
+
+void HeScrollbarColumn::value(heIndex ix) {
+  scroll->value(ix, column()->rowsPerPage(), 0, column()->rows());
+}
+
+void HeScrollbarColumn::scrollCB(Fl_Widget*, void *userdata) {
+  HeScrollbarColumn *This = (HeScrollbarColumn*)userdata;
+  This->column()->topRow(This->scroll->value());
+}
+
+//---- HeOverviewMap -----------------------------------------------------------
+
+// Blocks are at least 256 bytes, and there are never more than a million of
+// them, so a 4 GByte document uses 4 kByte blocks and 5.3 MBytes of cells.
+#define HE_MAP_MIN_SHIFT  8
+#define HE_MAP_MAX_SHIFT  12
+#define HE_MAP_MAX_BLOCKS (1<<20)
+#define HE_MAP_CHUNK      64
+
+HeOverviewMap::HeOverviewMap(HeDocument *d) {
+  doc = d;
+  cells_ = 0;
+  nLevels_ = 0;
+  nBlocks_ = 0;
+  blockShift_ = HE_MAP_MIN_SHIFT;
+  dirtyFirst_ = dirtyLast_ = 0;
+  jobFirst_ = jobLast_ = 0;
+  running_ = scheduled_ = 0;
+  cancel_ = 0;
+  doc->addListener(this);
+  update();
+}
+
+HeOverviewMap::~HeOverviewMap() {
+  if (scheduled_)
+    Fl::remove_timeout(restartCB, this);
+  cancelAndWait();
+  doc->removeListener(this);
+  if (cells_)
+    free(cells_);
+}
+
+/// Mark blocks [first, last) for recomputation.
+void HeOverviewMap::markDirty(heIndex first, heIndex last) {
+  if (dirtyFirst_>=dirtyLast_) {
+    dirtyFirst_ = first; dirtyLast_ = last;
+  } else {
+    if (first<dirtyFirst_) dirtyFirst_ = first;
+    if (last>dirtyLast_) dirtyLast_ = last;
+  }
+}
+
+/// Overwritten bytes only invalidate their own blocks. Inserting or deleting
+/// shifts everything behind the edit, so those blocks must be recomputed,
+/// too. The old values stay visible until the new ones are ready.
+void HeOverviewMap::edited(heIndex pos, heIndex nDel, heIndex nIns) {
+  heIndex first = pos>>blockShift_, last = (heIndex)-1;
+  if (nDel==nIns)
+    last = (heIndex)(((unsigned long long)pos+nIns+(1<<blockShift_)-1)
+                     >>blockShift_);
+  markDirty(first, last);
+  if (!scheduled_) {
+    scheduled_ = 1;
+    Fl::add_timeout(MM_MAP_DELAY, restartCB, this);
+  }
+}
+
+void HeOverviewMap::restartCB(void *user_data) {
+  HeOverviewMap *m = (HeOverviewMap*)user_data;
+  m->scheduled_ = 0;
+  m->update();
+}
+
+/// Size the block and pyramid arrays for the current document size. Level 0
+/// is kept if the block size does not change.
+void HeOverviewMap::allocate() {
+  heIndex size = doc->size();
+  int i, shift = HE_MAP_MIN_SHIFT;
+  while (shift<HE_MAP_MAX_SHIFT && (size>>shift)>=HE_MAP_MAX_BLOCKS)
+    shift++;
+  heIndex n = (heIndex)(((unsigned long long)size+(1<<shift)-1)>>shift);
+  if (shift!=blockShift_) {
+    blockShift_ = shift;
+    nBlocks_ = 0;
+  }
+  if (n>nBlocks_)
+    markDirty(nBlocks_, n);
+  else if (n<nBlocks_)
+    markDirty(n-1, n);
+  heIndex total = 0, ln = n;
+  for (i=0; ln>0 && i<32; i++) {
+    levelStart_[i] = total;
+    levelSize_[i] = ln;
+    total += ln;
+    if (ln==1) { i++; break; }
+    ln = (ln+1)/2;
+  }
+  nLevels_ = i;
+  nBlocks_ = n;
+  if (total) cells_ = (HeMapCell*)realloc(cells_, total*sizeof(HeMapCell));
+}
+
+/// Start computing all blocks that were marked since the last run.
+void HeOverviewMap::update() {
+  cancelAndWait();
+  allocate();
+  if (dirtyLast_>nBlocks_) dirtyLast_ = nBlocks_;
+  if (dirtyFirst_>=dirtyLast_) {
+    dirtyFirst_ = dirtyLast_ = 0;
+    return;
+  }
+  jobFirst_ = dirtyFirst_; jobLast_ = dirtyLast_;
+  dirtyFirst_ = dirtyLast_ = 0;
+  running_ = 1;
+  cancelled_ = 0;
+  HeThreadPool::shared()->post(jobCB, this);
+}
+
+/// Stop the background job. Blocks it did not finish are marked again.
+void HeOverviewMap::cancelAndWait() {
+  mutex_.lock();
+  if (running_) {
+    cancel_ = 1;
+    while (running_)
+      idle_.wait(mutex_);
+    cancel_ = 0;
+    if (cancelled_)
+      markDirty(jobFirst_, jobLast_);
+  }
+  mutex_.unlock();
+}
+
+void HeOverviewMap::jobCB(void *user_data, int) {
+  HeOverviewMap *m = (HeOverviewMap*)user_data;
+  heIndex n = (m->jobLast_-m->jobFirst_+HE_MAP_CHUNK-1)/HE_MAP_CHUNK;
+  HeThreadPool::shared()->parallelFor(n, chunkCB, m);
+  if (!m->cancel_)
+    m->buildLevels();
+  m->mutex_.lock();
+  m->cancelled_ = m->cancel_;
+  m->running_ = 0;
+  m->idle_.broadcast();
+  m->mutex_.unlock();
+}
+
+void HeOverviewMap::chunkCB(void *user_data, int index) {
+  HeOverviewMap *m = (HeOverviewMap*)user_data;
+  heIndex first = m->jobFirst_+index*HE_MAP_CHUNK;
+  heIndex last = first+HE_MAP_CHUNK;
+  if (last>m->jobLast_) last = m->jobLast_;
+  m->computeBlocks(first, last);
+}
+
+void HeOverviewMap::computeBlocks(heIndex first, heIndex last) {
+  unsigned char buf[1<<HE_MAP_MAX_SHIFT];
+  unsigned int hist[256];
+  heIndex b;
+  int i;
+  for (b=first; b<last && !cancel_; b++) {
+    heIndex n = doc->read(b<<blockShift_, buf, 1<<blockShift_);
+    HeMapCell &c = cells_[b];
+    if (n==0) {
+      c.entropy = c.zeros = c.ascii = c.high = 0;
+      continue;
+    }
+    memset(hist, 0, sizeof(hist));
+    for (i=0; i<(int)n; i++)
+      hist[buf[i]]++;
+    double e = 0.0;
+    unsigned int ascii = hist[9]+hist[10]+hist[13], high = 0;
+    for (i=0; i<256; i++) {
+      if (hist[i]) {
+        double p = (double)hist[i]/n;
+        e -= p*log(p);
+      }
+      if (i>=32 && i<127) ascii += hist[i];
+      if (i>=128) high += hist[i];
+    }
+    // log(256) is the maximum entropy of a byte
+    c.entropy = (unsigned char)(255.0*e/log(256.0)+0.5);
+    c.zeros = (unsigned char)(255*hist[0]/n);
+    c.ascii = (unsigned char)(255*ascii/n);
+    c.high = (unsigned char)(255*high/n);
+  }
+}
+
+/// Each level averages two neighbouring cells of the level below.
+void HeOverviewMap::buildLevels() {
+  int k;
+  heIndex i;
+  for (k=1; k<nLevels_; k++) {
+    HeMapCell *src = cells_+levelStart_[k-1], *dst = cells_+levelStart_[k];
+    heIndex ns = levelSize_[k-1];
+    for (i=0; i<levelSize_[k]; i++) {
+      HeMapCell &a = src[2*i], &b = (2*i+1<ns) ? src[2*i+1] : src[2*i];
+      dst[i].entropy = (a.entropy+b.entropy+1)/2;
+      dst[i].zeros = (a.zeros+b.zeros+1)/2;
+      dst[i].ascii = (a.ascii+b.ascii+1)/2;
+      dst[i].high = (a.high+b.high+1)/2;
+    }
+  }
+}
+
+/// Summarize the bytes [first, last) from the coarsest level that still
+/// resolves the range, so the cost does not depend on the range size.
+void HeOverviewMap::summary(heIndex first, heIndex last, HeMapCell &c) {
+  c.entropy = c.zeros = c.ascii = c.high = 0;
+  if (!cells_ || !nBlocks_) return;
+  heIndex b0 = first>>blockShift_;
+  heIndex b1 = (heIndex)(((unsigned long long)last+(1<<blockShift_)-1)
+                         >>blockShift_);
+  if (b0>=nBlocks_) b0 = nBlocks_-1;
+  if (b1>nBlocks_) b1 = nBlocks_;
+  if (b1<=b0) b1 = b0+1;
+  int k = 0;
+  while (k+1<nLevels_ && ((heIndex)2<<k)<=b1-b0) k++;
+  heIndex i, i0 = b0>>k, i1 = (b1-1)>>k;
+  unsigned int e = 0, z = 0, a = 0, h = 0, n = i1-i0+1;
+  HeMapCell *src = cells_+levelStart_[k];
+  for (i=i0; i<=i1; i++) {
+    e += src[i].entropy; z += src[i].zeros;
+    a += src[i].ascii; h += src[i].high;
+  }
+  c.entropy = e/n; c.zeros = z/n; c.ascii = a/n; c.high = h/n;
+}
+
+//---- HeOverviewColumn --------------------------------------------------------
+
+HeOverviewColumn::HeOverviewColumn(int x, int y, int w, int h,
+                                   HeDocumentManager *cm)
+: HeColumn(x, y, w, h, cm)
+{
+  box(FL_DOWN_BOX);
+  image = 0;
+  imageSize = 0;
+  map = new HeOverviewMap(doc);
+}
+
+HeOverviewColumn::~HeOverviewColumn() {
+  Fl::remove_timeout(pollCB, this);
+  delete map;
+  if (image)
+    free(image);
+}
+
+void HeOverviewColumn::getWidth(int &fixed, int &perByte) {
+  fixed += 18;
+  perByte += 0;
+}
+
+/// While the map is computed in the background, redraw periodically to show
+/// the progress.
+void HeOverviewColumn::pollCB(void *user_data) {
+  HeOverviewColumn *oc = (HeOverviewColumn*)user_data;
+  oc->redraw();
+  if (oc->map->busy())
+    Fl::repeat_timeout(MM_MAP_POLL, pollCB, user_data);
+}
+
+/// Draw the whole document as a vertical strip, one pixel row per slice.
+/// Red shows high bytes, green ASCII text, and blue the entropy, so zero
+/// filled areas are black and compressed or encrypted data is bright.
+void HeOverviewColumn::draw() {
+  int i, iw = w()-4, ih = h()-4;
+  heIndex size = doc->size();
+  draw_box();
+  if (map->busy() && !Fl::has_timeout(pollCB, this))
+    Fl::add_timeout(MM_MAP_POLL, pollCB, this);
+  if (iw<=0 || ih<=0 || size==0) return;
+  if (imageSize<iw*ih*3) {
+    imageSize = iw*ih*3;
+    image = (unsigned char*)realloc(image, imageSize);
+  }
+  unsigned char *dst = image;
+  for (i=0; i<ih; i++) {
+    HeMapCell c;
+    heIndex a = (heIndex)((unsigned long long)size*i/ih);
+    heIndex b = (heIndex)((unsigned long long)size*(i+1)/ih);
+    map->summary(a, b, c);
+    for (int j=0; j<iw; j++) {
+      *dst++ = c.high; *dst++ = c.ascii; *dst++ = c.entropy;
+    }
+  }
+  fl_draw_image(image, x()+2, y()+2, iw, ih, 3);
+  // frame the part of the document that is visible in the other columns
+  HeColumnGroup *cg = column();
+  int y0 = (int)((unsigned long long)cg->topLeftByte()*ih/size);
+  int y1 = (int)((unsigned long long)(cg->topLeftByte()+cg->bytesPerPage())
+                 *ih/size);
+  if (y1>ih) y1 = ih;
+  if (y1<y0+2) y1 = y0+2;
+  fl_color(FL_YELLOW);
+  fl_rect(x()+1, y()+2+y0, w()-2, y1-y0);
+}
+
+int HeOverviewColumn::handle(int event) {
+  switch (event) {
+    case FL_PUSH:
+    case FL_DRAG: {
+      int ih = h()-4, py = Fl::event_y()-y()-2;
+      if (ih<=0) return 1;
+      if (py<0) py = 0;
+      if (py>=ih) py = ih-1;
+      heIndex pos = (heIndex)((unsigned long long)doc->size()*py/ih);
+      manager->cursor(pos);
+      return 1; }
+  }
+  return HeColumn::handle(event);
+}
+
+//---- HeHistogramView ---------------------------------------------------------
+
+HeHistogramView::HeHistogramView(int x, int y, int w, int h)
+: Fl_Widget(x, y, w, h)
+{
+  hist_ = 0;
+  box(FL_DOWN_BOX);
+  color(FL_WHITE);
+}
+
+/// Bars are scaled logarithmically, so rare values are still visible next to
+/// a dominant one such as zero padding.
+void HeHistogramView::draw() {
+  draw_box();
+  if (!hist_) return;
+  int i, bx = x()+2, by = y()+2, bw = w()-4, bh = h()-4;
+  unsigned long long max = 0;
+  for (i=0; i<256; i++)
+    if (hist_[i]>max) max = hist_[i];
+  if (!max) return;
+  double scale = bh/log(1.0+max);
+  fl_color(FL_DARK_BLUE);
+  for (i=0; i<256; i++) {
+    if (!hist_[i]) continue;
+    int x0 = bx+i*bw/256, x1 = bx+(i+1)*bw/256;
+    int hh = (int)(log(1.0+hist_[i])*scale+0.5);
+    if (hh<1) hh = 1;
+    fl_rectf(x0, by+bh-hh, x1>x0 ? x1-x0 : 1, hh);
+  }
+}
+
+//---- HeStatsPanel -------------------------------------------------------------
+
+HeStatsPanel::HeStatsPanel(HeDocumentManager *m)
+: Fl_Double_Window(540, 290, "Selection Statistics")
+{
+  manager = m;
+  doc = m->document();
+  first_ = done_ = 0;
+  valid_ = pending_ = 0;
+  int y = 10, lw = 70, ow = w()-lw-10, oh = 22;
+  histogram = new HeHistogramView(10, y, w()-20, 110); y += 118;
+  Fl_Output **field[] = { &range, &minmax, &sum, &entropy, &crc, &xxh, &sha };
+  const char *label[] = { "range:", "min/max:", "sum:", "entropy:",
+                          "crc32/c:", "xxh64:", "sha256:" };
+  for (int i=0; i<7; i++, y+=oh) {
+    Fl_Output *o = *field[i] = new Fl_Output(lw, y, ow, oh, label[i]);
+    o->textfont(FL_COURIER);
+    o->textsize(MM_FIXED_SIZE);
+  }
+  end();
+  doc->addListener(this);
+  if (doc->filename())
+    copy_label(doc->filename());
+}
+
+HeStatsPanel::~HeStatsPanel() {
+  if (pending_)
+    Fl::remove_timeout(stepCB, this);
+  doc->removeListener(this);
+}
+
+void HeStatsPanel::edited(heIndex pos, heIndex, heIndex) {
+  if (pos<done_)
+    valid_ = 0;
+  selectionChanged();
+}
+
+void HeStatsPanel::selectionChanged() {
+  if (pending_ || !shown()) return;
+  pending_ = 1;
+  Fl::add_timeout(MM_STATUS_DELAY, stepCB, this);
+}
+
+void HeStatsPanel::stepCB(void *user_data) {
+  ((HeStatsPanel*)user_data)->step();
+}
+
+/// Process up to MM_STATS_STEP more bytes of the selection, then come back
+/// for the rest so the user interface stays responsive.
+void HeStatsPanel::step() {
+  pending_ = 0;
+  heIndex a = manager->selection(), b = manager->cursor();
+  if (a>b) { heIndex t = a; a = b; b = t; }
+  heIndex end = b+1;
+  if (end>doc->size()) end = doc->size();
+  if (a>end) a = end;
+  if (!valid_ || a!=first_ || end<done_) {
+    stats.reset();
+    first_ = done_ = a;
+    valid_ = 1;
+  }
+  if (done_<end) {
+    HeDataSpan span[2];
+    heIndex n = end-done_;
+    if (n>MM_STATS_STEP) n = MM_STATS_STEP;
+    int ns = doc->lockData(done_, n, span);
+    for (int i=0; i<ns; i++)
+      stats.add(span[i].data, span[i].size, HeThreadPool::shared());
+    doc->unlockData();
+    done_ += n;
+  }
+  showResults(end);
+  if (done_<end) {
+    pending_ = 1;
+    Fl::add_timeout(0.0, stepCB, this);
+  }
+}
+
+void HeStatsPanel::showResults(heIndex end) {
+  char buf[80];
+  sprintf(buf, "%08X-%08X, %u bytes", first_, end, end-first_);
+  range->value(buf);
+  if (stats.count) {
+    sprintf(buf, "%02X / %02X", stats.minimum(), stats.maximum());
+    minmax->value(buf);
+    sprintf(buf, "%llu, mean %.3f", stats.sum(),
+            (double)stats.sum()/stats.count);
+    sum->value(buf);
+    sprintf(buf, "%.4f bits per byte", stats.entropy());
+    entropy->value(buf);
+  } else {
+    minmax->value("");
+    sum->value("");
+    entropy->value("");
+  }
+  if (done_<end) {
+    sprintf(buf, "computing, %d%% done",
+            (int)(100.0*(done_-first_)/(end-first_)));
+    crc->value(buf);
+    xxh->value("");
+    sha->value("");
+  } else {
+    unsigned char digest[32];
+    HeSha256 s = stats.sha256;
+    s.digest(digest);
+    sprintf(buf, "%08X / %08X", stats.crc32, stats.crc32c);
+    crc->value(buf);
+    sprintf(buf, "%016llX", stats.xxh64.digest());
+    xxh->value(buf);
+    for (int i=0; i<32; i++)
+      sprintf(buf+2*i, "%02x", digest[i]);
+    sha->value(buf);
+  }
+  histogram->data(stats.hist);
+}
+
+//---- HeDocumentHasher --------------------------------------------------------
+
+// Documents are read in blocks of this size. For BLAKE3 each block is a
+// complete subtree of 1024 chunks.
+#define HE_HASH_BLOCK (1<<20)
+
+HeDocumentHasher::HeDocumentHasher(HeDocument *d) {
+  doc = d;
+  size_ = 0;
+  blockCV_ = 0;
+  running_ = 0;
+  changed_ = 0;
+  cancel_ = 0;
+  memset((void*)done_, 0, sizeof(done_));
+  memset(finished_, 0, sizeof(finished_));
+  doc->addListener(this);
+}
+
+HeDocumentHasher::~HeDocumentHasher() {
+  cancelAndWait();
+  doc->removeListener(this);
+  if (blockCV_)
+    free(blockCV_);
+}
+
+void HeDocumentHasher::edited(heIndex, heIndex, heIndex) {
+  changed_ = 1;
+  cancel_ = 1;
+}
+
+void HeDocumentHasher::start() {
+  cancelAndWait();
+  size_ = doc->size();
+  memset((void*)done_, 0, sizeof(done_));
+  memset(finished_, 0, sizeof(finished_));
+  changed_ = 0;
+  cancel_ = 0;
+  heCrc32(0, 0, 0); // build the tables before the jobs need them
+  running_ = HE_HASH_N;
+  HeThreadPool::shared()->post(jobCB, this, HE_HASH_N);
+}
+
+void HeDocumentHasher::cancelAndWait() {
+  mutex_.lock();
+  if (running_) {
+    cancel_ = 1;
+    while (running_)
+      idle_.wait(mutex_);
+  }
+  mutex_.unlock();
+}
+
+void HeDocumentHasher::jobCB(void *user_data, int index) {
+  HeDocumentHasher *h = (HeDocumentHasher*)user_data;
+  if (index==HE_HASH_BLAKE3)
+    h->runBlake3();
+  else
+    h->runSequential(index);
+  h->mutex_.lock();
+  h->running_--;
+  h->idle_.broadcast();
+  h->mutex_.unlock();
+}
+
+void HeDocumentHasher::runSequential(int algorithm) {
+  unsigned char *buf = (unsigned char*)malloc(HE_HASH_BLOCK);
+  unsigned char *dst = digest_[algorithm];
+  unsigned int crc = 0;
+  HeMd5 md5;
+  HeSha1 sha1;
+  HeSha256 sha256;
+  heIndex pos = 0;
+  while (pos<size_ && !cancel_) {
+    heIndex n = doc->read(pos, buf, HE_HASH_BLOCK);
+    if (!n) break;
+    switch (algorithm) {
+      case HE_HASH_CRC32: crc = heCrc32(crc, buf, n); break;
+      case HE_HASH_MD5: md5.update(buf, n); break;
+      case HE_HASH_SHA1: sha1.update(buf, n); break;
+      case HE_HASH_SHA256: sha256.update(buf, n); break;
+    }
+    pos += n;
+    done_[algorithm] = pos;
+  }
+  free(buf);
+  if (cancel_) return;
+  switch (algorithm) {
+    case HE_HASH_CRC32:
+      dst[0] = crc>>24; dst[1] = crc>>16; dst[2] = crc>>8; dst[3] = crc;
+      break;
+    case HE_HASH_MD5: md5.digest(dst); break;
+    case HE_HASH_SHA1: sha1.digest(dst); break;
+    case HE_HASH_SHA256: sha256.digest(dst); break;
+  }
+  finished_[algorithm] = 1;
+}
+
+/// Hash all blocks in parallel, then join their chaining values in the
+/// shape of the BLAKE3 tree.
+void HeDocumentHasher::runBlake3() {
+  unsigned int cv[8];
+  heIndex nBlocks = (heIndex)(((unsigned long long)size_+HE_HASH_BLOCK-1)
+                              /HE_HASH_BLOCK);
+  if (nBlocks<=1) {
+    unsigned char *buf = (unsigned char*)malloc(HE_HASH_BLOCK);
+    heIndex n = doc->read(0, buf, size_);
+    heBlake3Subtree(buf, n, 0, 1, cv);
+    free(buf);
+    done_[HE_HASH_BLAKE3] = n;
+  } else {
+    blockCV_ = (unsigned int*)realloc(blockCV_, nBlocks*8*sizeof(unsigned int));
+    HeThreadPool::shared()->parallelFor(nBlocks, blockCB, this);
+    if (cancel_) return;
+    mergeBlake3(0, nBlocks, 1, cv);
+  }
+  if (cancel_) return;
+  heBlake3Digest(cv, digest_[HE_HASH_BLAKE3]);
+  finished_[HE_HASH_BLAKE3] = 1;
+}
+
+void HeDocumentHasher::blockCB(void *user_data, int index) {
+  HeDocumentHasher *h = (HeDocumentHasher*)user_data;
+  if (h->cancel_) return;
+  unsigned char *buf = (unsigned char*)malloc(HE_HASH_BLOCK);
+  heIndex n = h->doc->read((heIndex)index*HE_HASH_BLOCK, buf, HE_HASH_BLOCK);
+  heBlake3Subtree(buf, n,
+                  (unsigned long long)index*(HE_HASH_BLOCK/HE_BLAKE3_CHUNK), 0,
+                  h->blockCV_+8*index);
+  free(buf);
+  h->mutex_.lock();
+  h->done_[HE_HASH_BLAKE3] += n;
+  h->mutex_.unlock();
+}
+
+void HeDocumentHasher::mergeBlake3(heIndex first, heIndex n, char root,
+                                   unsigned int cv[8]) {
+  if (n==1) {
+    memcpy(cv, blockCV_+8*first, 8*sizeof(unsigned int));
+    return;
+  }
+  unsigned int l[8], r[8];
+  heIndex left = 1;
+  while (2*left<n) left *= 2;
+  mergeBlake3(first, left, 0, l);
+  mergeBlake3(first+left, n-left, 0, r);
+  heBlake3Parent(l, r, root, cv);
+}
+
+double HeDocumentHasher::progress(int algorithm) {
+  if (finished_[algorithm] || !size_) return 1.0;
+  return (double)done_[algorithm]/size_;
+}
+
+int HeDocumentHasher::length(int algorithm) {
+  static const int len[HE_HASH_N] = { 4, 16, 20, 32, 32 };
+  return len[algorithm];
+}
+
+const char *HeDocumentHasher::name(int algorithm) {
+  static const char *names[HE_HASH_N] = {
+    "CRC32", "MD5", "SHA-1", "SHA-256", "BLAKE3" };
+  return names[algorithm];
+}
+
+/// Compare a hex digest, as pasted from a checksum file or web page, with
+/// the finished results. Returns the matching algorithm, -1 if none matches
+/// and -2 if 'expected' holds no digest.
+int HeDocumentHasher::match(const char *expected) {
+  unsigned char want[32];
+  int i, n = 0, nibble = -1;
+  if (!expected) return -2;
+  while (*expected==' ' || *expected=='\t') expected++;
+  if (expected[0]=='0' && (expected[1]=='x' || expected[1]=='X'))
+    expected += 2;
+  for ( ; *expected && *expected!=' ' && *expected!='\t'; expected++) {
+    int c = *expected, v;
+    if (c>='0' && c<='9') v = c-'0';
+    else if (c>='a' && c<='f') v = c-'a'+10;
+    else if (c>='A' && c<='F') v = c-'A'+10;
+    else return -2;
+    if (nibble<0) {
+      nibble = v;
+    } else {
+      if (n==32) return -2;
+      want[n++] = (nibble<<4)|v;
+      nibble = -1;
+    }
+  }
+  if (n==0 || nibble>=0) return -2;
+  for (i=0; i<HE_HASH_N; i++)
+    if (finished_[i] && length(i)==n && memcmp(want, digest_[i], n)==0)
+      return i;
+  return -1;
+}
+
+//---- HeHashPanel --------------------------------------------------------------
+
+HeHashPanel::HeHashPanel(HeDocumentManager *m)
+: Fl_Double_Window(560, 220)
+{
+  char buf[2048];
+  doc = m->document();
+  int i, y = 10, lw = 70, ow = w()-lw-10, oh = 22;
+  for (i=0; i<HE_HASH_N; i++, y+=oh) {
+    result[i] = new Fl_Output(lw, y, ow, oh, HeDocumentHasher::name(i));
+    result[i]->textfont(FL_COURIER);
+    result[i]->textsize(MM_FIXED_SIZE);
+  }
+  y += 8;
+  expected = new Fl_Input(lw, y, ow, oh, "expected:");
+  expected->textfont(FL_COURIER);
+  expected->textsize(MM_FIXED_SIZE);
+  expected->callback(expectedCB, this);
+  expected->when(FL_WHEN_CHANGED);
+  y += oh+8;
+  verdict = new Fl_Box(lw, y, ow-90, oh);
+  verdict->align(FL_ALIGN_LEFT|FL_ALIGN_INSIDE);
+  startButton = new Fl_Button(w()-90, y, 80, oh, "Hash");
+  startButton->callback(startCB, this);
+  end();
+  hasher = new HeDocumentHasher(doc);
+  doc->addListener(this);
+  sprintf(buf, "Hash %.2000s", doc->filename() ? doc->filename() : "document");
+  copy_label(buf);
+}
+
+HeHashPanel::~HeHashPanel() {
+  Fl::remove_timeout(pollCB, this);
+  doc->removeListener(this);
+  delete hasher;
+}
+
+void HeHashPanel::start() {
+  hasher->start();
+  if (!Fl::has_timeout(pollCB, this))
+    Fl::add_timeout(MM_MAP_POLL, pollCB, this);
+  showResults();
+}
+
+/// The hasher cancels itself on edits; make sure the panel says so.
+void HeHashPanel::edited(heIndex, heIndex, heIndex) {
+  if (!Fl::has_timeout(pollCB, this))
+    Fl::add_timeout(MM_MAP_POLL, pollCB, this);
+}
+
+void HeHashPanel::pollCB(void *user_data) {
+  HeHashPanel *hp = (HeHashPanel*)user_data;
+  hp->showResults();
+  if (hp->hasher->busy())
+    Fl::repeat_timeout(MM_MAP_POLL, pollCB, user_data);
+}
+
+void HeHashPanel::startCB(Fl_Widget*, void *user_data) {
+  HeHashPanel *hp = (HeHashPanel*)user_data;
+  if (hp->hasher->busy()) {
+    hp->hasher->cancelAndWait();
+    hp->showResults();
+  } else {
+    hp->start();
+  }
+}
+
+void HeHashPanel::expectedCB(Fl_Widget*, void *user_data) {
+  ((HeHashPanel*)user_data)->showResults();
+}
+
+void HeHashPanel::showResults() {
+  char buf[80];
+  char busy = hasher->busy();
+  for (int i=0; i<HE_HASH_N; i++) {
+    if (hasher->finished(i)) {
+      const unsigned char *d = hasher->digest(i);
+      for (int j=0; j<HeDocumentHasher::length(i); j++)
+        sprintf(buf+2*j, "%02x", d[j]);
+    } else if (busy) {
+      sprintf(buf, "%d%%", (int)(100.0*hasher->progress(i)));
+    } else {
+      buf[0] = 0;
+    }
+    result[i]->value(buf);
+  }
+  int m = hasher->match(expected->value());
+  if (hasher->changed()) {
+    verdict->labelcolor(FL_DARK_RED);
+    verdict->label("document was changed, hash it again");
+  } else if (m>=0) {
+    sprintf(buf, "matches %s", HeDocumentHasher::name(m));
+    verdict->labelcolor(FL_DARK_GREEN);
+    verdict->copy_label(buf);
+  } else if (m==-1 && !busy) {
+    verdict->labelcolor(FL_DARK_RED);
+    verdict->label("does not match");
+  } else {
+    verdict->label(busy ? "hashing..." : "");
+  }
+  startButton->label(busy ? "Cancel" : "Hash");
+  redraw();
+}
+
+//---- HeStructView -------------------------------------------------------------
+
+// width of one level of indentation in the structure tree
+#define MM_TREE_INDENT 14
+
+HeStructView::HeStructView(int x, int y, int w, int h, HeDocumentManager *m)
+: Fl_Group(x, y, w, h)
+{
+  manager = m;
+  tree_ = 0;
+  top_ = 0;
+  selected_ = -1;
+  box(FL_DOWN_BOX);
+  color(FL_WHITE);
+  scroll = new Fl_Scrollbar(x+w-16, y+2, 14, h-4);
+  scroll->type(FL_VERTICAL);
+  scroll->callback(scrollCB, this);
+  end();
+  resizable(0);
+}
+
+int HeStructView::rowHeight() {
+  fl_font(FL_COURIER, MM_FIXED_SIZE);
+  return fl_height()+2;
+}
+
+void HeStructView::tree(HeTplTree *t) {
+  tree_ = t;
+  top_ = 0;
+  selected_ = -1;
+  update();
+}
+
+/// The number of rows changed: an edit moved fields, or a node was opened.
+void HeStructView::update() {
+  long long n = tree_ ? tree_->rows() : 0;
+  int page = (h()-4)/rowHeight();
+  if (top_>n-page) top_ = n-page;
+  if (top_<0) top_ = 0;
+  if (selected_>=n) selected_ = -1;
+  scroll->value((int)top_, page, 0, (int)n);
+  redraw();
+}
+
+void HeStructView::resize(int x, int y, int w, int h) {
+  Fl_Widget::resize(x, y, w, h);
+  scroll->resize(x+w-16, y+2, 14, h-4);
+  update();
+}
+
+void HeStructView::scrollCB(Fl_Widget*, void *userdata) {
+  HeStructView *v = (HeStructView*)userdata;
+  v->top_ = v->scroll->value();
+  v->redraw();
+}
+
+void HeStructView::draw() {
+  char buf[256];
+  draw_box();
+  int rh = rowHeight(), page = (h()-4)/rh;
+  int xx = x()+2, ww = w()-20;
+  int nameW = ww*2/5, offsW = 10*fl_width('0'), sizeW = 8*fl_width('0');
+  fl_push_clip(xx, y()+2, ww, h()-4);
+  if (tree_) {
+    long long n = tree_->rows();
+    for (int r=0; r<page && top_+r<n; r++) {
+      int depth, yy = y()+2+r*rh, tx;
+      HeTplNode *node = tree_->row(top_+r, &depth);
+      if (!node) break;
+      if (top_+r==selected_) fl_color(FL_SELECTION_COLOR);
+      else fl_color((top_+r)&1 ? fl_rgb_color(240, 240, 240) : FL_WHITE);
+      fl_rectf(xx, yy, ww, rh);
+      fl_color(top_+r==selected_ ? FL_WHITE : FL_BLACK);
+      tx = xx+4+depth*MM_TREE_INDENT;
+      if (tree_->expandable(node)) {
+        int cy = yy+rh/2;
+        if (node->expanded)
+          fl_polygon(tx, cy-3, tx+8, cy-3, tx+4, cy+3);
+        else
+          fl_polygon(tx+2, cy-4, tx+2, cy+4, tx+7, cy);
+      }
+      tx += MM_TREE_INDENT;
+      fl_font(FL_HELVETICA, MM_PROP_SIZE);
+      tree_->name(node, buf, sizeof(buf));
+      fl_push_clip(tx, yy, xx+nameW-tx, rh);
+      fl_draw(buf, tx, yy+rh-fl_descent()-1);
+      fl_pop_clip();
+      fl_font(FL_COURIER, MM_FIXED_SIZE);
+      int ty = yy+rh-fl_descent()-1;
+      sprintf(buf, "%08llX", node->pos);
+      fl_draw(buf, xx+nameW, ty);
+      // the size of a structure of varying size is only shown once known,
+      // measuring a table could take a while
+      if (node->sizeKnown) {
+        sprintf(buf, "%llu", node->size);
+        fl_draw(buf, xx+nameW+offsW, ty);
+      }
+      tree_->value(node, buf, sizeof(buf));
+      fl_draw(buf, xx+nameW+offsW+sizeW, ty);
+    }
+  }
+  fl_pop_clip();
+  draw_child(*scroll);
+}
+
+/// Clicking the triangle opens or closes a node, clicking elsewhere selects
+/// its bytes in the document.
+int HeStructView::handle(int event) {
+  switch (event) {
+    case FL_PUSH: {
+      if (!tree_ || Fl::event_x()>=scroll->x()) break;
+      long long r = top_+(Fl::event_y()-y()-2)/rowHeight();
+      int depth;
+      if (r>=tree_->rows()) return 1;
+      HeTplNode *node = tree_->row(r, &depth);
+      if (!node) return 1;
+      int tx = x()+6+depth*MM_TREE_INDENT;
+      if (tree_->expandable(node)
+          && ((Fl::event_x()<tx+MM_TREE_INDENT && Fl::event_x()>=tx-2)
+              || Fl::event_clicks())) {
+        tree_->expand(node, !node->expanded);
+        Fl::event_clicks(0);
+        update();
+        return 1;
+      }
+      selected_ = r;
+      unsigned long long size = tree_->size(node);
+      if (size)
+        manager->select((heIndex)node->pos, (heIndex)(node->pos+size-1), false);
+      else
+        manager->cursor((heIndex)node->pos);
+      redraw();
+      return 1; }
+    case FL_MOUSEWHEEL:
+      if (Fl::event_dy()==0 || !tree_) break;
+      top_ += Fl::event_dy()*MM_WHEEL_ROWS;
+      update();
+      return 1;
+  }
+  return Fl_Group::handle(event);
+}
+
+//---- HeStructPanel ------------------------------------------------------------
+
+HeStructPanel::HeStructPanel(HeDocumentManager *m)
+: Fl_Double_Window(640, 420)
+{
+  char buf[2048];
+  manager = m;
+  doc = m->document();
+  template_ = 0;
+  tree_ = 0;
+  templateName_ = 0;
+  Fl_Button *b = new Fl_Button(10, 10, 130, 24, "Load Template...");
+  b->callback(loadCB, this);
+  status = new Fl_Box(150, 10, w()-160, 24);
+  status->align(FL_ALIGN_LEFT|FL_ALIGN_INSIDE|FL_ALIGN_CLIP);
+  view = new HeStructView(10, 44, w()-20, h()-54, m);
+  end();
+  resizable(view);
+  doc->addListener(this);
+  sprintf(buf, "Structure of %.2000s", doc->filename() ? doc->filename() : "document");
+  copy_label(buf);
+}
+
+HeStructPanel::~HeStructPanel() {
+  doc->removeListener(this);
+  delete tree_;
+  delete template_;
+  if (templateName_)
+    free(templateName_);
+}
+
+void HeStructPanel::loadCB(Fl_Widget*, void *user_data) {
+  ((HeStructPanel*)user_data)->choose();
+}
+
+void HeStructPanel::choose() {
+  const char *name = fl_file_chooser("Load Template", "*.tpl", templateName_);
+  if (name)
+    load(name);
+}
+
+/// Compile a template file. The old template stays if the new one has
+/// errors.
+char HeStructPanel::load(const char *filename) {
+  FILE *f = fopen(filename, "rb");
+  if (!f) {
+    fl_alert("Can't open template \n\"%s\"\n%s.", filename, strerror(errno));
+    return 0;
+  }
+  fseek(f, 0, SEEK_END);
+  long n = ftell(f);
+  fseek(f, 0, SEEK_SET);
+  char *text = (char*)malloc(n+1);
+  n = (long)fread(text, 1, n, f);
+  text[n>0 ? n : 0] = 0;
+  fclose(f);
+  int line;
+  HeTemplate *t = new HeTemplate();
+  const char *err = t->compile(text, &line);
+  free(text);
+  if (err) {
+    fl_alert("Error in template \n\"%s\"\nline %d: %s.", filename, line, err);
+    delete t;
+    return 0;
+  }
+  view->tree(0);
+  delete tree_;
+  delete template_;
+  template_ = t;
+  tree_ = new HeTplTree(t, HeDocument::readCB, doc, doc->size());
+  if (templateName_) free(templateName_);
+  templateName_ = _strdup(filename);
+  view->tree(tree_);
+  showStatus();
+  return 1;
+}
+
+void HeStructPanel::showStatus() {
+  char buf[2048];
+  if (!tree_) return;
+  const char *err = tree_->error();
+  snprintf(buf, sizeof(buf), "%s%s%s", fl_filename_name(templateName_),
+           err ? ": " : "", err ? err : "");
+  status->copy_label(buf);
+  status->labelcolor(err ? FL_RED : FL_FOREGROUND_COLOR);
+  status->redraw();
+}
+
+void HeStructPanel::edited(heIndex pos, heIndex nDel, heIndex nIns) {
+  if (!tree_) return;
+  tree_->edited(pos, nDel, nIns);
+  view->update();
+  showStatus();
+}
+
+//---- HeDocumentStrings --------------------------------------------------------
+
+// bytes per scanning job
+#define HE_STR_PIECE (1<<20)
+
+HeDocumentStrings::HeDocumentStrings(HeDocument *d) {
+  doc = d;
+  pieces_ = 0;
+  nPieces_ = capPieces_ = 0;
+  jobs_ = 0;
+  nJobs_ = 0;
+  memset(&result_, 0, sizeof(result_));
+  types_ = HE_STR_ASCII|HE_STR_UTF8|HE_STR_UTF16LE;
+  minChars_ = 4;
+  running_ = 0;
+  scheduled_ = polling_ = 0;
+  cancel_ = 0;
+  changedCB_ = 0;
+  changedData_ = 0;
+  doc->addListener(this);
+}
+
+HeDocumentStrings::~HeDocumentStrings() {
+  if (scheduled_)
+    Fl::remove_timeout(restartCB, this);
+  if (polling_)
+    Fl::remove_timeout(pollCB, this);
+  cancelAndWait();
+  doc->removeListener(this);
+  for (int i=0; i<nPieces_; i++)
+    pieces_[i].runs.clear();
+  if (pieces_) free(pieces_);
+  if (jobs_) free(jobs_);
+  result_.clear();
+}
+
+void HeDocumentStrings::reserve(int n) {
+  if (n<=capPieces_) return;
+  capPieces_ = n+64;
+  pieces_ = (Piece*)realloc(pieces_, capPieces_*sizeof(Piece));
+}
+
+/// Cut a long piece into pieces of HE_STR_PIECE bytes, so that it is
+/// scanned on all cores.
+void HeDocumentStrings::split(int i) {
+  heIndex first = pieces_[i].first, last = pieces_[i].last;
+  int k = (int)(((unsigned long long)last-first+HE_STR_PIECE-1)/HE_STR_PIECE);
+  pieces_[i].runs.clear();
+  reserve(nPieces_+k-1);
+  memmove(pieces_+i+k, pieces_+i+1, (nPieces_-i-1)*sizeof(Piece));
+  for (int j=0; j<k; j++) {
+    Piece &p = pieces_[i+j];
+    memset(&p, 0, sizeof(Piece));
+    p.first = first+(heIndex)j*HE_STR_PIECE;
+    p.last = j==k-1 ? last : p.first+HE_STR_PIECE;
+    p.dirty = 1;
+  }
+  nPieces_ += k-1;
+}
+
+void HeDocumentStrings::settings(int types, int minChars) {
+  cancelAndWait();
+  types_ = types;
+  minChars_ = minChars>0 ? minChars : 1;
+  for (int i=0; i<nPieces_; i++)
+    pieces_[i].runs.clear();
+  nPieces_ = 0;
+  nJobs_ = 0;
+  result_.n = 0;
+  if (doc->size()) {
+    reserve(1);
+    memset(pieces_, 0, sizeof(Piece));
+    pieces_[0].last = doc->size();
+    pieces_[0].dirty = 1;
+    nPieces_ = 1;
+  }
+  start();
+}
+
+static heIndex heShiftPos(heIndex x, heIndex pos, heIndex nDel, heIndex nIns) {
+  if (x<pos) return x;
+  if (x>=pos+nDel) return x-nDel+nIns;
+  return pos;
+}
+
+/// Pieces are moved along with the bytes; only those whose bytes, or the
+/// few bytes around them that a multibyte character may need, changed are
+/// scanned again. Bytes inserted at the border of two pieces go to the
+/// first one.
+void HeDocumentStrings::edited(heIndex pos, heIndex nDel, heIndex nIns) {
+  int i, j;
+  cancelAndWait();
+  // pieces of an unfinished scan may have read the new bytes already
+  for (i=0; i<nJobs_; i++)
+    pieces_[jobs_[i]].dirty = 1;
+  nJobs_ = 0;
+  heIndex from = pos>HE_STR_MARGIN ? pos-HE_STR_MARGIN : 0;
+  heIndex to = pos+nIns+HE_STR_MARGIN;
+  for (i=0, j=0; i<nPieces_; i++) {
+    Piece &p = pieces_[i];
+    heIndex first = j ? pieces_[j-1].last : 0;
+    heIndex last = heShiftPos(p.last, pos, nDel, nIns);
+    if (first==last) {
+      p.runs.clear();
+      continue;
+    }
+    if (last-first!=p.last-p.first || (first<to && last>from))
+      p.dirty = 1;
+    p.first = first;
+    p.last = last;
+    pieces_[j++] = p;
+  }
+  nPieces_ = j;
+  if (nPieces_==0 && doc->size()) {
+    reserve(1);
+    memset(pieces_, 0, sizeof(Piece));
+    pieces_[0].last = doc->size();
+    pieces_[0].dirty = 1;
+    nPieces_ = 1;
+  }
+  // keep the list usable until the new one is ready
+  for (i=0; i<result_.n; i++) {
+    HeStringRun &r = result_.run[i];
+    if (r.pos>=(unsigned long long)pos+nDel) r.pos = r.pos-nDel+nIns;
+    else if (r.pos>pos) r.pos = pos;
+  }
+  if (!scheduled_) {
+    scheduled_ = 1;
+    Fl::add_timeout(MM_MAP_DELAY, restartCB, this);
+  }
+  changed();
+}
+
+void HeDocumentStrings::restartCB(void *user_data) {
+  HeDocumentStrings *s = (HeDocumentStrings*)user_data;
+  s->scheduled_ = 0;
+  s->start();
+}
+
+void HeDocumentStrings::start() {
+  int i;
+  if (scheduled_) {
+    Fl::remove_timeout(restartCB, this);
+    scheduled_ = 0;
+  }
+  cancelAndWait();
+  for (i=0; i<nPieces_; i++)
+    if (pieces_[i].dirty && pieces_[i].last-pieces_[i].first>2*HE_STR_PIECE)
+      split(i);
+  jobs_ = (int*)realloc(jobs_, (nPieces_ ? nPieces_ : 1)*sizeof(int));
+  nJobs_ = 0;
+  for (i=0; i<nPieces_; i++)
+    if (pieces_[i].dirty)
+      jobs_[nJobs_++] = i;
+  if (nJobs_) {
+    cancel_ = 0;
+    running_ = nJobs_;
+    HeThreadPool::shared()->post(pieceCB, this, nJobs_);
+    if (!polling_) {
+      polling_ = 1;
+      Fl::add_timeout(MM_MAP_POLL, pollCB, this);
+    }
+  } else {
+    merge();
+  }
+  changed();
+}
+
+void HeDocumentStrings::cancelAndWait() {
+  mutex_.lock();
+  if (running_) {
+    cancel_ = 1;
+    while (running_)
+      idle_.wait(mutex_);
+  }
+  mutex_.unlock();
+}
+
+/// Each job owns its piece. The piece array doesn't change while jobs run,
+/// edits wait for them first.
+void HeDocumentStrings::pieceCB(void *user_data, int index) {
+  HeDocumentStrings *s = (HeDocumentStrings*)user_data;
+  Piece &p = s->pieces_[s->jobs_[index]];
+  if (!s->cancel_) {
+    heIndex from = p.first>HE_STR_MARGIN ? p.first-HE_STR_MARGIN : 0;
+    heIndex max = p.last-from+HE_STR_MARGIN;
+    unsigned char *buf = (unsigned char*)malloc(max);
+    heIndex n = s->doc->read(from, buf, max);
+    p.runs.n = 0;
+    // positions relative to the start of the piece
+    heFindStrings(buf, n, p.first-from, p.last-from, 0ULL-(p.first-from),
+                  s->types_, s->minChars_, &p.runs);
+    free(buf);
+    if (!s->cancel_)
+      p.dirty = 0;
+  }
+  s->mutex_.lock();
+  s->running_--;
+  s->idle_.broadcast();
+  s->mutex_.unlock();
+}
+
+void HeDocumentStrings::pollCB(void *user_data) {
+  HeDocumentStrings *s = (HeDocumentStrings*)user_data;
+  if (s->running_>0) {
+    Fl::repeat_timeout(MM_MAP_POLL, pollCB, user_data);
+    return;
+  }
+  s->polling_ = 0;
+  if (!s->cancel_) {
+    s->nJobs_ = 0;
+    s->merge();
+  }
+  s->changed();
+}
+
+/// Join the strings of all pieces, including those that continue from one
+/// piece into the next.
+void HeDocumentStrings::merge() {
+  result_.n = 0;
+  HeStringMerger m(&result_, types_, minChars_);
+  for (int i=0; i<nPieces_; i++) {
+    Piece &p = pieces_[i];
+    for (int j=0; j<p.runs.n; j++) {
+      HeStringRun r = p.runs.run[j];
+      r.pos += p.first;
+      m.add(r, p.last);
+    }
+  }
+  m.finish();
+}
+
+//---- HeStringsView -------------------------------------------------------------
+
+// bytes of a string shown in the list
+#define HE_STR_SHOWN 200
+
+HeStringsView::HeStringsView(int x, int y, int w, int h, HeDocumentManager *m,
+                             HeDocumentStrings *s)
+: Fl_Group(x, y, w, h)
+{
+  manager = m;
+  strings_ = s;
+  top_ = 0;
+  selectedPos_ = ~0ULL;
+  selectedType_ = 0;
+  box(FL_DOWN_BOX);
+  color(FL_WHITE);
+  scroll = new Fl_Scrollbar(x+w-16, y+2, 14, h-4);
+  scroll->type(FL_VERTICAL);
+  scroll->callback(scrollCB, this);
+  end();
+  resizable(0);
+}
+
+int HeStringsView::rowHeight() {
+  fl_font(FL_COURIER, MM_FIXED_SIZE);
+  return fl_height()+2;
+}
+
+void HeStringsView::update() {
+  int n = strings_->count();
+  int page = (h()-4)/rowHeight();
+  if (top_>n-page) top_ = n-page;
+  if (top_<0) top_ = 0;
+  scroll->value(top_, page, 0, n);
+  redraw();
+}
+
+void HeStringsView::resize(int x, int y, int w, int h) {
+  Fl_Widget::resize(x, y, w, h);
+  scroll->resize(x+w-16, y+2, 14, h-4);
+  update();
+}
+
+void HeStringsView::scrollCB(Fl_Widget*, void *userdata) {
+  HeStringsView *v = (HeStringsView*)userdata;
+  v->top_ = v->scroll->value();
+  v->redraw();
+}
+
+/// The beginning of a string as UTF-8 text that can be drawn.
+static void heStringText(HeDocument *doc, const HeStringRun &r, char *dst, int n) {
+  // one more byte than is shown, to see where the next character starts
+  unsigned char buf[HE_STR_SHOWN+1];
+  heIndex got = r.len<HE_STR_SHOWN+1 ? r.len : HE_STR_SHOWN+1;
+  got = doc->read((heIndex)r.pos, buf, got);
+  heIndex len = got<HE_STR_SHOWN ? got : HE_STR_SHOWN;
+  int i, k = 0;
+  if (r.type==HE_STR_UTF16LE || r.type==HE_STR_UTF16BE) {
+    int lo = r.type==HE_STR_UTF16LE ? 0 : 1;
+    for (i=0; i+1<(int)len && k<n-1; i+=2)
+      dst[k++] = buf[i+lo]=='\t' ? ' ' : (char)buf[i+lo];
+  } else {
+    // don't cut a character in half
+    if (len<got)
+      while (len>0 && (buf[len]&0xc0)==0x80) len--;
+    for (i=0; i<(int)len && k<n-1; i++)
+      dst[k++] = buf[i]=='\t' ? ' ' : (char)buf[i];
+  }
+  dst[k] = 0;
+}
+
+void HeStringsView::draw() {
+  static const char *typeName[] = { "", "ASCII", "UTF-8", "", "UTF-16LE",
+                                    "", "", "", "UTF-16BE" };
+  char buf[HE_STR_SHOWN+1];
+  draw_box();
+  int rh = rowHeight(), page = (h()-4)/rh;
+  int xx = x()+2, ww = w()-20;
+  int offsW = 10*fl_width('0'), typeW = 9*fl_width('0'), lenW = 7*fl_width('0');
+  fl_push_clip(xx, y()+2, ww, h()-4);
+  int n = strings_->count();
+  for (int r=0; r<page && top_+r<n; r++) {
+    const HeStringRun &s = strings_->string(top_+r);
+    int yy = y()+2+r*rh, ty = yy+rh-fl_descent()-1;
+    char sel = s.pos==selectedPos_ && s.type==selectedType_;
+    if (sel) fl_color(FL_SELECTION_COLOR);
+    else fl_color((top_+r)&1 ? fl_rgb_color(240, 240, 240) : FL_WHITE);
+    fl_rectf(xx, yy, ww, rh);
+    fl_color(sel ? FL_WHITE : FL_BLACK);
+    fl_font(FL_COURIER, MM_FIXED_SIZE);
+    sprintf(buf, "%08llX", s.pos);
+    fl_draw(buf, xx+4, ty);
+    fl_draw(typeName[s.type], xx+4+offsW, ty);
+    sprintf(buf, "%u", s.chars);
+    fl_draw(buf, xx+4+offsW+typeW, ty);
+    heStringText(manager->document(), s, buf, sizeof(buf));
+    fl_draw(buf, xx+4+offsW+typeW+lenW, ty);
+  }
+  fl_pop_clip();
+  draw_child(*scroll);
+}
+
+/// Clicking a string selects its bytes in the document.
+int HeStringsView::handle(int event) {
+  switch (event) {
+    case FL_PUSH: {
+      if (Fl::event_x()>=scroll->x()) break;
+      int r = top_+(Fl::event_y()-y()-2)/rowHeight();
+      if (r>=strings_->count()) return 1;
+      const HeStringRun &s = strings_->string(r);
+      selectedPos_ = s.pos;
+      selectedType_ = s.type;
+      manager->select((heIndex)s.pos, (heIndex)(s.pos+s.len-1), false);
+      redraw();
+      return 1; }
+    case FL_MOUSEWHEEL:
+      if (Fl::event_dy()==0) break;
+      top_ += Fl::event_dy()*MM_WHEEL_ROWS;
+      update();
+      return 1;
+  }
+  return Fl_Group::handle(event);
+}
+
+//---- HeStringsPanel ------------------------------------------------------------
+
+HeStringsPanel::HeStringsPanel(HeDocumentManager *m)
+: Fl_Double_Window(600, 420)
+{
+  static const char *label[] = { "ASCII", "UTF-8", "UTF-16LE", "UTF-16BE" };
+  char buf[2048];
+  HeDocument *doc = m->document();
+  strings = new HeDocumentStrings(doc);
+  minLength = new Fl_Input(90, 10, 40, 24, "min. length:");
+  minLength->type(FL_INT_INPUT);
+  minLength->value("4");
+  minLength->callback(settingsCB, this);
+  for (int i=0; i<4; i++) {
+    typeButton[i] = new Fl_Check_Button(140+i*90, 10, 90, 24, label[i]);
+    typeButton[i]->value((strings->types()>>i)&1);
+    typeButton[i]->callback(settingsCB, this);
+  }
+  status = new Fl_Box(10, 40, w()-20, 20);
+  status->align(FL_ALIGN_LEFT|FL_ALIGN_INSIDE|FL_ALIGN_CLIP);
+  view = new HeStringsView(10, 64, w()-20, h()-74, m, strings);
+  end();
+  resizable(view);
+  sprintf(buf, "Strings in %.2000s", doc->filename() ? doc->filename() : "document");
+  copy_label(buf);
+  strings->notify(changedCB, this);
+  strings->settings(strings->types(), 4);
+}
+
+HeStringsPanel::~HeStringsPanel() {
+  delete strings;
+}
+
+void HeStringsPanel::settingsCB(Fl_Widget*, void *user_data) {
+  HeStringsPanel *p = (HeStringsPanel*)user_data;
+  int types = 0;
+  for (int i=0; i<4; i++)
+    if (p->typeButton[i]->value()) types |= 1<<i;
+  p->strings->settings(types, atoi(p->minLength->value()));
+}
+
+void HeStringsPanel::changedCB(void *user_data) {
+  HeStringsPanel *p = (HeStringsPanel*)user_data;
+  p->view->update();
+  p->showStatus();
+}
+
+void HeStringsPanel::showStatus() {
+  char buf[80];
+  sprintf(buf, "%d strings%s", strings->count(), strings->busy() ? ", searching..." : "");
+  status->copy_label(buf);
+  status->redraw();
+}
+
+//---- HeScriptPanel -------------------------------------------------------------
+
+HeScriptPanel::HeScriptPanel(HeDocumentManager *m)
+: Fl_Double_Window(640, 480)
+{
+  char buf[2048];
+  manager = m;
+  doc = m->document();
+  scriptName_ = 0;
+  running_ = stop_ = 0;
+  lastCheck_ = 0.0;
+  Fl_Button *b = new Fl_Button(10, 10, 110, 24, "Load Script...");
+  b->callback(loadCB, this);
+  b = new Fl_Button(130, 10, 110, 24, "Save Script...");
+  b->callback(saveCB, this);
+  runButton = new Fl_Button(250, 10, 80, 24, "Run");
+  runButton->callback(runCB, this);
+  status = new Fl_Box(340, 10, w()-350, 24);
+  status->align(FL_ALIGN_LEFT|FL_ALIGN_INSIDE|FL_ALIGN_CLIP);
+  source = new Fl_Text_Buffer();
+  output = new Fl_Text_Buffer();
+  editor = new Fl_Text_Editor(10, 44, w()-20, 260);
+  editor->buffer(source);
+  editor->textfont(FL_COURIER);
+  outputView = new Fl_Text_Display(10, 314, w()-20, h()-324);
+  outputView->buffer(output);
+  outputView->textfont(FL_COURIER);
+  end();
+  resizable(editor);
+  callback(closeCB, this);
+  sprintf(buf, "Script for %.2000s", doc->filename() ? doc->filename() : "document");
+  copy_label(buf);
+}
+
+HeScriptPanel::~HeScriptPanel() {
+  // the widgets must let go of the buffers first
+  editor->buffer(0);
+  outputView->buffer(0);
+  delete source;
+  delete output;
+  if (scriptName_)
+    free(scriptName_);
+}
+
+void HeScriptPanel::loadCB(Fl_Widget*, void *user_data) {
+  HeScriptPanel *p = (HeScriptPanel*)user_data;
+  if (p->running_) return;
+  const char *name = fl_file_chooser("Load Script", "*.he", p->scriptName_);
+  if (!name) return;
+  if (p->source->loadfile(name)) {
+    fl_alert("Can't open script \n\"%s\"\n%s.", name, strerror(errno));
+    return;
+  }
+  if (p->scriptName_)
+    free(p->scriptName_);
+  p->scriptName_ = _strdup(name);
+}
+
+void HeScriptPanel::saveCB(Fl_Widget*, void *user_data) {
+  HeScriptPanel *p = (HeScriptPanel*)user_data;
+  const char *name = fl_file_chooser("Save Script", "*.he", p->scriptName_);
+  if (!name) return;
+  if (p->source->savefile(name)) {
+    fl_alert("Can't save script \n\"%s\"\n%s.", name, strerror(errno));
+    return;
+  }
+  if (p->scriptName_)
+    free(p->scriptName_);
+  p->scriptName_ = _strdup(name);
+}
+
+/// Closing the panel stops a running script.
+void HeScriptPanel::closeCB(Fl_Widget*, void *user_data) {
+  HeScriptPanel *p = (HeScriptPanel*)user_data;
+  p->stop_ = 1;
+  p->hide();
+}
+
+void HeScriptPanel::runCB(Fl_Widget*, void *user_data) {
+  HeScriptPanel *p = (HeScriptPanel*)user_data;
+  if (p->running_)
+    p->stop_ = 1;
+  else
+    p->run();
+}
+
+/// Compile and run the script in the editor. Compile errors move the
+/// editor's cursor to the line. The main window is inactive while the
+/// script runs, so the document can't be edited under it, and
+/// HeApp::closeDocument() won't close it.
+void HeScriptPanel::run() {
+  char buf[256];
+  char *text = source->text();
+  HeScript script;
+  int line = 0;
+  output->text("");
+  const char *err = script.compile(text, &line);
+  free(text);
+  if (err) {
+    snprintf(buf, sizeof(buf), "Line %d: %s.", line, err);
+    status->copy_label(buf);
+    status->redraw();
+    int pos = 0;
+    while (--line>0)
+      pos = source->line_end(pos)+1;
+    editor->insert_position(pos);
+    editor->show_insert_position();
+    return;
+  }
+  running_ = 1;
+  stop_ = 0;
+  runButton->label("Stop");
+  status->label("Running...");
+  status->redraw();
+  Fl_Window *main = doc->window();
+  if (main) main->deactivate();
+  double t0 = heSeconds();
+  lastCheck_ = t0;
+  err = script.run(this);
+  if (main) main->activate();
+  running_ = 0;
+  runButton->label("Run");
+  if (err)
+    status->copy_label(err);
+  else {
+    snprintf(buf, sizeof(buf), "Done in %.3f s.", heSeconds()-t0);
+    status->copy_label(buf);
+  }
+  status->redraw();
+  manager->update();
+}
+
+unsigned long long HeScriptPanel::size() {
+  return doc->size();
+}
+
+int HeScriptPanel::lock(unsigned long long pos, unsigned long long n,
+                        HeScriptSpan *span)
+{
+  HeDataSpan s[2];
+  int i, ns = doc->lockData((heIndex)pos, (heIndex)n, s);
+  for (i=0; i<ns; i++) {
+    span[i].data = s[i].data;
+    span[i].size = s[i].size;
+  }
+  return ns;
+}
+
+void HeScriptPanel::unlock() {
+  doc->unlockData();
+}
+
+const char *HeScriptPanel::replace(unsigned long long pos,
+                                   unsigned long long nDel,
+                                   const unsigned char *data,
+                                   unsigned long long nIns)
+{
+  // replaceBytes() would clamp the position and append
+  if (pos>doc->size() || nDel>doc->size()-pos)
+    return "Can't replace past the end of the document";
+  // replaceBytes() leaves the document alone if it runs out of memory
+  heIndex expected = doc->size()-(heIndex)nDel+(heIndex)nIns;
+  doc->replaceBytes((heIndex)pos, (heIndex)nDel, data, (heIndex)nIns);
+  if (doc->size()!=expected) return "Not enough memory";
+  return 0;
+}
+
+void HeScriptPanel::print(const char *text, size_t n) {
+  char *line = (char*)malloc(n+1);
+  memcpy(line, text, n);
+  line[n] = 0;
+  output->append(line);
+  free(line);
+}
+
+/// Annotations are kept one per line, like the ones typed in.
+void HeScriptPanel::note(unsigned long long pos, unsigned long long n,
+                         const char *text)
+{
+  char *line = _strdup(text), *p;
+  for (p=line; *p; p++)
+    if (*p=='\n' || *p=='\r') *p = ' ';
+  doc->marks()->annotate((heIndex)pos, (heIndex)(pos+n), line);
+  free(line);
+  doc->setChanged();
+}
+
+/// Keep the panel alive a few times a second, so Stop can be clicked.
+char HeScriptPanel::poll() {
+  double t = heSeconds();
+  if (t-lastCheck_>=0.1) {
+    lastCheck_ = t;
+    Fl::check();
+  }
+  return stop_;
+}
+
+//---- HeDiff ------------------------------------------------------------------
+
+// 4 kByte blocks, so even a 4 GByte document has no more than a million
+#define HE_DIFF_SHIFT 12
+#define HE_DIFF_CHUNK 256
+// bytes compared per lock while searching
+#define HE_DIFF_STEP  (1<<20)
+
+HeDiff::HeDiff(HeDocument *a, HeDocument *b, Fl_Widget *v) {
+  docA = a;
+  docB = b;
+  view = v;
+  diffBytes_ = 0;
+  prefix_ = 0;
+  nBlocks_ = 0;
+  dirtyFirst_ = dirtyLast_ = 0;
+  jobFirst_ = jobLast_ = 0;
+  running_ = scheduled_ = cancelled_ = 0;
+  cancel_ = 0;
+  docA->addListener(this);
+  docB->addListener(this);
+  update();
+}
+
+HeDiff::~HeDiff() {
+  if (scheduled_)
+    Fl::remove_timeout(restartCB, this);
+  cancelAndWait();
+  docA->removeListener(this);
+  docB->removeListener(this);
+  if (diffBytes_)
+    free(diffBytes_);
+  if (prefix_)
+    free(prefix_);
+}
+
+void HeDiff::markDirty(heIndex first, heIndex last) {
+  if (dirtyFirst_>=dirtyLast_) {
+    dirtyFirst_ = first; dirtyLast_ = last;
+  } else {
+    if (first<dirtyFirst_) dirtyFirst_ = first;
+    if (last>dirtyLast_) dirtyLast_ = last;
+  }
+}
+
+/// Edits in either document change the differences. Overwriting only
+/// affects its own blocks, inserting and deleting everything behind it.
+void HeDiff::edited(heIndex pos, heIndex nDel, heIndex nIns) {
+  heIndex first = pos>>HE_DIFF_SHIFT, last = (heIndex)-1;
+  if (nDel==nIns)
+    last = (heIndex)(((unsigned long long)pos+nIns+(1<<HE_DIFF_SHIFT)-1)
+                     >>HE_DIFF_SHIFT);
+  markDirty(first, last);
+  if (!scheduled_) {
+    scheduled_ = 1;
+    Fl::add_timeout(MM_MAP_DELAY, restartCB, this);
+  }
+  view->redraw();
+}
+
+void HeDiff::restartCB(void *user_data) {
+  HeDiff *d = (HeDiff*)user_data;
+  d->scheduled_ = 0;
+  d->update();
+  d->view->redraw();
+}
+
+void HeDiff::allocate() {
+  heIndex size = docA->size();
+  if (docB->size()>size) size = docB->size();
+  heIndex n = (heIndex)(((unsigned long long)size+(1<<HE_DIFF_SHIFT)-1)
+                        >>HE_DIFF_SHIFT);
+  if (n>nBlocks_)
+    markDirty(nBlocks_, n);
+  diffBytes_ = (unsigned short*)realloc(diffBytes_, (n+1)*sizeof(short));
+  prefix_ = (unsigned long long*)realloc(prefix_, (n+1)*sizeof(*prefix_));
+  nBlocks_ = n;
+}
+
+void HeDiff::update() {
+  cancelAndWait();
+  allocate();
+  if (dirtyLast_>nBlocks_) dirtyLast_ = nBlocks_;
+  if (dirtyFirst_>=dirtyLast_) {
+    dirtyFirst_ = dirtyLast_ = 0;
+    sumBlocks();
+    return;
+  }
+  jobFirst_ = dirtyFirst_; jobLast_ = dirtyLast_;
+  dirtyFirst_ = dirtyLast_ = 0;
+  running_ = 1;
+  cancelled_ = 0;
+  HeThreadPool::shared()->post(jobCB, this);
+}
+
+void HeDiff::cancelAndWait() {
+  mutex_.lock();
+  if (running_) {
+    cancel_ = 1;
+    while (running_)
+      idle_.wait(mutex_);
+    cancel_ = 0;
+    if (cancelled_)
+      markDirty(jobFirst_, jobLast_);
+  }
+  mutex_.unlock();
+}
+
+void HeDiff::jobCB(void *user_data, int) {
+  HeDiff *d = (HeDiff*)user_data;
+  heIndex n = (d->jobLast_-d->jobFirst_+HE_DIFF_CHUNK-1)/HE_DIFF_CHUNK;
+  HeThreadPool::shared()->parallelFor(n, chunkCB, d);
+  if (!d->cancel_)
+    d->sumBlocks();
+  d->mutex_.lock();
+  d->cancelled_ = d->cancel_;
+  d->running_ = 0;
+  d->idle_.broadcast();
+  d->mutex_.unlock();
+}
+
+void HeDiff::chunkCB(void *user_data, int index) {
+  HeDiff *d = (HeDiff*)user_data;
+  heIndex first = d->jobFirst_+index*HE_DIFF_CHUNK;
+  heIndex last = first+HE_DIFF_CHUNK;
+  if (last>d->jobLast_) last = d->jobLast_;
+  d->computeBlocks(first, last);
+}
+
+/// Count the differing bytes of each block. Bytes that exist in only one
+/// of the documents count as different.
+void HeDiff::computeBlocks(heIndex first, heIndex last) {
+  unsigned char a[1<<HE_DIFF_SHIFT], b[1<<HE_DIFF_SHIFT];
+  for (heIndex i=first; i<last && !cancel_; i++) {
+    heIndex na = docA->read(i<<HE_DIFF_SHIFT, a, 1<<HE_DIFF_SHIFT);
+    heIndex nb = docB->read(i<<HE_DIFF_SHIFT, b, 1<<HE_DIFF_SHIFT);
+    heIndex common = na<nb ? na : nb;
+    diffBytes_[i] = (unsigned short)(heCountMismatch(a, b, common)
+                                     +(na>nb ? na-nb : nb-na));
+  }
+}
+
+void HeDiff::sumBlocks() {
+  prefix_[0] = 0;
+  for (heIndex i=0; i<nBlocks_; i++)
+    prefix_[i+1] = prefix_[i]+diffBytes_[i];
+}
+
+/// The block counts may only be used to skip ahead if they are up to date.
+char HeDiff::indexed() {
+  return !busy() && dirtyFirst_>=dirtyLast_ && nBlocks_>0;
+}
+
+unsigned long long HeDiff::differences() {
+  return nBlocks_ ? prefix_[nBlocks_] : 0;
+}
+
+int HeDiff::marked(heIndex first, heIndex last) {
+  if (!nBlocks_) return 0;
+  heIndex b0 = first>>HE_DIFF_SHIFT;
+  heIndex b1 = (heIndex)(((unsigned long long)last+(1<<HE_DIFF_SHIFT)-1)
+                         >>HE_DIFF_SHIFT);
+  if (b0>=nBlocks_) b0 = nBlocks_-1;
+  if (b1>nBlocks_) b1 = nBlocks_;
+  if (b1<=b0) b1 = b0+1;
+  return prefix_[b1]>prefix_[b0];
+}
+
+int HeDiff::spans(heIndex first, heIndex last, HeSpan *dst, int max) {
+  unsigned char a[256], b[256];
+  heIndex pos = first;
+  int n = 0;
+  while (pos<last && n<max) {
+    heIndex i, m = last-pos;
+    if (m>sizeof(a)) m = sizeof(a);
+    heIndex na = docA->read(pos, a, m), nb = docB->read(pos, b, m);
+    for (i=0; i<m; i++) {
+      char differs = (i<na && i<nb) ? a[i]!=b[i] : (i<na)!=(i<nb);
+      if (!differs) continue;
+      if (n>0 && dst[n-1].last==pos+i) {
+        dst[n-1].last++;
+      } else if (n<max) {
+        dst[n].first = pos+i; dst[n].last = pos+i+1;
+        dst[n].attr = HE_HIGHLIGHT;
+        dst[n].color = fl_rgb_color(255, 200, 120);
+        n++;
+      }
+    }
+    pos += m;
+  }
+  return n;
+}
+
+/// Find the first or last difference in [pos, pos+n), which must lie within
+/// both documents. Both buffers are compared in place; the range is cut
+/// where either document has its gap, so every piece is contiguous.
+heIndex HeDiff::compare(heIndex pos, heIndex n, char backwards) {
+  HeDataSpan a[2], b[2];
+  heIndex cut[4], found = (heIndex)-1;
+  int i, j, nc = 0;
+  int na = docA->lockData(pos, n, a);
+  int nb = docB->lockData(pos, n, b);
+  cut[nc++] = 0;
+  if (na==2) cut[nc++] = a[0].size;
+  if (nb==2) cut[nc++] = b[0].size;
+  if (nc==3 && cut[2]<cut[1]) { heIndex t = cut[1]; cut[1] = cut[2]; cut[2] = t; }
+  cut[nc++] = n;
+  for (j=0; j<nc-1 && found==(heIndex)-1; j++) {
+    i = backwards ? nc-2-j : j;
+    heIndex p0 = cut[i], len = cut[i+1]-p0;
+    if (!len || !na || !nb) continue;
+    const unsigned char *pa = p0<a[0].size ? a[0].data+p0 : a[1].data+p0-a[0].size;
+    const unsigned char *pb = p0<b[0].size ? b[0].data+p0 : b[1].data+p0-b[0].size;
+    size_t k = backwards ? heLastMismatch(pa, pb, len) : heMismatch(pa, pb, len);
+    if (k<len) found = pos+p0+(heIndex)k;
+  }
+  docB->unlockData();
+  docA->unlockData();
+  return found;
+}
+
+/// First difference at or after 'from', or -1 if there is none. Blocks the
+/// index knows to be equal are skipped without reading them.
+heIndex HeDiff::next(heIndex from) {
+  heIndex sa = docA->size(), sb = docB->size();
+  heIndex common = sa<sb ? sa : sb, end = sa<sb ? sb : sa;
+  heIndex pos = from;
+  char useIndex = indexed();
+  while (pos<common) {
+    if (useIndex) {
+      heIndex b = pos>>HE_DIFF_SHIFT;
+      while (b<nBlocks_ && !diffBytes_[b]) b++;
+      if (b>=nBlocks_) { pos = common; break; }
+      if ((b<<HE_DIFF_SHIFT)>pos) pos = b<<HE_DIFF_SHIFT;
+      if (pos>=common) break;
+    }
+    heIndex n = common-pos;
+    if (n>HE_DIFF_STEP) n = HE_DIFF_STEP;
+    heIndex found = compare(pos, n, 0);
+    if (found!=(heIndex)-1) return found;
+    pos += n;
+  }
+  // the tail of the longer document is all different
+  if (from<end && common<end)
+    return from>common ? from : common;
+  return (heIndex)-1;
+}
+
+/// Last difference before 'from', or -1 if there is none.
+heIndex HeDiff::previous(heIndex from) {
+  heIndex sa = docA->size(), sb = docB->size();
+  heIndex common = sa<sb ? sa : sb, end = sa<sb ? sb : sa;
+  heIndex pos = from>end ? end : from;
+  char useIndex = indexed();
+  if (pos>common)
+    return pos-1;
+  while (pos>0) {
+    if (useIndex) {
+      heIndex b = (pos-1)>>HE_DIFF_SHIFT;
+      while (b>0 && !diffBytes_[b]) b--;
+      if (!diffBytes_[b]) return (heIndex)-1;
+      unsigned long long p = (unsigned long long)(b+1)<<HE_DIFF_SHIFT;
+      if (p<pos) pos = (heIndex)p;
+    }
+    heIndex n = pos>HE_DIFF_STEP ? HE_DIFF_STEP : pos;
+    heIndex found = compare(pos-n, n, 1);
+    if (found!=(heIndex)-1) return found;
+    pos -= n;
+  }
+  return (heIndex)-1;
+}
+
+/// First byte of the run of differences that contains 'pos'.
+heIndex HeDiff::runStart(heIndex pos) {
+  HeSpan sp[HE_MAX_SPANS];
+  while (pos>0) {
+    heIndex first = pos>256 ? pos-256 : 0;
+    int n = spans(first, pos, sp, HE_MAX_SPANS);
+    if (n==0 || sp[n-1].last!=pos) break;
+    pos = sp[n-1].first;
+    if (pos>first) break;
+  }
+  return pos;
+}
+
+/// First byte after the run of differences that starts at 'pos'.
+heIndex HeDiff::runEnd(heIndex pos) {
+  HeSpan sp[HE_MAX_SPANS];
+  heIndex sa = docA->size(), sb = docB->size();
+  heIndex end = sa<sb ? sb : sa;
+  while (pos<end) {
+    heIndex last = end-pos>256 ? pos+256 : end;
+    int n = spans(pos, last, sp, HE_MAX_SPANS);
+    if (n==0 || sp[0].first!=pos) break;
+    pos = sp[0].last;
+    if (pos<last) break;
   }
-  return Fl_Group::handle(event);
+  return pos;
 }
 
-//---- HeColumn ----------------------------------------------------------------
+//---- HeAligner ---------------------------------------------------------------
 
-HeColumn::HeColumn(int x, int y, int w, int h, HeDocumentManager *m)
-: Fl_Group(x, y, w, h)
+HeAligner::HeAligner(HeDocument *a, HeDocument *b, Fl_Widget *v)
+: sideA_(this, 0), sideB_(this, 1)
 {
-  end();
-  box(FL_FLAT_BOX);
-  manager = m;
+  docA = a;
+  docB = b;
+  view = v;
+  result_ = new HeAlignment();
+  job_ = 0;
+  changes_[0] = changes_[1] = 0;
+  nChanges_[0] = nChanges_[1] = 0;
+  sizeA_ = sizeB_ = 0;
+  running_ = scheduled_ = 0;
+  cancel_ = 0;
+  docA->addListener(this);
+  docB->addListener(this);
+  start();
+}
+
+HeAligner::~HeAligner() {
+  if (scheduled_)
+    Fl::remove_timeout(restartCB, this);
+  cancelAndWait();
+  docA->removeListener(this);
+  docB->removeListener(this);
+  delete result_;
+  if (changes_[0]) free(changes_[0]);
+  if (changes_[1]) free(changes_[1]);
+}
+
+/// Any edit may move everything behind it, so the running alignment is
+/// useless and is stopped right away.
+void HeAligner::edited(heIndex, heIndex, heIndex) {
+  if (running_)
+    cancel_ = 1;
+  if (!scheduled_) {
+    scheduled_ = 1;
+    Fl::add_timeout(MM_MAP_DELAY, restartCB, this);
+  }
+  view->redraw();
+}
+
+void HeAligner::restartCB(void *user_data) {
+  HeAligner *al = (HeAligner*)user_data;
+  al->scheduled_ = 0;
+  al->start();
+  al->view->redraw();
+}
+
+void HeAligner::start() {
+  cancelAndWait();
+  job_ = new HeAlignment();
+  sizeA_ = docA->size();
+  sizeB_ = docB->size();
+  cancel_ = 0;
+  running_ = 1;
+  HeThreadPool::shared()->post(jobCB, this);
+}
+
+void HeAligner::cancelAndWait() {
+  mutex_.lock();
+  if (running_) {
+    cancel_ = 1;
+    while (running_)
+      idle_.wait(mutex_);
+  }
+  mutex_.unlock();
+  if (job_)
+    delete job_;
+  job_ = 0;
+}
+
+void HeAligner::jobCB(void *user_data, int) {
+  HeAligner *al = (HeAligner*)user_data;
+  al->job_->compute(HeDocument::readCB, al->docA, al->sizeA_,
+                    HeDocument::readCB, al->docB, al->sizeB_,
+                    HeThreadPool::shared(), &al->cancel_);
+  al->mutex_.lock();
+  al->running_ = 0;
+  al->idle_.broadcast();
+  al->mutex_.unlock();
+}
+
+/// Take over a finished alignment. Returns 1 if there is a new one.
+char HeAligner::collect() {
+  mutex_.lock();
+  char done = !running_;
+  mutex_.unlock();
+  if (!done || !job_) return 0;
+  if (cancel_) {
+    delete job_;
+    job_ = 0;
+    return 0;
+  }
+  delete result_;
+  result_ = job_;
+  job_ = 0;
+  indexChanges();
+  return 1;
+}
+
+int HeAligner::progress() {
+  if (!job_ || !sizeB_) return 100;
+  return (int)((unsigned long long)job_->scanned*100/sizeB_);
+}
+
+/// List the steps that each side highlights: deletions in A, insertions
+/// in B.
+void HeAligner::indexChanges() {
+  for (int side=0; side<2; side++) {
+    int type = side ? HE_DIFF_INSERT : HE_DIFF_DELETE, n = 0;
+    changes_[side] = (int*)realloc(changes_[side], (result_->nOps+1)*sizeof(int));
+    for (int i=0; i<result_->nOps; i++)
+      if (result_->ops[i].type==type) changes_[side][n++] = i;
+    nChanges_[side] = n;
+  }
+}
+
+/// Index of the first change on 'side' that ends after 'pos'.
+int HeAligner::firstChange(int side, heIndex pos) {
+  int lo = 0, hi = nChanges_[side];
+  while (lo<hi) {
+    int mid = (lo+hi)/2;
+    HeDiffOp *op = result_->ops+changes_[side][mid];
+    size_t end = (side ? op->bPos : op->aPos)+op->len;
+    if (end<=pos) lo = mid+1; else hi = mid;
+  }
+  return lo;
+}
+
+int HeAlignSide::spans(heIndex first, heIndex last, HeSpan *dst, int max) {
+  HeAligner *al = aligner;
+  int i = al->firstChange(side, first), n = 0;
+  for ( ; i<al->nChanges_[side] && n<max; i++) {
+    HeDiffOp *op = al->result_->ops+al->changes_[side][i];
+    size_t start = side ? op->bPos : op->aPos, end = start+op->len;
+    if (start>=last) break;
+    dst[n].first = start<first ? first : (heIndex)start;
+    dst[n].last = end>last ? last : (heIndex)end;
+    dst[n].attr = HE_HIGHLIGHT;
+    dst[n].color = side ? fl_rgb_color(170, 230, 170) : fl_rgb_color(255, 170, 170);
+    n++;
+  }
+  return n;
+}
+
+int HeAlignSide::marked(heIndex first, heIndex last) {
+  HeAligner *al = aligner;
+  int i = al->firstChange(side, first);
+  if (i>=al->nChanges_[side]) return 0;
+  HeDiffOp *op = al->result_->ops+al->changes_[side][i];
+  return (side ? op->bPos : op->aPos)<last;
+}
+
+heIndex HeAlignSide::mapOffset(heIndex pos) {
+  return (heIndex)aligner->result_->map(side, pos);
+}
+
+//---- HePatchJob ----------------------------------------------------------------
+
+HePatchJob::HePatchJob(HeDocumentManager *m) {
   doc = m->document();
-  layout();
+  src_ = 0;
+  al_ = 0;
+  patchName_[0] = 0;
+  size_ = 0;
+  ips_ = 0;
+  err_ = 0;
+  running_ = polling_ = 0;
+  cancel_ = 0;
+  doc->addListener(this);
 }
 
-int HeColumn::handle(int event) {
-  switch (event) {
-    case FL_KEYBOARD:
-      break;
+HePatchJob::~HePatchJob() {
+  if (polling_)
+    Fl::remove_timeout(pollCB, this);
+  cancelAndWait();
+  doc->removeListener(this);
+}
+
+/// Stop a running job and throw away what it wrote.
+void HePatchJob::cancelAndWait() {
+  mutex_.lock();
+  if (running_) {
+    cancel_ = 1;
+    while (running_)
+      idle_.wait(mutex_);
   }
-  return Fl_Group::handle(event);
+  mutex_.unlock();
+  if (cancel_ && patchName_[0])
+    unlink(patchName_);
+  cancel_ = 0;
+  delete al_;
+  al_ = 0;
+  delete src_;
+  src_ = 0;
 }
 
-void HeColumn::layout() {
-  lines = h() / manager->fontHeight();
-  redraw();
+/// The patch would mix bytes from before and after the edit.
+void HePatchJob::edited(heIndex, heIndex, heIndex) {
+  if (running_)
+    cancel_ = 1;
 }
 
-void HeColumn::draw_bg() {
-  int i, ch = manager->fontHeight();
-  draw_box();
-  fl_color(0xc8c8c800);
-  for (i=column()->topRow()&1; i<lines; i+=2) {
-    int yp = i*ch + y();
-    fl_rectf(x(), yp, w(), ch);
+void HePatchJob::start(const char *patchName) {
+  src_ = new HeFileSource();
+  if (!src_->open(doc->filename())) {
+    fl_alert("Can't open file \n\"%s\"\nfor reading.\n%s.",
+             doc->filename(), strerror(errno));
+    delete src_;
+    src_ = 0;
+    return;
   }
+  strncpy(patchName_, patchName, 2047); patchName_[2047] = 0;
+  ips_ = hePatchFormatByName(patchName_)==HE_PATCH_IPS;
+  size_ = doc->size();
+  al_ = ips_ ? 0 : new HeAlignment();
+  err_ = 0;
+  cancel_ = 0;
+  running_ = 1;
+  HeThreadPool::shared()->post(jobCB, this);
+  polling_ = 1;
+  Fl::add_timeout(MM_MAP_POLL, pollCB, this);
 }
 
-heIndex HeColumn::eventRow() {
-  int py = Fl::event_y() - y() - 2; //++ why -2 ???
-  py /= manager->fontHeight();
-  return column()->topRow()+py;
+void HePatchJob::jobCB(void *user_data, int) {
+  HePatchJob *p = (HePatchJob*)user_data;
+  const char *err = 0;
+  HeFileSource *src = p->src_;
+  size_t size = p->size_;
+  if (p->ips_) {
+    err = heWriteIps(p->patchName_, HeFileSource::read, src, src->size,
+                     HeDocument::readCB, p->doc, size);
+  } else if (p->al_->compute(HeFileSource::read, src, src->size,
+                             HeDocument::readCB, p->doc, size,
+                             HeThreadPool::shared(), &p->cancel_)) {
+    err = heWriteBps(p->patchName_, HeFileSource::read, src, src->size,
+                     HeDocument::readCB, p->doc, size, p->al_);
+  }
+  p->mutex_.lock();
+  p->err_ = err;
+  p->running_ = 0;
+  p->idle_.broadcast();
+  p->mutex_.unlock();
 }
 
-//---- HeSeperatorColumn -------------------------------------------------------
+void HePatchJob::pollCB(void *user_data) {
+  HePatchJob *p = (HePatchJob*)user_data;
+  p->mutex_.lock();
+  char done = !p->running_;
+  p->mutex_.unlock();
+  if (!done) {
+    Fl::repeat_timeout(MM_MAP_POLL, pollCB, user_data);
+    return;
+  }
+  p->polling_ = 0;
+  char cancelled = p->cancel_;
+  const char *err = p->err_;
+  p->cancelAndWait();
+  if (cancelled)
+    fl_alert("The document was changed while the patch \n\"%s\"\n"
+             "was created. The patch was not written.", p->patchName_);
+  else if (err)
+    fl_alert("Can't create patch \n\"%s\".\n%s.", p->patchName_, err);
+}
 
-HeScrollbarColumn::HeScrollbarColumn(int x, int y, int w, int h,
-                                     HeDocumentManager *cm)
-: HeColumn(x, y, w, h, cm)
+//---- HeDiffWindow ------------------------------------------------------------
+
+HeDiffWindow::HeDiffWindow(HeApp *app, const char *nameA, const char *nameB)
+: Fl_Double_Window(1000, 640, "Compare Files")
 {
-  begin();
-  scroll = new Fl_Scrollbar(x, y, w, h-14);
-  scroll->type(FL_VERTICAL);
-  scroll->callback(scrollCB, this);
+  int ty = 48, hw = w()/2;
+  diff = 0;
+  aligner = 0;
+  op_ = -1;
+  Fl_Button *b;
+  b = new Fl_Button(4, 4, 90, 22, "@< Previous");
+  b->callback(previousCB, this);
+  b = new Fl_Button(98, 4, 90, 22, "Next @>");
+  b->callback(nextCB, this);
+  alignButton = new Fl_Check_Button(196, 4, 70, 22, "Align");
+  alignButton->tooltip("Match up moved content instead of comparing offsets");
+  alignButton->callback(alignCB, this);
+  summary = new Fl_Box(270, 4, w()-274, 22);
+  summary->align(FL_ALIGN_LEFT|FL_ALIGN_INSIDE);
+  Fl_Group *split = new Fl_Group(0, ty, w(), h()-ty);
+  docA = new HeDocument(0, ty, hw, h()-ty, app);
+  docA->align(FL_ALIGN_TOP_LEFT);
+  docB = new HeDocument(hw, ty, w()-hw, h()-ty, app);
+  docB->align(FL_ALIGN_TOP_LEFT);
+  split->end();
   end();
-  resizable(scroll);
+  resizable(split);
+  callback(closeCB, this);
+  docA->loadFile(nameA);
+  docB->loadFile(nameB);
+  docA->layout();
+  docB->layout();
+  diff = new HeDiff(docA, docB, this);
+  HeColumnGroup *ca = docA->manager()->columns();
+  HeColumnGroup *cb = docB->manager()->columns();
+  docA->manager()->addLayer(diff);
+  docB->manager()->addLayer(diff);
+  ca->marks(diff);
+  cb->marks(diff);
+  ca->link(cb);
+  cb->link(ca);
+  showSummary();
 }
 
-void HeScrollbarColumn::getWidth(int &fixed, int &perByte) {
-  fixed += 14;
-  perByte += 0;
+HeDiffWindow::~HeDiffWindow() {
+  Fl::remove_timeout(pollCB, this);
+  HeColumnGroup *ca = docA->manager()->columns();
+  HeColumnGroup *cb = docB->manager()->columns();
+  ca->link(0); ca->marks(0);
+  cb->link(0); cb->marks(0);
+  docA->manager()->removeLayer(diff);
+  docB->manager()->removeLayer(diff);
+  delete diff;
+  if (aligner) {
+    docA->manager()->removeLayer(aligner->side(0));
+    docB->manager()->removeLayer(aligner->side(1));
+    delete aligner;
+  }
 }
 
-void HeScrollbarColumn::layout() {
-  HeColumn::layout();
-  value(column()->topRow());
+/// Switch both views between the offset comparison and the alignment.
+void HeDiffWindow::useLayers(char aligned) {
+  HeDocumentManager *ma = docA->manager(), *mb = docB->manager();
+  ma->removeLayer(diff);
+  mb->removeLayer(diff);
+  if (aligner) {
+    ma->removeLayer(aligner->side(0));
+    mb->removeLayer(aligner->side(1));
+  }
+  if (aligned) {
+    ma->addLayer(aligner->side(0));
+    mb->addLayer(aligner->side(1));
+    ma->columns()->marks(aligner->side(0));
+    mb->columns()->marks(aligner->side(1));
+    ma->columns()->link(mb->columns(), aligner->side(0));
+    mb->columns()->link(ma->columns(), aligner->side(1));
+  } else {
+    ma->addLayer(diff);
+    mb->addLayer(diff);
+    ma->columns()->marks(diff);
+    mb->columns()->marks(diff);
+    ma->columns()->link(mb->columns());
+    mb->columns()->link(ma->columns());
+  }
 }
 
-void HeScrollbarColumn::value(heIndex ix) {
-  scroll->value(ix, column()->rowsPerPage(), 0, column()->rows());
+void HeDiffWindow::alignCB(Fl_Widget*, void *user_data) {
+  HeDiffWindow *dw = (HeDiffWindow*)user_data;
+  char aligned = dw->alignButton->value();
+  if (aligned && !dw->aligner)
+    dw->aligner = new HeAligner(dw->docA, dw->docB, dw);
+  dw->useLayers(aligned);
+  dw->showSummary();
+  dw->redraw();
 }
 
-void HeScrollbarColumn::scrollCB(Fl_Widget*, void *userdata) {
-  HeScrollbarColumn *This = (HeScrollbarColumn*)userdata;
-  This->column()->topRow(This->scroll->value());
+char HeDiffWindow::busy() {
+  return diff->busy() || (aligner && aligner->busy());
+}
+
+void HeDiffWindow::draw() {
+  Fl_Double_Window::draw();
+  if (diff && busy() && !Fl::has_timeout(pollCB, this))
+    Fl::add_timeout(MM_MAP_POLL, pollCB, this);
+}
+
+void HeDiffWindow::pollCB(void *user_data) {
+  HeDiffWindow *dw = (HeDiffWindow*)user_data;
+  if (dw->aligner && dw->aligner->collect())
+    dw->op_ = -1;
+  dw->showSummary();
+  dw->redraw();
+  if (dw->busy())
+    Fl::repeat_timeout(MM_MAP_POLL, pollCB, user_data);
+}
+
+void HeDiffWindow::showSummary() {
+  char buf[200];
+  if (alignButton->value()) {
+    HeAlignment *al = aligner->alignment();
+    int n = sprintf(buf, "%llu bytes matched, %llu inserted, %llu deleted",
+                    (unsigned long long)al->total(HE_DIFF_COPY),
+                    (unsigned long long)al->total(HE_DIFF_INSERT),
+                    (unsigned long long)al->total(HE_DIFF_DELETE));
+    if (aligner->busy())
+      sprintf(buf+n, " (aligning... %d%%)", aligner->progress());
+    summary->copy_label(buf);
+    return;
+  }
+  int n = sprintf(buf, "%llu bytes differ", diff->differences());
+  if (diff->busy())
+    strcpy(buf+n, " (comparing...)");
+  else if (docA->size()!=docB->size())
+    sprintf(buf+n, ", sizes are %u and %u bytes", docA->size(), docB->size());
+  summary->copy_label(buf);
+}
+
+void HeDiffWindow::jump(heIndex pos) {
+  if (pos==(heIndex)-1) {
+    fl_beep();
+    return;
+  }
+  docA->manager()->cursor(pos);
+  docB->manager()->cursor(pos);
+}
+
+/// Move both cursors to the next or previous insertion or deletion. The
+/// current step is remembered, because several can start at the same place.
+void HeDiffWindow::jumpToOp(int step) {
+  HeAlignment *al = aligner->alignment();
+  heIndex ca = docA->manager()->cursor(), cb = docB->manager()->cursor();
+  int i = op_;
+  if (i<0 || i>=al->nOps || al->ops[i].aPos!=ca || al->ops[i].bPos!=cb)
+    i = al->find(0, ca);
+  for (i+=step; i>=0 && i<al->nOps; i+=step)
+    if (al->ops[i].type!=HE_DIFF_COPY) break;
+  if (i<0 || i>=al->nOps) {
+    fl_beep();
+    return;
+  }
+  op_ = i;
+  docA->manager()->cursor((heIndex)al->ops[i].aPos);
+  docB->manager()->cursor((heIndex)al->ops[i].bPos);
+}
+
+/// Move to the start of the next run of differences.
+void HeDiffWindow::nextCB(Fl_Widget*, void *user_data) {
+  HeDiffWindow *dw = (HeDiffWindow*)user_data;
+  if (dw->alignButton->value()) {
+    dw->jumpToOp(1);
+    return;
+  }
+  heIndex pos = dw->diff->runEnd(dw->docA->manager()->cursor());
+  dw->jump(dw->diff->next(pos));
+}
+
+void HeDiffWindow::previousCB(Fl_Widget*, void *user_data) {
+  HeDiffWindow *dw = (HeDiffWindow*)user_data;
+  if (dw->alignButton->value()) {
+    dw->jumpToOp(-1);
+    return;
+  }
+  heIndex pos = dw->diff->runStart(dw->docA->manager()->cursor());
+  pos = dw->diff->previous(pos);
+  if (pos!=(heIndex)-1)
+    pos = dw->diff->runStart(pos);
+  dw->jump(pos);
+}
+
+void HeDiffWindow::closeCB(Fl_Widget*, void *user_data) {
+  HeDiffWindow *dw = (HeDiffWindow*)user_data;
+  if (!dw->docA->close() || !dw->docB->close())
+    return;
+  dw->hide();
+  Fl::delete_widget(dw);
 }
 
 //---- HeSeperatorColumn -------------------------------------------------------
@@ -1342,12 +5730,11 @@ void HeSeperatorColumn::getWidth(int &fixed, int &perByte) {
   perByte += 0;
 }
 
-void HeSeperatorColumn::draw() {
+void HeSeperatorColumn::drawRows(int r0, int r1) {
   int xp = x()+w()/2;
-  draw_bg();
+  draw_bg(r0, r1);
   fl_color(FL_BLUE);
   fl_line(xp, y(), xp, y()+h());
-  draw_label();
 }
 
 //---- HeAddrColumn ------------------------------------------------------------
@@ -1363,15 +5750,15 @@ void HeAddrColumn::getWidth(int &fixed, int &perByte) {
   perByte += 0;
 }
 
-void HeAddrColumn::draw() {
+void HeAddrColumn::drawRows(int r0, int r1) {
   int i, cw = manager->fontWidth(), ch = manager->fontHeight();
   int cs = manager->spaceWidth(), ca = manager->fontAscent();
   int first = column()->topLeftByte(), bpr = column()->bytesPerRow();
   char buf[20];
-  draw_bg();
+  draw_bg(r0, r1);
   manager->setFont();
   fl_color(FL_BLACK);
-  for (i=0; i<lines; i++) {
+  for (i=r0; i<r1; i++) {
     int xp = x()+cs, yp = i*ch + y() + ca;
     unsigned int ix = first+i*bpr;
     if (ix<=doc->size()) {
@@ -1379,9 +5766,9 @@ void HeAddrColumn::draw() {
       fl_draw(buf,   2, xp,           yp);
       fl_draw(buf+2, 4, xp+cw*2+  cs, yp);
       fl_draw(buf+6, 4, xp+cw*6+2*cs, yp);
+      heDrawCounters.drawCalls += 3;
     }
   }
-  draw_label();
 }
 
 int HeAddrColumn::handle(int event) {
@@ -1413,52 +5800,58 @@ void HeHexColumn::getWidth(int &fixed, int &perByte) {
   perByte += 2*cw+cs;
 }
 
-void HeHexColumn::draw() {
-  int i, j;
+void HeHexColumn::drawRows(int r0, int r1) {
+  static const char hex[] = "0123456789abcdef";
+  int i, j, k, n;
   int cw = manager->fontWidth(), ch = manager->fontHeight();
   int cs = manager->spaceWidth(), ca = manager->fontAscent(), cd = 2*cw+cs;
-  int first = column()->topLeftByte(), bpr = column()->bytesPerRow();
-  char buf[4];
-  draw_bg();
+  int bpr = column()->bytesPerRow();
+  heIndex first = column()->topLeftByte(), size = doc->size();
+  HeSpan spans[HE_MAX_SPANS];
+  char buf[2];
+  draw_bg(r0, r1);
   manager->setFont();
-  fl_color(FL_BLACK);
-  for (i=0; i<lines; i++) {
+  for (i=r0; i<r1; i++) {
     int xp = x()+cs, yp = i*ch + y() + ca;
-    for (j=0; j<bpr; j++) {
-      heIndex ix = first+i*bpr+j;
-      if (ix<=doc->size()) {
-        int a = manager->attributeAt(ix);
-        if (a & HE_SELECTED) { // draw a red background cursor
-          fl_rectf(xp+j*cd-2, yp-ca, 2*cw+4, ch, 180, 200, 255);
-          fl_color(FL_BLACK);
-        }
-        if (a & HE_CURSOR) { // draw a red background cursor
-          fl_rectf(xp+j*cd-2, yp-ca, 2*cw+4, ch, 255, 180, 180);
-          fl_color(FL_RED);
-          fl_rect(xp+j*cd-2, yp-ca, 2*cw+4, ch);
-          if (this == Fl::focus()) {
-            if (subCrsr) {
-              if (manager->insertMode())
-                fl_rectf(xp+j*cd+cw, yp-ca+ch/2, cw+2, ch/2, 255, 48, 48);
-              else
-                fl_rectf(xp+j*cd+cw, yp-ca, cw+2, ch, 255, 48, 48);
-            } else {
-              if (manager->insertMode())
-                fl_rectf(xp+j*cd-2, yp-ca+ch/2, cw+2, ch/2, 255, 48, 48);
-              else
-                fl_rectf(xp+j*cd-2, yp-ca, cw+2, ch, 255, 48, 48);
-            }
+    heIndex row = first+i*bpr;
+    if (row>size) break;
+    // backgrounds: one rectangle per run of equally highlighted bytes
+    n = manager->rowSpans(row, row+bpr, spans, HE_MAX_SPANS);
+    for (k=0; k<n; k++) {
+      int xs = xp+(spans[k].first-row)*cd, nj = spans[k].last-spans[k].first;
+      if (spans[k].attr & HE_CURSOR) { // draw a red background cursor
+        fl_rectf(xs-2, yp-ca, 2*cw+4, ch, 255, 180, 180);
+        fl_color(FL_RED);
+        fl_rect(xs-2, yp-ca, 2*cw+4, ch);
+        if (this == Fl::focus()) {
+          if (subCrsr) {
+            if (manager->insertMode())
+              fl_rectf(xs+cw, yp-ca+ch/2, cw+2, ch/2, 255, 48, 48);
+            else
+              fl_rectf(xs+cw, yp-ca, cw+2, ch, 255, 48, 48);
+          } else {
+            if (manager->insertMode())
+              fl_rectf(xs-2, yp-ca+ch/2, cw+2, ch/2, 255, 48, 48);
+            else
+              fl_rectf(xs-2, yp-ca, cw+2, ch, 255, 48, 48);
           }
-          fl_color(FL_BLACK);
-        }
-        if (!(a & HE_OUT_OF_BOUNDS)) {
-          sprintf(buf, "%02x", doc->byteAt(first+i*bpr+j));
-          fl_draw(buf, 2, xp+j*cd, yp);
         }
+      } else {
+        fl_rectf(xs-2, yp-ca, (nj-1)*cd+2*cw+4, ch, spans[k].color);
       }
     }
+    // text
+    fl_color(FL_BLACK);
+    heIndex nb = size-row;
+    if (nb>(heIndex)bpr) nb = bpr;
+    for (j=0; j<(int)nb; j++) {
+      unsigned char c = doc->byteAt(row+j);
+      buf[0] = hex[c>>4]; buf[1] = hex[c&15];
+      fl_draw(buf, 2, xp+j*cd, yp);
+    }
+    heDrawCounters.drawCalls += n+nb;
+    heDrawCounters.bytesFormatted += nb;
   }
-  draw_label();
 }
 
 heIndex HeHexColumn::eventAddr() {
@@ -1484,6 +5877,9 @@ int HeHexColumn::handle(int event) {
       }
     case FL_DRAG:
       manager->cursor(eventAddr(), (event==FL_DRAG)||(Fl::event_shift()));
+      // dragging with Alt selects a block
+      if (event==FL_PUSH && Fl::event_alt())
+        manager->blockMode(1);
       subCrsr = 0;
       return 1;
     case FL_KEYBOARD:
@@ -1494,11 +5890,18 @@ int HeHexColumn::handle(int event) {
         else if (c>='a' && c<='f') v = c-'a'+10;
         else if (c>='A' && c<='F') v = c-'A'+10;
         if (v==-1) break;
+        // in a block, the nibble goes into every row
+        if (subCrsr==0 ? manager->typeInBlock(v<<4, 0x0f, 0)
+                       : manager->typeInBlock(v, 0xf0, 1)) {
+          subCrsr = !subCrsr;
+          redraw();
+          return 1;
+        }
         heIndex crsr = manager->cursor();
         if (subCrsr==0) {
           if (manager->insertMode() || crsr==doc->size()) {
-            doc->insertBytes(crsr, 1);
-            doc->byteAt(crsr, v<<4);
+            unsigned char b = v<<4;
+            doc->insertBytes(crsr, &b, 1);
           } else {
             doc->byteAt(crsr, (doc->byteAt(crsr)&0x0f)|(v<<4));
           }
@@ -1530,45 +5933,48 @@ void HeTextColumn::getWidth(int &fixed, int &perByte) {
   perByte += cw;
 }
 
-void HeTextColumn::draw() {
-  int i, j;
+void HeTextColumn::drawRows(int r0, int r1) {
+  int i, j, k, n;
   int cw = manager->fontWidth(), ch = manager->fontHeight();
   int cs = manager->spaceWidth(), ca = manager->fontAscent();
-  int first = column()->topLeftByte(), bpr = column()->bytesPerRow();
-  draw_bg();
+  int bpr = column()->bytesPerRow();
+  heIndex first = column()->topLeftByte(), size = doc->size();
+  HeSpan spans[HE_MAX_SPANS];
+  draw_bg(r0, r1);
   manager->setFont();
-  fl_color(FL_BLACK);
-  for (i=0; i<lines; i++) {
+  for (i=r0; i<r1; i++) {
     int xp = x()+cs, yp = i*ch + y() + ca;
-    for (j=0; j<bpr; j++) {
-      heIndex ix = first+i*bpr+j;
-      if (ix<=doc->size()) {
-        unsigned char c = doc->byteAt(ix);
-        int a = manager->attributeAt(ix);
-        if (a & HE_SELECTED) {
-          fl_rectf(xp+j*cw, yp-ca, cw, ch, 180, 200, 255);
-          fl_color(FL_BLACK);
-        }
-        if (a & HE_CURSOR) {
-          if (this == Fl::focus()) {
-            if (manager->insertMode())
-              fl_rectf(xp+j*cw, yp-ca+ch/2, cw, ch/2, 255, 48, 48);
-            else
-              fl_rectf(xp+j*cw, yp-ca, cw, ch, 255, 48, 48);
-          } else {
-            fl_rectf(xp+j*cw, yp-ca, cw, ch, 255, 180, 180);
-            fl_color(FL_RED);
-            fl_rect(xp+j*cw, yp-ca, cw, ch);
-          }
-          fl_color(FL_BLACK);
+    heIndex row = first+i*bpr;
+    if (row>size) break;
+    n = manager->rowSpans(row, row+bpr, spans, HE_MAX_SPANS);
+    for (k=0; k<n; k++) {
+      int xs = xp+(spans[k].first-row)*cw, nj = spans[k].last-spans[k].first;
+      if (spans[k].attr & HE_CURSOR) {
+        if (this == Fl::focus()) {
+          if (manager->insertMode())
+            fl_rectf(xs, yp-ca+ch/2, cw, ch/2, 255, 48, 48);
+          else
+            fl_rectf(xs, yp-ca, cw, ch, 255, 48, 48);
+        } else {
+          fl_rectf(xs, yp-ca, cw, ch, 255, 180, 180);
+          fl_color(FL_RED);
+          fl_rect(xs, yp-ca, cw, ch);
         }
-        if (c<32||c==127) c = '.';
-        if (!(a & HE_OUT_OF_BOUNDS))
-          fl_draw((char*)&c, 1, xp+j*cw, yp);
+      } else {
+        fl_rectf(xs, yp-ca, nj*cw, ch, spans[k].color);
       }
     }
+    fl_color(FL_BLACK);
+    heIndex nb = size-row;
+    if (nb>(heIndex)bpr) nb = bpr;
+    for (j=0; j<(int)nb; j++) {
+      unsigned char c = doc->byteAt(row+j);
+      if (c<32||c==127) c = '.';
+      fl_draw((char*)&c, 1, xp+j*cw, yp);
+    }
+    heDrawCounters.drawCalls += n+nb;
+    heDrawCounters.bytesFormatted += nb;
   }
-  draw_label();
 }
 
 heIndex HeTextColumn::eventAddr() {
@@ -1591,13 +5997,20 @@ int HeTextColumn::handle(int event) {
       }
     case FL_DRAG:
       manager->cursor(eventAddr(), (event==FL_DRAG)||(Fl::event_shift()));
+      // dragging with Alt selects a block
+      if (event==FL_PUSH && Fl::event_alt())
+        manager->blockMode(1);
       return 1;
     case FL_KEYBOARD:
       if (Fl::event_state()&(MM_CMD|FL_META)) break;
       if (Fl::event_length()) {
         char c = Fl::event_text()[0];
         if ( c<' ' && c!=0x0d && c!=0x0a ) break;
-        manager->insert(Fl::event_text(), Fl::event_length());
+        const char *t = Fl::event_text();
+        int i, n = Fl::event_length();
+        for (i=0; i<n && manager->typeInBlock(t[i], 0, 1); i++) { }
+        if (i==0)
+          manager->insert(t, n);
         return 1;
       }
       break;
@@ -1605,6 +6018,245 @@ int HeTextColumn::handle(int event) {
   return HeColumn::handle(event);
 }
 
+//---- HePluginColumn ------------------------------------------------------------
+
+// longest text of a row
+#define MM_PLUGIN_TEXT 512
+// time that a plugin column may take per redraw
+#define MM_PLUGIN_DRAW_TIME 0.02
+
+HePluginColumn::HePluginColumn(int x, int y, int w, int h, HeDocumentManager *cm,
+                               const HePluginColumnType *t)
+: HeColumn(x, y, w, h, cm)
+{
+  type = t;
+}
+
+void HePluginColumn::getWidth(int &fixed, int &perByte) {
+  fixed += type->chars*manager->fontWidth() + 2*manager->spaceWidth();
+  perByte += 0;
+}
+
+/// rowText() runs on the main thread, so the plugin gets a time box per
+/// redraw; the rows after it is used up stay blank until the next one.
+void HePluginColumn::drawRows(int r0, int r1) {
+  int i, ch = manager->fontHeight(), cs = manager->spaceWidth();
+  int ca = manager->fontAscent(), bpr = column()->bytesPerRow();
+  heIndex first = column()->topLeftByte(), size = doc->size();
+  char text[MM_PLUGIN_TEXT];
+  double deadline = heSeconds()+MM_PLUGIN_DRAW_TIME;
+  draw_bg(r0, r1);
+  manager->setFont();
+  for (i=r0; i<r1 && heSeconds()<deadline; i++) {
+    heIndex row = first+i*bpr;
+    if (row>=size) break;
+    int n = size-row<(heIndex)bpr ? (int)(size-row) : bpr;
+    text[0] = 0;
+    type->rowText(type->user, manager->plugins(), row, n, text, sizeof(text));
+    text[sizeof(text)-1] = 0;
+    fl_color(FL_BLACK);
+    fl_push_clip(x()+cs, y()+i*ch, w()-cs, ch);
+    fl_draw(text, x()+cs, y()+i*ch+ca);
+    fl_pop_clip();
+    heDrawCounters.drawCalls++;
+  }
+}
+
+//---- HeDocumentPlugins ---------------------------------------------------------
+
+HeDocumentPlugins::HeDocumentPlugins(HeDocumentManager *m) {
+  manager = m;
+  doc = m->document();
+  nTasks_ = 0;
+  polling_ = 0;
+  doc->addListener(this);
+}
+
+HeDocumentPlugins::~HeDocumentPlugins() {
+  if (polling_)
+    Fl::remove_timeout(pollCB, this);
+  // each task stops and waits for its plugin to return
+  for (int i=0; i<nTasks_; i++)
+    delete task_[i];
+  doc->removeListener(this);
+}
+
+unsigned long long HeDocumentPlugins::size() {
+  return doc->size();
+}
+
+int HeDocumentPlugins::lock(unsigned long long pos, unsigned long long n,
+                            HePluginSpan *span)
+{
+  HeDataSpan s[2];
+  // lockData() locks even if there is nothing to see
+  if (pos>doc->size()) pos = doc->size();
+  int i, ns = doc->lockData((heIndex)pos, (heIndex)n, s);
+  for (i=0; i<ns; i++) {
+    span[i].data = s[i].data;
+    span[i].size = s[i].size;
+  }
+  return ns;
+}
+
+void HeDocumentPlugins::unlock() {
+  doc->unlockData();
+}
+
+void HeDocumentPlugins::edited(heIndex, heIndex, heIndex) {
+  stop();
+}
+
+void HeDocumentPlugins::run(const HePluginAnalysis *a) {
+  if (nTasks_==HE_MAX_PLUGIN_TASKS) {
+    fl_alert("Too many plugins are running already.");
+    return;
+  }
+  HePluginTask *t = new HePluginTask(this, a);
+  task_[nTasks_++] = t;
+  t->start();
+  if (!polling_) {
+    polling_ = 1;
+    Fl::add_timeout(MM_MAP_POLL, pollCB, this);
+  }
+}
+
+/// Tasks that are stopped return soon, and their results are dropped.
+void HeDocumentPlugins::stop() {
+  for (int i=0; i<nTasks_; i++)
+    task_[i]->stop();
+}
+
+void HeDocumentPlugins::pollCB(void *user_data) {
+  HeDocumentPlugins *p = (HeDocumentPlugins*)user_data;
+  int i, j;
+  for (i=j=0; i<p->nTasks_; i++) {
+    HePluginTask *t = p->task_[i];
+    if (t->done()) {
+      p->collect(t);
+      delete t;
+    } else {
+      p->task_[j++] = t;
+    }
+  }
+  p->nTasks_ = j;
+  if (j)
+    Fl::repeat_timeout(MM_MAP_POLL, pollCB, user_data);
+  else
+    p->polling_ = 0;
+}
+
+/// Annotations are kept one per line, like the ones typed in.
+void HeDocumentPlugins::collect(HePluginTask *t) {
+  if (t->timedOut()) {
+    fl_alert("The plugin \"%s\" took too long and was stopped.", t->name());
+    return;
+  }
+  if (t->stopped())
+    return;
+  if (t->error()) {
+    fl_alert("The plugin \"%s\" failed:\n%s", t->name(), t->error());
+    return;
+  }
+  int i, n = 0;
+  heIndex size = doc->size();
+  for (i=0; i<t->notes(); i++) {
+    const HePluginTask::Note &m = t->noteAt(i);
+    if (m.pos>=size || m.n==0) continue;
+    unsigned long long end = m.n>size-m.pos ? size : m.pos+m.n;
+    char *line = _strdup(m.text), *q;
+    for (q=line; *q; q++)
+      if (*q=='\n' || *q=='\r') *q = ' ';
+    doc->marks()->annotate((heIndex)m.pos, (heIndex)end, line);
+    free(line);
+    n++;
+  }
+  if (n) {
+    doc->setChanged();
+    manager->update();
+  }
+}
+
+//---- HeNoteColumn --------------------------------------------------------------
+
+// width of the annotation column in characters
+#define MM_NOTE_CHARS 24
+// annotations looked at per redraw
+#define MM_NOTE_MAX 1024
+
+HeNoteColumn::HeNoteColumn(int x, int y, int w, int h, HeDocumentManager *cm)
+: HeColumn(x, y, w, h, cm)
+{
+}
+
+void HeNoteColumn::getWidth(int &fixed, int &perByte) {
+  if (doc->marks()->tree()->notes())
+    fixed += MM_NOTE_CHARS*manager->fontWidth() + 3*manager->spaceWidth() + 6;
+  perByte += 0;
+}
+
+/// Every annotation gets a bar along the rows it covers, and its text in the
+/// row where it starts, unless an earlier one took that row already.
+void HeNoteColumn::drawRows(int r0, int r1) {
+  int i, ch = manager->fontHeight(), cs = manager->spaceWidth();
+  int ca = manager->fontAscent(), bpr = column()->bytesPerRow();
+  unsigned long long first = column()->topLeftByte();
+  unsigned long long a = first+(unsigned long long)r0*bpr;
+  unsigned long long b = first+(unsigned long long)r1*bpr;
+  draw_bg(r0, r1);
+  HeMarkTree *tree = doc->marks()->tree();
+  if (!tree->notes() || r1<=r0) return;
+  fl_color(FL_BLUE);
+  fl_line(x(), y(), x(), y()+h());
+  HeMark *m = (HeMark*)malloc(MM_NOTE_MAX*sizeof(HeMark));
+  char *taken = (char*)calloc(r1-r0, 1);
+  int n = tree->query(a, b, m, MM_NOTE_MAX);
+  manager->setFont();
+  for (i=0; i<n; i++) {
+    if (!m[i].text) continue;
+    int rs = m[i].start<a ? r0 : (int)((m[i].start-first)/bpr);
+    int re = m[i].end>b ? r1-1 : (int)((m[i].end-1-first)/bpr);
+    fl_color(HeDocumentMarks::color(m[i]));
+    fl_rectf(x()+3, y()+rs*ch, 4, (re-rs+1)*ch);
+    if (m[i].start>=a && !taken[rs-r0]) {
+      taken[rs-r0] = 1;
+      fl_color(FL_BLACK);
+      fl_push_clip(x()+cs+8, y()+rs*ch, w()-cs-8, ch);
+      fl_draw(m[i].text, x()+cs+8, y()+rs*ch+ca);
+      fl_pop_clip();
+      heDrawCounters.drawCalls++;
+    }
+  }
+  free(taken);
+  free(m);
+}
+
+/// A click selects the annotated bytes, a double click edits the text.
+int HeNoteColumn::handle(int event) {
+  switch (event) {
+    case FL_PUSH: {
+      int bpr = column()->bytesPerRow();
+      unsigned long long row = (unsigned long long)eventRow()*bpr;
+      HeMark m[HE_MAX_SPANS];
+      HeMarkTree *tree = doc->marks()->tree();
+      int i, n = tree->query(row, row+bpr, m, HE_MAX_SPANS);
+      for (i=0; i<n && !m[i].text; i++) { }
+      if (i==n) return 1;
+      manager->select((heIndex)m[i].start, (heIndex)(m[i].end-1), false);
+      if (Fl::event_clicks()) {
+        Fl::event_clicks(0);
+        const char *text = fl_input("Annotation:", m[i].text);
+        if (!text) return 1;
+        if (*text) tree->text(m[i].id, text);
+        else tree->remove(m[i]);
+        doc->setChanged();
+        manager->update();
+      }
+      return 1; }
+  }
+  return HeColumn::handle(event);
+}
+
 //---- HeInput -----------------------------------------------------------------
 
 HeInput::HeInput(int x, int y, int w, int h, const char *label, int bb, int nn)
@@ -1619,6 +6271,14 @@ HeInput::HeInput(int x, int y, int w, int h, const char *label, int bb, int nn)
 }
 
 void HeInput::value(heIndex v) {
+  value64(v);
+}
+
+void HeInput::value(const char *t) {
+  Fl_Input::value(t);
+}
+
+void HeInput::value64(unsigned long long v) {
   static char *lu[] = {
     "NUL", "SOH", "STX", "ETX", "EOT", "ENQ", "ACK", "BEL",
     "BS" , "HT" , "NL" , "VT" , "NP" , "CR" , "SO" , "SI",
@@ -1630,12 +6290,12 @@ void HeInput::value(heIndex v) {
     case 0:
       if (v==127) strcpy(buf, "DEL");
       else if (v<32) strcpy(buf, lu[v]);
-      else { buf[0] = ' '; buf[1]=v; buf[2]=0; }
+      else { buf[0] = ' '; buf[1]=(char)v; buf[2]=0; }
       break;
     case 2: {
       char *dst = buf;
       for (int i=wdt-1; i>=0; i--)
-        *dst++ = v&(1<<i)?'1':'0';
+        *dst++ = v&(1ULL<<i)?'1':'0';
       *dst = 0;
       break; }
     default:
@@ -1663,14 +6323,14 @@ void HeInput::base(int bb) {
   base_ = bb;
   switch (bb) {
     case 0: strcpy(fmt, "%c"); break;
-    case 8: strcpy(fmt, "%#o"); break;
-    case 10: strcpy(fmt, "%u"); break;
-    case -10: strcpy(fmt, "%d"); break;
-    case 16: sprintf(fmt, "%%0%dx", wdt); break;
+    case 8: strcpy(fmt, "%#llo"); break;
+    case 10: strcpy(fmt, "%llu"); break;
+    case -10: strcpy(fmt, "%lld"); break;
+    case 16: sprintf(fmt, "%%0%dllx", wdt); break;
     case 100: strcpy(fmt, "%g"); break;
     case 101: strcpy(fmt, "%lg"); break;
   }
-  value(value_);
+  value64(value_);
 }
 
 //----- HeButton ---------------------------------------------------------------
@@ -1735,6 +6395,7 @@ HePreferences::HePreferences()
   app.get("propsize", propsize, MM_PROP_SIZE);
   app.get("fixedfont", fixedfont, MM_FIXED_FONT);
   app.get("fixedsize", fixedsize, MM_FIXED_SIZE);
+  app.get("hugepages", hugepages, 0);
   Fl_Preferences win(app, "win");
   win.get("flags", winflags, 0);
   win.get("x", winx, 55);
@@ -1748,6 +6409,7 @@ HePreferences::~HePreferences() {
   app.set("propsize", propsize);
   app.set("fixedfont", fixedfont);
   app.set("fixedsize", fixedsize);
+  app.set("hugepages", hugepages);
   Fl_Preferences win(app, "win");
   win.set("flags", winflags);
   win.set("x", winx);
@@ -1758,9 +6420,111 @@ HePreferences::~HePreferences() {
   if (fixedfont) free(fixedfont);
 }
 
+/// Plugins are loaded from a folder next to the preferences.
+void HePreferences::pluginFolder(char *path, int n) {
+  path[0] = 0;
+  app.getUserdataPath(path, n-8);
+  strcat(path, "plugins");
+}
+
+//---- HeBenchmark -------------------------------------------------------------
+
+// 'mickey -benchmark [MBytes [frames]]' builds a document with synthetic data
+// and renders the standard columns into an offscreen surface for a number of
+// typical interactions. It needs a display, but no user: run it under Xvfb
+// ('make bench') to catch rendering regressions.
+
+HeBenchmark::HeBenchmark(int mbytes, int nFrames) {
+  frames = nFrames;
+  window = new Fl_Double_Window(prefs.winw, prefs.winh, "mickey benchmark");
+  doc = new HeDocument(0, 0, window->w(), window->h(), 0);
+  doc->filename("synthetic.bin");
+  window->end();
+  window->show();
+  Fl::check();
+  heIndex i, n = mbytes<<20;
+  doc->insertBytes(0, n);
+  // a mix of text and binary data, so that both columns have work to do
+  unsigned char *dst = doc->blockAt(0, n);
+  unsigned int seed = 4711;
+  for (i=0; i<n; i++) {
+    seed = seed*1103515245+12345;
+    unsigned char c = seed>>16;
+    dst[i] = ((i>>10)&1) ? 'A'+c%26 : c;
+  }
+  doc->layout();
+  group = doc->manager()->columns();
+  surface = fl_create_offscreen(window->w(), window->h());
+  frame();
+}
+
+HeBenchmark::~HeBenchmark() {
+  fl_delete_offscreen(surface);
+  delete window;
+}
+
+/// Render one frame of the column group and wait until the display is done.
+void HeBenchmark::frame() {
+  window->make_current();
+  fl_begin_offscreen(surface);
+  group->draw();
+  fl_end_offscreen();
+  group->clear_damage();
+#if !defined(WIN32) && !defined(__APPLE__)
+  XSync(fl_display, False);
+#endif
+}
+
+void HeBenchmark::run(const char *name, int scenario) {
+  HeDocumentManager *mgr = doc->manager();
+  int i;
+  mgr->cursor(0);
+  group->topRow(0);
+  mgr->insertMode(scenario==3);
+  frame();
+  heDrawCounters.drawCalls = heDrawCounters.bytesFormatted = 0;
+  double t0 = heSeconds();
+  for (i=0; i<frames; i++) {
+    switch (scenario) {
+      case 0: group->scrollRows(1); break;
+      case 1: mgr->cursor(mgr->cursor()+group->bytesPerPage()); break;
+      case 2: mgr->cursor(mgr->cursor()+group->bytesPerRow()+3, true); break;
+      case 3: mgr->insert("x", 1); break;
+    }
+    frame();
+  }
+  double dt = heSeconds()-t0;
+  if (dt<=0.0) dt = 0.000001;
+  printf("%-16s %8d %10.3f %12lu %12.2f\n", name, frames, 1000.0*dt/frames,
+         heDrawCounters.drawCalls/frames, heDrawCounters.bytesFormatted/dt/1e6);
+}
+
+int HeBenchmark::main(int argc, char **argv) {
+  int mbytes = argc>2 ? atoi(argv[2]) : 16;
+  int nFrames = argc>3 ? atoi(argv[3]) : 500;
+  if (mbytes<1) mbytes = 1;
+  if (nFrames<1) nFrames = 1;
+  HeBenchmark b(mbytes, nFrames);
+  printf("mickey rendering benchmark, %d MBytes, %d bytes per row\n",
+         mbytes, b.group->bytesPerRow());
+  printf("%-16s %8s %10s %12s %12s\n",
+         "scenario", "frames", "ms/frame", "draws/frame", "MB fmt/s");
+  b.run("scroll", 0);
+  b.run("page-down", 1);
+  b.run("selection-drag", 2);
+  b.run("typing", 3);
+  return 0;
+}
+
 //---- main --------------------------------------------------------------------
 
 int main(int argc, char **argv) {
+  // converting and batch processing need no display
+  if (argc>1 && strcmp(argv[1], "-convert")==0)
+    return heConvertMain(argc, argv);
+  if (argc>1 && strcmp(argv[1], "-batch")==0)
+    return HeBatch::main(argc, argv);
+
   Fl::set_font(FL_HELVETICA, prefs.propfont);
   Fl::set_font(FL_COURIER, prefs.fixedfont);
   fl_font(FL_COURIER, prefs.fixedsize);
@@ -1769,6 +6533,9 @@ int main(int argc, char **argv) {
   fixedFontWidth = (int)(fl_width("W")+.7);
   fl_message_font(FL_HELVETICA, MM_PROP_SIZE_MED);
 
+  if (argc>1 && strcmp(argv[1], "-benchmark")==0)
+    return HeBenchmark::main(argc, argv);
+
   HeApp app(argc, argv);
   return Fl::run();
 }
@@ -11,9 +11,32 @@
 #include <FL/Fl_Preferences.H>
 #include <FL/Fl_Input.H>
 #include <FL/Fl_Button.H>
+#include <FL/Fl_Double_Window.H>
+#include <FL/x.H>
+#include <stdio.h>
+
+#include "heThread.h"
+#include "heDigest.h"
+#include "heMagic.h"
+#include "heTemplate.h"
+#include "heStrings.h"
+#include "heMarks.h"
+#include "heTransform.h"
+#include "heConvert.h"
+#include "heScript.h"
+#include "hePlugin.h"
+#include "heProfile.h"
 
 typedef unsigned int heIndex;
 
+/// Counters for profiling the column renderers.
+struct HeDrawCounters {
+  unsigned long drawCalls;
+  unsigned long bytesFormatted;
+};
+extern HeDrawCounters heDrawCounters;
+double heSeconds();
+
 class Fl_Window;
 class Fl_Group;
 class Fl_Box;
@@ -22,18 +45,39 @@ class Fl_Menu_Item;
 class Fl_Menu_Bar;
 class Fl_Tabs;
 class Fl_Input;
+class Fl_Output;
+class Fl_Text_Buffer;
+class Fl_Text_Editor;
+class Fl_Text_Display;
 class HeMenubar;
 class HeToolbar;
 class HeDocumentList;
 class HeDocument;
 class HeDocumentManager;
+class HeFileType;
+class HeDocumentMarks;
 class HeStatusBar;
 class HeColumnGroup;
 class HeColumn;
 class HeScrollbarColumn;
+class HeOverviewColumn;
+class HeStatsPanel;
+class HeHashPanel;
+class HeStructPanel;
+class HeStringsPanel;
+class HeScriptPanel;
+class HeDocumentPlugins;
+class HeDiff;
+class HeDiffWindow;
+class HeAligner;
+class HeAlignment;
+class HeFileSource;
+class HePatchJob;
+class HeHistogramView;
 class HeInput;
 class HeButton;
 class HeCycleButton;
+class HeBenchmark;
 
 class HeApp {
   HeDocumentList *doclist;
@@ -58,13 +102,38 @@ class HeMenubar : public Fl_Group {
   static void openCB(Fl_Widget*, void*);
   static void saveCB(Fl_Widget*, void*);
   static void saveAsCB(Fl_Widget*, void*);
+  static void insertFileCB(Fl_Widget*, void*);
+  static void exportCB(Fl_Widget*, void*);
+  static void exportAsCB(Fl_Widget*, void*);
+  static void importCB(Fl_Widget*, void*);
+  static void copyAsCB(Fl_Widget*, void*);
   static void closeCB(Fl_Widget*, void*);
   static void quitCB(Fl_Widget*, void*);
   static void cutCB(Fl_Widget*, void*);
   static void copyCB(Fl_Widget*, void*);
   static void pasteCB(Fl_Widget*, void*);
   static void insertModeCB(Fl_Widget*, void*);
+  static void bookmarkCB(Fl_Widget*, void*);
+  static void nextMarkCB(Fl_Widget*, void*);
+  static void previousMarkCB(Fl_Widget*, void*);
+  static void annotateCB(Fl_Widget*, void*);
+  static void removeMarkCB(Fl_Widget*, void*);
+  static void transformCB(Fl_Widget*, void*);
+  static void blockCB(Fl_Widget*, void*);
+  static void statisticsCB(Fl_Widget*, void*);
+  static void hashCB(Fl_Widget*, void*);
+  static void structureCB(Fl_Widget*, void*);
+  static void stringsCB(Fl_Widget*, void*);
+  static void scriptCB(Fl_Widget*, void*);
+  static void pluginCB(Fl_Widget*, void*);
+  static void stopPluginsCB(Fl_Widget*, void*);
+  static void compareCB(Fl_Widget*, void*);
+  static void createPatchCB(Fl_Widget*, void*);
+  static void applyPatchCB(Fl_Widget*, void*);
   static void aboutCB(Fl_Widget*, void*);
+  static void overlayCB(Fl_Widget*, void*);
+  static void overlayTimerCB(void*);
+  static void traceCB(Fl_Widget*, void*);
 public:
   HeMenubar(int x, int y, int w, int h, HeApp*);
 };
@@ -109,20 +178,55 @@ public:
   void add(const char *filename=0);
 };
 
+#define HE_MAX_LISTENERS  16
+
+/// Listeners are told about every change to the document contents: 'nDel'
+/// bytes at 'pos' were replaced by 'nIns' new bytes. Overwriting bytes
+/// reports nDel==nIns.
+class HeEditListener {
+public:
+  virtual ~HeEditListener() { }
+  virtual void edited(heIndex pos, heIndex nDel, heIndex nIns) = 0;
+};
+
+/// Direct view of a contiguous part of the document buffer.
+struct HeDataSpan {
+  const unsigned char *data;
+  heIndex size;
+};
+
+/// A rectangular selection: 'rows' runs of 'width' bytes that start
+/// 'stride' bytes apart.
+struct HeBlock {
+  heIndex first, width, stride, rows;
+};
+
 class HeDocument : public Fl_Group {
   HeApp *app;
   HeDocumentManager *manager_;
   char *filename_;
   char *shortname;
   char *labelname;
+  char *tooltip_;
+  HeFileType *fileType_;
+  HeDocumentMarks *marks_;
   heIndex size_;
   unsigned char *buffer_;
   heIndex gap, gapSize;
+  char mapped_;
   int file_;
+  /// modification time of the file when it was loaded or saved
+  long long mtime_;
   void moveGapTo(heIndex pos);
-  void addToGap(heIndex n);
+  char resizeBuffer(heIndex capacity);
+  char addToGap(heIndex n);
+  void releaseGap();
   char changed_;
   void clearChanged();
+  HeMutex dataLock_;
+  HeEditListener *listeners_[HE_MAX_LISTENERS];
+  int nListeners_;
+  void notify(heIndex pos, heIndex nDel, heIndex nIns);
 public:
   HeDocument(int x, int y, int w, int h, HeApp*);
   ~HeDocument();
@@ -139,19 +243,129 @@ public:
   void byteAt(heIndex i, unsigned char v);
   void deleteBytes(heIndex first, heIndex n);
   void insertBytes(heIndex first, heIndex n);
+  void insertBytes(heIndex pos, const unsigned char *data, heIndex n);
+  void replaceBytes(heIndex pos, heIndex nDel, const unsigned char *data, heIndex nIns);
+  void transformBytes(heIndex pos, heIndex n, const HeTransform *t);
+  void transformBlock(const HeBlock &b, const HeTransform *t);
+  heIndex read(heIndex pos, unsigned char *dst, heIndex n);
+  char writeBytes(int fd, heIndex pos, heIndex n);
+  char exportBytes(int fd, heIndex pos, heIndex n);
+  heIndex insertFile(heIndex pos, const char *name);
+  static size_t readCB(void *doc, size_t pos, unsigned char *dst, size_t n);
+  int lockData(heIndex pos, heIndex n, HeDataSpan *span);
+  void unlockData();
+  void addListener(HeEditListener*);
+  void removeListener(HeEditListener*);
   void setChanged();
   char changed() { return changed_; }
+  HeFileType *fileType() { return fileType_; }
+  HeDocumentMarks *marks() { return marks_; }
+  void updateTooltip();
+};
+
+// embedded formats kept per scanned piece, and in total
+#define HE_TYPE_PIECE_HITS 16
+#define HE_TYPE_MAX_HITS 1024
+
+/// Recognizes the format of the document from its first bytes, then scans
+/// the whole document for embedded files in the background, one piece per
+/// job, so all cores share the work. Every piece is read with a little of
+/// its neighbours, so signatures that cross piece borders are found, too.
+/// Edits restart the scan after a short delay.
+class HeFileType : public HeEditListener {
+  HeDocument *doc;
+  int type_;
+  HeMagicHit *hits_, *pieceHits_;
+  int nHits_, *nPieceHits_, nPieces_;
+  heIndex size_;
+  HeMutex mutex_;
+  HeCondition idle_;
+  int running_;
+  char scheduled_, polling_;
+  volatile char cancel_;
+  static void pieceCB(void*, int);
+  static void restartCB(void*);
+  static void pollCB(void*);
+  void collect();
+public:
+  HeFileType(HeDocument*);
+  ~HeFileType();
+  virtual void edited(heIndex pos, heIndex nDel, heIndex nIns);
+  void start();
+  void cancelAndWait();
+  char busy() { return running_>0 || scheduled_; }
+  /// index of the signature that was recognized, or -1
+  int type() { return type_; }
+  int nHits() { return nHits_; }
+  const HeMagicHit &hit(int i) { return hits_[i]; }
+  int describe(char *dst, int n);
 };
 
 // attribute flags
 #define HE_CURSOR         0x0001
 #define HE_SELECTED       0x0002
 #define HE_OUT_OF_BOUNDS  0x0004
+#define HE_HIGHLIGHT      0x0008
+#define HE_BOOKMARK       0x0010
 
 // search flags
 #define HE_DONT_CARE      0x0100
 #define HE_IGNORE_CASE    0x0200
 
+#define HE_MAX_SPANS      64
+#define HE_MAX_LAYERS     8
+
+/// A range of bytes [first, last) that is drawn with the same attributes.
+struct HeSpan {
+  heIndex first, last;
+  int attr;
+  Fl_Color color;
+};
+
+/// Highlight layers add their own spans (marks, search hits, diffs, ...)
+/// beneath the selection and cursor.
+class HeHighlightLayer {
+public:
+  virtual ~HeHighlightLayer() { }
+  virtual int spans(heIndex first, heIndex last, HeSpan *dst, int max) = 0;
+};
+
+/// Marks drawn along the scrollbar, so the user can find them in the whole
+/// document at a glance.
+class HeScrollMarks {
+public:
+  virtual ~HeScrollMarks() { }
+  virtual int marked(heIndex first, heIndex last) = 0;
+};
+
+/// Bookmarks and annotations of a document. They move along with the bytes
+/// they belong to, are drawn as a highlight layer, and are kept in a file
+/// next to the document.
+class HeDocumentMarks : public HeEditListener, public HeHighlightLayer {
+  HeDocument *doc;
+  HeMarkTree tree_;
+public:
+  HeDocumentMarks(HeDocument*);
+  ~HeDocumentMarks();
+  virtual void edited(heIndex pos, heIndex nDel, heIndex nIns);
+  virtual int spans(heIndex first, heIndex last, HeSpan *dst, int max);
+  HeMarkTree *tree() { return &tree_; }
+  void toggleBookmark(heIndex pos);
+  void annotate(heIndex first, heIndex last, const char *text);
+  void removeAt(heIndex pos);
+  static Fl_Color color(const HeMark&);
+  static void sidecarName(const char *filename, char *dst, int n);
+  char load(const char *filename);
+  char save(const char *filename);
+};
+
+/// Translates positions of a view into the view that scrolls along with it.
+class HeOffsetMap {
+public:
+  virtual ~HeOffsetMap() { }
+  virtual heIndex mapOffset(heIndex pos) = 0;
+};
+
 class HeDocumentManager : public Fl_Group {
   HeDocument *doc;
   HeStatusBar *status;
@@ -159,9 +373,25 @@ class HeDocumentManager : public Fl_Group {
   heIndex cursor_;
   heIndex selection_;
   char insertMode_;
+  char block_;
+  heIndex blockStride_;
+  heIndex blockColumn_;
+  HeHighlightLayer *layers_[HE_MAX_LAYERS];
+  int nLayers_;
+  HeStatsPanel *stats_;
+  HeHashPanel *hash_;
+  HeStructPanel *struct_;
+  HeStringsPanel *strings_;
+  HeScriptPanel *script_;
+  HeDocumentPlugins *plugins_;
+  HePatchJob *patch_;
 public:
   HeDocumentManager(int x, int y, int w, int h, HeDocument*);
+  ~HeDocumentManager();
   HeDocument *document() { return doc; }
+  HeColumnGroup *columns() { return column; }
+  HeDocumentPlugins *plugins() { return plugins_; }
+  HePatchJob *patch() { return patch_; }
   void layout();
   void update();
   void setFont();
@@ -170,11 +400,18 @@ public:
   int spaceWidth();
   int fontAscent();
   int attributeAt(heIndex);
+  int rowSpans(heIndex first, heIndex last, HeSpan *dst, int max);
+  void addLayer(HeHighlightLayer*);
+  void removeLayer(HeHighlightLayer*);
   void select(heIndex, heIndex, bool toggle);
   void extendSelection(heIndex, heIndex);
   void cursor(heIndex, bool extend = false);
   heIndex cursor() { return cursor_; }
   heIndex selection() { return selection_; }
+  void blockMode(char on);
+  char blockMode() { return block_; }
+  char block(HeBlock *b);
+  char typeInBlock(unsigned char value, unsigned char keep, char advance);
   void insertMode(char m);
   char insertMode() { return insertMode_; }
   void insert(const char *text, heIndex len);
@@ -183,28 +420,58 @@ public:
   void copyToClipboard();
   void pasteFromClipboard();
   bool searchNext(const unsigned short*, int);
+  void showStatistics();
+  void showHashPanel();
+  void showStructure();
+  void showStrings();
+  void showScript();
+  char scriptRunning();
+  void toggleBookmark();
+  void nextMark();
+  void previousMark();
+  void annotateSelection();
+  void removeMarks();
+  void transformSelection(int op);
+  void exportSelection();
+  void insertFile();
+  char encodeSelection(int format, FILE *f, HeText *out);
+  void copyAs(int format);
+  void exportAs(int format);
+  void importAs(int format);
 };
 
 class HeStatusBar : public Fl_Group {
   HeDocumentManager *manager;
   HeDocument *doc;
   HeInput *crsr, *slct, *offs;
-  HeCycleButton *adrb, *dtab, *blsb, *brwm, *bins;
+  HeCycleButton *adrb, *dtab, *dinb, *blsb, *brwm, *bins;
   Fl_Group *hexGrp, *binGrp, *octGrp, *decGrp, *sdcGrp;
-  HeInput *d1x, *d2x, *d4x;
+  Fl_Group *txtGrp, *fltGrp, *i64Grp, *lebGrp, *timGrp;
+  HeInput *d1x, *d2x, *d4x, *d8x;
   HeInput *d1b, *d2b;
   HeInput *d1o, *d2o, *d4o;
   HeInput *d1d, *d2d, *d4d;
-  HeInput *d1c, *d4f, *d8f;
+  HeInput *d1s, *d2s, *d4s;
+  HeInput *d1c, *u8c, *u16c;
+  HeInput *d2f, *d4f, *d8f;
+  HeInput *d8u, *d8s;
+  HeInput *vlu, *vls;
+  HeInput *tm4, *tm8;
   int byteOrder_;
+  heIndex cursor_, selection_;
+  char pending_;
+  static void cursorTimeoutCB(void*);
   static void cycleAddressBaseCB(Fl_Widget*, void*);
   static void cycleDataBaseCB(Fl_Widget*, void*);
+  static void cycleInspectorCB(Fl_Widget*, void*);
   static void lsbMsbModeCB(Fl_Widget*, void*);
   static void readOnlyModeCB(Fl_Widget*, void*);
   static void insertModeCB(Fl_Widget*, void*);
 public:
   HeStatusBar(int x, int y, int w, int h, HeDocumentManager*);
+  ~HeStatusBar();
   void cursor(heIndex a, heIndex b);
+  void updateCursor();
   void updateData();
   void updateFlags();
   void update() { updateData(); updateFlags(); }
@@ -219,12 +486,26 @@ class HeColumnGroup : public Fl_Group {
   int bytesPerRow_;
   heIndex topByte_;
   heIndex topLeftByte_;
+  HeColumnGroup *linked_;
+  HeOffsetMap *linkMap_;
+  char syncing_;
+  HeScrollMarks *marks_;
+  Fl_Offscreen backBuffer_, shiftBuffer_;
+  int backW_, backH_;
+  heIndex backTopRow_;
+  void scrolled();
+  void drawColumnRows(HeColumn*, int r0, int r1);
+  void scrollBackBuffer();
+  void drawOverlay();
+  static char overlay_;
 public:
   HeColumnGroup(int x, int y, int w, int h, HeDocumentManager*);
+  ~HeColumnGroup();
   void createStandardColumns();
   void resize(int x, int y, int w, int h);
   void layout();
   virtual int handle(int);
+  virtual void draw();
   int bytesPerRow() { return bytesPerRow_; }
   int bytesPerPage() { return rowsPerPage_*bytesPerRow_; }
   int rows() { return rows_; }
@@ -234,6 +515,12 @@ public:
   heIndex topByte() { return topByte_; }
   void topRow(heIndex);
   void topByte(heIndex);
+  void scrollRows(int);
+  void link(HeColumnGroup *other, HeOffsetMap *map=0) { linked_ = other; linkMap_ = map; }
+  void marks(HeScrollMarks *m) { marks_ = m; redraw(); }
+  HeScrollMarks *marks() { return marks_; }
+  /// show the performance counters on top of the rows
+  static void overlay(char on) { overlay_ = on; }
   void cursor(heIndex ix, bool extend = false) { mgr->cursor(ix, extend); }
   heIndex cursor() { return mgr->cursor(); }
 };
@@ -249,7 +536,11 @@ public:
   virtual int handle(int);
   virtual void layout();
   virtual void getWidth(int&, int&) = 0;
-  void draw_bg();
+  virtual void draw();
+  virtual void drawRows(int r0, int r1) { }
+  virtual int rowAligned() { return 1; }
+  void draw_bg(int r0, int r1);
+  int lineCount() { return lines; }
   heIndex eventRow();
 };
 
@@ -260,21 +551,483 @@ public:
   HeScrollbarColumn(int x, int y, int w, int h, HeDocumentManager*);
   virtual void getWidth(int&, int&);
   virtual void layout();
+  virtual void draw();
+  virtual int rowAligned() { return 0; }
   void value(heIndex);
 };
 
+/// Summary of one block of data for the overview map, all values scaled to
+/// 0..255: Shannon entropy, and the share of zero, ASCII and high bytes.
+struct HeMapCell {
+  unsigned char entropy, zeros, ascii, high;
+};
+
+/// Block summaries of a whole document, computed in the background and kept
+/// as a pyramid of levels, each with half the cells of the one below. Edits
+/// only mark the affected blocks for recomputation.
+class HeOverviewMap : public HeEditListener {
+  HeDocument *doc;
+  HeMapCell *cells_;
+  heIndex levelStart_[33], levelSize_[33];
+  int nLevels_, blockShift_;
+  heIndex nBlocks_;
+  heIndex dirtyFirst_, dirtyLast_;
+  heIndex jobFirst_, jobLast_;
+  HeMutex mutex_;
+  HeCondition idle_;
+  char running_, scheduled_, cancelled_;
+  volatile char cancel_;
+  void markDirty(heIndex first, heIndex last);
+  void allocate();
+  void computeBlocks(heIndex first, heIndex last);
+  void buildLevels();
+  void cancelAndWait();
+  static void jobCB(void*, int);
+  static void chunkCB(void*, int);
+  static void restartCB(void*);
+public:
+  HeOverviewMap(HeDocument*);
+  ~HeOverviewMap();
+  virtual void edited(heIndex pos, heIndex nDel, heIndex nIns);
+  void update();
+  char busy() { return running_ || scheduled_; }
+  void summary(heIndex first, heIndex last, HeMapCell&);
+};
+
+class HeOverviewColumn : public HeColumn {
+  HeOverviewMap *map;
+  unsigned char *image;
+  int imageSize;
+  static void pollCB(void*);
+public:
+  HeOverviewColumn(int x, int y, int w, int h, HeDocumentManager*);
+  ~HeOverviewColumn();
+  virtual void getWidth(int&, int&);
+  virtual void draw();
+  virtual int rowAligned() { return 0; }
+  virtual int handle(int);
+};
+
+class HeHistogramView : public Fl_Widget {
+  const unsigned long long *hist_;
+public:
+  HeHistogramView(int x, int y, int w, int h);
+  void data(const unsigned long long *hist) { hist_ = hist; redraw(); }
+  virtual void draw();
+};
+
+/// Histogram and checksums of the current selection. The selection is
+/// processed in steps directly from the document buffer; as long as it only
+/// grows at the end, earlier results are kept and extended.
+class HeStatsPanel : public Fl_Double_Window, public HeEditListener {
+  HeDocumentManager *manager;
+  HeDocument *doc;
+  HeHistogramView *histogram;
+  Fl_Output *range, *minmax, *sum, *entropy, *crc, *xxh, *sha;
+  HeByteStats stats;
+  heIndex first_, done_;
+  char valid_, pending_;
+  static void stepCB(void*);
+  void step();
+  void showResults(heIndex end);
+public:
+  HeStatsPanel(HeDocumentManager*);
+  ~HeStatsPanel();
+  virtual void edited(heIndex pos, heIndex nDel, heIndex nIns);
+  void selectionChanged();
+};
+
+// whole document digests
+#define HE_HASH_CRC32   0
+#define HE_HASH_MD5     1
+#define HE_HASH_SHA1    2
+#define HE_HASH_SHA256  3
+#define HE_HASH_BLAKE3  4
+#define HE_HASH_N       5
+
+/// Computes all digests of the document in the background, one job per
+/// algorithm. BLAKE3 is a tree hash, so its job splits the document into
+/// subtrees that are hashed on all cores. Editing the document cancels the
+/// jobs.
+class HeDocumentHasher : public HeEditListener {
+  HeDocument *doc;
+  heIndex size_;
+  volatile heIndex done_[HE_HASH_N];
+  unsigned char digest_[HE_HASH_N][32];
+  char finished_[HE_HASH_N];
+  unsigned int *blockCV_;
+  HeMutex mutex_;
+  HeCondition idle_;
+  int running_;
+  char changed_;
+  volatile char cancel_;
+  static void jobCB(void*, int);
+  static void blockCB(void*, int);
+  void runSequential(int algorithm);
+  void runBlake3();
+  void mergeBlake3(heIndex first, heIndex n, char root, unsigned int cv[8]);
+public:
+  HeDocumentHasher(HeDocument*);
+  ~HeDocumentHasher();
+  virtual void edited(heIndex pos, heIndex nDel, heIndex nIns);
+  void start();
+  void cancelAndWait();
+  char busy() { return running_>0; }
+  char changed() { return changed_; }
+  double progress(int algorithm);
+  char finished(int algorithm) { return finished_[algorithm]; }
+  const unsigned char *digest(int algorithm) { return digest_[algorithm]; }
+  static int length(int algorithm);
+  static const char *name(int algorithm);
+  int match(const char *expected);
+};
+
+class HeHashPanel : public Fl_Double_Window, public HeEditListener {
+  HeDocument *doc;
+  HeDocumentHasher *hasher;
+  Fl_Output *result[HE_HASH_N];
+  Fl_Input *expected;
+  Fl_Box *verdict;
+  Fl_Button *startButton;
+  static void pollCB(void*);
+  static void startCB(Fl_Widget*, void*);
+  static void expectedCB(Fl_Widget*, void*);
+  void showResults();
+public:
+  HeHashPanel(HeDocumentManager*);
+  ~HeHashPanel();
+  virtual void edited(heIndex pos, heIndex nDel, heIndex nIns);
+  void start();
+};
+
+/// Rows of a structure template. Only the rows on screen are looked up in
+/// the tree, which evaluates them on demand, so drawing does not depend on
+/// the size of the tables in the file.
+class HeStructView : public Fl_Group {
+  HeDocumentManager *manager;
+  HeTplTree *tree_;
+  Fl_Scrollbar *scroll;
+  long long top_, selected_;
+  int rowHeight();
+  static void scrollCB(Fl_Widget*, void*);
+public:
+  HeStructView(int x, int y, int w, int h, HeDocumentManager*);
+  void tree(HeTplTree *t);
+  void update();
+  virtual void resize(int x, int y, int w, int h);
+  virtual void draw();
+  virtual int handle(int);
+};
+
+class HeStructPanel : public Fl_Double_Window, public HeEditListener {
+  HeDocumentManager *manager;
+  HeDocument *doc;
+  HeTemplate *template_;
+  HeTplTree *tree_;
+  HeStructView *view;
+  Fl_Box *status;
+  char *templateName_;
+  static void loadCB(Fl_Widget*, void*);
+  void showStatus();
+public:
+  HeStructPanel(HeDocumentManager*);
+  ~HeStructPanel();
+  virtual void edited(heIndex pos, heIndex nDel, heIndex nIns);
+  char load(const char *filename);
+  void choose();
+  char loaded() { return tree_!=0; }
+};
+
+#define HE_MAX_PLUGIN_TASKS 16
+
+/// The document as plugins see it, and the plugin analyses that run on it.
+/// An edit stops them, since their results would point to the wrong bytes.
+/// Results of analyses that finish are added as annotations.
+class HeDocumentPlugins : public HePluginDoc, public HeEditListener {
+  HeDocumentManager *manager;
+  HeDocument *doc;
+  HePluginTask *task_[HE_MAX_PLUGIN_TASKS];
+  int nTasks_;
+  char polling_;
+  static void pollCB(void*);
+  void collect(HePluginTask*);
+public:
+  HeDocumentPlugins(HeDocumentManager*);
+  ~HeDocumentPlugins();
+  virtual unsigned long long size();
+  virtual int lock(unsigned long long pos, unsigned long long n,
+                   HePluginSpan *span);
+  virtual void unlock();
+  virtual void edited(heIndex pos, heIndex nDel, heIndex nIns);
+  void run(const HePluginAnalysis*);
+  void stop();
+  char busy() { return nTasks_>0; }
+};
+
+/// Writes a patch of the document against its file in the background, so
+/// aligning large files doesn't freeze the window. An edit stops the job and
+/// the unfinished patch file is removed.
+class HePatchJob : public HeEditListener {
+  HeDocument *doc;
+  HeFileSource *src_;
+  HeAlignment *al_;
+  char patchName_[2048];
+  size_t size_;
+  char ips_;
+  const char *err_;
+  char running_, polling_;
+  volatile char cancel_;
+  HeMutex mutex_;
+  HeCondition idle_;
+  static void jobCB(void*, int);
+  static void pollCB(void*);
+  void cancelAndWait();
+public:
+  HePatchJob(HeDocumentManager*);
+  ~HePatchJob();
+  virtual void edited(heIndex pos, heIndex nDel, heIndex nIns);
+  void start(const char *patchName);
+  char busy() { return running_ || polling_; }
+};
+
+/// Finds the strings of a document in the background. The document is
+/// covered by pieces that keep their strings relative to their start, so an
+/// edit only rescans the pieces it touched; the pieces behind it just move.
+class HeDocumentStrings : public HeEditListener {
+  struct Piece {
+    heIndex first, last;
+    HeStringList runs;
+    char dirty;
+  };
+  HeDocument *doc;
+  Piece *pieces_;
+  int nPieces_, capPieces_;
+  int *jobs_;
+  int nJobs_;
+  HeStringList result_;
+  int types_, minChars_;
+  HeMutex mutex_;
+  HeCondition idle_;
+  int running_;
+  char scheduled_, polling_;
+  volatile char cancel_;
+  void (*changedCB_)(void*);
+  void *changedData_;
+  static void pieceCB(void*, int);
+  static void restartCB(void*);
+  static void pollCB(void*);
+  void reserve(int n);
+  void split(int i);
+  void merge();
+  void changed() { if (changedCB_) changedCB_(changedData_); }
+public:
+  HeDocumentStrings(HeDocument*);
+  ~HeDocumentStrings();
+  virtual void edited(heIndex pos, heIndex nDel, heIndex nIns);
+  /// Look for other types of strings or another minimum length. This
+  /// starts over.
+  void settings(int types, int minChars);
+  void start();
+  void cancelAndWait();
+  char busy() { return running_>0 || scheduled_; }
+  /// 'cb' is called when the list of strings changed
+  void notify(void (*cb)(void*), void *data) { changedCB_ = cb; changedData_ = data; }
+  int count() { return result_.n; }
+  const HeStringRun &string(int i) { return result_.run[i]; }
+  int types() { return types_; }
+  int minChars() { return minChars_; }
+};
+
+/// The list of strings. Like the structure view, only the rows on screen
+/// are drawn, and their text is read from the document as they are.
+class HeStringsView : public Fl_Group {
+  HeDocumentManager *manager;
+  HeDocumentStrings *strings_;
+  Fl_Scrollbar *scroll;
+  int top_;
+  unsigned long long selectedPos_;
+  int selectedType_;
+  int rowHeight();
+  static void scrollCB(Fl_Widget*, void*);
+public:
+  HeStringsView(int x, int y, int w, int h, HeDocumentManager*, HeDocumentStrings*);
+  void update();
+  virtual void resize(int x, int y, int w, int h);
+  virtual void draw();
+  virtual int handle(int);
+};
+
+class HeStringsPanel : public Fl_Double_Window {
+  HeDocumentStrings *strings;
+  HeStringsView *view;
+  Fl_Input *minLength;
+  Fl_Button *typeButton[4];
+  Fl_Box *status;
+  static void settingsCB(Fl_Widget*, void*);
+  static void changedCB(void*);
+  void showStatus();
+public:
+  HeStringsPanel(HeDocumentManager*);
+  ~HeStringsPanel();
+};
+
+/// Edits and runs scripts on the document. The panel is the script's host:
+/// it hands out the document buffer, applies changes and collects what the
+/// script prints. While a script runs, the Run button stops it.
+class HeScriptPanel : public Fl_Double_Window, public HeScriptHost {
+  HeDocumentManager *manager;
+  HeDocument *doc;
+  Fl_Text_Buffer *source, *output;
+  Fl_Text_Editor *editor;
+  Fl_Text_Display *outputView;
+  Fl_Button *runButton;
+  Fl_Box *status;
+  char *scriptName_;
+  char running_, stop_;
+  double lastCheck_;
+  static void loadCB(Fl_Widget*, void*);
+  static void saveCB(Fl_Widget*, void*);
+  static void runCB(Fl_Widget*, void*);
+  static void closeCB(Fl_Widget*, void*);
+public:
+  HeScriptPanel(HeDocumentManager*);
+  ~HeScriptPanel();
+  void run();
+  char running() { return running_; }
+  virtual unsigned long long size();
+  virtual int lock(unsigned long long pos, unsigned long long n,
+                   HeScriptSpan *span);
+  virtual void unlock();
+  virtual const char *replace(unsigned long long pos, unsigned long long nDel,
+                              const unsigned char *data,
+                              unsigned long long nIns);
+  virtual void print(const char *text, size_t n);
+  virtual void note(unsigned long long pos, unsigned long long n,
+                    const char *text);
+  virtual char poll();
+};
+
+/// Compares two documents byte by byte. Differences are counted per block
+/// in the background to mark them along the scrollbar; highlighting and
+/// searching compare the document buffers directly.
+class HeDiff : public HeEditListener, public HeHighlightLayer,
+               public HeScrollMarks {
+  HeDocument *docA, *docB;
+  Fl_Widget *view;
+  unsigned short *diffBytes_;
+  unsigned long long *prefix_;
+  heIndex nBlocks_;
+  heIndex dirtyFirst_, dirtyLast_;
+  heIndex jobFirst_, jobLast_;
+  HeMutex mutex_;
+  HeCondition idle_;
+  char running_, scheduled_, cancelled_;
+  volatile char cancel_;
+  void markDirty(heIndex first, heIndex last);
+  void allocate();
+  void computeBlocks(heIndex first, heIndex last);
+  void sumBlocks();
+  void cancelAndWait();
+  char indexed();
+  heIndex compare(heIndex pos, heIndex n, char backwards);
+  static void jobCB(void*, int);
+  static void chunkCB(void*, int);
+  static void restartCB(void*);
+public:
+  HeDiff(HeDocument *a, HeDocument *b, Fl_Widget *view);
+  ~HeDiff();
+  virtual void edited(heIndex pos, heIndex nDel, heIndex nIns);
+  virtual int spans(heIndex first, heIndex last, HeSpan *dst, int max);
+  virtual int marked(heIndex first, heIndex last);
+  void update();
+  char busy() { return running_ || scheduled_; }
+  unsigned long long differences();
+  heIndex next(heIndex from);
+  heIndex previous(heIndex from);
+  heIndex runStart(heIndex pos);
+  heIndex runEnd(heIndex pos);
+};
+
+/// One document's view of an alignment.
+class HeAlignSide : public HeHighlightLayer, public HeScrollMarks,
+                    public HeOffsetMap {
+  HeAligner *aligner;
+  int side;
+public:
+  HeAlignSide(HeAligner *a, int s) { aligner = a; side = s; }
+  virtual int spans(heIndex first, heIndex last, HeSpan *dst, int max);
+  virtual int marked(heIndex first, heIndex last);
+  virtual heIndex mapOffset(heIndex pos);
+};
+
+/// Aligns two documents that differ by inserted and deleted bytes, in the
+/// background, and again after every edit. The last finished alignment
+/// stays on display until the next one is done. Each side highlights the
+/// bytes that only its own document has.
+class HeAligner : public HeEditListener {
+  friend class HeAlignSide;
+  HeDocument *docA, *docB;
+  Fl_Widget *view;
+  HeAlignment *result_, *job_;
+  int *changes_[2], nChanges_[2];
+  HeAlignSide sideA_, sideB_;
+  heIndex sizeA_, sizeB_;
+  HeMutex mutex_;
+  HeCondition idle_;
+  char running_, scheduled_;
+  volatile char cancel_;
+  void indexChanges();
+  int firstChange(int side, heIndex pos);
+  void cancelAndWait();
+  static void jobCB(void*, int);
+  static void restartCB(void*);
+public:
+  HeAligner(HeDocument *a, HeDocument *b, Fl_Widget *view);
+  ~HeAligner();
+  virtual void edited(heIndex pos, heIndex nDel, heIndex nIns);
+  void start();
+  char collect();
+  char busy() { return running_ || scheduled_ || job_; }
+  int progress();
+  HeAlignment *alignment() { return result_; }
+  HeAlignSide *side(int i) { return i ? &sideB_ : &sideA_; }
+};
+
+class HeDiffWindow : public Fl_Double_Window {
+  HeDocument *docA, *docB;
+  HeDiff *diff;
+  HeAligner *aligner;
+  int op_;
+  Fl_Button *alignButton;
+  Fl_Box *summary;
+  void useLayers(char aligned);
+  void jumpToOp(int step);
+  static void alignCB(Fl_Widget*, void*);
+  static void nextCB(Fl_Widget*, void*);
+  static void previousCB(Fl_Widget*, void*);
+  static void closeCB(Fl_Widget*, void*);
+  static void pollCB(void*);
+  void jump(heIndex);
+  void showSummary();
+  char busy();
+public:
+  HeDiffWindow(HeApp*, const char *nameA, const char *nameB);
+  ~HeDiffWindow();
+  virtual void draw();
+};
+
 class HeSeperatorColumn : public HeColumn {
 public:
   HeSeperatorColumn(int x, int y, int w, int h, HeDocumentManager*);
   virtual void getWidth(int&, int&);
-  virtual void draw();
+  virtual void drawRows(int r0, int r1);
 };
 
 class HeAddrColumn : public HeColumn {
 public:
   HeAddrColumn(int x, int y, int w, int h, HeDocumentManager*);
   virtual void getWidth(int&, int&);
-  virtual void draw();
+  virtual void drawRows(int r0, int r1);
   virtual int handle(int);
 };
 
@@ -283,7 +1036,7 @@ class HeHexColumn : public HeColumn {
 public:
   HeHexColumn(int x, int y, int w, int h, HeDocumentManager*);
   virtual void getWidth(int&, int&);
-  virtual void draw();
+  virtual void drawRows(int r0, int r1);
   virtual int handle(int);
   heIndex eventAddr();
 };
@@ -292,21 +1045,44 @@ class HeTextColumn : public HeColumn {
 public:
   HeTextColumn(int x, int y, int w, int h, HeDocumentManager*);
   virtual void getWidth(int&, int&);
-  virtual void draw();
+  virtual void drawRows(int r0, int r1);
   virtual int handle(int);
   heIndex eventAddr();
 };
 
+/// A column type of a plugin. Drawing is time boxed: rows that the plugin
+/// can't deliver in time stay blank.
+class HePluginColumn : public HeColumn {
+  const HePluginColumnType *type;
+public:
+  HePluginColumn(int x, int y, int w, int h, HeDocumentManager*,
+                 const HePluginColumnType*);
+  virtual void getWidth(int&, int&);
+  virtual void drawRows(int r0, int r1);
+};
+
+/// Text of the annotations, next to the rows they belong to. The column
+/// only takes up room once the document has annotations.
+class HeNoteColumn : public HeColumn {
+public:
+  HeNoteColumn(int x, int y, int w, int h, HeDocumentManager*);
+  virtual void getWidth(int&, int&);
+  virtual void drawRows(int r0, int r1);
+  virtual int handle(int);
+};
+
 class HeInput : public Fl_Input {
   int wdt;
   int base_;
   char fmt[10];
-  heIndex value_;
+  unsigned long long value_;
   float value_f;
   double value_d;
 public:
   HeInput(int x, int y, int w, int h, const char *label=0, int bb=10, int nn=4);
   void value(heIndex);
+  void value(const char*);
+  void value64(unsigned long long);
   void value(float);
   void value(double);
   void base(int);
@@ -339,6 +1115,23 @@ public:
   int winflags, winx, winy, winw, winh;
   char *fixedfont, *propfont;
   int fixedsize, propsize;
+  /// map documents of 32 MB and more with huge pages (Linux only)
+  int hugepages;
+  void pluginFolder(char *path, int n);
+};
+
+class HeBenchmark {
+  Fl_Window *window;
+  HeDocument *doc;
+  HeColumnGroup *group;
+  Fl_Offscreen surface;
+  int frames;
+  void frame();
+  void run(const char *name, int scenario);
+public:
+  HeBenchmark(int mbytes, int frames);
+  ~HeBenchmark();
+  static int main(int argc, char **argv);
 };
 
 #endif
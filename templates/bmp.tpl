@@ -0,0 +1,32 @@
+// Windows bitmap images
+
+endian little;
+
+struct FileHeader {
+  char magic[2];
+  u32 size;
+  u16 reserved1, reserved2;
+  u32 offset;
+}
+
+struct InfoHeader {
+  u32 size;
+  s32 width, height;
+  u16 planes, bitCount;
+  u32 compression, imageSize;
+  s32 xPelsPerMeter, yPelsPerMeter;
+  u32 colorsUsed, colorsImportant;
+}
+
+struct Color {
+  u8 blue, green, red, reserved;
+}
+
+FileHeader file;
+InfoHeader info;
+if (info.colorsUsed) {
+  Color palette[info.colorsUsed] @ 14+info.size;
+} else if (info.bitCount<=8) {
+  Color palette[1<<info.bitCount] @ 14+info.size;
+}
+u8 pixels[filesize-file.offset] @ file.offset;
@@ -0,0 +1,57 @@
+// ELF executables, shared libraries and object files
+//
+// The byte order of an ELF file is given in its header, but templates use
+// one byte order throughout, so this describes little endian files only.
+
+endian little;
+
+struct Ident {
+  char magic[4];
+  u8 class, data, version, osabi, abiversion;
+  u8 pad[7];
+}
+
+struct Header32 {
+  u16 type, machine;
+  u32 version, entry, phoff, shoff, flags;
+  u16 ehsize, phentsize, phnum, shentsize, shnum, shstrndx;
+}
+
+struct Header64 {
+  u16 type, machine;
+  u32 version;
+  u64 entry, phoff, shoff;
+  u32 flags;
+  u16 ehsize, phentsize, phnum, shentsize, shnum, shstrndx;
+}
+
+struct ProgramHeader32 {
+  u32 type, offset, vaddr, paddr, filesz, memsz, flags, align;
+}
+
+struct ProgramHeader64 {
+  u32 type, flags;
+  u64 offset, vaddr, paddr, filesz, memsz, align;
+}
+
+struct SectionHeader32 {
+  u32 name, type, flags, addr, offset, size, link, info, addralign, entsize;
+}
+
+struct SectionHeader64 {
+  u32 name, type;
+  u64 flags, addr, offset, size;
+  u32 link, info;
+  u64 addralign, entsize;
+}
+
+Ident ident;
+if (ident.class==2) {
+  Header64 header;
+  ProgramHeader64 programHeaders[header.phnum] @ header.phoff;
+  SectionHeader64 sections[header.shnum] @ header.shoff;
+} else {
+  Header32 header;
+  ProgramHeader32 programHeaders[header.phnum] @ header.phoff;
+  SectionHeader32 sections[header.shnum] @ header.shoff;
+}